@@ -1,4 +1,15 @@
 #include <bits/stdc++.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -6,1131 +17,10959 @@ namespace csv
 {
 
 /*!
- *  @brief  `csv::Parser` is the type that parse the CSV file and store the data in a structured way.
+ * @brief   `csv::parse_result` is the result of `csv::from_chars`.
+ * @details It mirrors `std::from_chars_result`: `ptr` points at the first character not consumed and `ec` is
+ *          `std::errc()` on success, `std::errc::invalid_argument` if no number was found, or
+ *          `std::errc::result_out_of_range` if the number does not fit in the target type.
  */
-class Parser
+struct parse_result
+{
+    char const *ptr;
+    errc ec;
+};
+
+namespace detail
+{
+
+/*!
+ * @brief   `csv::detail::is_eight_digits` is a function that checks if 8 bytes loaded as a little-endian word are all ASCII digits.
+ * @param   chunk The 8 bytes to check
+ * @return  `bool` `true` if every byte is in `'0'..'9'`, `false` otherwise
+ */
+inline bool is_eight_digits(uint64_t chunk)
+{
+    return ((chunk & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL) &&
+           (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL);
+}
+/*!
+ * @brief   `csv::detail::parse_eight_digits` is a function that converts 8 ASCII digits to their value in a few multiplications (SWAR).
+ * @param   chunk The 8 digits loaded as a little-endian word, checked by `csv::detail::is_eight_digits`
+ * @return  `uint32_t` The value of the 8 digits
+ */
+inline uint32_t parse_eight_digits(uint64_t chunk)
+{
+    uint64_t const mask = 0x000000FF000000FFULL;
+    uint64_t const mul1 = 100 + (1000000ULL << 32);
+    uint64_t const mul2 = 1 + (10000ULL << 32);
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10) + (chunk >> 8);
+    return static_cast<uint32_t>((((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32);
+}
+/*!
+ * @brief   `csv::detail::parse_digits` is a function that accumulates a run of decimal digits into an unsigned 64-bit value.
+ * @details Runs of 8 digits are converted at once on little-endian targets, the tail is converted digit by digit.
+ *          On overflow the whole digit run is still consumed so the caller can report the error precisely.
+ * @param   first The beginning of the digits
+ * @param   last The end of the input
+ * @param   value The accumulated value
+ * @param   overflow Set to `true` if the value does not fit in 64 bits
+ * @return  `char const *` The first character that is not a digit
+ */
+inline char const *parse_digits(char const *first, char const *last, uint64_t &value, bool &overflow)
+{
+    uint64_t const max = numeric_limits<uint64_t>::max();
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (last - first >= 8)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, first, sizeof chunk);
+        if (!is_eight_digits(chunk))
+            break;
+        uint64_t const digits = parse_eight_digits(chunk);
+        if (value > (max - digits) / 100000000ULL)
+            overflow = true;
+        value = value * 100000000ULL + digits;
+        first += 8;
+    }
+#endif
+    for (; first != last && static_cast<unsigned char>(*first - '0') < 10; ++first)
+    {
+        uint64_t const digit = static_cast<uint64_t>(*first - '0');
+        if (value > (max - digit) / 10)
+            overflow = true;
+        value = value * 10 + digit;
+    }
+    return first;
+}
+/*!
+ * @brief   `csv::detail::pow10` is a table of the powers of ten that are exactly representable in `long double`.
+ */
+static long double const pow10[] = {
+    1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,  1e10L, 1e11L, 1e12L, 1e13L,
+    1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+/*!
+ * @brief   `csv::detail::c_locale` is a function that returns the `"C"` locale, created on first use.
+ * @return  `locale_t` The locale
+ */
+inline locale_t c_locale()
+{
+    static locale_t const locale = ::newlocale(LC_ALL_MASK, "C", locale_t(0));
+    return locale;
+}
+/*!
+ * @brief   `csv::detail::round_decimal` is a function that rounds a decimal number with the C library, whatever the
+ *          global locale.
+ * @details The first 40 significant digits, more than a `long double` can tell apart, and the exponent are written
+ *          to a buffer on the stack and converted by `strtold_l` in the `"C"` locale.
+ * @param   first The beginning of the digits, with at most one `.`
+ * @param   last The end of the digits
+ * @param   exponent The power of ten the digits, read as an integer without the point, are multiplied by
+ * @param   out_of_range Set to `true` if the number overflows or underflows `long double`
+ * @return  `long double` The number
+ */
+inline long double round_decimal(char const *first, char const *last, long exponent, bool &out_of_range)
+{
+    char buffer[64];
+    size_t size = 0;
+    for (; first != last; ++first)
+    {
+        if (*first == '.' || (*first == '0' && size == 0))
+            continue;
+        if (size < 40)
+            buffer[size++] = *first;
+        else
+            ++exponent;
+    }
+    if (size == 0)
+        return 0;
+    buffer[size++] = 'e';
+    snprintf(buffer + size, sizeof buffer - size, "%ld", exponent);
+    errno = 0;
+    long double const number = ::strtold_l(buffer, nullptr, c_locale());
+    out_of_range = errno == ERANGE;
+    return number;
+}
+
+} // namespace detail
+
+/*!
+ * @brief   `csv::from_chars` is a function that parses an integer without allocating and without looking at the locale.
+ * @details It accepts an optional `-` for signed types followed by decimal digits, the same as `std::from_chars`.
+ * @param   first The beginning of the input
+ * @param   last The end of the input
+ * @param   value The parsed value, unchanged on error
+ * @return  `csv::parse_result` Where the parsing stopped and whether it succeeded
+ */
+template <typename Integer>
+typename enable_if<is_integral<Integer>::value, parse_result>::type from_chars(char const *first, char const *last,
+                                                                               Integer &value)
+{
+    typedef typename make_unsigned<Integer>::type Unsigned;
+    bool const negative = is_signed<Integer>::value && first != last && *first == '-';
+    char const *const digits_begin = negative ? first + 1 : first;
+    uint64_t magnitude = 0;
+    bool overflow = false;
+    char const *const digits_end = detail::parse_digits(digits_begin, last, magnitude, overflow);
+    parse_result result = {digits_end, errc()};
+    if (digits_end == digits_begin)
+    {
+        result.ptr = first;
+        result.ec = errc::invalid_argument;
+        return result;
+    }
+    uint64_t const limit = static_cast<uint64_t>(numeric_limits<Integer>::max()) + (negative ? 1 : 0);
+    if (overflow || magnitude > limit)
+    {
+        result.ec = errc::result_out_of_range;
+        return result;
+    }
+    value = negative ? static_cast<Integer>(Unsigned(0) - static_cast<Unsigned>(magnitude))
+                     : static_cast<Integer>(magnitude);
+    return result;
+}
+/*!
+ * @brief   `csv::from_chars` is a function that parses a decimal number without allocating and without looking at the locale.
+ * @details It accepts `[-]digits[.digits][(e|E)[+|-]digits]`. Up to 19 significant digits with a small exponent are
+ *          converted exactly with one multiplication or division; anything else is rounded by
+ *          `csv::detail::round_decimal`. A number too large or too small for the target type, whatever its exponent,
+ *          is `std::errc::result_out_of_range`.
+ * @param   first The beginning of the input
+ * @param   last The end of the input
+ * @param   value The parsed value, unchanged on error
+ * @return  `csv::parse_result` Where the parsing stopped and whether it succeeded
+ */
+template <typename Floating>
+typename enable_if<is_floating_point<Floating>::value, parse_result>::type from_chars(char const *first,
+                                                                                      char const *last,
+                                                                                      Floating &value)
+{
+    char const *cursor = first;
+    bool const negative = cursor != last && *cursor == '-';
+    if (negative)
+        ++cursor;
+    uint64_t mantissa = 0;
+    bool overflow = false;
+    char const *const int_begin = cursor;
+    cursor = detail::parse_digits(cursor, last, mantissa, overflow);
+    size_t digit_count = static_cast<size_t>(cursor - int_begin);
+    long exponent = 0;
+    if (cursor != last && *cursor == '.')
+    {
+        char const *const frac_begin = ++cursor;
+        cursor = detail::parse_digits(cursor, last, mantissa, overflow);
+        exponent -= cursor - frac_begin;
+        digit_count += static_cast<size_t>(cursor - frac_begin);
+    }
+    parse_result result = {cursor, errc()};
+    if (digit_count == 0)
+    {
+        result.ptr = first;
+        result.ec = errc::invalid_argument;
+        return result;
+    }
+    char const *const digits_end = cursor;
+    if (cursor != last && (*cursor == 'e' || *cursor == 'E'))
+    {
+        int exp_value = 0;
+        char const *exp_begin = cursor + 1;
+        if (exp_begin != last && *exp_begin == '+')
+            ++exp_begin;
+        parse_result const exp_result = from_chars(exp_begin, last, exp_value);
+        if (exp_result.ec == errc())
+        {
+            exponent += exp_value;
+            result.ptr = exp_result.ptr;
+        }
+        else if (exp_result.ec == errc::result_out_of_range)
+        {
+            // No number but zero survives an exponent beyond `int`
+            result.ptr = exp_result.ptr;
+            if (mantissa != 0 || overflow)
+            {
+                result.ec = errc::result_out_of_range;
+                return result;
+            }
+            exponent = 0;
+        }
+    }
+    long double magnitude;
+    if (!overflow && mantissa <= (1ULL << 63) && exponent >= -27 && exponent <= 27)
+    {
+        magnitude = static_cast<long double>(mantissa);
+        magnitude = exponent < 0 ? magnitude / detail::pow10[-exponent] : magnitude * detail::pow10[exponent];
+    }
+    else
+    {
+        bool out_of_range = false;
+        magnitude = detail::round_decimal(int_begin, digits_end, exponent, out_of_range);
+        if (out_of_range)
+        {
+            result.ec = errc::result_out_of_range;
+            return result;
+        }
+    }
+    if (magnitude > numeric_limits<Floating>::max())
+    {
+        result.ec = errc::result_out_of_range;
+        return result;
+    }
+    value = static_cast<Floating>(negative ? -magnitude : magnitude);
+    return result;
+}
+
+/*!
+ * @brief   `csv::Dialect` is the set of options that describes the flavour of a CSV file.
+ * @details The default dialect is RFC 4180 (comma separated, `"` quoted, `""` as an escaped quote) that also skips
+ *          spaces after a delimiter, which is what `distance.csv` uses.
+ */
+struct Dialect
 {
-  private:
-    /*!
-     * @brief   `csv::Parser::record_type` is a vector of strings that represents the fields in a line in the CSV file.
-     */
-    typedef vector<string> record_type;
     /*!
-     * @brief   `csv::Parser::title_type` is a vector of strings that represents the title fields in the CSV file.
+     * @brief   `csv::Dialect::delimiter` is the character that separates the fields.
      */
-    typedef vector<string> title_type;
+    char delimiter;
     /*!
-     * @brief   `csv::Parser::m_title_fields` is a vector of strings that stores the title fields in the CSV file.
+     * @brief   `csv::Dialect::quote` is the character that encloses a field containing special characters.
      */
-    title_type m_title_fields;
+    char quote;
     /*!
-     * @brief   `csv::Parser::m_data` is a vector of `record_type` that stores the data in the CSV file.
+     * @brief   `csv::Dialect::escape` is the character that makes the next character literal, `'\0'` for none.
      */
-    vector<record_type> m_data;
-
+    char escape;
     /*!
-     * @brief   `csv::Parser::string_trim_result` is a struct that stores two iterators of the trimmed string.
-     * @details It stores the `begin` and the `end` of the trimmed string.
+     * @brief   `csv::Dialect::double_quote` tells if two quotes inside a quoted field stand for one quote.
      */
-    struct string_trim_result
-    {
-        string::const_iterator begin, end;
-    };
+    bool double_quote;
     /*!
-     * @brief   `csv::Parser::string_trim` is a function that trims the string from the beginning and the end.
-     * @details It trims the string from the beginning and the end by removing the leading and trailing whitespaces.
-     * @param   string_begin The beginning of the string
-     * @param   string_end The end of the string
-     * @return  `csv::Parser::string_trim_result` The trimmed string
+     * @brief   `csv::Dialect::skip_initial_space` tells if spaces and tabs right after a delimiter are ignored.
      */
-    static string_trim_result string_trim(string::const_iterator string_begin, string::const_iterator string_end);
+    bool skip_initial_space;
     /*!
-     * @brief   `csv::Parser::parse_line` is a function that parses a line in the CSV file.
-     * @details It parses a line in the CSV file and returns a vector of strings that represents the fields in the line.
-     * @param   line_begin The beginning of the line
-     * @param   line_end The end of the line
-     * @return  `csv::Parser::record_type` The fields in the line
-     * @throws  `std::runtime_error` If the field is not enclosed in double quotes
+     * @brief   `csv::Dialect::has_header` tells if the data starts with a title line.
      */
-    static record_type parse_line(string::const_iterator line_begin, string::const_iterator line_end);
+    bool has_header;
 
-  public:
+    Dialect()
+        : delimiter(',')
+        , quote('"')
+        , escape('\0')
+        , double_quote(true)
+        , skip_initial_space(true)
+        , has_header(true)
+    {}
+};
+
+/*!
+ * @brief   `csv::Tokenizer` is the type that splits CSV data into fields and records according to a `csv::Dialect`.
+ * @details It is a table-driven state machine: each byte is mapped to a character class, and the pair of the current
+ *          state and the class selects the next state and an action. Inside a field, runs of ordinary bytes are
+ *          skipped with a single table lookup per byte and appended in one go, which keeps the common path as cheap
+ *          as scanning with `std::find`.
+ */
+class Tokenizer
+{
+  private:
+    enum char_class
+    {
+        class_other,
+        class_delimiter,
+        class_quote,
+        class_escape,
+        class_space,
+        class_cr,
+        class_lf,
+        class_count
+    };
+    enum state
+    {
+        state_record_start,
+        state_field_start,
+        state_unquoted,
+        state_unquoted_escape,
+        state_quoted,
+        state_quoted_escape,
+        state_quote_in_quoted,
+        state_after_quoted,
+        state_count
+    };
+    enum action
+    {
+        action_none,
+        action_append,
+        action_end_field,
+        action_end_record,
+        action_error
+    };
     /*!
-     * @brief   `csv::Parser::Parser` is a constructor that initializes the `csv::Parser` object.
-     * @details It initializes the `csv::Parser` object with the title line in the CSV file.
-     * @param   title_line The title line in the CSV file
+     * @brief   `csv::Tokenizer::transition` is an entry of the state transition table.
      */
-    Parser(string const &title_line) 
-        : m_title_fields(parse_line(title_line.begin(), title_line.end()))
-        , m_data()
-    {}
+    struct transition
+    {
+        unsigned char next;
+        unsigned char act;
+    };
     /*!
-     * @brief   `csv::Parser::add_records` is a function that adds the records in the CSV file.
-     * @details It adds the records in the CSV file by parsing the data string and storing the data in the structured way.
-     *          It also checks if the title line in the CSV file matches the title fields in the `csv::Parser` object.
-     * @param   data_str The string that contains the data in the CSV file
+     * @brief   `csv::Tokenizer::m_classes` maps every byte to its character class.
      */
-    void add_records(string const &data_str);
+    unsigned char m_classes[256];
     /*!
-     * @brief   `csv::Parser::titles` is a function that returns the title fields in the CSV file.
-     * @return  `csv::Parser::title_type const &` The title fields in the CSV file
+     * @brief   `csv::Tokenizer::m_table` is the state transition table indexed by state and character class.
      */
-    title_type const &titles() const
-    {
-        return m_title_fields;
-    }
+    transition m_table[state_count][class_count];
     /*!
-     * @brief   `csv::Parser::record_at` is a function that returns the record at the specified index.
-     * @param   index The index of the record
-     * @return  `csv::Parser::record_type const &` The record at the specified index
-     * @throws  `std::out_of_range` If the index is more than `record_count()`
+     * @brief   `csv::Tokenizer::m_run_stops` is, for every state, the bit set of character classes that end a run of
+     *          bytes which are appended to the field unchanged. A state without a run has every bit set.
      */
-    record_type const &record_at(size_t index) const
-    {
-        return m_data.at(index);
-    }
+    unsigned m_run_stops[state_count];
     /*!
-     * @brief   `csv::Parser::field_at` is a function that returns the field at the specified index in the record at the specified index.
-     * @param   record_index The index of the record
-     * @param   field_index The index of the field
-     * @return  `std::string const &` The field at the specified index in the record at the specified index
-     * @throws  `std::out_of_range` If the index is more than `record_count()` or `field_count()`
+     * @brief   `csv::Tokenizer::m_quoted_run_end` is the only byte that ends a run in a quoted field, `'\0'` if there
+     *          are several, in which case `m_run_stops` is used instead of `memchr`.
      */
-    string const &field_at(size_t record_index, size_t field_index) const
+    char m_quoted_run_end;
+
+    void set(state from, char_class cls, state next, action act)
     {
-        return record_at(record_index).at(field_index);
+        m_table[from][cls].next = static_cast<unsigned char>(next);
+        m_table[from][cls].act = static_cast<unsigned char>(act);
     }
+
+  public:
     /*!
-     * @brief   `csv::Parser::record_count` is a function that returns the number of records in the CSV file.
-     * @return  `std::size_t` The number of records in the CSV file
+     * @brief   `csv::Tokenizer::Tokenizer` is a constructor that builds the tables of the state machine.
+     * @param   dialect The dialect of the CSV data
      */
-    size_t record_count() const
-    {
-        return m_data.size();
-    }
+    explicit Tokenizer(Dialect const &dialect);
     /*!
-     * @brief   `csv::Parser::field_count` is a function that returns the number of fields in the CSV file.
-     * @return  `std::size_t` The number of fields in the CSV file
+     * @brief   `csv::Tokenizer::tokenize` is a function that splits the data and reports each field and record to `sink`.
+     * @details Blank lines are skipped. `sink` must provide `field(char const *begin, char const *end)` and
+     *          `end_record()`.
+     * @param   first The beginning of the data
+     * @param   last The end of the data
+     * @param   sink The receiver of the fields and records
+     * @throws  `std::runtime_error` If a quote is missing or followed by an unexpected character
      */
-    size_t field_count() const
-    {
-        return m_title_fields.size();
-    }
+    template <typename Sink>
+    void tokenize(char const *first, char const *last, Sink &sink) const;
 };
 
-Parser::string_trim_result Parser::string_trim(string::const_iterator string_begin, string::const_iterator string_end)
+Tokenizer::Tokenizer(Dialect const &dialect)
+    : m_classes()
+    , m_table()
+    , m_run_stops()
+    , m_quoted_run_end(dialect.escape == '\0' || dialect.escape == dialect.quote ? dialect.quote : '\0')
 {
-    typedef string::const_iterator Iterator;
-    Iterator new_begin = string_begin, new_last = string_end - 1;
-    while (new_begin != string_end && !isgraph(*new_begin))
-        ++new_begin;
-    while (new_last != new_begin && !isgraph(*new_last))
-        --new_last;
-    Parser::string_trim_result result;
-    result.begin = new_begin;
-    result.end = new_last + 1;
-    return result;
-}
+    // Later assignments win, so the delimiter and the quote take precedence over whitespace
+    m_classes[static_cast<unsigned char>(' ')] = class_space;
+    m_classes[static_cast<unsigned char>('\t')] = class_space;
+    m_classes[static_cast<unsigned char>('\r')] = class_cr;
+    m_classes[static_cast<unsigned char>('\n')] = class_lf;
+    if (dialect.escape != '\0')
+        m_classes[static_cast<unsigned char>(dialect.escape)] = class_escape;
+    m_classes[static_cast<unsigned char>(dialect.quote)] = class_quote;
+    m_classes[static_cast<unsigned char>(dialect.delimiter)] = class_delimiter;
 
-Parser::record_type Parser::parse_line(string::const_iterator line_begin, string::const_iterator line_end)
-{
-    typedef string::const_iterator Iterator;
-    Parser::string_trim_result const trimmed = string_trim(line_begin, line_end);
-    // Each field is enclosed in double quotes
-    Parser::record_type fields;
-    Iterator field_begin = trimmed.begin, field_end;
-    do
+    state const leading_space = dialect.skip_initial_space ? state_field_start : state_unquoted;
+    action const leading_space_action = dialect.skip_initial_space ? action_none : action_append;
+    for (int cls = 0; cls < class_count; ++cls)
     {
-        field_begin = find(field_begin, trimmed.end, '\"');
-        field_end = find(field_begin + 1, trimmed.end, '\"');
-        if (field_begin == trimmed.end)
-            break; // No more fields
-        if (field_begin != trimmed.end && field_end == trimmed.end)
-            throw runtime_error("Invalid CSV format: missing quote");
-        fields.push_back(string(field_begin + 1, field_end));
-        field_begin = field_end + 1;
-    } while (true);
-    return fields;
+        char_class const c = static_cast<char_class>(cls);
+        set(state_field_start, c, state_unquoted, action_append);
+        set(state_unquoted, c, state_unquoted, action_append);
+        set(state_unquoted_escape, c, state_unquoted, action_append);
+        set(state_quoted, c, state_quoted, action_append);
+        set(state_quoted_escape, c, state_quoted, action_append);
+        set(state_quote_in_quoted, c, state_quoted, action_error);
+        set(state_after_quoted, c, state_after_quoted, action_error);
+    }
+    set(state_field_start, class_delimiter, state_field_start, action_end_field);
+    set(state_field_start, class_quote, state_quoted, action_none);
+    set(state_field_start, class_escape, state_unquoted_escape, action_none);
+    set(state_field_start, class_space, leading_space, leading_space_action);
+    set(state_field_start, class_cr, state_record_start, action_end_record);
+    set(state_field_start, class_lf, state_record_start, action_end_record);
+
+    set(state_unquoted, class_delimiter, state_field_start, action_end_field);
+    set(state_unquoted, class_escape, state_unquoted_escape, action_none);
+    set(state_unquoted, class_cr, state_record_start, action_end_record);
+    set(state_unquoted, class_lf, state_record_start, action_end_record);
+
+    set(state_quoted, class_quote, dialect.double_quote ? state_quote_in_quoted : state_after_quoted, action_none);
+    set(state_quoted, class_escape, state_quoted_escape, action_none);
+
+    set(state_quote_in_quoted, class_quote, state_quoted, action_append);
+    set(state_quote_in_quoted, class_delimiter, state_field_start, action_end_field);
+    set(state_quote_in_quoted, class_space, state_after_quoted, action_none);
+    set(state_quote_in_quoted, class_cr, state_record_start, action_end_record);
+    set(state_quote_in_quoted, class_lf, state_record_start, action_end_record);
+
+    set(state_after_quoted, class_delimiter, state_field_start, action_end_field);
+    set(state_after_quoted, class_space, state_after_quoted, action_none);
+    set(state_after_quoted, class_cr, state_record_start, action_end_record);
+    set(state_after_quoted, class_lf, state_record_start, action_end_record);
+
+    // A record starts like a field, except that leading whitespace and empty lines are skipped
+    for (int cls = 0; cls < class_count; ++cls)
+        m_table[state_record_start][cls] = m_table[state_field_start][cls];
+    set(state_record_start, class_space, leading_space == state_field_start ? state_record_start : state_unquoted,
+        leading_space_action);
+    set(state_record_start, class_cr, state_record_start, action_none);
+    set(state_record_start, class_lf, state_record_start, action_none);
+
+    for (int st = 0; st < state_count; ++st)
+        m_run_stops[st] = ~0U;
+    m_run_stops[state_unquoted] =
+        (1U << class_delimiter) | (1U << class_escape) | (1U << class_cr) | (1U << class_lf);
+    m_run_stops[state_quoted] = (1U << class_quote) | (1U << class_escape);
 }
 
-void Parser::add_records(string const &data_str)
+template <typename Sink>
+void Tokenizer::tokenize(char const *first, char const *last, Sink &sink) const
 {
-    typedef string::const_iterator Iterator;
-    // Trim the data string
-    Parser::string_trim_result const trimmed = string_trim(data_str.begin(), data_str.end());
-    // Parse the title line
-    Iterator record_begin = trimmed.begin;
-    Iterator record_end = find(record_begin, trimmed.end, '\n');
-    Parser::record_type const title_fields = parse_line(record_begin, record_end);
-    if (title_fields != this->titles())
-        throw runtime_error("Invalid CSV format: title line mismatch");
-    // Parse the data lines
-    while (record_end != trimmed.end)
+    // The field being built is a slice of the input until an escape breaks it up. Only then are the pieces copied
+    // into `buffer`, so plain and quoted fields reach the sink without any copy.
+    string buffer;
+    char const *slice_begin = first, *slice_end = first;
+    state current = state_record_start;
+    char const *cursor = first;
+    while (cursor != last)
+    {
+        char const *run_end = cursor;
+        if (current == state_quoted && m_quoted_run_end != '\0')
+        {
+            run_end = static_cast<char const *>(memchr(cursor, m_quoted_run_end, static_cast<size_t>(last - cursor)));
+            if (run_end == nullptr)
+                run_end = last;
+        }
+        else
+        {
+            unsigned const stops = m_run_stops[current];
+            while (run_end != last && !((stops >> m_classes[static_cast<unsigned char>(*run_end)]) & 1U))
+                ++run_end;
+        }
+        if (run_end != cursor)
+        {
+            if (cursor != slice_end)
+            {
+                buffer.append(slice_begin, slice_end);
+                slice_begin = cursor;
+            }
+            slice_end = cursor = run_end;
+            if (cursor == last)
+                break;
+        }
+        transition const t = m_table[current][m_classes[static_cast<unsigned char>(*cursor)]];
+        switch (t.act)
+        {
+        case action_append:
+            if (cursor != slice_end)
+            {
+                buffer.append(slice_begin, slice_end);
+                slice_begin = cursor;
+            }
+            slice_end = cursor + 1;
+            break;
+        case action_end_field:
+        case action_end_record:
+            if (buffer.empty())
+                sink.field(slice_begin, slice_end);
+            else
+            {
+                buffer.append(slice_begin, slice_end);
+                sink.field(buffer.data(), buffer.data() + buffer.size());
+                buffer.clear();
+            }
+            slice_begin = slice_end = cursor + 1;
+            if (t.act == action_end_record)
+                sink.end_record();
+            break;
+        case action_error:
+            throw runtime_error(current == state_quote_in_quoted || current == state_after_quoted
+                                    ? "Invalid CSV format: unexpected character after quote"
+                                    : "Invalid CSV format");
+        default:
+            break;
+        }
+        current = static_cast<state>(t.next);
+        ++cursor;
+    }
+    switch (current)
     {
-        record_begin = record_end + 1;
-        record_end = find(record_begin, trimmed.end, '\n');
-        Parser::record_type const fields = parse_line(record_begin, record_end);
-        if (fields.size() != this->field_count())
-            throw runtime_error("Invalid CSV format: field count mismatch");
-        m_data.push_back(fields);
+    case state_record_start:
+        break;
+    case state_quoted:
+    case state_quoted_escape:
+        throw runtime_error("Invalid CSV format: missing quote");
+    default:
+        buffer.append(slice_begin, slice_end);
+        sink.field(buffer.data(), buffer.data() + buffer.size());
+        sink.end_record();
+        break;
     }
 }
 
-} // namespace csv
+namespace detail
+{
 
-namespace mail
+/*!
+ * @brief   `csv::detail::field_to` is a function that converts a whole field to a number.
+ * @param   first The beginning of the field
+ * @param   last The end of the field
+ * @param   record_index The index of the record, for the error message
+ * @param   field_index The index of the field, for the error message
+ * @return  `T` The value of the field
+ * @throws  `std::runtime_error` If the field is not a number of type `T`
+ * @throws  `std::out_of_range` If the number does not fit in `T`
+ */
+template <typename T>
+T field_to(char const *first, char const *last, size_t record_index, size_t field_index)
 {
+    T value = T();
+    parse_result const result = from_chars(first, last, value);
+    if (result.ec == errc::result_out_of_range)
+        throw out_of_range("CSV number out of range at record " + std::to_string(record_index) + ", field " +
+                           std::to_string(field_index) + ": \"" + string(first, last) + "\"");
+    if (result.ec != errc() || result.ptr != last)
+        throw runtime_error("Invalid CSV format: not a number at record " + std::to_string(record_index) +
+                            ", field " + std::to_string(field_index) + ": \"" + string(first, last) + "\"");
+    return value;
+}
+
+} // namespace detail
 
 /*!
- * @brief   `mail::Location` is an abstract class that represents a location.
+ * @brief   `csv::Column` is the type that stores one column of a CSV file contiguously.
+ * @details All fields are concatenated in one character buffer and located by an offsets array, so a field costs
+ *          4 bytes of bookkeeping and scanning a column is a sequential walk through memory.
  */
-class Location
+class Column
 {
-  public:
+  private:
     /*!
-     * @brief   `mail::Location::~Location` is a pure virtual destructor of the `mail::Location` class.
-     * @details This ensures that the `mail::Location` class is an abstract class and won't cause memory leak.
+     * @brief   `csv::Column::m_chars` is the concatenation of all the fields in the column.
      */
-    virtual ~Location() = 0;
+    string m_chars;
     /*!
-     * @brief   `mail::Location::operator<` is a function that compares two locations.
-     * @details It compares two locations by comparing their string representations. This is to enable the use of `std::map`.
-     * @param   other The other location
-     * @return  `bool` `true` if the current location is less than the other location, `false` otherwise
+     * @brief   `csv::Column::m_offsets` is the offset of every field in `m_chars`, followed by the size of `m_chars`.
      */
-    bool operator<(Location const &other) const
+    vector<uint32_t> m_offsets;
+
+  public:
+    Column()
+        : m_chars()
+        , m_offsets(1, 0)
+    {}
+    /*!
+     * @brief   `csv::Column::size` is a function that returns the number of fields in the column.
+     * @return  `std::size_t` The number of fields in the column
+     */
+    size_t size() const
     {
-        return (string)(*this) < (string)(other);
+        return m_offsets.size() - 1;
     }
     /*!
-     * @brief   `mail::Location::operator==` is a function that compares two locations.
-     * @details It compares two locations by comparing their string representations. This is to enable the use of `std::map`.
-     * @param   other The other location
-     * @return  `bool` `true` if the current location is equal to the other location, `false` otherwise
+     * @brief   `csv::Column::field_begin` is a function that returns the beginning of the field at the specified index.
+     * @param   index The index of the field, less than `size()`
+     * @return  `char const *` The beginning of the field
      */
-    bool operator==(Location const &other) const
+    char const *field_begin(size_t index) const
     {
-        return (string)(*this) == (string)(other);
+        return m_chars.data() + m_offsets[index];
     }
     /*!
-     * @brief   `mail::Location::operator string` is a pure virtual function that returns the string representation of the location.
+     * @brief   `csv::Column::field_end` is a function that returns the end of the field at the specified index.
+     * @param   index The index of the field, less than `size()`
+     * @return  `char const *` The end of the field
      */
-    virtual operator string() const = 0;
+    char const *field_end(size_t index) const
+    {
+        return m_chars.data() + m_offsets[index + 1];
+    }
     /*!
-     * @brief   `mail::Location::to_string` is a pure virtual function that returns the string representation of the location with more information that suitable for human reading.
+     * @brief   `csv::Column::at` is a function that returns a copy of the field at the specified index.
+     * @param   index The index of the field
+     * @return  `std::string` The field
+     * @throws  `std::out_of_range` If the index is more than `size()`
      */
-    virtual string to_string() const = 0;
-};
-/*!
- * @brief   `mail::Location::~Location` is using the default destructor created by the compiler.
- * @details This ensures that the use of `mail::Location` won't cause any linker error.
- */
-Location::~Location() = default;
-/*!
- * @brief   `mail::FromLocation` is a class that represents a location from a city.
- */
-class FromLocation : public Location
-{
-  protected:
+    string at(size_t index) const
+    {
+        if (index >= this->size())
+            throw out_of_range("CSV field index out of range");
+        return string(field_begin(index), field_end(index));
+    }
     /*!
-     * @brief   `mail::FromLocation::city` is a string that represents the city of the location.
+     * @brief   `csv::Column::push_back` is a function that appends a field to the column.
+     * @param   begin The beginning of the field
+     * @param   end The end of the field
+     * @throws  `std::length_error` If the column grows beyond 4 GiB
      */
-    string city;
-
-  public:
+    void push_back(char const *begin, char const *end)
+    {
+        if (m_chars.size() + static_cast<size_t>(end - begin) > numeric_limits<uint32_t>::max())
+            throw length_error("CSV column too large");
+        m_chars.append(begin, end);
+        m_offsets.push_back(static_cast<uint32_t>(m_chars.size()));
+    }
     /*!
-     * @brief   `mail::FromLocation::FromLocation` is a constructor that initializes the `mail::FromLocation` object.
+     * @brief   `csv::Column::truncate` is a function that drops the fields from the specified index on.
+     * @param   count The number of fields to keep
      */
-    FromLocation(string const &city) 
-        : city(city)
+    void truncate(size_t count)
     {
+        if (count >= this->size())
+            return;
+        m_offsets.resize(count + 1);
+        m_chars.resize(m_offsets.back());
     }
     /*!
-     * @brief   `mail::FromLocation::~FromLocation` is using the default destructor created by the compiler.
-     * @details This ensures that the use of `mail::FromLocation` won't cause any linker error or memory leakage.
+     * @brief   `csv::Column::memory_usage` is a function that returns the number of bytes held by the column.
+     * @return  `std::size_t` The capacity of the character buffer and the offsets array in bytes
      */
-    virtual ~FromLocation() = default;
-    /*!
-     * @brief   `mail::FromLocation::operator string` is a function that returns the string representation of the location.
-     */
-    virtual operator string() const override
+    size_t memory_usage() const
     {
-        return "{ " + this->city + " }";
+        return m_chars.capacity() + m_offsets.capacity() * sizeof(uint32_t);
     }
     /*!
-     * @brief   `mail::FromLocation::to_string` is a function that returns the string representation of the location with more information.
+     * @brief   `csv::Column::as` is a function that decodes every field in the column to a number.
+     * @param   field_index The index of the column in the file, for the error message
+     * @return  `std::vector<T>` The values of the column
+     * @throws  `std::runtime_error` If a field is not a number of type `T`
+     * @throws  `std::out_of_range` If a number does not fit in `T`
      */
-    virtual string to_string() const override
+    template <typename T>
+    vector<T> as(size_t field_index = 0) const
     {
-        return "From: { " + this->city + " }";
+        vector<T> values;
+        values.reserve(this->size());
+        for (size_t i = 0; i < this->size(); ++i)
+            values.push_back(detail::field_to<T>(field_begin(i), field_end(i), i, field_index));
+        return values;
     }
 };
+
 /*!
- * @brief   `mail::ToLocation` is a class that represents a location to a city.
+ *  @brief  `csv::Parser` is the type that parse the CSV file and store the data in a structured way.
  */
-class ToLocation : public Location
+class Parser
 {
-  protected:
+  public:
     /*!
-     * @brief   `mail::ToLocation::city` is a string that represents the city of the location.
+     * @brief   `csv::Parser::storage_type` selects how the records are kept in memory.
+     * @details `row_storage` keeps a vector of strings per record. `column_storage` keeps one `csv::Column` per field,
+     *          which is much smaller and faster to scan when the consumer walks one column at a time.
      */
-    string city;
+    enum storage_type
+    {
+        row_storage,
+        column_storage
+    };
 
-  public:
+  private:
     /*!
-     * @brief   `mail::ToLocation::ToLocation` is a constructor that initializes the `mail::ToLocation` object.
-     * @param   city The city of the location
+     * @brief   `csv::Parser::record_type` is a vector of strings that represents the fields in a line in the CSV file.
      */
-    ToLocation(string const &city) 
-        : city(city)
-    {
-    }
+    typedef vector<string> record_type;
     /*!
-     * @brief   `mail::ToLocation::~ToLocation` is using the default destructor created by the compiler.
-     * @details This ensures that the use of `mail::ToLocation` won't cause any linker error or memory leakage.
+     * @brief   `csv::Parser::title_type` is a vector of strings that represents the title fields in the CSV file.
      */
-    virtual ~ToLocation() = default;
+    typedef vector<string> title_type;
     /*!
-     * @brief   `mail::ToLocation::operator string` is a function that returns the string representation of the location.
+     * @brief   `csv::Parser::m_title_fields` is a vector of strings that stores the title fields in the CSV file.
      */
-    virtual operator string() const override
-    {
-        return "{ " + this->city + " }";
-    }
+    title_type m_title_fields;
     /*!
-     * @brief   `mail::ToLocation::to_string` is a function that returns the string representation of the location with more information.
+     * @brief   `csv::Parser::m_data` is a vector of `record_type` that stores the data in the CSV file.
+     * @details It is only used with `row_storage`.
      */
-    virtual string to_string() const override
-    {
-        return "To: { " + this->city + " }";
-    }
-};
-/*!
- * @brief   `Route` is a type that represents a route from a location to another location.
- */
-typedef pair<FromLocation, ToLocation> Route;
-/*!
- * @brief   `mail::make_route` is a function that creates a route from a location to another location.
- * @param   from The location from
- * @param   to The location to
- * @return  `mail::Route` The route from the location `from` to the location `to`
- */
-Route make_route(FromLocation from, ToLocation to)
-{
-    return make_pair(from, to);
-}
-/*!
- * @brief   `mail::RouteToDistance` is a class that stores the distance between two locations and converts a route to its distance.
- */
-class RouteToDistance
-{
-  public:
-    typedef Route RouteType;
-    typedef unsigned int DistanceType;
-
-  protected:
+    vector<record_type> m_data;
     /*!
-     * @brief   `mail::RouteToDistance::distance_map_init` is a function that reads the distance from file.
-     * @return  `std::map<mail::RouteToDistance::RouteType, mail::RouteToDistance::DistanceType>` The distance map
+     * @brief   `csv::Parser::m_columns` is a vector of `csv::Column` that stores the data in the CSV file.
+     * @details It is only used with `column_storage`.
      */
-    static map<RouteType, DistanceType> distance_map_init();
+    vector<Column> m_columns;
     /*!
-     * @brief   `mail::RouteToDistance::distance_map_filename` is a string that represents the filename of the distance map file in CSV format.
+     * @brief   `csv::Parser::m_record_count` is the number of records stored.
      */
-    static string const distance_map_filename;
+    size_t m_record_count;
+    /*!
+     * @brief   `csv::Parser::m_storage` is how the records are stored.
+     */
+    storage_type m_storage;
     /*!
-     * @brief   `mail::RouteToDistance::distance_map` is a map that stores the distance between two locations.
+     * @brief   `csv::Parser::m_dialect` is the dialect of the CSV file.
      */
-    static map<RouteType, DistanceType> const distance_map;
+    Dialect m_dialect;
+    /*!
+     * @brief   `csv::Parser::m_tokenizer` is the state machine built for `m_dialect`.
+     */
+    Tokenizer m_tokenizer;
 
-  public:
     /*!
-     * @brief   `mail::RouteToDistance::exists` is a function that checks if the route exists in the distance map.
-     * @param   route The route
-     * @return  `bool` `true` if the route exists in the distance map, `false` otherwise
+     * @brief   `csv::Parser::line_builder` is the sink of `csv::Tokenizer` that collects the fields of single lines.
      */
-    bool exists(RouteType const &route) const
+    struct line_builder
     {
-        return distance_map.find(route) != distance_map.end();
-    }
+        vector<record_type> &records;
+        record_type current;
+
+        void field(char const *begin, char const *end)
+        {
+            current.push_back(string(begin, end));
+        }
+        void end_record()
+        {
+            records.push_back(record_type());
+            records.back().swap(current);
+        }
+    };
     /*!
-     * @brief   `mail::RouteToDistance::operator()` is a function that converts a route to its distance.
-     * @param   route The route to convert
-     * @return  `mail::RouteToDistance::DistanceType` The distance between the two locations in the route
-     * @throws  `std::out_of_range` If the route does not exist in the distance map
+     * @brief   `csv::Parser::record_builder` is the sink of `csv::Tokenizer` that checks records and stores them in
+     *          `csv::Parser::m_data`.
      */
-    DistanceType operator()(RouteType const &route) const
+    struct record_builder
     {
-        try
+        Parser &parser;
+        bool expect_header;
+        record_type current;
+
+        void field(char const *begin, char const *end)
         {
-            return distance_map.at(route);
+            current.push_back(string(begin, end));
         }
-        catch (out_of_range const &)
+        void end_record()
         {
-            throw out_of_range("Route not found");
+            if (expect_header)
+            {
+                if (current != parser.titles())
+                    throw runtime_error("Invalid CSV format: title line mismatch");
+                expect_header = false;
+                current.clear();
+                return;
+            }
+            if (current.size() != parser.field_count())
+                throw runtime_error("Invalid CSV format: field count mismatch");
+            parser.m_data.push_back(record_type());
+            parser.m_data.back().swap(current);
+            current.reserve(parser.field_count());
+            ++parser.m_record_count;
         }
-    }
-} const route_to_distance;
-
-map<RouteToDistance::RouteType, RouteToDistance::DistanceType> RouteToDistance::distance_map_init()
-{
-    map<RouteToDistance::RouteType, RouteToDistance::DistanceType> distance_map;
-    ifstream distance_map_stream(distance_map_filename);
-    if (!distance_map_stream)
-        throw runtime_error("Failed to open distance map file");
-
-    string distance_map_title_line;
-    getline(distance_map_stream, distance_map_title_line);
-
-    distance_map_stream.seekg(0);
-    string file_buffer((istreambuf_iterator<char>(distance_map_stream)), istreambuf_iterator<char>());
-
-    csv::Parser distance_map_parser(distance_map_title_line);
-    distance_map_parser.add_records(file_buffer);
-
-    for (size_t i = 0; i < distance_map_parser.record_count(); ++i)
+    };
+    /*!
+     * @brief   `csv::Parser::column_builder` is the sink of `csv::Tokenizer` that checks records and appends their
+     *          fields to `csv::Parser::m_columns`.
+     * @details A record with the wrong number of fields is removed from the columns before the error is thrown.
+     */
+    struct column_builder
     {
-        string const &from_city = distance_map_parser.field_at(i, 0);
-        string const &to_city = distance_map_parser.field_at(i, 1);
-        RouteToDistance::RouteType const route = make_pair(FromLocation(from_city), ToLocation(to_city));
-        istringstream ss(distance_map_parser.field_at(i, 2));
-        RouteToDistance::DistanceType distance;
-        ss >> distance;
-        distance_map[route] = distance;
-    }
-
-    return distance_map;
-}
-
-const string RouteToDistance::distance_map_filename = "distance.csv";
-const map<RouteToDistance::RouteType, RouteToDistance::DistanceType> RouteToDistance::distance_map =
-    RouteToDistance::distance_map_init();
-
-/*!
- * @brief   `mail::Centimeter` is a class that represents a length in centimeters.
- */
-class Centimeter
-{
-  public:
-    typedef long double ValueType;
+        Parser &parser;
+        bool expect_header;
+        record_type header;
+        size_t field_index;
 
-  private:
+        void field(char const *begin, char const *end)
+        {
+            if (expect_header)
+                header.push_back(string(begin, end));
+            else if (field_index < parser.field_count())
+                parser.m_columns[field_index].push_back(begin, end);
+            ++field_index;
+        }
+        void end_record()
+        {
+            size_t const fields = field_index;
+            field_index = 0;
+            if (expect_header)
+            {
+                if (header != parser.titles())
+                    throw runtime_error("Invalid CSV format: title line mismatch");
+                expect_header = false;
+                return;
+            }
+            if (fields != parser.field_count())
+            {
+                for (size_t i = 0; i < parser.m_columns.size(); ++i)
+                    parser.m_columns[i].truncate(parser.m_record_count);
+                throw runtime_error("Invalid CSV format: field count mismatch");
+            }
+            ++parser.m_record_count;
+        }
+    };
     /*!
-     * @brief   `mail::Centimeter::value` is a value that represents the length in centimeters.
+     * @brief   `csv::Parser::parse_line` is a function that parses a line in the CSV file.
+     * @details It parses a line in the CSV file and returns a vector of strings that represents the fields in the line.
+     * @param   line_begin The beginning of the line
+     * @param   line_end The end of the line
+     * @return  `csv::Parser::record_type` The fields in the line
+     * @throws  `std::runtime_error` If a quote is missing or the line holds more than one record
      */
-    ValueType value;
+    record_type parse_line(char const *line_begin, char const *line_end) const;
 
   public:
     /*!
-     * @brief   `mail::Centimeter::Centimeter` is a constructor that initializes the `mail::Centimeter` object.
-     * @param   value A value not less than 0 that represents the length in centimeters
-     * @throws  `std::runtime_error` If the value is less than 0
+     * @brief   `csv::Parser::Parser` is a constructor that initializes the `csv::Parser` object.
+     * @details It initializes the `csv::Parser` object with the title line in the CSV file.
+     * @param   title_line The title line in the CSV file
+     * @param   dialect The dialect of the CSV file
+     * @param   storage How the records are stored
      */
-    Centimeter(ValueType value = 0) : value(value >= 0 ? value : -1)
+    Parser(string const &title_line, Dialect const &dialect = Dialect(), storage_type storage = row_storage)
+        : m_title_fields()
+        , m_data()
+        , m_columns()
+        , m_record_count(0)
+        , m_storage(storage)
+        , m_dialect(dialect)
+        , m_tokenizer(dialect)
     {
-        if (this->value == -1)
-            throw runtime_error("Invalid centimeter value");
+        m_title_fields = parse_line(title_line.data(), title_line.data() + title_line.size());
+        if (m_storage == column_storage)
+            m_columns.resize(m_title_fields.size());
     }
     /*!
-     * @brief   `mail::Centimeter::unit` is a function that returns the unit of the length.
-     * @return  `string` The unit of the length
+     * @brief   `csv::Parser::add_records` is a function that adds the records in the CSV file.
+     * @details It adds the records in the CSV file by parsing the data string and storing the data in the structured way.
+     *          If the dialect has a header, it also checks if the title line in the CSV file matches the title fields in
+     *          the `csv::Parser` object.
+     * @param   data_str The string that contains the data in the CSV file
+     * @throws  `std::runtime_error` If the data is malformed or does not match the title fields
      */
-    static string unit()
+    void add_records(string const &data_str);
+    /*!
+     * @brief   `csv::Parser::titles` is a function that returns the title fields in the CSV file.
+     * @return  `csv::Parser::title_type const &` The title fields in the CSV file
+     */
+    title_type const &titles() const
     {
-        return "cm";
+        return m_title_fields;
     }
     /*!
-     * @brief   `mail::Centimeter::operator ValueType` is a function that converts the `mail::Centimeter` object to its value.
-     * @return  `mail::Centimeter::ValueType` The value of the `mail::Centimeter` object
+     * @brief   `csv::Parser::dialect` is a function that returns the dialect of the CSV file.
+     * @return  `csv::Dialect const &` The dialect of the CSV file
      */
-    operator ValueType() const
+    Dialect const &dialect() const
     {
-        return this->value;
+        return m_dialect;
     }
-};
-
-/*!
- * @brief   `mail::Freight` is an abstract class that represents a freight.
- * @example 
- *  ```cpp
- *  Freight const *freight = &air_freight;
- *  long double volumetric_weight = freight->volumetric_weight(32, 24, 1, 1);
- *  ```
- */
-class Freight
-{
-  public:
     /*!
-     * @brief   `mail::Freight::~Freight` is a pure virtual destructor of the `mail::Freight` class.
-     * @details This ensures that the `mail::Freight` class is an abstract class and won't cause memory leak.
+     * @brief   `csv::Parser::storage` is a function that returns how the records are stored.
+     * @return  `csv::Parser::storage_type` How the records are stored
      */
-    virtual ~Freight() = 0;
+    storage_type storage() const
+    {
+        return m_storage;
+    }
     /*!
-     * @brief   `mail::Freight::volumetric_weight` is a pure virtual function that calculates the volumetric weight of this freight.
-     * @param   l The length of the package
-     * @param   w The width of the package 
-     * @param   h The height of the package
-     * @param   packages The number of packages
-     * @return  `long double` The volumetric weight of the freight
+     * @brief   `csv::Parser::record_at` is a function that returns the record at the specified index.
+     * @param   index The index of the record
+     * @return  `csv::Parser::record_type const &` The record at the specified index
+     * @throws  `std::out_of_range` If the index is more than `record_count()`
+     * @throws  `std::logic_error` If the records are not stored by row; use `column` instead
      */
-    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const = 0;
+    record_type const &record_at(size_t index) const
+    {
+        if (m_storage != row_storage)
+            throw logic_error("CSV records are only available with row storage");
+        return m_data.at(index);
+    }
     /*!
-     * @brief   `mail::Freight::operator string` is a pure virtual function that returns the string representation of the freight.
+     * @brief   `csv::Parser::field_at` is a function that returns the field at the specified index in the record at the specified index.
+     * @param   record_index The index of the record
+     * @param   field_index The index of the field
+     * @return  `std::string const &` The field at the specified index in the record at the specified index
+     * @throws  `std::out_of_range` If the index is more than `record_count()` or `field_count()`
+     * @throws  `std::logic_error` If the records are not stored by row; use `column` instead
      */
-    virtual operator string() const = 0;
-};
-/*!
- * @brief   `mail::Freight::~Freight` is using the default destructor created by the compiler.
- * @details This ensures that the use of `mail::Freight` won't cause any linker error or memory leakage.
- */
-Freight::~Freight() = default;
-
-class AirFreight : public Freight
-{
-  public:
-    virtual ~AirFreight() = default;
-
-    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const override
+    string const &field_at(size_t record_index, size_t field_index) const
     {
-        return l * w * h / 6000.0 * packages;
+        return record_at(record_index).at(field_index);
     }
-    virtual operator string() const override
+    /*!
+     * @brief   `csv::Parser::column` is a function that returns the column at the specified index.
+     * @param   field_index The index of the column
+     * @return  `csv::Column const &` The column at the specified index
+     * @throws  `std::out_of_range` If the index is more than `field_count()`
+     * @throws  `std::logic_error` If the records are not stored by column
+     */
+    Column const &column(size_t field_index) const
     {
-        return "Air transport";
+        if (m_storage != column_storage)
+            throw logic_error("CSV columns are only available with column storage");
+        return m_columns.at(field_index);
     }
-} const air_freight;
-
-class OceanFreight : public Freight
-{
-  public:
-    virtual ~OceanFreight() = default;
-
-    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const override
+    /*!
+     * @brief   `csv::Parser::record_count` is a function that returns the number of records in the CSV file.
+     * @return  `std::size_t` The number of records in the CSV file
+     */
+    size_t record_count() const
     {
-        return l * w * h / 1000.0 * packages;
+        return m_record_count;
     }
-    virtual operator string() const override
+    /*!
+     * @brief   `csv::Parser::field_count` is a function that returns the number of fields in the CSV file.
+     * @return  `std::size_t` The number of fields in the CSV file
+     */
+    size_t field_count() const
     {
-        return "Ocean transport";
+        return m_title_fields.size();
     }
-} const ocean_freight;
+    /*!
+     * @brief   `csv::Parser::field_as` is a function that converts the field at the specified index to a number.
+     * @param   record_index The index of the record
+     * @param   field_index The index of the field
+     * @return  `T` The value of the field
+     * @throws  `std::runtime_error` If the field is not a number of type `T`
+     * @throws  `std::out_of_range` If the index is out of range or the number does not fit in `T`
+     */
+    template <typename T>
+    T field_as(size_t record_index, size_t field_index) const;
+    /*!
+     * @brief   `csv::Parser::column_as` is a function that converts every field in a column to a number.
+     * @details The conversion uses `csv::from_chars`, so it neither allocates per field nor depends on the locale.
+     *          With `column_storage` it is a single sequential pass over the column buffer. Nothing is cached: every
+     *          call decodes the column again, so a caller that needs the values more than once keeps the result.
+     * @param   field_index The index of the column
+     * @return  `std::vector<T>` The values of the column, one per record
+     * @throws  `std::runtime_error` If a field is not a number of type `T`
+     * @throws  `std::out_of_range` If the index is out of range or a number does not fit in `T`
+     */
+    template <typename T>
+    vector<T> column_as(size_t field_index) const;
+};
 
-class RailFreight : public Freight
+Parser::record_type Parser::parse_line(char const *line_begin, char const *line_end) const
+{
+    vector<record_type> records;
+    line_builder builder = {records, record_type()};
+    m_tokenizer.tokenize(line_begin, line_end, builder);
+    if (records.size() > 1)
+        throw runtime_error("Invalid CSV format: unexpected line break");
+    return records.empty() ? record_type() : records.front();
+}
+
+void Parser::add_records(string const &data_str)
+{
+    bool expect_header = m_dialect.has_header;
+    if (m_storage == column_storage)
+    {
+        column_builder builder = {*this, expect_header, record_type(), 0};
+        m_tokenizer.tokenize(data_str.data(), data_str.data() + data_str.size(), builder);
+        expect_header = builder.expect_header;
+    }
+    else
+    {
+        record_builder builder = {*this, expect_header, record_type()};
+        m_tokenizer.tokenize(data_str.data(), data_str.data() + data_str.size(), builder);
+        expect_header = builder.expect_header;
+    }
+    if (expect_header)
+        throw runtime_error("Invalid CSV format: title line mismatch");
+}
+
+template <typename T>
+T Parser::field_as(size_t record_index, size_t field_index) const
+{
+    if (m_storage == column_storage)
+    {
+        Column const &field_column = this->column(field_index);
+        if (record_index >= field_column.size())
+            throw out_of_range("CSV record index out of range");
+        return detail::field_to<T>(field_column.field_begin(record_index), field_column.field_end(record_index),
+                                   record_index, field_index);
+    }
+    string const &field = m_data.at(record_index).at(field_index);
+    return detail::field_to<T>(field.data(), field.data() + field.size(), record_index, field_index);
+}
+
+template <typename T>
+vector<T> Parser::column_as(size_t field_index) const
+{
+    if (field_index >= this->field_count())
+        throw out_of_range("CSV column index out of range");
+    if (m_storage == column_storage)
+        return m_columns[field_index].as<T>(field_index);
+    vector<T> column;
+    column.reserve(this->record_count());
+    for (size_t i = 0; i < this->record_count(); ++i)
+        column.push_back(this->field_as<T>(i, field_index));
+    return column;
+}
+
+} // namespace csv
+
+namespace mail
+{
+
+/*!
+ * @brief   `mail::Location` is an abstract class that represents a location.
+ */
+class Location
 {
   public:
-    virtual ~RailFreight() = default;
+    /*!
+     * @brief   `mail::Location::~Location` is a pure virtual destructor of the `mail::Location` class.
+     * @details This ensures that the `mail::Location` class is an abstract class and won't cause memory leak.
+     */
+    virtual ~Location() = 0;
+    /*!
+     * @brief   `mail::Location::operator<` is a function that compares two locations.
+     * @details It compares two locations by comparing their string representations. This is to enable the use of `std::map`.
+     * @param   other The other location
+     * @return  `bool` `true` if the current location is less than the other location, `false` otherwise
+     */
+    bool operator<(Location const &other) const
+    {
+        return (string)(*this) < (string)(other);
+    }
+    /*!
+     * @brief   `mail::Location::operator==` is a function that compares two locations.
+     * @details It compares two locations by comparing their string representations. This is to enable the use of `std::map`.
+     * @param   other The other location
+     * @return  `bool` `true` if the current location is equal to the other location, `false` otherwise
+     */
+    bool operator==(Location const &other) const
+    {
+        return (string)(*this) == (string)(other);
+    }
+    /*!
+     * @brief   `mail::Location::operator string` is a pure virtual function that returns the string representation of the location.
+     */
+    virtual operator string() const = 0;
+    /*!
+     * @brief   `mail::Location::to_string` is a pure virtual function that returns the string representation of the location with more information that suitable for human reading.
+     */
+    virtual string to_string() const = 0;
+};
+/*!
+ * @brief   `mail::Location::~Location` is using the default destructor created by the compiler.
+ * @details This ensures that the use of `mail::Location` won't cause any linker error.
+ */
+Location::~Location() = default;
+/*!
+ * @brief   `mail::FromLocation` is a class that represents a location from a city.
+ */
+class FromLocation : public Location
+{
+  protected:
+    /*!
+     * @brief   `mail::FromLocation::city` is a string that represents the city of the location.
+     */
+    string city;
 
-    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const override
+  public:
+    /*!
+     * @brief   `mail::FromLocation::FromLocation` is a constructor that initializes the `mail::FromLocation` object.
+     */
+    FromLocation(string const &city) 
+        : city(city)
+    {
+    }
+    /*!
+     * @brief   `mail::FromLocation::~FromLocation` is using the default destructor created by the compiler.
+     * @details This ensures that the use of `mail::FromLocation` won't cause any linker error or memory leakage.
+     */
+    virtual ~FromLocation() = default;
+    /*!
+     * @brief   `mail::FromLocation::operator string` is a function that returns the string representation of the location.
+     */
+    virtual operator string() const override
+    {
+        return "{ " + this->city + " }";
+    }
+    /*!
+     * @brief   `mail::FromLocation::to_string` is a function that returns the string representation of the location with more information.
+     */
+    virtual string to_string() const override
+    {
+        return "From: { " + this->city + " }";
+    }
+    /*!
+     * @brief   `mail::FromLocation::city_name` is a function that returns the name of the city.
+     * @return  `std::string const &` The name of the city
+     */
+    string const &city_name() const
+    {
+        return this->city;
+    }
+};
+/*!
+ * @brief   `mail::ToLocation` is a class that represents a location to a city.
+ */
+class ToLocation : public Location
+{
+  protected:
+    /*!
+     * @brief   `mail::ToLocation::city` is a string that represents the city of the location.
+     */
+    string city;
+
+  public:
+    /*!
+     * @brief   `mail::ToLocation::ToLocation` is a constructor that initializes the `mail::ToLocation` object.
+     * @param   city The city of the location
+     */
+    ToLocation(string const &city) 
+        : city(city)
     {
-        return l * w * h / 3000.0 * packages;
     }
+    /*!
+     * @brief   `mail::ToLocation::~ToLocation` is using the default destructor created by the compiler.
+     * @details This ensures that the use of `mail::ToLocation` won't cause any linker error or memory leakage.
+     */
+    virtual ~ToLocation() = default;
+    /*!
+     * @brief   `mail::ToLocation::operator string` is a function that returns the string representation of the location.
+     */
     virtual operator string() const override
     {
-        return "Rail transport";
+        return "{ " + this->city + " }";
+    }
+    /*!
+     * @brief   `mail::ToLocation::to_string` is a function that returns the string representation of the location with more information.
+     */
+    virtual string to_string() const override
+    {
+        return "To: { " + this->city + " }";
+    }
+    /*!
+     * @brief   `mail::ToLocation::city_name` is a function that returns the name of the city.
+     * @return  `std::string const &` The name of the city
+     */
+    string const &city_name() const
+    {
+        return this->city;
+    }
+};
+/*!
+ * @brief   `Route` is a type that represents a route from a location to another location.
+ */
+typedef pair<FromLocation, ToLocation> Route;
+/*!
+ * @brief   `mail::make_route` is a function that creates a route from a location to another location.
+ * @param   from The location from
+ * @param   to The location to
+ * @return  `mail::Route` The route from the location `from` to the location `to`
+ */
+Route make_route(FromLocation from, ToLocation to)
+{
+    return make_pair(from, to);
+}
+/*!
+ * @brief   `mail::CityIndex` is a class that interns city names into dense IDs.
+ * @details The names are kept sorted, so the ID of a city is its rank and lookups are a binary search over a
+ *          contiguous table.
+ */
+class CityIndex
+{
+  public:
+    typedef unsigned int IdType;
+    /*!
+     * @brief   `mail::CityIndex::npos` is the ID returned for an unknown city.
+     */
+    static IdType const npos = ~0U;
+
+  private:
+    /*!
+     * @brief   `mail::CityIndex::m_names` is the sorted vector of the city names without duplicates.
+     */
+    vector<string> m_names;
+
+  public:
+    /*!
+     * @brief   `mail::CityIndex::CityIndex` is a constructor that initializes the `mail::CityIndex` object.
+     * @param   names The city names, in any order and possibly repeated
+     */
+    explicit CityIndex(vector<string> names = vector<string>())
+        : m_names(names)
+    {
+        sort(m_names.begin(), m_names.end());
+        m_names.erase(unique(m_names.begin(), m_names.end()), m_names.end());
+    }
+    /*!
+     * @brief   `mail::CityIndex::id_of` is a function that returns the ID of a city.
+     * @param   name The name of the city
+     * @return  `mail::CityIndex::IdType` The ID of the city, or `npos` if the city is unknown
+     */
+    IdType id_of(string const &name) const
+    {
+        vector<string>::const_iterator const it = lower_bound(m_names.begin(), m_names.end(), name);
+        return it != m_names.end() && *it == name ? static_cast<IdType>(it - m_names.begin()) : npos;
+    }
+    /*!
+     * @brief   `mail::CityIndex::contains` is a function that checks if a city is known.
+     * @param   name The name of the city
+     * @return  `bool` `true` if the city is known, `false` otherwise
+     */
+    bool contains(string const &name) const
+    {
+        return id_of(name) != npos;
+    }
+    /*!
+     * @brief   `mail::CityIndex::name_of` is a function that returns the name of a city.
+     * @param   id The ID of the city
+     * @return  `std::string const &` The name of the city
+     * @throws  `std::out_of_range` If the ID is not less than `size()`
+     */
+    string const &name_of(IdType id) const
+    {
+        return m_names.at(id);
+    }
+    /*!
+     * @brief   `mail::CityIndex::size` is a function that returns the number of cities.
+     * @return  `std::size_t` The number of cities
+     */
+    size_t size() const
+    {
+        return m_names.size();
+    }
+    /*!
+     * @brief   `mail::CityIndex::names` is a function that returns all the city names in ID order.
+     * @return  `std::vector<std::string> const &` The city names
+     */
+    vector<string> const &names() const
+    {
+        return m_names;
+    }
+    /*!
+     * @brief   `mail::CityIndex::fingerprint` is a function that returns a hash of the city names.
+     * @details IDs are only meaningful for the index that assigned them; data that stores IDs keeps the fingerprint
+     *          of its index to notice when the city list has changed.
+     * @return  `uint64_t` The 64-bit FNV-1a hash of the names in ID order, each followed by a NUL
+     */
+    uint64_t fingerprint() const
+    {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < m_names.size(); ++i)
+            for (size_t j = 0; j <= m_names[i].size(); ++j)
+                hash = (hash ^ static_cast<unsigned char>(m_names[i].c_str()[j])) * 0x100000001B3ULL;
+        return hash;
+    }
+};
+
+/*!
+ * @brief   `mail::GeoIndex` is a class that stores the coordinates of cities and finds the nearest ones.
+ * @details Coordinates are kept as separate arrays of latitudes, longitudes and cosines of latitude, so
+ *          `distances_from` runs one branch-free loop over contiguous data. For nearest-neighbour queries every city
+ *          is also a point on the unit sphere, in a k-d tree stored implicitly in `m_order`: the median of a range
+ *          is its node and the two halves are its subtrees. Straight-line distance through the sphere grows with
+ *          great-circle distance, so the tree prunes without handling the wrap-around of longitude.
+ */
+class GeoIndex
+{
+  public:
+    /*!
+     * @brief   `mail::GeoIndex::earth_radius` is the mean radius of the Earth in kilometers.
+     */
+    static double const earth_radius;
+    /*!
+     * @brief   `mail::GeoIndex::Neighbour` is a city found by `nearest`.
+     */
+    struct Neighbour
+    {
+        CityIndex::IdType id;
+        /*!
+         * @brief   `mail::GeoIndex::Neighbour::distance` is the great-circle distance in kilometers.
+         */
+        double distance;
+    };
+
+  private:
+    CityIndex m_cities;
+    vector<double> m_latitude;
+    vector<double> m_longitude;
+    vector<double> m_cos_latitude;
+    /*!
+     * @brief   `mail::GeoIndex::m_points` is the position of city `i` on the unit sphere at `3 * i` to `3 * i + 2`.
+     */
+    vector<double> m_points;
+    vector<CityIndex::IdType> m_order;
+    /*!
+     * @brief   `mail::GeoIndex::m_axis` is the axis that the node at each position of `m_order` splits on.
+     */
+    vector<unsigned char> m_axis;
+
+    void build(size_t begin, size_t end);
+    template <typename Filter>
+    void search(size_t begin, size_t end, double const *point, size_t count, Filter const &keep,
+                CityIndex::IdType skip, vector<pair<double, CityIndex::IdType> > &heap) const;
+    template <typename Filter>
+    vector<Neighbour> nearest(double const *point, size_t count, Filter const &keep, CityIndex::IdType skip) const;
+
+  public:
+    /*!
+     * @brief   `mail::GeoIndex::GeoIndex` is a constructor that indexes no city.
+     */
+    GeoIndex()
+        : m_cities()
+        , m_latitude()
+        , m_longitude()
+        , m_cos_latitude()
+        , m_points()
+        , m_order()
+        , m_axis()
+    {}
+    /*!
+     * @brief   `mail::GeoIndex::GeoIndex` is a constructor that indexes cities.
+     * @param   names The city names
+     * @param   latitudes The latitude of each city in degrees
+     * @param   longitudes The longitude of each city in degrees
+     * @throws  `std::runtime_error` If a name is repeated, the vectors differ in size, or a coordinate is out of range
+     */
+    GeoIndex(vector<string> const &names, vector<double> const &latitudes, vector<double> const &longitudes);
+    /*!
+     * @brief   `mail::GeoIndex::load` is a function that reads the coordinates of cities from file.
+     * @param   filename The coordinate file in CSV format, with the city, its latitude and its longitude per record
+     * @return  `mail::GeoIndex` The index of the cities in the file
+     * @throws  `std::runtime_error` If the file cannot be read or is not valid
+     */
+    static GeoIndex load(string const &filename);
+    /*!
+     * @brief   `mail::GeoIndex::cities` is a function that returns the cities that have coordinates.
+     * @return  `mail::CityIndex const &` The cities, whose IDs index every other function
+     */
+    CityIndex const &cities() const
+    {
+        return m_cities;
+    }
+    /*!
+     * @brief   `mail::GeoIndex::distance` is a function that returns the great-circle distance between two cities.
+     * @param   from The ID of the first city
+     * @param   to The ID of the second city
+     * @return  `double` The distance in kilometers by the haversine formula
+     */
+    double distance(CityIndex::IdType from, CityIndex::IdType to) const
+    {
+        double result;
+        distances_from(from, &to, 1, &result);
+        return result;
+    }
+    /*!
+     * @brief   `mail::GeoIndex::distances_from` is a function that returns the great-circle distances from one city to many.
+     * @param   from The ID of the city to measure from
+     * @param   to The IDs of the cities to measure to
+     * @param   count The number of cities in `to`
+     * @param   distances The `count` distances in kilometers, written in the order of `to`
+     */
+    void distances_from(CityIndex::IdType from, CityIndex::IdType const *to, size_t count, double *distances) const
+    {
+        double const latitude = m_latitude[from], longitude = m_longitude[from], cos_latitude = m_cos_latitude[from];
+        double const *const latitudes = m_latitude.data();
+        double const *const longitudes = m_longitude.data();
+        double const *const cos_latitudes = m_cos_latitude.data();
+        for (size_t i = 0; i < count; ++i)
+        {
+            double const half_latitude = sin((latitudes[to[i]] - latitude) * 0.5);
+            double const half_longitude = sin((longitudes[to[i]] - longitude) * 0.5);
+            double const h =
+                half_latitude * half_latitude + cos_latitude * cos_latitudes[to[i]] * half_longitude * half_longitude;
+            distances[i] = 2 * earth_radius * asin(sqrt(min(h, 1.0)));
+        }
+    }
+    /*!
+     * @brief   `mail::GeoIndex::nearest` is a function that finds the cities nearest to another.
+     * @param   id The ID of the city to search around, which is never part of the result
+     * @param   count The number of cities to find
+     * @param   keep A predicate on city IDs; only the cities it accepts are found
+     * @return  `std::vector<mail::GeoIndex::Neighbour>` Up to `count` cities, nearest first
+     */
+    template <typename Filter>
+    vector<Neighbour> nearest(CityIndex::IdType id, size_t count, Filter const &keep) const
+    {
+        return nearest(&m_points[3 * id], count, keep, id);
+    }
+    /*!
+     * @brief   `mail::GeoIndex::nearest` is a function that finds the cities nearest to a position.
+     * @param   latitude The latitude in degrees
+     * @param   longitude The longitude in degrees
+     * @param   count The number of cities to find
+     * @param   keep A predicate on city IDs; only the cities it accepts are found
+     * @return  `std::vector<mail::GeoIndex::Neighbour>` Up to `count` cities, nearest first
+     */
+    template <typename Filter>
+    vector<Neighbour> nearest(double latitude, double longitude, size_t count, Filter const &keep) const
+    {
+        double const pi = acos(-1.0);
+        latitude *= pi / 180;
+        longitude *= pi / 180;
+        double const point[3] = {cos(latitude) * cos(longitude), cos(latitude) * sin(longitude), sin(latitude)};
+        return nearest(point, count, keep, CityIndex::npos);
+    }
+};
+
+double const GeoIndex::earth_radius = 6371.0088;
+
+GeoIndex::GeoIndex(vector<string> const &names, vector<double> const &latitudes, vector<double> const &longitudes)
+    : m_cities(names)
+    , m_latitude(names.size())
+    , m_longitude(names.size())
+    , m_cos_latitude(names.size())
+    , m_points(3 * names.size())
+    , m_order(names.size())
+    , m_axis(names.size())
+{
+    if (latitudes.size() != names.size() || longitudes.size() != names.size())
+        throw runtime_error("Every city needs a latitude and a longitude");
+    if (m_cities.size() != names.size())
+        throw runtime_error("A city has more than one coordinate");
+    double const pi = acos(-1.0);
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        if (!(fabs(latitudes[i]) <= 90) || !(fabs(longitudes[i]) <= 180))
+            throw runtime_error("Coordinates of " + names[i] + " are out of range");
+        CityIndex::IdType const id = m_cities.id_of(names[i]);
+        m_latitude[id] = latitudes[i] * pi / 180;
+        m_longitude[id] = longitudes[i] * pi / 180;
+        m_cos_latitude[id] = cos(m_latitude[id]);
+        m_points[3 * id] = m_cos_latitude[id] * cos(m_longitude[id]);
+        m_points[3 * id + 1] = m_cos_latitude[id] * sin(m_longitude[id]);
+        m_points[3 * id + 2] = sin(m_latitude[id]);
+        m_order[id] = id;
+    }
+    build(0, m_order.size());
+}
+
+GeoIndex GeoIndex::load(string const &filename)
+{
+    ifstream stream(filename);
+    if (!stream)
+        throw runtime_error("Failed to open coordinate file " + filename);
+    string title_line;
+    getline(stream, title_line);
+    stream.seekg(0);
+    string const file_buffer((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+
+    csv::Parser parser(title_line, csv::Dialect(), csv::Parser::column_storage);
+    parser.add_records(file_buffer);
+    csv::Column const &cities = parser.column(0);
+    vector<string> names;
+    for (size_t i = 0; i < parser.record_count(); ++i)
+        names.push_back(string(cities.field_begin(i), cities.field_end(i)));
+    return GeoIndex(names, parser.column_as<double>(1), parser.column_as<double>(2));
+}
+
+void GeoIndex::build(size_t begin, size_t end)
+{
+    if (end - begin < 2)
+        return;
+    double low[3] = {2, 2, 2}, high[3] = {-2, -2, -2};
+    for (size_t i = begin; i < end; ++i)
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            low[axis] = min(low[axis], m_points[3 * m_order[i] + axis]);
+            high[axis] = max(high[axis], m_points[3 * m_order[i] + axis]);
+        }
+    unsigned char axis = 0;
+    for (unsigned char a = 1; a < 3; ++a)
+        if (high[a] - low[a] > high[axis] - low[axis])
+            axis = a;
+    size_t const middle = begin + (end - begin) / 2;
+    vector<double> const &points = m_points;
+    nth_element(m_order.begin() + begin, m_order.begin() + middle, m_order.begin() + end,
+                [&points, axis](CityIndex::IdType a, CityIndex::IdType b) {
+                    return points[3 * a + axis] < points[3 * b + axis];
+                });
+    m_axis[middle] = axis;
+    build(begin, middle);
+    build(middle + 1, end);
+}
+
+template <typename Filter>
+void GeoIndex::search(size_t begin, size_t end, double const *point, size_t count, Filter const &keep,
+                      CityIndex::IdType skip, vector<pair<double, CityIndex::IdType> > &heap) const
+{
+    if (begin >= end)
+        return;
+    size_t const middle = begin + (end - begin) / 2;
+    CityIndex::IdType const id = m_order[middle];
+    double const *const node = &m_points[3 * id];
+    if (id != skip && keep(id))
+    {
+        double const dx = node[0] - point[0], dy = node[1] - point[1], dz = node[2] - point[2];
+        double const squared = dx * dx + dy * dy + dz * dz;
+        if (heap.size() < count)
+        {
+            heap.push_back(make_pair(squared, id));
+            push_heap(heap.begin(), heap.end());
+        }
+        else if (squared < heap.front().first)
+        {
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = make_pair(squared, id);
+            push_heap(heap.begin(), heap.end());
+        }
+    }
+    double const offset = point[m_axis[middle]] - node[m_axis[middle]];
+    if (offset < 0)
+        search(begin, middle, point, count, keep, skip, heap);
+    else
+        search(middle + 1, end, point, count, keep, skip, heap);
+    if (heap.size() < count || offset * offset < heap.front().first)
+    {
+        if (offset < 0)
+            search(middle + 1, end, point, count, keep, skip, heap);
+        else
+            search(begin, middle, point, count, keep, skip, heap);
+    }
+}
+
+template <typename Filter>
+vector<GeoIndex::Neighbour> GeoIndex::nearest(double const *point, size_t count, Filter const &keep,
+                                              CityIndex::IdType skip) const
+{
+    vector<pair<double, CityIndex::IdType> > heap;
+    heap.reserve(count);
+    if (count > 0)
+        search(0, m_order.size(), point, count, keep, skip, heap);
+    sort_heap(heap.begin(), heap.end());
+    vector<Neighbour> neighbours;
+    for (size_t i = 0; i < heap.size(); ++i)
+    {
+        Neighbour const neighbour = {heap[i].second, 2 * earth_radius * asin(min(sqrt(heap[i].first) / 2, 1.0))};
+        neighbours.push_back(neighbour);
+    }
+    return neighbours;
+}
+
+/*!
+ * @brief   `mail::LaneTable` is a class that stores the distances of a network in a plain or a compressed matrix.
+ * @details A network of at most `dense_cities` cities is kept as a plain matrix, 64 KiB at most, which stays in cache
+ *          and is looked up with one load. A larger one is packed: most lanes are listed both ways with the same
+ *          distance, so the matrix is stored once as its upper triangle, diagonal included, in row order. The
+ *          triangle is cut into blocks of `block_size` pairs; each block keeps the shortest distance in it as a base
+ *          and every pair as its offset from the base plus one, 0 for no lane, in as few bits as the widest offset
+ *          of the block needs. A pair whose way back differs from its way out is marked in its block, and its way
+ *          back is kept in `m_overrides`, ranked by the marks before it. A packed lookup is a few shifts and masks
+ *          with no branch, but it takes about seven times as long as a matrix lookup on 2000 random cities
+ *          (`--bench-lanes`: 17.5 ns against 2.3 ns): the packed form trades lookup time for memory and is only worth
+ *          it where the matrix would not fit in cache.
+ */
+class LaneTable
+{
+  public:
+    typedef unsigned int DistanceType;
+    /*!
+     * @brief   `mail::LaneTable::no_lane` is the distance of a missing lane.
+     */
+    static DistanceType const no_lane = ~0U;
+    /*!
+     * @brief   `mail::LaneTable::block_size` is the number of pairs that share a base and a bit width.
+     */
+    static size_t const block_size = 32;
+    /*!
+     * @brief   `mail::LaneTable::dense_cities` is the number of cities up to which the matrix is kept unpacked.
+     */
+    static size_t const dense_cities = 128;
+    /*!
+     * @brief   `mail::LaneTable::Lane` is a lane between two cities by ID.
+     */
+    struct Lane
+    {
+        CityIndex::IdType from;
+        CityIndex::IdType to;
+        DistanceType distance;
+    };
+
+  private:
+    /*!
+     * @brief   `mail::LaneTable::Block` is the header of a block of the triangle.
+     */
+    struct Block
+    {
+        /*!
+         * @brief   `mail::LaneTable::Block::position` is the offset of the first code in bits, shifted left by 6,
+         *          with the width of the codes in the low 6 bits.
+         */
+        uint64_t position;
+        DistanceType base;
+        /*!
+         * @brief   `mail::LaneTable::Block::asymmetric` has bit `i` set if the way back of pair `i` is an override.
+         */
+        uint32_t asymmetric;
+    };
+
+    size_t m_cities;
+    /*!
+     * @brief   `mail::LaneTable::m_blocks` is the headers of the blocks of a packed network, empty for a plain one.
+     */
+    vector<Block> m_blocks;
+    /*!
+     * @brief   `mail::LaneTable::m_codes` is the packed codes, plus one word so that a code can always be read as
+     *          two words.
+     */
+    vector<uint64_t> m_codes;
+    /*!
+     * @brief   `mail::LaneTable::m_first_override` is the index in `m_overrides` of the first override of each block.
+     */
+    vector<uint32_t> m_first_override;
+    /*!
+     * @brief   `mail::LaneTable::m_overrides` is the distances of the ways back that differ, plus one unused entry so
+     *          that it can always be read, for a packed network.
+     */
+    vector<DistanceType> m_overrides;
+    /*!
+     * @brief   `mail::LaneTable::m_dense` is the distance from city `i` to city `j` at `i * m_cities + j` for a plain
+     *          network, empty for a packed one.
+     */
+    vector<DistanceType> m_dense;
+
+    /*!
+     * @brief   `mail::LaneTable::slot` is a function that returns the position of a pair in the triangle.
+     * @param   low The smaller ID
+     * @param   high The larger ID
+     * @return  `uint64_t` The index of the pair in row order
+     */
+    uint64_t slot(uint64_t low, uint64_t high) const
+    {
+        return low * (2 * m_cities - low + 1) / 2 + (high - low);
+    }
+    /*!
+     * @brief   `mail::LaneTable::pack` is a function that packs the lanes of a large network into the triangle.
+     * @param   lanes The lanes, checked, at most one per ordered pair
+     */
+    void pack(vector<Lane> const &lanes);
+    /*!
+     * @brief   `mail::LaneTable::packed_distance` is a function that returns the distance between two cities from the
+     *          packed triangle.
+     * @param   from The ID of the origin, less than `cities()`
+     * @param   to The ID of the destination, less than `cities()`
+     * @return  `mail::LaneTable::DistanceType` The distance, `no_lane` if there is no lane
+     */
+    DistanceType packed_distance(CityIndex::IdType from, CityIndex::IdType to) const;
+
+  public:
+    /*!
+     * @brief   `mail::LaneTable::LaneTable` is a constructor that stores the lanes of a network, packed if it has more
+     *          than `dense_cities` cities.
+     * @param   cities The number of cities
+     * @param   lanes The lanes, at most one per ordered pair
+     * @throws  `std::out_of_range` If a lane names a city ID not less than `cities`
+     * @throws  `std::runtime_error` If a distance is `no_lane`
+     */
+    explicit LaneTable(size_t cities = 0, vector<Lane> const &lanes = vector<Lane>());
+    /*!
+     * @brief   `mail::LaneTable::cities` is a function that returns the number of cities.
+     * @return  `std::size_t` The number of cities
+     */
+    size_t cities() const
+    {
+        return m_cities;
+    }
+    /*!
+     * @brief   `mail::LaneTable::distance` is a function that returns the distance between two cities by ID.
+     * @param   from The ID of the origin, less than `cities()`
+     * @param   to The ID of the destination, less than `cities()`
+     * @return  `mail::LaneTable::DistanceType` The distance, `no_lane` if there is no lane
+     */
+    DistanceType distance(CityIndex::IdType from, CityIndex::IdType to) const
+    {
+        return m_dense.empty() ? packed_distance(from, to) : m_dense[size_t(from) * m_cities + to];
+    }
+    /*!
+     * @brief   `mail::LaneTable::lanes` is a function that returns every lane.
+     * @return  `std::vector<mail::LaneTable::Lane>` The lanes, sorted by origin and then destination
+     */
+    vector<Lane> lanes() const;
+    /*!
+     * @brief   `mail::LaneTable::override_count` is a function that returns the number of ways back stored apart.
+     * @return  `std::size_t` The number of pairs whose two ways differ in a packed network, 0 in a plain one
+     */
+    size_t override_count() const
+    {
+        return m_overrides.empty() ? 0 : m_overrides.size() - 1;
+    }
+    /*!
+     * @brief   `mail::LaneTable::memory_usage` is a function that returns the memory taken by the table.
+     * @return  `std::size_t` The bytes of the matrix, or of the blocks, the codes and the overrides
+     */
+    size_t memory_usage() const
+    {
+        return m_blocks.size() * sizeof(Block) + m_codes.size() * sizeof(uint64_t) +
+               m_first_override.size() * sizeof(uint32_t) + (m_overrides.size() + m_dense.size()) * sizeof(DistanceType);
+    }
+};
+
+LaneTable::DistanceType const LaneTable::no_lane;
+size_t const LaneTable::block_size;
+size_t const LaneTable::dense_cities;
+
+LaneTable::LaneTable(size_t cities, vector<Lane> const &lanes)
+    : m_cities(cities)
+    , m_blocks()
+    , m_codes()
+    , m_first_override()
+    , m_overrides()
+    , m_dense()
+{
+    for (size_t i = 0; i < lanes.size(); ++i)
+    {
+        if (lanes[i].from >= cities || lanes[i].to >= cities)
+            throw out_of_range("City not found");
+        if (lanes[i].distance == no_lane)
+            throw runtime_error("Invalid distance");
+    }
+    if (cities > dense_cities)
+    {
+        pack(lanes);
+        return;
+    }
+    m_dense.assign(cities * cities, no_lane);
+    for (size_t i = 0; i < lanes.size(); ++i)
+        m_dense[lanes[i].from * cities + lanes[i].to] = lanes[i].distance;
+}
+
+void LaneTable::pack(vector<Lane> const &lanes)
+{
+    size_t const cities = m_cities;
+    // Each pair of the triangle with its way out (low to high ID) and its way back.
+    struct Pair
+    {
+        uint64_t slot;
+        DistanceType out;
+        DistanceType back;
+    };
+    vector<pair<uint64_t, size_t> > order;
+    order.reserve(lanes.size());
+    for (size_t i = 0; i < lanes.size(); ++i)
+        order.push_back(make_pair(slot(min(lanes[i].from, lanes[i].to), max(lanes[i].from, lanes[i].to)), i));
+    sort(order.begin(), order.end());
+    vector<Pair> pairs;
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        Lane const &lane = lanes[order[i].second];
+        if (pairs.empty() || pairs.back().slot != order[i].first)
+        {
+            Pair const blank = {order[i].first, no_lane, no_lane};
+            pairs.push_back(blank);
+        }
+        (lane.from <= lane.to ? pairs.back().out : pairs.back().back) = lane.distance;
+        if (lane.from == lane.to)
+            pairs.back().back = lane.distance;
+    }
+
+    uint64_t const slots = uint64_t(cities) * (cities + 1) / 2;
+    size_t const blocks = static_cast<size_t>((slots + block_size - 1) / block_size);
+    m_blocks.reserve(blocks);
+    m_first_override.reserve(blocks);
+    uint64_t bits = 0;
+    for (size_t b = 0, p = 0; b < blocks; ++b)
+    {
+        size_t const end = static_cast<size_t>(
+            lower_bound(pairs.begin() + p, pairs.end(), (b + 1) * uint64_t(block_size),
+                        [](Pair const &pair, uint64_t slot) { return pair.slot < slot; }) -
+            pairs.begin());
+        Block block = {0, no_lane, 0};
+        for (size_t i = p; i < end; ++i)
+            block.base = min(block.base, pairs[i].out);
+        DistanceType widest = 0;
+        for (size_t i = p; i < end; ++i)
+        {
+            if (pairs[i].out != no_lane)
+                widest = max(widest, pairs[i].out - block.base + 1);
+            if (pairs[i].back != pairs[i].out)
+                block.asymmetric |= uint32_t(1) << (pairs[i].slot % block_size);
+        }
+        unsigned width = 0;
+        while (width < 32 && (widest >> width) != 0)
+            ++width;
+        block.position = bits << 6 | width;
+        bits += uint64_t(block_size) * width;
+        m_blocks.push_back(block);
+        m_first_override.push_back(static_cast<uint32_t>(m_overrides.size()));
+        for (size_t i = p; i < end; ++i)
+            if (pairs[i].back != pairs[i].out)
+                m_overrides.push_back(pairs[i].back);
+        p = end;
+    }
+    m_overrides.push_back(no_lane);
+
+    m_codes.assign(static_cast<size_t>(bits / 64 + 2), 0);
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        if (pairs[i].out == no_lane)
+            continue;
+        Block const &block = m_blocks[static_cast<size_t>(pairs[i].slot / block_size)];
+        unsigned const width = block.position & 63;
+        uint64_t const bit = (block.position >> 6) + pairs[i].slot % block_size * width;
+        uint64_t const code = pairs[i].out - block.base + 1;
+        m_codes[static_cast<size_t>(bit / 64)] |= code << (bit % 64);
+        if (bit % 64 + width > 64)
+            m_codes[static_cast<size_t>(bit / 64 + 1)] |= code >> (64 - bit % 64);
+    }
+}
+
+inline LaneTable::DistanceType LaneTable::packed_distance(CityIndex::IdType from, CityIndex::IdType to) const
+{
+    CityIndex::IdType const swap = (from ^ to) & (CityIndex::IdType(0) - (from > to));
+    uint64_t const index = slot(from ^ swap, to ^ swap);
+    Block const &block = m_blocks[index / block_size];
+    unsigned const lane = index % block_size, width = block.position & 63;
+    uint64_t const bit = (block.position >> 6) + uint64_t(lane) * width;
+    uint64_t const word = bit / 64, shift = bit % 64;
+    uint64_t const bits = m_codes[word] >> shift | (m_codes[word + 1] << 1) << (63 - shift);
+    DistanceType const code = static_cast<DistanceType>(bits & ((uint64_t(1) << width) - 1));
+    DistanceType const stored = (block.base + code - 1) | (DistanceType(0) - (code == 0));
+    uint32_t const overridden = (block.asymmetric >> lane) & uint32_t(from > to);
+    uint32_t marks = block.asymmetric & ((uint32_t(2) << lane) - 1);
+    marks = marks - ((marks >> 1) & 0x55555555U);
+    marks = (marks & 0x33333333U) + ((marks >> 2) & 0x33333333U);
+    marks = (((marks + (marks >> 4)) & 0x0F0F0F0FU) * 0x01010101U) >> 24;
+    uint32_t const rank = m_first_override[index / block_size] + marks - 1;
+    DistanceType const back = m_overrides[rank * overridden];
+    return (back & (DistanceType(0) - overridden)) | (stored & (overridden - 1));
+}
+
+vector<LaneTable::Lane> LaneTable::lanes() const
+{
+    vector<Lane> lanes;
+    for (CityIndex::IdType from = 0; from < m_cities; ++from)
+        for (CityIndex::IdType to = 0; to < m_cities; ++to)
+        {
+            Lane const lane = {from, to, distance(from, to)};
+            if (lane.distance != no_lane)
+                lanes.push_back(lane);
+        }
+    return lanes;
+}
+
+/*!
+ * @brief   `mail::RouteToDistance` is a class that stores the distance between two locations and converts a route to its distance.
+ */
+class RouteToDistance
+{
+  public:
+    typedef Route RouteType;
+    typedef LaneTable::DistanceType DistanceType;
+    /*!
+     * @brief   `mail::RouteToDistance::no_lane` marks a missing lane.
+     */
+    static DistanceType const no_lane = LaneTable::no_lane;
+    /*!
+     * @brief   `mail::RouteToDistance::LookupResult` is the result of a lookup that does not throw.
+     */
+    struct LookupResult
+    {
+        bool found;
+        /*!
+         * @brief   `mail::RouteToDistance::LookupResult::distance` is the distance of the route, 0 if not found.
+         */
+        DistanceType distance;
+        /*!
+         * @brief   `mail::RouteToDistance::LookupResult::estimated` is `true` if the distance is estimated from the
+         *          coordinates of the cities instead of read from the distance map.
+         */
+        bool estimated;
+
+        explicit operator bool() const
+        {
+            return found;
+        }
+    };
+
+  protected:
+    /*!
+     * @brief   `mail::RouteToDistance::distance_map_init` is a function that reads the distance from file.
+     * @param   filename The distance map file in CSV format
+     * @return  `std::map<mail::RouteToDistance::RouteType, mail::RouteToDistance::DistanceType>` The distance map
+     */
+    static map<RouteType, DistanceType> distance_map_init(string const &filename);
+    /*!
+     * @brief   `mail::RouteToDistance::distance_map_filename` is a string that represents the filename of the distance map file in CSV format.
+     */
+    static string const distance_map_filename;
+    /*!
+     * @brief   `mail::RouteToDistance::city_index_init` is a function that interns every city in the distance map.
+     * @param   distance_map The distance map
+     * @return  `mail::CityIndex` The cities of the distance map
+     */
+    static CityIndex city_index_init(map<RouteType, DistanceType> const &distance_map);
+    /*!
+     * @brief   `mail::RouteToDistance::city_index` is the set of cities that appear in the distance map.
+     */
+    CityIndex city_index;
+    /*!
+     * @brief   `mail::RouteToDistance::lane_table_init` is a function that packs the distance map by city ID.
+     * @param   distance_map The distance map
+     * @param   city_index The cities of the distance map
+     * @return  `mail::LaneTable` The lanes of the distance map
+     */
+    static LaneTable lane_table_init(map<RouteType, DistanceType> const &distance_map, CityIndex const &city_index);
+    /*!
+     * @brief   `mail::RouteToDistance::lane_table` is the distance map packed by city ID.
+     * @details Lookups go through it, which costs two binary searches over the city names instead of a map descent
+     *          that builds the string of a `mail::Location` at every comparison. The map itself is only kept while
+     *          loading.
+     */
+    LaneTable lane_table;
+    /*!
+     * @brief   `mail::RouteToDistance::coordinates_filename` is the filename of the city coordinate file in CSV format.
+     */
+    static string const coordinates_filename;
+    /*!
+     * @brief   `mail::RouteToDistance::coordinates_init` is a function that reads the coordinates of the cities.
+     * @param   filename The coordinate file in CSV format
+     * @return  `mail::GeoIndex` The coordinates, empty if the file does not exist
+     * @throws  `std::runtime_error` If the file exists but is not valid
+     */
+    static GeoIndex coordinates_init(string const &filename);
+    /*!
+     * @brief   `mail::RouteToDistance::coordinates` is the coordinates of the cities, listed in the distance map or not.
+     */
+    GeoIndex coordinates;
+    /*!
+     * @brief   `mail::RouteToDistance::default_detour` is the ratio of lane to great-circle distance assumed when no
+     *          lane can be measured.
+     */
+    static double const default_detour;
+    /*!
+     * @brief   `mail::RouteToDistance::hub_detour_init` is a function that measures how far the lanes of each city
+     *          stray from the great circle.
+     * @param   lane_table The lanes
+     * @param   city_index The cities of the lanes
+     * @param   coordinates The coordinates of the cities
+     * @return  `std::vector<double>` For each city of `coordinates`, the mean ratio of lane to great-circle distance
+     *          over its lanes, 0 if it has none
+     */
+    static vector<double> hub_detour_init(LaneTable const &lane_table, CityIndex const &city_index,
+                                          GeoIndex const &coordinates);
+    /*!
+     * @brief   `mail::RouteToDistance::hub_detour` is the detour ratio of each city of `coordinates`; the cities with a
+     *          non-zero ratio are the hubs.
+     */
+    vector<double> hub_detour;
+    /*!
+     * @brief   `mail::RouteToDistance::local_detour` is a function that returns the detour ratio around a city.
+     * @param   id The ID of the city in `coordinates`
+     * @return  `double` The mean detour ratio of the three hubs nearest to the city, or `default_detour`
+     */
+    double local_detour(CityIndex::IdType id) const;
+    RouteToDistance(map<RouteType, DistanceType> const &distance_map, string const &coordinates_file)
+        : city_index(city_index_init(distance_map))
+        , lane_table(lane_table_init(distance_map, city_index))
+        , coordinates(coordinates_init(coordinates_file))
+        , hub_detour(hub_detour_init(lane_table, city_index, coordinates))
+    {}
+
+  public:
+    /*!
+     * @brief   `mail::RouteToDistance::RouteToDistance` is a constructor that loads a distance map.
+     * @details `mail::route_to_distance` is the one read from `distance.csv`; other networks, such as generated
+     *          ones, can be loaded side by side.
+     * @param   filename The distance map file in CSV format
+     * @param   coordinates_file The city coordinate file in CSV format; without it, no distance is estimated
+     * @throws  `std::runtime_error` If a file cannot be read or is not valid
+     */
+    explicit RouteToDistance(string const &filename = distance_map_filename,
+                             string const &coordinates_file = coordinates_filename)
+        : RouteToDistance(distance_map_init(filename), coordinates_file)
+    {}
+    /*!
+     * @brief   `mail::RouteToDistance::cities` is a function that returns the cities that appear in the distance map.
+     * @return  `mail::CityIndex const &` The cities of the distance map
+     */
+    CityIndex const &cities() const
+    {
+        return city_index;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::lanes` is a function that returns the packed distances.
+     * @return  `mail::LaneTable const &` The lanes by city ID
+     */
+    LaneTable const &lanes() const
+    {
+        return lane_table;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::geo_index` is a function that returns the coordinates of the cities.
+     * @return  `mail::GeoIndex const &` The coordinates, which may cover cities outside the distance map
+     */
+    GeoIndex const &geo_index() const
+    {
+        return coordinates;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::nearest_hubs` is a function that finds the hubs nearest to a city.
+     * @details A hub is a city of the distance map with a lane to another city with coordinates.
+     * @param   city The name of a city with coordinates, listed in the distance map or not
+     * @param   count The number of hubs to find
+     * @return  `std::vector<mail::GeoIndex::Neighbour>` Up to `count` hubs by their ID in `cities()`, nearest first
+     * @throws  `std::out_of_range` If the city has no coordinates
+     */
+    vector<GeoIndex::Neighbour> nearest_hubs(string const &city, size_t count) const;
+    /*!
+     * @brief   `mail::RouteToDistance::estimate` is a function that estimates the distance between two cities from
+     *          their coordinates.
+     * @details The great-circle distance is scaled by the mean detour ratio of the lanes of the hubs nearest to each
+     *          end, so an estimate in a region of winding lanes is longer than one where lanes run straight.
+     * @param   from The name of the origin
+     * @param   to The name of the destination
+     * @return  `mail::RouteToDistance::LookupResult` The estimate with `estimated` set, or `found` set to `false` if
+     *          a city has no coordinates or both are the same
+     */
+    LookupResult estimate(string const &from, string const &to) const;
+    /*!
+     * @brief   `mail::RouteToDistance::routes` is a function that returns every route with its distance.
+     * @return  `std::vector<mail::LaneTable::Lane>` The lanes by city ID in `cities()`, sorted by origin and then
+     *          destination
+     */
+    vector<LaneTable::Lane> routes() const
+    {
+        return lane_table.lanes();
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::exists` is a function that checks if the route exists in the distance map.
+     * @param   route The route
+     * @return  `bool` `true` if the route exists in the distance map, `false` otherwise
+     */
+    bool exists(RouteType const &route) const
+    {
+        LookupResult const result = lookup(route);
+        return result.found && !result.estimated;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::operator()` is a function that converts a route to its distance.
+     * @param   route The route to convert
+     * @return  `mail::RouteToDistance::DistanceType` The distance between the two locations in the route, estimated
+     *          if a city is not in the distance map but has coordinates
+     * @throws  `std::out_of_range` If the route is neither in the distance map nor can be estimated
+     */
+    DistanceType operator()(RouteType const &route) const
+    {
+        LookupResult const result = lookup(route);
+        if (!result)
+            throw out_of_range("Route not found");
+        return result.distance;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::lookup` is a function that converts a route to its distance without throwing.
+     * @details A route between two cities of the distance map is looked up in it. A route with a city outside the
+     *          distance map, or between two cities of the distance map without a lane, falls back to `estimate`.
+     * @param   route The route to convert
+     * @return  `mail::RouteToDistance::LookupResult` The distance, with `estimated` set if it is an estimate and
+     *          `found` set to `false` for a route that is neither listed nor can be estimated
+     */
+    LookupResult lookup(RouteType const &route) const
+    {
+        string const from = route.first.city_name(), to = route.second.city_name();
+        CityIndex::IdType const from_id = city_index.id_of(from), to_id = city_index.id_of(to);
+        if (from_id != CityIndex::npos && to_id != CityIndex::npos)
+        {
+            LookupResult const listed = lookup(from_id, to_id);
+            if (listed)
+                return listed;
+        }
+        return estimate(from, to);
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::lookup` is a function that returns the distance between two cities by ID.
+     * @details Only the distance map is read; a caller that wants an estimate for a missing lane falls back to
+     *          `estimate` with the names of the cities, as `lookup` by route does.
+     * @param   from The ID of the origin in `cities()`
+     * @param   to The ID of the destination in `cities()`
+     * @return  `mail::RouteToDistance::LookupResult` The distance, with `found` set to `false` if there is no lane
+     */
+    LookupResult lookup(CityIndex::IdType from, CityIndex::IdType to) const
+    {
+        DistanceType const distance =
+            from < city_index.size() && to < city_index.size() ? lane_table.distance(from, to) : no_lane;
+        LookupResult const result = {distance != no_lane, distance != no_lane ? distance : 0, false};
+        return result;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::fingerprint` is a function that returns a hash of the cities and the distances.
+     * @return  `uint64_t` The 64-bit FNV-1a hash of the city fingerprint and every lane, changed by any edit of the data
+     */
+    uint64_t fingerprint() const
+    {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        uint64_t const cities = city_index.fingerprint();
+        for (int byte = 0; byte < 8; ++byte)
+            hash = (hash ^ ((cities >> (8 * byte)) & 0xFFU)) * 0x100000001B3ULL;
+        for (CityIndex::IdType from = 0; from < city_index.size(); ++from)
+            for (CityIndex::IdType to = 0; to < city_index.size(); ++to)
+            {
+                DistanceType const distance = lane_table.distance(from, to);
+                for (int byte = 0; byte < 4; ++byte)
+                    hash = (hash ^ ((distance >> (8 * byte)) & 0xFFU)) * 0x100000001B3ULL;
+            }
+        return hash;
+    }
+    /*!
+     * @brief   `mail::RouteToDistance::lookup_many` is a function that converts a batch of routes to their distances.
+     * @details Unknown routes get the distance 0 and their bit set in `misses`; nothing is thrown. Estimated routes
+     *          count as found.
+     * @param   routes The routes to convert
+     * @param   count The number of routes
+     * @param   distances The `count` distances, written in route order
+     * @param   misses A bitmap of `(count + 63) / 64` words, bit `i % 64` of word `i / 64` set if route `i` is unknown
+     * @return  `std::size_t` The number of unknown routes
+     */
+    size_t lookup_many(RouteType const *routes, size_t count, DistanceType *distances, uint64_t *misses) const
+    {
+        fill(misses, misses + (count + 63) / 64, uint64_t(0));
+        size_t missed = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            LookupResult const result = lookup(routes[i]);
+            distances[i] = result.distance;
+            misses[i / 64] |= uint64_t(!result.found) << (i % 64);
+            missed += !result.found;
+        }
+        return missed;
+    }
+};
+
+map<RouteToDistance::RouteType, RouteToDistance::DistanceType> RouteToDistance::distance_map_init(
+    string const &filename)
+{
+    map<RouteToDistance::RouteType, RouteToDistance::DistanceType> distance_map;
+    ifstream distance_map_stream(filename);
+    if (!distance_map_stream)
+        throw runtime_error("Failed to open distance map file");
+
+    string distance_map_title_line;
+    getline(distance_map_stream, distance_map_title_line);
+
+    distance_map_stream.seekg(0);
+    string file_buffer((istreambuf_iterator<char>(distance_map_stream)), istreambuf_iterator<char>());
+
+    csv::Parser distance_map_parser(distance_map_title_line, csv::Dialect(), csv::Parser::column_storage);
+    distance_map_parser.add_records(file_buffer);
+
+    csv::Column const &from_cities = distance_map_parser.column(0);
+    csv::Column const &to_cities = distance_map_parser.column(1);
+    vector<RouteToDistance::DistanceType> const distances =
+        distance_map_parser.column_as<RouteToDistance::DistanceType>(2);
+    for (size_t i = 0; i < distance_map_parser.record_count(); ++i)
+    {
+        string const from_city(from_cities.field_begin(i), from_cities.field_end(i));
+        string const to_city(to_cities.field_begin(i), to_cities.field_end(i));
+        RouteToDistance::RouteType const route = make_pair(FromLocation(from_city), ToLocation(to_city));
+        distance_map[route] = distances[i];
+    }
+
+    return distance_map;
+}
+
+const string RouteToDistance::distance_map_filename = "distance.csv";
+
+CityIndex RouteToDistance::city_index_init(map<RouteType, DistanceType> const &distance_map)
+{
+    vector<string> names;
+    names.reserve(distance_map.size() * 2);
+    for (map<RouteType, DistanceType>::const_iterator it = distance_map.begin(); it != distance_map.end(); ++it)
+    {
+        names.push_back(it->first.first.city_name());
+        names.push_back(it->first.second.city_name());
+    }
+    return CityIndex(names);
+}
+
+RouteToDistance::DistanceType const RouteToDistance::no_lane;
+
+const string RouteToDistance::coordinates_filename = "coordinates.csv";
+
+GeoIndex RouteToDistance::coordinates_init(string const &filename)
+{
+    if (!ifstream(filename))
+        return GeoIndex();
+    return GeoIndex::load(filename);
+}
+
+double const RouteToDistance::default_detour = 1.25;
+
+vector<double> RouteToDistance::hub_detour_init(LaneTable const &lane_table, CityIndex const &city_index,
+                                                GeoIndex const &coordinates)
+{
+    CityIndex const &cities = coordinates.cities();
+    vector<double> total(cities.size());
+    vector<size_t> lanes(cities.size());
+    vector<LaneTable::Lane> const routes = lane_table.lanes();
+    for (size_t i = 0; i < routes.size(); ++i)
+    {
+        CityIndex::IdType const from = cities.id_of(city_index.name_of(routes[i].from));
+        CityIndex::IdType const to = cities.id_of(city_index.name_of(routes[i].to));
+        if (from == CityIndex::npos || to == CityIndex::npos)
+            continue;
+        double const great_circle = coordinates.distance(from, to);
+        if (great_circle < 1)
+            continue;
+        double const ratio = routes[i].distance / great_circle;
+        total[from] += ratio;
+        total[to] += ratio;
+        ++lanes[from];
+        ++lanes[to];
+    }
+    for (size_t i = 0; i < total.size(); ++i)
+        total[i] = lanes[i] ? total[i] / lanes[i] : 0;
+    return total;
+}
+
+double RouteToDistance::local_detour(CityIndex::IdType id) const
+{
+    vector<double> const &detour = hub_detour;
+    vector<GeoIndex::Neighbour> const hubs =
+        coordinates.nearest(id, 3, [&detour](CityIndex::IdType hub) { return detour[hub] > 0; });
+    if (hubs.empty())
+        return default_detour;
+    double total = 0;
+    for (size_t i = 0; i < hubs.size(); ++i)
+        total += hub_detour[hubs[i].id];
+    return total / hubs.size();
+}
+
+vector<GeoIndex::Neighbour> RouteToDistance::nearest_hubs(string const &city, size_t count) const
+{
+    CityIndex::IdType const id = coordinates.cities().id_of(city);
+    if (id == CityIndex::npos)
+        throw out_of_range("City not found");
+    vector<double> const &detour = hub_detour;
+    vector<GeoIndex::Neighbour> neighbours =
+        coordinates.nearest(id, count, [&detour](CityIndex::IdType hub) { return detour[hub] > 0; });
+    for (size_t i = 0; i < neighbours.size(); ++i)
+        neighbours[i].id = city_index.id_of(coordinates.cities().name_of(neighbours[i].id));
+    return neighbours;
+}
+
+RouteToDistance::LookupResult RouteToDistance::estimate(string const &from, string const &to) const
+{
+    CityIndex::IdType const from_id = coordinates.cities().id_of(from), to_id = coordinates.cities().id_of(to);
+    if (from_id == CityIndex::npos || to_id == CityIndex::npos || from_id == to_id)
+    {
+        LookupResult const result = {false, 0, false};
+        return result;
+    }
+    double const detour = (local_detour(from_id) + local_detour(to_id)) / 2;
+    LookupResult const result = {
+        true, max(DistanceType(1), static_cast<DistanceType>(lround(coordinates.distance(from_id, to_id) * detour))),
+        true};
+    return result;
+}
+
+LaneTable RouteToDistance::lane_table_init(map<RouteType, DistanceType> const &distance_map,
+                                           CityIndex const &city_index)
+{
+    vector<LaneTable::Lane> lanes;
+    lanes.reserve(distance_map.size());
+    for (map<RouteType, DistanceType>::const_iterator it = distance_map.begin(); it != distance_map.end(); ++it)
+    {
+        LaneTable::Lane const lane = {city_index.id_of(it->first.first.city_name()),
+                                      city_index.id_of(it->first.second.city_name()), it->second};
+        lanes.push_back(lane);
+    }
+    return LaneTable(city_index.size(), lanes);
+}
+
+/*!
+ * @brief   `mail::route_to_distance` is the distance map of `distance.csv` that quotes are made with.
+ */
+RouteToDistance const route_to_distance;
+
+/*!
+ * @brief   `mail::NumaNode` is a memory node of the machine and the CPUs attached to it.
+ */
+struct NumaNode
+{
+    unsigned id;
+    vector<unsigned> cpus;
+};
+
+/*!
+ * @brief   `mail::numa_nodes` is a function that lists the memory nodes of the machine.
+ * @details The nodes are read from `/sys/devices/system/node`. A machine without that directory, or a process allowed
+ *          on none of its CPUs, is treated as a single node holding every CPU the process may run on.
+ * @return  `std::vector<mail::NumaNode>` The nodes that have at least one CPU the process may run on
+ */
+vector<NumaNode> numa_nodes()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (::sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+        for (unsigned cpu = 0; cpu < thread::hardware_concurrency(); ++cpu)
+            CPU_SET(cpu, &allowed);
+
+    vector<NumaNode> nodes;
+    for (unsigned id = 0; id < 1024; ++id)
+    {
+        ifstream stream("/sys/devices/system/node/node" + to_string(id) + "/cpulist");
+        if (!stream)
+        {
+            if (id > 0 && nodes.empty())
+                break;
+            continue;
+        }
+        NumaNode node = {id, vector<unsigned>()};
+        string range;
+        while (getline(stream, range, ','))
+        {
+            unsigned first = 0, last = 0;
+            int const fields = sscanf(range.c_str(), "%u-%u", &first, &last);
+            if (fields < 1)
+                continue;
+            for (unsigned cpu = first; cpu <= (fields == 2 ? last : first); ++cpu)
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    node.cpus.push_back(cpu);
+        }
+        if (!node.cpus.empty())
+            nodes.push_back(node);
+    }
+    if (nodes.empty())
+    {
+        NumaNode node = {0, vector<unsigned>()};
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed))
+                node.cpus.push_back(cpu);
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+/*!
+ * @brief   `mail::pin_to_cpus` is a function that restricts the calling thread to some CPUs.
+ * @param   cpus The CPUs the thread may run on
+ * @throws  `std::runtime_error` If the affinity cannot be set
+ */
+void pin_to_cpus(vector<unsigned> const &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i)
+        CPU_SET(cpus[i], &set);
+    int const error = ::pthread_setaffinity_np(::pthread_self(), sizeof set, &set);
+    if (error != 0)
+        throw runtime_error("Failed to pin thread: " + string(strerror(error)));
+}
+
+/*!
+ * @brief   `mail::DistanceReplica` is a private copy of the lane table of a `mail::RouteToDistance`.
+ * @details It is the same `mail::LaneTable` the router looks distances up in, so a lookup costs the same in both. The
+ *          copy is made, and its pages first touched, by the constructing thread, so under the default first-touch
+ *          policy they are placed on the memory node of the CPU that thread runs on.
+ */
+class DistanceReplica
+{
+  private:
+    LaneTable m_lanes;
+
+  public:
+    /*!
+     * @brief   `mail::DistanceReplica::DistanceReplica` is a constructor that copies the lane table of a router.
+     * @param   router The router to copy
+     */
+    explicit DistanceReplica(RouteToDistance const &router)
+        : m_lanes(router.lanes())
+    {}
+    DistanceReplica(DistanceReplica const &) = delete;
+    DistanceReplica &operator=(DistanceReplica const &) = delete;
+    /*!
+     * @brief   `mail::DistanceReplica::lookup` is a function that returns the distance between two cities by ID.
+     * @param   from The ID of the origin in the cities of the router
+     * @param   to The ID of the destination in the cities of the router
+     * @return  `mail::RouteToDistance::LookupResult` The distance, with `found` set to `false` if there is no lane
+     */
+    RouteToDistance::LookupResult lookup(CityIndex::IdType from, CityIndex::IdType to) const
+    {
+        RouteToDistance::DistanceType const distance = from < m_lanes.cities() && to < m_lanes.cities()
+                                                           ? m_lanes.distance(from, to)
+                                                           : RouteToDistance::no_lane;
+        RouteToDistance::LookupResult const result = {distance != RouteToDistance::no_lane,
+                                                      distance != RouteToDistance::no_lane ? distance : 0, false};
+        return result;
+    }
+};
+
+/*!
+ * @brief   `mail::ReplicatedRouteIndex` is a class that keeps one `mail::DistanceReplica` per memory node.
+ * @details Each replica is built by a thread pinned to the CPUs of its node, so its pages are local to that node.
+ *          Worker threads pin themselves with `pin_worker` and read the replica of their own node, so no lookup
+ *          crosses the interconnect between sockets. The distance table is read-only, so the replicas never need to
+ *          be synchronized.
+ */
+class ReplicatedRouteIndex
+{
+  private:
+    vector<NumaNode> m_nodes;
+    vector<unique_ptr<DistanceReplica> > m_replicas;
+
+  public:
+    /*!
+     * @brief   `mail::ReplicatedRouteIndex::ReplicatedRouteIndex` is a constructor that replicates a router on every node.
+     * @param   router The router to replicate
+     * @throws  `std::runtime_error` If a replica cannot be built
+     */
+    explicit ReplicatedRouteIndex(RouteToDistance const &router);
+    /*!
+     * @brief   `mail::ReplicatedRouteIndex::nodes` is a function that returns the memory nodes replicated on.
+     * @return  `std::vector<mail::NumaNode> const &` The nodes, in the order of their replicas
+     */
+    vector<NumaNode> const &nodes() const
+    {
+        return m_nodes;
+    }
+    /*!
+     * @brief   `mail::ReplicatedRouteIndex::replica` is a function that returns the replica of a node.
+     * @param   node The position of the node in `nodes()`
+     * @return  `mail::DistanceReplica const &` The replica
+     * @throws  `std::out_of_range` If there is no such node
+     */
+    DistanceReplica const &replica(size_t node) const
+    {
+        return *m_replicas.at(node);
+    }
+    /*!
+     * @brief   `mail::ReplicatedRouteIndex::pin_worker` is a function that pins the calling thread to a node.
+     * @details Workers are spread over the nodes in turn: worker `i` goes to node `i % nodes().size()` and may run on
+     *          any of its CPUs.
+     * @param   worker The number of the worker
+     * @return  `mail::DistanceReplica const &` The replica local to the thread
+     * @throws  `std::runtime_error` If the thread cannot be pinned
+     */
+    DistanceReplica const &pin_worker(size_t worker) const
+    {
+        size_t const node = worker % m_nodes.size();
+        pin_to_cpus(m_nodes[node].cpus);
+        return *m_replicas[node];
+    }
+};
+
+ReplicatedRouteIndex::ReplicatedRouteIndex(RouteToDistance const &router)
+    : m_nodes(numa_nodes())
+    , m_replicas(m_nodes.size())
+{
+    vector<string> errors(m_nodes.size());
+    vector<thread> builders;
+    for (size_t node = 0; node < m_nodes.size(); ++node)
+        builders.push_back(thread([&, node]() {
+            try
+            {
+                pin_to_cpus(m_nodes[node].cpus);
+                m_replicas[node].reset(new DistanceReplica(router));
+            }
+            catch (exception const &e)
+            {
+                errors[node] = e.what();
+            }
+        }));
+    for (size_t node = 0; node < builders.size(); ++node)
+        builders[node].join();
+    for (size_t node = 0; node < errors.size(); ++node)
+        if (!errors[node].empty())
+            throw runtime_error("Failed to replicate distances on node " + to_string(m_nodes[node].id) + ": " +
+                                errors[node]);
+}
+
+/*!
+ * @brief   `mail::EditDistance` is a class that computes the edit distance from one pattern to many words.
+ * @details It uses Myers' bit-vector algorithm: the whole column of the dynamic programming matrix lives in a pair of
+ *          64-bit words, so each character of a word costs a handful of bitwise operations. Letters are compared
+ *          without regard to case. Patterns longer than 64 characters fall back to the quadratic algorithm.
+ */
+class EditDistance
+{
+  private:
+    /*!
+     * @brief   `mail::EditDistance::m_pattern` is the lower-cased pattern.
+     */
+    string m_pattern;
+    /*!
+     * @brief   `mail::EditDistance::m_peq` is, for every byte, the bit set of the pattern positions holding it.
+     */
+    uint64_t m_peq[256];
+
+  public:
+    /*!
+     * @brief   `mail::EditDistance::EditDistance` is a constructor that prepares the bit vectors of the pattern.
+     * @param   pattern The pattern
+     */
+    explicit EditDistance(string const &pattern)
+        : m_pattern(pattern)
+        , m_peq()
+    {
+        for (size_t i = 0; i < m_pattern.size(); ++i)
+            m_pattern[i] = static_cast<char>(tolower(static_cast<unsigned char>(m_pattern[i])));
+        if (m_pattern.size() <= 64)
+            for (size_t i = 0; i < m_pattern.size(); ++i)
+                m_peq[static_cast<unsigned char>(m_pattern[i])] |= uint64_t(1) << i;
+    }
+    /*!
+     * @brief   `mail::EditDistance::operator()` is a function that computes the edit distance from the pattern to a word.
+     * @param   word The word
+     * @return  `std::size_t` The minimum number of insertions, deletions and substitutions
+     */
+    size_t operator()(string const &word) const
+    {
+        size_t const m = m_pattern.size();
+        if (m == 0)
+            return word.size();
+        if (m > 64)
+            return quadratic(word);
+        uint64_t const last = uint64_t(1) << (m - 1);
+        uint64_t pv = ~uint64_t(0), mv = 0;
+        size_t score = m;
+        for (size_t j = 0; j < word.size(); ++j)
+        {
+            uint64_t const eq = m_peq[static_cast<unsigned char>(tolower(static_cast<unsigned char>(word[j])))];
+            uint64_t const xv = eq | mv;
+            uint64_t const xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            score += (ph & last) != 0;
+            score -= (mh & last) != 0;
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+        }
+        return score;
+    }
+
+  private:
+    size_t quadratic(string const &word) const
+    {
+        vector<size_t> row(word.size() + 1);
+        for (size_t j = 0; j <= word.size(); ++j)
+            row[j] = j;
+        for (size_t i = 1; i <= m_pattern.size(); ++i)
+        {
+            size_t diagonal = row[0];
+            row[0] = i;
+            for (size_t j = 1; j <= word.size(); ++j)
+            {
+                size_t const above = row[j];
+                bool const same = m_pattern[i - 1] == tolower(static_cast<unsigned char>(word[j - 1]));
+                row[j] = min(min(row[j] + 1, row[j - 1] + 1), diagonal + (same ? 0 : 1));
+                diagonal = above;
+            }
+        }
+        return row[word.size()];
+    }
+};
+
+/*!
+ * @brief   `mail::CityCheck` is the result of checking one city name against the `mail::CityIndex`.
+ */
+struct CityCheck
+{
+    /*!
+     * @brief   `mail::CityCheck::id` is the ID of the city, `mail::CityIndex::npos` if it is unknown.
+     */
+    CityIndex::IdType id;
+    /*!
+     * @brief   `mail::CityCheck::suggestions` is the closest known city names when the city is unknown.
+     */
+    vector<string> suggestions;
+
+    CityCheck()
+        : id(CityIndex::npos)
+        , suggestions()
+    {}
+};
+
+/*!
+ * @brief   `mail::RouteCheck` is the result of checking an origin and a destination.
+ */
+struct RouteCheck
+{
+    CityCheck origin;
+    CityCheck destination;
+    /*!
+     * @brief   `mail::RouteCheck::lane_exists` tells if the distance map has the lane from the origin to the destination.
+     */
+    bool lane_exists;
+    /*!
+     * @brief   `mail::RouteCheck::lane_estimated` tells if the lane is missing but its distance can be estimated from
+     *          the coordinates of the cities, see `mail::RouteToDistance::estimate`.
+     */
+    bool lane_estimated;
+
+    RouteCheck()
+        : origin()
+        , destination()
+        , lane_exists(false)
+        , lane_estimated(false)
+    {}
+    /*!
+     * @brief   `mail::RouteCheck::valid` is a function that checks if the route can be quoted.
+     * @return  `bool` `true` if the lane exists or can be estimated, `false` otherwise
+     */
+    bool valid() const
+    {
+        return lane_exists || lane_estimated;
+    }
+};
+
+/*!
+ * @brief   `mail::check_city` is a function that checks a city name and suggests close matches if it is unknown.
+ * @param   cities The known cities
+ * @param   name The city name to check
+ * @param   max_suggestions The maximum number of suggestions
+ * @return  `mail::CityCheck` The ID of the city or the suggestions, closest first
+ */
+CityCheck check_city(CityIndex const &cities, string const &name, size_t max_suggestions = 3)
+{
+    CityCheck result;
+    result.id = cities.id_of(name);
+    if (result.id != CityIndex::npos)
+        return result;
+    EditDistance const distance_to(name);
+    size_t const threshold = max<size_t>(2, name.size() / 3);
+    vector<pair<size_t, CityIndex::IdType> > candidates;
+    for (CityIndex::IdType id = 0; id < cities.size(); ++id)
+    {
+        size_t const distance = distance_to(cities.name_of(id));
+        if (distance <= threshold)
+            candidates.push_back(make_pair(distance, id));
+    }
+    sort(candidates.begin(), candidates.end());
+    for (size_t i = 0; i < candidates.size() && i < max_suggestions; ++i)
+        result.suggestions.push_back(cities.name_of(candidates[i].second));
+    return result;
+}
+
+/*!
+ * @brief   `mail::validate_routes` is a function that checks a batch of origins and destinations before quoting.
+ * @details The batch is split into contiguous chunks that are checked on separate threads; a batch that fits in one
+ *          chunk is checked on the calling thread. Each check is a binary search in the `mail::CityIndex` and, only
+ *          for unknown cities, a fuzzy search over the whole dictionary. A route without a lane is estimable if both
+ *          cities have coordinates, whether they are in the distance map or not.
+ * @param   routes The origin and destination city names
+ * @param   threads The number of threads to use, 0 for the number of hardware threads
+ * @return  `std::vector<mail::RouteCheck>` The result for every route, in the same order
+ */
+vector<RouteCheck> validate_routes(vector<pair<string, string> > const &routes, unsigned threads = 0)
+{
+    vector<RouteCheck> results(routes.size());
+    CityIndex const &cities = route_to_distance.cities();
+    if (threads == 0)
+        threads = max(1U, thread::hardware_concurrency());
+    size_t const chunk = max<size_t>(64, (routes.size() + threads - 1) / threads);
+    auto const check_chunk = [&routes, &results, &cities](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            RouteCheck &check = results[i];
+            check.origin = check_city(cities, routes[i].first);
+            check.destination = check_city(cities, routes[i].second);
+            check.lane_exists = check.origin.id != CityIndex::npos && check.destination.id != CityIndex::npos &&
+                                route_to_distance.exists(make_route(routes[i].first, routes[i].second));
+            check.lane_estimated =
+                !check.lane_exists && route_to_distance.estimate(routes[i].first, routes[i].second).found;
+        }
+    };
+    if (routes.size() <= chunk)
+    {
+        check_chunk(0, routes.size());
+        return results;
+    }
+    vector<thread> workers;
+    for (size_t begin = 0; begin < routes.size(); begin += chunk)
+        workers.push_back(thread(check_chunk, begin, min(routes.size(), begin + chunk)));
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    return results;
+}
+
+/*!
+ * @brief   `mail::describe_city_check` is a function that returns a message for an unknown city.
+ * @param   name The city name that was checked
+ * @param   check The result of the check
+ * @return  `std::string` The message with the suggestions, if any
+ */
+string describe_city_check(string const &name, CityCheck const &check)
+{
+    string message = "Unknown city: " + name + ".";
+    for (size_t i = 0; i < check.suggestions.size(); ++i)
+        message += (i == 0 ? " Did you mean: " : ", ") + check.suggestions[i];
+    if (!check.suggestions.empty())
+        message += "?";
+    return message;
+}
+
+/*!
+ * @brief   `mail::checked_multiply` is a function that multiplies two integers and checks for overflow.
+ * @param   a The first factor
+ * @param   b The second factor
+ * @return  `int64_t` The product
+ * @throws  `std::out_of_range` If the product does not fit in `int64_t`
+ */
+int64_t checked_multiply(int64_t a, int64_t b)
+{
+    int64_t product;
+    if (__builtin_mul_overflow(a, b, &product))
+        throw out_of_range("Quantity too large to compute");
+    return product;
+}
+
+/*!
+ * @brief   `mail::checked_add` is a function that adds two integers and checks for overflow.
+ * @param   a The first term
+ * @param   b The second term
+ * @return  `int64_t` The sum
+ * @throws  `std::out_of_range` If the sum does not fit in `int64_t`
+ */
+int64_t checked_add(int64_t a, int64_t b)
+{
+    int64_t sum;
+    if (__builtin_add_overflow(a, b, &sum))
+        throw out_of_range("Quantity too large to compute");
+    return sum;
+}
+
+/*!
+ * @brief   `mail::checked_subtract` is a function that subtracts two integers and checks for overflow.
+ * @param   a The minuend
+ * @param   b The subtrahend
+ * @return  `int64_t` The difference
+ * @throws  `std::out_of_range` If the difference does not fit in `int64_t`
+ */
+int64_t checked_subtract(int64_t a, int64_t b)
+{
+    int64_t difference;
+    if (__builtin_sub_overflow(a, b, &difference))
+        throw out_of_range("Quantity too large to compute");
+    return difference;
+}
+
+/*!
+ * @brief   `mail::Fixed` is a class template that represents an exact quantity as an integer count of minor units.
+ * @details `Unit` names the minor unit and how many of them make the major unit the rest of the program speaks in,
+ *          e.g. millimeters per centimeter. Quantities of different units are different types, so adding grams to
+ *          millimeters or passing a price where a weight is expected does not compile. Arithmetic is integer only
+ *          and gives the same result on every machine.
+ */
+template <typename Unit>
+class Fixed
+{
+  public:
+    typedef int64_t ValueType;
+
+  private:
+    /*!
+     * @brief   `mail::Fixed::m_count` is the quantity in minor units.
+     */
+    ValueType m_count;
+
+  public:
+    Fixed()
+        : m_count(0)
+    {}
+    /*!
+     * @brief   `mail::Fixed::Fixed` is a constructor that initializes the quantity from a count of minor units.
+     * @param   count The quantity in minor units
+     */
+    explicit Fixed(ValueType count)
+        : m_count(count)
+    {}
+    /*!
+     * @brief   `mail::Fixed::from_value` is a function that rounds a quantity in major units to minor units.
+     * @param   value The quantity in major units
+     * @return  `mail::Fixed` The quantity, rounded half away from zero
+     * @throws  `std::out_of_range` If the quantity does not fit in `ValueType`
+     */
+    static Fixed from_value(long double value)
+    {
+        long double const scaled = value * Unit::per_major;
+        if (!(scaled > -9.2e18L && scaled < 9.2e18L))
+            throw out_of_range("Fixed-point value out of range");
+        return Fixed(static_cast<ValueType>(llroundl(scaled)));
+    }
+    /*!
+     * @brief   `mail::Fixed::unit` is a function that returns the symbol of the minor unit.
+     * @return  `string` The symbol of the minor unit
+     */
+    static string unit()
+    {
+        return Unit::symbol();
+    }
+    /*!
+     * @brief   `mail::Fixed::count` is a function that returns the quantity in minor units.
+     * @return  `mail::Fixed::ValueType` The quantity in minor units
+     */
+    ValueType count() const
+    {
+        return m_count;
+    }
+    /*!
+     * @brief   `mail::Fixed::value` is a function that returns the quantity in major units.
+     * @return  `long double` The quantity in major units
+     */
+    long double value() const
+    {
+        return static_cast<long double>(m_count) / Unit::per_major;
+    }
+    /*!
+     * @brief   `mail::Fixed::operator+=` is a function that adds a quantity to this one.
+     * @param   other The quantity to add
+     * @return  `mail::Fixed &` This quantity
+     * @throws  `std::out_of_range` If the sum does not fit in `ValueType`
+     */
+    Fixed &operator+=(Fixed other)
+    {
+        m_count = checked_add(m_count, other.m_count);
+        return *this;
+    }
+    /*!
+     * @brief   `mail::Fixed::operator-=` is a function that subtracts a quantity from this one.
+     * @param   other The quantity to subtract
+     * @return  `mail::Fixed &` This quantity
+     * @throws  `std::out_of_range` If the difference does not fit in `ValueType`
+     */
+    Fixed &operator-=(Fixed other)
+    {
+        m_count = checked_subtract(m_count, other.m_count);
+        return *this;
+    }
+    Fixed operator+(Fixed other) const
+    {
+        return Fixed(checked_add(m_count, other.m_count));
+    }
+    Fixed operator-(Fixed other) const
+    {
+        return Fixed(checked_subtract(m_count, other.m_count));
+    }
+    /*!
+     * @brief   `mail::Fixed::operator*` is a function that scales the quantity.
+     * @param   factor The factor
+     * @return  `mail::Fixed` The scaled quantity
+     * @throws  `std::out_of_range` If the result does not fit in `ValueType`
+     */
+    Fixed operator*(ValueType factor) const
+    {
+        return Fixed(checked_multiply(m_count, factor));
+    }
+    bool operator==(Fixed other) const
+    {
+        return m_count == other.m_count;
+    }
+    bool operator!=(Fixed other) const
+    {
+        return m_count != other.m_count;
+    }
+    bool operator<(Fixed other) const
+    {
+        return m_count < other.m_count;
+    }
+    bool operator>(Fixed other) const
+    {
+        return m_count > other.m_count;
+    }
+    bool operator<=(Fixed other) const
+    {
+        return m_count <= other.m_count;
+    }
+    bool operator>=(Fixed other) const
+    {
+        return m_count >= other.m_count;
+    }
+};
+
+struct millimeter_unit
+{
+    static int64_t const per_major = 10; // per centimeter
+    static string symbol()
+    {
+        return "mm";
+    }
+};
+struct gram_unit
+{
+    static int64_t const per_major = 1000; // per kilogram
+    static string symbol()
+    {
+        return "g";
+    }
+};
+struct cent_unit
+{
+    static int64_t const per_major = 100; // per currency unit
+    static string symbol()
+    {
+        return "cent";
+    }
+};
+/*!
+ * @brief   `mail::Millimeter` is a length in whole millimeters; its major unit is the centimeter.
+ */
+typedef Fixed<millimeter_unit> Millimeter;
+/*!
+ * @brief   `mail::Gram` is a weight in whole grams; its major unit is the kilogram.
+ */
+typedef Fixed<gram_unit> Gram;
+/*!
+ * @brief   `mail::Money` is a price in whole cents.
+ */
+typedef Fixed<cent_unit> Money;
+
+/*!
+ * @brief   `mail::Centimeter` is a class that represents a length in centimeters.
+ * @details The length is held in whole millimeters; a length given in centimeters is rounded once, when it is made.
+ */
+class Centimeter
+{
+  public:
+    typedef Millimeter ValueType;
+
+  private:
+    /*!
+     * @brief   `mail::Centimeter::value` is a value that represents the length in millimeters.
+     */
+    ValueType value;
+
+    static ValueType checked(ValueType value)
+    {
+        if (value < ValueType())
+            throw runtime_error("Invalid centimeter value");
+        return value;
+    }
+
+  public:
+    /*!
+     * @brief   `mail::Centimeter::Centimeter` is a constructor that initializes the `mail::Centimeter` object.
+     * @param   value A value not less than 0 that represents the length in centimeters
+     * @throws  `std::runtime_error` If the value is less than 0 or not a number
+     * @throws  `std::out_of_range` If the value does not fit in whole millimeters
+     */
+    Centimeter(long double value = 0) : value()
+    {
+        if (!(value >= 0))
+            throw runtime_error("Invalid centimeter value");
+        this->value = Millimeter::from_value(value);
+    }
+    /*!
+     * @brief   `mail::Centimeter::Centimeter` is a constructor that converts an exact length.
+     * @param   value A length not less than 0
+     * @throws  `std::runtime_error` If the length is less than 0
+     */
+    Centimeter(Millimeter value) : value(checked(value))
+    {}
+    /*!
+     * @brief   `mail::Centimeter::millimeters` is a function that returns the exact length.
+     * @return  `mail::Millimeter` The length in millimeters
+     */
+    Millimeter millimeters() const
+    {
+        return this->value;
+    }
+    /*!
+     * @brief   `mail::Centimeter::unit` is a function that returns the unit of the length.
+     * @return  `string` The unit of the length
+     */
+    static string unit()
+    {
+        return "cm";
+    }
+    /*!
+     * @brief   `mail::Centimeter::operator long double` is a function that converts the `mail::Centimeter` object to
+     *          centimeters.
+     * @return  `long double` The length in centimeters
+     */
+    operator long double() const
+    {
+        return this->value.value();
+    }
+};
+
+/*!
+ * @brief   `mail::Freight` is an abstract class that represents a freight.
+ * @example 
+ *  ```cpp
+ *  Freight const *freight = &air_freight;
+ *  long double volumetric_weight = freight->volumetric_weight(32, 24, 1, 1);
+ *  ```
+ */
+class Freight
+{
+  public:
+    /*!
+     * @brief   `mail::Freight::~Freight` is a pure virtual destructor of the `mail::Freight` class.
+     * @details This ensures that the `mail::Freight` class is an abstract class and won't cause memory leak.
+     */
+    virtual ~Freight() = 0;
+    /*!
+     * @brief   `mail::Freight::volumetric_weight` is a pure virtual function that calculates the volumetric weight of this freight.
+     * @param   l The length of the package
+     * @param   w The width of the package 
+     * @param   h The height of the package
+     * @param   packages The number of packages
+     * @return  `long double` The volumetric weight of the freight
+     */
+    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const = 0;
+    /*!
+     * @brief   `mail::Freight::volumetric_divisor` is a pure virtual function that returns the volumetric divisor of this freight.
+     * @return  `unsigned int` The cubic centimeters charged as 1 kg
+     */
+    virtual unsigned int volumetric_divisor() const = 0;
+    /*!
+     * @brief   `mail::Freight::volumetric_grams` is a function that calculates the volumetric weight in integer arithmetic.
+     * @details A kilogram per `volumetric_divisor()` cubic centimeters is a gram per as many cubic millimeters.
+     * @param   l The length of the package
+     * @param   w The width of the package
+     * @param   h The height of the package
+     * @param   packages The number of packages
+     * @return  `mail::Gram` The volumetric weight, rounded half up
+     * @throws  `std::out_of_range` If the volume does not fit in 64 bits
+     */
+    Gram volumetric_grams(Millimeter l, Millimeter w, Millimeter h, unsigned int packages) const
+    {
+        int64_t const divisor = volumetric_divisor();
+        int64_t const volume = checked_multiply(checked_multiply(checked_multiply(l.count(), w.count()), h.count()),
+                                                packages);
+        return Gram(checked_add(volume, divisor / 2) / divisor);
+    }
+    /*!
+     * @brief   `mail::Freight::operator string` is a pure virtual function that returns the string representation of the freight.
+     */
+    virtual operator string() const = 0;
+    /*!
+     * @brief   `mail::Freight::base_fee` is a pure virtual function that returns the fixed fee of a leg in this freight.
+     * @return  `mail::Money` The fee charged once per leg, whatever the weight and the distance
+     */
+    virtual Money base_fee() const = 0;
+    /*!
+     * @brief   `mail::Freight::rate` is a pure virtual function that returns the price of carrying 1 tonne over 1 km.
+     * @return  `mail::Money` The price per tonne of chargeable weight and per kilometer
+     */
+    virtual Money rate() const = 0;
+    /*!
+     * @brief   `mail::Freight::speed` is a pure virtual function that returns the average speed of this freight.
+     * @return  `long double` The speed in kilometers per hour
+     */
+    virtual long double speed() const = 0;
+    /*!
+     * @brief   `mail::Freight::handling_hours` is a pure virtual function that returns the time to load a leg.
+     * @return  `long double` The hours spent before a leg starts moving
+     */
+    virtual long double handling_hours() const = 0;
+    /*!
+     * @brief   `mail::Freight::cost` is a function that calculates the price of one leg in this freight.
+     * @param   chargeable_weight The chargeable weight in kilograms
+     * @param   distance The distance in kilometers
+     * @return  `long double` The price of the leg
+     */
+    long double cost(long double chargeable_weight, unsigned int distance) const
+    {
+        return base_fee().value() + rate().value() / 1000 * chargeable_weight * distance;
+    }
+    /*!
+     * @brief   `mail::Freight::cost` is a function that calculates the exact price of one leg in this freight.
+     * @details The fee is in cents and the rate in cents per tonne and kilometer, so everything is integer.
+     * @param   chargeable_weight The chargeable weight
+     * @param   distance The distance in kilometers
+     * @return  `mail::Money` The price of the leg, rounded half up to the cent
+     * @throws  `std::out_of_range` If the price does not fit in 64 bits
+     */
+    Money cost(Gram chargeable_weight, unsigned int distance) const
+    {
+        int64_t const product =
+            checked_multiply(checked_multiply(chargeable_weight.count(), distance), rate().count());
+        return base_fee() + Money(checked_add(product, 500000) / 1000000);
+    }
+    /*!
+     * @brief   `mail::Freight::transit_hours` is a function that calculates the duration of one leg in this freight.
+     * @param   distance The distance in kilometers
+     * @return  `long double` The hours from handing over the shipment to its arrival
+     */
+    long double transit_hours(unsigned int distance) const
+    {
+        return handling_hours() + distance / speed();
+    }
+};
+/*!
+ * @brief   `mail::Freight::~Freight` is using the default destructor created by the compiler.
+ * @details This ensures that the use of `mail::Freight` won't cause any linker error or memory leakage.
+ */
+Freight::~Freight() = default;
+
+class AirFreight : public Freight
+{
+  public:
+    virtual ~AirFreight() = default;
+
+    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const override
+    {
+        return l * w * h / 6000.0 * packages;
+    }
+    virtual unsigned int volumetric_divisor() const override
+    {
+        return 6000;
+    }
+    virtual operator string() const override
+    {
+        return "Air transport";
+    }
+    virtual Money base_fee() const override
+    {
+        return Money(5000);
+    }
+    virtual Money rate() const override
+    {
+        return Money(250);
+    }
+    virtual long double speed() const override
+    {
+        return 700.0;
+    }
+    virtual long double handling_hours() const override
+    {
+        return 24.0;
+    }
+} const air_freight;
+
+class OceanFreight : public Freight
+{
+  public:
+    virtual ~OceanFreight() = default;
+
+    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const override
+    {
+        return l * w * h / 1000.0 * packages;
+    }
+    virtual unsigned int volumetric_divisor() const override
+    {
+        return 1000;
+    }
+    virtual operator string() const override
+    {
+        return "Ocean transport";
+    }
+    virtual Money base_fee() const override
+    {
+        return Money(3000);
+    }
+    virtual Money rate() const override
+    {
+        return Money(20);
+    }
+    virtual long double speed() const override
+    {
+        return 30.0;
+    }
+    virtual long double handling_hours() const override
+    {
+        return 72.0;
+    }
+} const ocean_freight;
+
+class RailFreight : public Freight
+{
+  public:
+    virtual ~RailFreight() = default;
+
+    virtual long double volumetric_weight(Centimeter l, Centimeter w, Centimeter h, unsigned int packages) const override
+    {
+        return l * w * h / 3000.0 * packages;
+    }
+    virtual unsigned int volumetric_divisor() const override
+    {
+        return 3000;
+    }
+    virtual operator string() const override
+    {
+        return "Rail transport";
+    }
+    virtual Money base_fee() const override
+    {
+        return Money(4000);
+    }
+    virtual Money rate() const override
+    {
+        return Money(60);
+    }
+    virtual long double speed() const override
+    {
+        return 60.0;
+    }
+    virtual long double handling_hours() const override
+    {
+        return 24.0;
+    }
+} const rail_freight;
+
+// Corresponding to the CSV file format
+class PostalAddress
+{
+  protected:
+    string m_user_type;
+    string m_country;
+    string m_postal_code;
+    string m_location;
+
+  public:
+    PostalAddress() = default;
+    PostalAddress(string ut, string c, string pc, string l)
+    {
+        m_user_type = ut;
+        m_country = c;
+        m_postal_code = pc;
+        m_location = l;
+    }
+
+    string getUserType() const
+    {
+        return m_user_type;
+    }
+
+    void setUserType(string ut)
+    {
+        if (ut == "business" || ut == "private")
+        {
+            m_user_type = ut;
+        }
+        else
+        {
+            cout << "Invalid user type! Choose business or private." << endl;
+        }
+    }
+
+    string getCountry() const
+    {
+        return m_country;
+    }
+
+    void setCountry(string c)
+    {
+        m_country = c;
+    }
+
+    string getPostalCode() const
+    {
+        return m_postal_code;
+    }
+
+    void setPostalCode(string pc)
+    {
+        m_postal_code = pc;
+    }
+
+    std::string getLocation() const
+    {
+        return m_location;
+    }
+
+    void setLocation(string l)
+    {
+        m_location = l;
+    }
+
+    void display(std::ostream &out = std::cout)
+    {
+        out << "Country: " << m_country << '\n';
+        out << "Postal code: " << m_postal_code << '\n';
+        out << "location: " << m_location << '\n';
+    }
+};
+
+// Other information
+class UserInfo
+{
+  protected:
+    std::string m_name;
+    std::string m_email;
+    std::string m_phone_number;
+
+  public:
+    UserInfo() = default;
+    UserInfo(std::string name, std::string email, std::string phone_number)
+        : m_name(name)
+        , m_email(email)
+        , m_phone_number(phone_number)
+    {}
+    std::string getName() const
+    {
+        return m_name;
+    }
+
+    void setName(const std::string &name)
+    {
+        m_name = name;
+    }
+
+    std::string getEmail() const
+    {
+        return m_email;
+    }
+
+    void setEmail(const std::string &email)
+    {
+        m_email = email;
+    }
+
+    std::string getPhoneNumber() const
+    {
+        return m_phone_number;
+    }
+
+    void setPhoneNumber(const std::string &phone_number)
+    {
+        m_phone_number = phone_number;
+    }
+    void display(std::ostream &out = std::cout)
+    {
+        out << "Name: " << m_name << '\n';
+        out << "Email: " << m_email << '\n';
+        out << "Phone number: " << m_phone_number << '\n';
+    }
+};
+
+// Pure storage struct, no need for any method
+struct Dimension
+{
+    Centimeter length;
+    Centimeter width;
+    Centimeter height;
+};
+
+class ShipmentMode
+{
+  private:
+    int choice;
+    string userType;
+    Dimension m_dimension;
+    string ModeOfShipment;
+
+  public:
+    ShipmentMode() = default;
+    ShipmentMode(int c, string ut, std::ostream &out = std::cout)
+    {
+        choice = c;
+        userType = ut;
+        setshipmentMode(c, out);
+    }
+    void selectShipmentMode(std::ostream &out = std::cout) const
+    {
+        if (userType == "private")
+        {
+            out << "Select Mode of Shipment: " << std::endl;
+            out << "1. Document (32 x 24 x 1 cm)" << std::endl;
+            out << "2. Moving Box (75 x 35 x 35 cm)" << std::endl;
+            out << "3. Packages" << std::endl;
+            out << "Enter choice: " << std::endl;
+        }
+        else if (userType == "business")
+        {
+            out << "Select Mode of Shipment: " << std::endl;
+            out << "1. Pallet (110 x 110 cm)" << std::endl;
+            out << "2. Container" << std::endl;
+            out << "3. Cargo" << std::endl;
+            out << "Enter choice: " << std::endl;
+        }
+    }
+    void setshipmentMode(int choice, std::ostream &out = std::cout)
+    {
+        if (userType == "private")
+        {
+            switch (choice)
+            {
+            case 1:
+                m_dimension.length = 32;
+                m_dimension.width = 24;
+                m_dimension.height = 1;
+                ModeOfShipment = "document";
+                break;
+            case 2:
+                m_dimension.length = 75;
+                m_dimension.width = 35;
+                m_dimension.height = 35;
+                ModeOfShipment = "moving box";
+            case 3:
+                ModeOfShipment = "packages";
+                break;
+            default:
+                out << "Invalid choice!" << std::endl;
+                break;
+            }
+        }
+        else if (userType == "business")
+        {
+            switch (choice)
+            {
+            case 1:
+                m_dimension.length = 110;
+                m_dimension.width = 110;
+                ModeOfShipment = "pallet";
+                break;
+            case 2:
+                ModeOfShipment = "container";
+                break;
+            case 3:
+                ModeOfShipment = "cargo";
+                break;
+            default:
+                out << "Invalid choice \n" << std::endl;
+                break;
+            }
+            if (m_dimension.length)
+                out << "Suggested length: " << m_dimension.length;
+            if (m_dimension.width)
+                out << "Suggested width: " << m_dimension.width;
+            if (m_dimension.height)
+                out << "Suggested height: " << m_dimension.height;
+        }
+    }
+};
+
+/*!
+ * @brief   `mail::max_package_quantity` is the largest number of packages a shipment is quoted for.
+ * @details With `max_package_weight` and `max_package_side`, it bounds what a user may enter so that the volume, the
+ *          chargeable weight and the price of a shipment over any lane up to half the Earth's circumference fit in
+ *          64 bits.
+ */
+unsigned int const max_package_quantity = 10000;
+/*!
+ * @brief   `mail::max_package_weight` is the largest weight of one package in kilograms.
+ */
+long double const max_package_weight = 100000;
+/*!
+ * @brief   `mail::max_package_side` is the largest length, width or height of one package in centimeters.
+ */
+long double const max_package_side = 500;
+
+// Dimensions are kept in whole millimeters and the weight in whole grams; the long double accessors speak
+// centimeters and kilograms as before.
+class PackageInfo
+{
+  protected:
+    Millimeter m_length;
+    Millimeter m_width;
+    Millimeter m_height;
+    Gram m_weight;
+    unsigned int m_quantity;
+
+  public:
+    PackageInfo()
+        : m_length()
+        , m_width()
+        , m_height()
+        , m_weight()
+        , m_quantity(0)
+    {}
+    PackageInfo(long double length, long double width, long double height, long double weight, unsigned int quantity)
+        : m_length(Centimeter(length).millimeters())
+        , m_width(Centimeter(width).millimeters())
+        , m_height(Centimeter(height).millimeters())
+        , m_weight(Gram::from_value(weight))
+        , m_quantity(quantity)
+    {}
+    PackageInfo(Millimeter length, Millimeter width, Millimeter height, Gram weight, unsigned int quantity)
+        : m_length(length)
+        , m_width(width)
+        , m_height(height)
+        , m_weight(weight)
+        , m_quantity(quantity)
+    {}
+
+    long double getLength() const
+    {
+        return m_length.value();
+    }
+
+    void setLength(long double length)
+    {
+        m_length = Centimeter(length).millimeters();
+    }
+
+    long double getWidth() const
+    {
+        return m_width.value();
+    }
+
+    void setWidth(long double width)
+    {
+        m_width = Centimeter(width).millimeters();
+    }
+
+    long double getHeight() const
+    {
+        return m_height.value();
+    }
+
+    void setHeight(long double height)
+    {
+        m_height = Centimeter(height).millimeters();
+    }
+
+    long double getWeight() const
+    {
+        return m_weight.value();
+    }
+
+    void setWeight(long double weight)
+    {
+        m_weight = Gram::from_value(weight);
+    }
+
+    Millimeter getFixedLength() const
+    {
+        return m_length;
+    }
+
+    Millimeter getFixedWidth() const
+    {
+        return m_width;
+    }
+
+    Millimeter getFixedHeight() const
+    {
+        return m_height;
+    }
+
+    Gram getFixedWeight() const
+    {
+        return m_weight;
+    }
+
+    unsigned int getQuantity() const
+    {
+        return m_quantity;
+    }
+
+    void setQuantity(unsigned int quantity)
+    {
+        m_quantity = quantity;
+    }
+    void display(std::ostream &out = std::cout) const
+    {
+        out << "Weight:" << m_weight.value() << '\n';
+        out << "length: " << m_length.value() << '\n';
+        out << "Width: " << m_width.value() << '\n';
+        out << "Height " << m_height.value() << '\n';
+        out << "Quantity " << m_quantity << '\n';
+    }
+};
+
+class ShipmentInfo
+{
+  protected:
+    UserInfo m_user;
+    PostalAddress m_origin;
+    PostalAddress m_destination;
+    PackageInfo m_package;
+    UserInfo m_consignee;
+    Freight const *m_service_type;
+    Gram m_freight_weight;
+    Money m_cost;
+
+    static Freight const *service_type_to_freight(string const &service_type)
+    {
+        if (service_type == "Air transport")
+        {
+            return &air_freight;
+        }
+        if (service_type == "Ocean transport")
+        {
+            return &ocean_freight;
+        }
+        if (service_type == "Rail transport")
+        {
+            return &rail_freight;
+        }
+        throw runtime_error("Invalid service type");
+    }
+
+  public:
+    ShipmentInfo() = default;
+    ShipmentInfo(
+        const PostalAddress& origin, 
+        const PostalAddress& destination, 
+        const PackageInfo& package,
+        const UserInfo& user, 
+        const UserInfo& consignee, 
+        const std::string& service_type,
+        long double /* For ABI compatibility */
+    )
+    {
+        m_origin = origin;
+        m_destination = destination;
+        m_package = package;
+        m_user = user;
+        m_consignee = consignee;
+        m_service_type = service_type_to_freight(service_type);
+        m_cost = Money();
+        m_freight_weight = m_service_type->volumetric_grams(
+            m_package.getFixedLength(), 
+            m_package.getFixedWidth(), 
+            m_package.getFixedHeight(), 
+            m_package.getQuantity()
+        );
+    }
+
+    // Getters
+    PostalAddress getOrigin() const
+    {
+        return m_origin;
+    }
+    PostalAddress getDestination() const
+    {
+        return m_destination;
+    }
+    PackageInfo getPackage() const
+    {
+        return m_package;
+    }
+    UserInfo getUser() const
+    {
+        return m_user;
+    }
+    UserInfo getconsignee() const
+    {
+        return m_consignee;
+    }
+    string getServiceType() const
+    {
+        return (string)(*m_service_type);
+    }
+    Freight const &getFreight() const
+    {
+        return *m_service_type;
+    }
+    long double getCost() const
+    {
+        return m_cost.value();
+    }
+    long double getFreightWeight() const
+    {
+        return m_freight_weight.value();
+    }
+    Money getFixedCost() const
+    {
+        return m_cost;
+    }
+    Gram getFixedFreightWeight() const
+    {
+        return m_freight_weight;
+    }
+
+    // Setters
+    void setOrigin(const PostalAddress &o)
+    {
+        m_origin = o;
+    }
+    void setDestination(const PostalAddress &d)
+    {
+        m_destination = d;
+    }
+    void setPackage(const PackageInfo &p)
+    {
+        m_package = p;
+    }
+    void setconsignee(const UserInfo &s)
+    {
+        m_consignee = s;
+    }
+    void setServiceType(const string &st)
+    {
+        m_service_type = service_type_to_freight(st);
+    }
+    void setFreightWeight(long double /* For ABI compatibility */)
+    {
+        m_freight_weight = m_service_type->volumetric_grams(
+            m_package.getFixedLength(), 
+            m_package.getFixedWidth(), 
+            m_package.getFixedHeight(), 
+            m_package.getQuantity()
+        );
+    }
+    void setCost(long double c)
+    {
+        m_cost = Money::from_value(c);
+    }
+    void setCost(Money c)
+    {
+        m_cost = c;
+    }
+    void display(std::ostream &out = std::cout)
+    {
+        out << "Account" << '\n';
+        m_user.display(out);
+        out << '\n';
+        out << "Origin" << '\n';
+        m_origin.display(out);
+        out << '\n';
+        out << "Destination" << '\n';
+        m_destination.display(out);
+        out << '\n';
+        out << "consignee information" << '\n';
+        m_consignee.display(out);
+        out << '\n';
+        out << "Shipment information" << '\n';
+        m_package.display(out);
+        out << '\n';
+        out << " Mode of transport: " << (string)(*m_service_type) << '\n';
+        out << '\n';
+        out << " Freight weight: " << m_freight_weight.value() << '\n';
+        out << '\n';
+        out << "Cost: " << m_cost.value() << '\n';
+    }
+};
+
+/*!
+ * @brief   `mail::chargeable_grams` is a function that returns the weight a package is charged for in a freight.
+ * @details It is the larger of the actual weight of all the packages and their volumetric weight in the freight.
+ * @param   freight The freight
+ * @param   package The package, whose weight is per package
+ * @return  `mail::Gram` The chargeable weight
+ */
+Gram chargeable_grams(Freight const &freight, PackageInfo const &package)
+{
+    Gram const actual = package.getFixedWeight() * package.getQuantity();
+    Gram const volumetric = freight.volumetric_grams(package.getFixedLength(), package.getFixedWidth(),
+                                                     package.getFixedHeight(), package.getQuantity());
+    return max(actual, volumetric);
+}
+
+/*!
+ * @brief   `mail::chargeable_weight` is a function that returns the weight a package is charged for in a freight.
+ * @param   freight The freight
+ * @param   package The package, whose weight is per package in kilograms
+ * @return  `long double` The chargeable weight in kilograms, see `mail::chargeable_grams`
+ */
+long double chargeable_weight(Freight const &freight, PackageInfo const &package)
+{
+    return chargeable_grams(freight, package).value();
+}
+
+/*!
+ * @brief   `mail::quote_cost` is a function that calculates the price of shipping a package directly in one freight.
+ * @param   freight The freight
+ * @param   package The package
+ * @param   distance The distance in kilometers
+ * @return  `mail::Money` The exact price of the shipment
+ */
+Money quote_cost(Freight const &freight, PackageInfo const &package, RouteToDistance::DistanceType distance)
+{
+    return freight.cost(chargeable_grams(freight, package), distance);
+}
+
+/*!
+ * @brief   `mail::Bin` is a pallet or container that packages are consolidated into.
+ */
+struct Bin
+{
+    string name;
+    Centimeter length;
+    Centimeter width;
+    /*!
+     * @brief   `mail::Bin::height` is the maximum height of the load, including the pallet itself if any.
+     */
+    Centimeter height;
+    /*!
+     * @brief   `mail::Bin::max_weight` is the maximum weight of the load in kilograms.
+     */
+    long double max_weight;
+    /*!
+     * @brief   `mail::Bin::deck_height` is the height of the pallet itself that boxes stand on, 0 for a container.
+     */
+    Centimeter deck_height;
+};
+
+/*!
+ * @brief   `mail::standard_bins` is the list of the pallets and containers known to the packing engine.
+ */
+Bin const standard_bins[] = {
+    {"pallet", 110, 110, 160, 1000, 15},
+    {"20ft container", 589, 235, 239, 28000, 0},
+    {"40ft container", 1203, 235, 239, 26500, 0},
+};
+
+/*!
+ * @brief   `mail::Placement` is the position and orientation of one package in a packed unit.
+ */
+struct Placement
+{
+    /*!
+     * @brief   `mail::Placement::item` is the index of the package in the list given to the packing engine.
+     */
+    size_t item;
+    Millimeter x, y, z;
+    Millimeter length, width, height;
+};
+
+/*!
+ * @brief   `mail::PackedUnit` is one loaded pallet or container.
+ */
+struct PackedUnit
+{
+    Bin const *bin;
+    vector<Placement> placements;
+    /*!
+     * @brief   `mail::PackedUnit::load_height` is the height of the top of the highest package, the pallet included.
+     */
+    Millimeter load_height;
+    Gram weight;
+    /*!
+     * @brief   `mail::PackedUnit::volume` is the volume of the packages in cubic millimeters.
+     */
+    int64_t volume;
+
+    PackedUnit()
+        : bin(nullptr)
+        , placements()
+        , load_height()
+        , weight()
+        , volume(0)
+    {}
+    PackedUnit(PackedUnit const &) = default;
+    PackedUnit &operator=(PackedUnit const &) = default;
+};
+
+/*!
+ * @brief   `mail::PackingResult` is the outcome of consolidating packages into units.
+ */
+struct PackingResult
+{
+    vector<PackedUnit> units;
+    /*!
+     * @brief   `mail::PackingResult::unpacked` is the index of every package too large or too heavy for the bin.
+     */
+    vector<size_t> unpacked;
+    /*!
+     * @brief   `mail::PackingResult::strategy` is the name of the heuristic that produced this result.
+     */
+    string strategy;
+
+    PackingResult()
+        : units()
+        , unpacked()
+        , strategy()
+    {}
+};
+
+/*!
+ * @brief   `mail::PackingEngine` is a class that consolidates packages into pallets or containers.
+ * @details Every package of a `mail::PackageInfo` is expanded into `getQuantity()` boxes. The boxes are placed one at a
+ *          time with the extreme-point heuristic: each bin keeps the corners where a box may go (initially the
+ *          corner of the deck), a box goes to the lowest, then deepest, then leftmost corner where one of its allowed
+ *          orientations fits without overlapping and stands either on the deck or with at least
+ *          `min_support_percent` of its base on the tops of the boxes below, and the three corners the box creates
+ *          are added. A new bin is opened when a box fits in none of the open ones. Heights are measured from the
+ *          floor, so a pallet load starts on top of `mail::Bin::deck_height`. All the geometry is in whole
+ *          millimeters and grams.
+ *
+ *          The floor of every bin is split into a grid of square cells no smaller than the smallest side of any box,
+ *          and each cell lists the boxes standing over it, so checking a candidate position only looks at the boxes
+ *          around it. Corners too close to a wall for the smallest side of any box are never kept.
+ *
+ *          The outcome depends a lot on the order of the boxes and on the orientations allowed, so several
+ *          strategies (sorted by volume, by height or by footprint, with free rotation or upright only) are run in
+ *          parallel and the one needing the fewest units, then the least loaded volume, is kept.
+ */
+class PackingEngine
+{
+  private:
+    struct box
+    {
+        size_t item;
+        Millimeter length, width, height;
+        Gram weight;
+    };
+    struct corner
+    {
+        Millimeter x, y, z;
+        /*!
+         * @brief   `blocked` is the shape key (see `shape_of`) of a box that no orientation fitted at this corner for
+         *          lack of room. Boxes only ever get added, so a box whose key is as large in all three parts has no
+         *          room either and the corner is skipped at once.
+         */
+        Millimeter blocked[3];
+
+        bool operator<(corner const &other) const
+        {
+            return z != other.z ? z < other.z : y != other.y ? y < other.y : x < other.x;
+        }
+    };
+    /*!
+     * @brief   `layout` is the cell grid of the bins and the smallest side of the boxes of one packing.
+     */
+    struct layout
+    {
+        int64_t cell;
+        size_t columns;
+        size_t rows;
+        Millimeter min_side;
+    };
+    struct open_bin
+    {
+        PackedUnit unit;
+        vector<corner> corners;
+        /*!
+         * @brief   `cells` lists, for every cell of the floor row by row, the placements whose footprint meets it.
+         */
+        vector<vector<uint32_t> > cells;
+        /*!
+         * @brief   `seen` is the last query that met each placement, so that a placement listed in several cells is
+         *          looked at once per query.
+         */
+        vector<uint32_t> seen;
+        uint32_t query;
+        /*!
+         * @brief   `failed_item` is the package whose box last did not fit, and `failed_count` the number of boxes
+         *          in the bin then. The identical boxes that follow are refused at once until the bin changes.
+         */
+        size_t failed_item;
+        size_t failed_count;
+
+        open_bin(Millimeter floor, layout const &grid)
+            : unit()
+            , corners()
+            , cells(grid.columns * grid.rows)
+            , seen()
+            , query(0)
+            , failed_item(~size_t(0))
+            , failed_count(0)
+        {
+            corners.push_back(corner_at(Millimeter(), Millimeter(), floor));
+        }
+    };
+    enum sort_key
+    {
+        by_volume,
+        by_height,
+        by_footprint
+    };
+    enum fit_type
+    {
+        fit,
+        no_room,
+        no_support
+    };
+
+    /*!
+     * @brief   `mail::PackingEngine::min_support_percent` is the share of the base of a box that must rest on boxes
+     *          below it when it does not stand on the deck.
+     */
+    static int64_t const min_support_percent = 75;
+
+    Bin m_bin;
+    Gram m_max_weight;
+
+    static corner corner_at(Millimeter x, Millimeter y, Millimeter z)
+    {
+        corner const point = {x, y, z, {Millimeter(INT64_MAX), Millimeter(INT64_MAX), Millimeter(INT64_MAX)}};
+        return point;
+    }
+    /*!
+     * @brief   `shape_of` is a key of the room a box needs in the orientations allowed: with free rotation, its sides
+     *          sorted; upright, the sides of its base sorted and its height. Every allowed orientation of a box whose
+     *          key is as large in all three parts contains an allowed orientation of the other.
+     */
+    static void shape_of(box const &item, bool upright_only, Millimeter *key)
+    {
+        key[0] = item.length;
+        key[1] = item.width;
+        key[2] = item.height;
+        sort(key, key + (upright_only ? 2 : 3));
+    }
+    static bool covers(Placement const &box, corner const &point)
+    {
+        return box.x <= point.x && point.x < box.x + box.length && box.y <= point.y && point.y < box.y + box.width &&
+               box.z <= point.z && point.z < box.z + box.height;
+    }
+    static bool overlaps(Placement const &a, Placement const &b)
+    {
+        return a.x < b.x + b.length && b.x < a.x + a.length && a.y < b.y + b.width && b.y < a.y + a.width &&
+               a.z < b.z + b.height && b.z < a.z + a.height;
+    }
+    layout layout_of(vector<box> const &boxes) const;
+    fit_type fits(open_bin &target, Placement const &candidate, layout const &grid) const;
+    bool try_place(open_bin &target, box const &item, bool upright_only, layout const &grid) const;
+    PackingResult run(vector<box> boxes, sort_key key, bool upright_only) const;
+
+  public:
+    /*!
+     * @brief   `mail::PackingEngine::PackingEngine` is a constructor that initializes the `mail::PackingEngine` object.
+     * @param   bin The pallet or container to pack into
+     */
+    explicit PackingEngine(Bin const &bin = standard_bins[0])
+        : m_bin(bin)
+        , m_max_weight(Gram::from_value(bin.max_weight))
+    {}
+    /*!
+     * @brief   `mail::PackingEngine::pack` is a function that consolidates packages into as few units as it can.
+     * @param   packages The packages; every one stands for `getQuantity()` identical boxes
+     * @return  `mail::PackingResult` The loaded units of the best strategy
+     */
+    PackingResult pack(vector<PackageInfo> const &packages) const;
+};
+
+int64_t const PackingEngine::min_support_percent;
+
+PackingEngine::layout PackingEngine::layout_of(vector<box> const &boxes) const
+{
+    int64_t const length = m_bin.length.millimeters().count(), width = m_bin.width.millimeters().count();
+    Millimeter min_side(max(length, width));
+    for (size_t i = 0; i < boxes.size(); ++i)
+        min_side = min(min_side, min(boxes[i].length, min(boxes[i].width, boxes[i].height)));
+    // At most 64 cells a side, and none narrower than a box so that a box meets few of them
+    int64_t const cell = max(max<int64_t>(min_side.count(), 1), max(length, width) / 64 + 1);
+    layout const grid = {cell, static_cast<size_t>((length + cell - 1) / cell),
+                         static_cast<size_t>((width + cell - 1) / cell), min_side};
+    return grid;
+}
+
+PackingEngine::fit_type PackingEngine::fits(open_bin &target, Placement const &candidate, layout const &grid) const
+{
+    bool const on_deck = candidate.z <= m_bin.deck_height.millimeters();
+    if (++target.query == 0)
+    {
+        fill(target.seen.begin(), target.seen.end(), 0U);
+        target.query = 1;
+    }
+    size_t const first_column = static_cast<size_t>(candidate.x.count() / grid.cell);
+    size_t const last_column = static_cast<size_t>(((candidate.x + candidate.length).count() - 1) / grid.cell);
+    size_t const first_row = static_cast<size_t>(candidate.y.count() / grid.cell);
+    size_t const last_row = static_cast<size_t>(((candidate.y + candidate.width).count() - 1) / grid.cell);
+    // Placed boxes never overlap, so the areas they hold up add up
+    int64_t area = 0;
+    for (size_t row = first_row; row <= last_row; ++row)
+        for (size_t column = first_column; column <= last_column; ++column)
+        {
+            // The latest boxes are the likeliest to be in the way, so they are looked at first
+            vector<uint32_t> const &cell = target.cells[row * grid.columns + column];
+            for (size_t i = cell.size(); i-- > 0;)
+            {
+                if (target.seen[cell[i]] == target.query)
+                    continue;
+                target.seen[cell[i]] = target.query;
+                Placement const &other = target.unit.placements[cell[i]];
+                if (overlaps(candidate, other))
+                    return no_room;
+                if (on_deck || other.z + other.height != candidate.z)
+                    continue;
+                int64_t const dx = (min(candidate.x + candidate.length, other.x + other.length) -
+                                    max(candidate.x, other.x)).count();
+                int64_t const dy = (min(candidate.y + candidate.width, other.y + other.width) -
+                                    max(candidate.y, other.y)).count();
+                if (dx > 0 && dy > 0)
+                    area += dx * dy;
+            }
+        }
+    return on_deck || area * 100 >= min_support_percent * candidate.length.count() * candidate.width.count()
+               ? fit
+               : no_support;
+}
+
+bool PackingEngine::try_place(open_bin &target, box const &item, bool upright_only, layout const &grid) const
+{
+    Millimeter const sides[3] = {item.length, item.width, item.height};
+    // The six orientations as permutations of (length, width, height); the first two keep the box upright
+    static int const orientations[6][3] = {{0, 1, 2}, {1, 0, 2}, {0, 2, 1}, {2, 0, 1}, {1, 2, 0}, {2, 1, 0}};
+    Millimeter const length = m_bin.length.millimeters(), width = m_bin.width.millimeters();
+    Millimeter const height = m_bin.height.millimeters();
+    int64_t const usable = length.count() * width.count() * (height - m_bin.deck_height.millimeters()).count();
+    int64_t const volume = item.length.count() * item.width.count() * item.height.count();
+    if (target.corners.empty() || target.unit.weight + item.weight > m_max_weight ||
+        target.unit.volume + volume > usable ||
+        (target.failed_item == item.item && target.failed_count == target.unit.placements.size()))
+        return false;
+    Millimeter shape[3];
+    shape_of(item, upright_only, shape);
+    // The corners are sorted from the lowest, deepest, leftmost one, so the first fit is the best one
+    for (size_t c = 0; c < target.corners.size(); ++c)
+    {
+        corner const at = target.corners[c];
+        if (shape[0] >= at.blocked[0] && shape[1] >= at.blocked[1] && shape[2] >= at.blocked[2])
+            continue;
+        bool supported = true;
+        for (int o = 0; o < (upright_only ? 2 : 6); ++o)
+        {
+            Placement const candidate = {item.item,
+                                         at.x,
+                                         at.y,
+                                         at.z,
+                                         sides[orientations[o][0]],
+                                         sides[orientations[o][1]],
+                                         sides[orientations[o][2]]};
+            if (candidate.x + candidate.length > length || candidate.y + candidate.width > width ||
+                candidate.z + candidate.height > height)
+                continue;
+            fit_type const result = fits(target, candidate, grid);
+            supported &= result != no_support;
+            if (result != fit)
+                continue;
+            // Corners now inside the box are gone, the three corners it creates are new unless already covered or
+            // too close to a wall for any box
+            vector<corner> &corners = target.corners;
+            corners.erase(remove_if(corners.begin(), corners.end(),
+                                    [&candidate](corner const &point) { return covers(candidate, point); }),
+                          corners.end());
+            corner const created[3] = {corner_at(candidate.x + candidate.length, candidate.y, candidate.z),
+                                       corner_at(candidate.x, candidate.y + candidate.width, candidate.z),
+                                       corner_at(candidate.x, candidate.y, candidate.z + candidate.height)};
+            uint32_t const index = static_cast<uint32_t>(target.unit.placements.size());
+            target.unit.placements.push_back(candidate);
+            target.seen.push_back(0);
+            for (size_t row = static_cast<size_t>(candidate.y.count() / grid.cell);
+                 row <= static_cast<size_t>(((candidate.y + candidate.width).count() - 1) / grid.cell); ++row)
+                for (size_t column = static_cast<size_t>(candidate.x.count() / grid.cell);
+                     column <= static_cast<size_t>(((candidate.x + candidate.length).count() - 1) / grid.cell);
+                     ++column)
+                    target.cells[row * grid.columns + column].push_back(index);
+            for (int n = 0; n < 3; ++n)
+            {
+                bool covered = length - created[n].x < grid.min_side || width - created[n].y < grid.min_side ||
+                               height - created[n].z < grid.min_side;
+                if (!covered)
+                {
+                    vector<uint32_t> const &cell =
+                        target.cells[static_cast<size_t>(created[n].y.count() / grid.cell) * grid.columns +
+                                     static_cast<size_t>(created[n].x.count() / grid.cell)];
+                    for (size_t i = 0; i < cell.size() && !covered; ++i)
+                        covered = covers(target.unit.placements[cell[i]], created[n]);
+                }
+                vector<corner>::iterator const slot = lower_bound(corners.begin(), corners.end(), created[n]);
+                if (!covered && (slot == corners.end() || created[n] < *slot))
+                    corners.insert(slot, created[n]);
+            }
+            target.unit.load_height = max(target.unit.load_height, candidate.z + candidate.height);
+            target.unit.weight += item.weight;
+            target.unit.volume += volume;
+            return true;
+        }
+        if (supported)
+            copy(shape, shape + 3, target.corners[c].blocked);
+    }
+    target.failed_item = item.item;
+    target.failed_count = target.unit.placements.size();
+    return false;
+}
+
+PackingResult PackingEngine::run(vector<box> boxes, sort_key key, bool upright_only) const
+{
+    struct order
+    {
+        sort_key key;
+        bool operator()(box const &a, box const &b) const
+        {
+            switch (key)
+            {
+            case by_height:
+                return a.height > b.height;
+            case by_footprint:
+                return a.length.count() * a.width.count() > b.length.count() * b.width.count();
+            default:
+                return a.length.count() * a.width.count() * a.height.count() >
+                       b.length.count() * b.width.count() * b.height.count();
+            }
+        }
+    };
+    order const compare = {key};
+    stable_sort(boxes.begin(), boxes.end(), compare);
+    static char const *const key_names[] = {"volume", "height", "footprint"};
+    PackingResult result;
+    result.strategy = string("by ") + key_names[key] + (upright_only ? ", upright" : ", any orientation");
+    layout const grid = layout_of(boxes);
+    vector<open_bin> bins;
+    for (size_t i = 0; i < boxes.size(); ++i)
+    {
+        bool placed = false;
+        for (size_t b = 0; b < bins.size() && !placed; ++b)
+            placed = try_place(bins[b], boxes[i], upright_only, grid);
+        if (placed)
+            continue;
+        open_bin fresh(m_bin.deck_height.millimeters(), grid);
+        if (try_place(fresh, boxes[i], upright_only, grid))
+            bins.push_back(std::move(fresh));
+        else
+            result.unpacked.push_back(boxes[i].item);
+    }
+    for (size_t b = 0; b < bins.size(); ++b)
+    {
+        result.units.push_back(std::move(bins[b].unit));
+        result.units.back().bin = &m_bin;
+    }
+    return result;
+}
+
+PackingResult PackingEngine::pack(vector<PackageInfo> const &packages) const
+{
+    vector<box> boxes;
+    for (size_t i = 0; i < packages.size(); ++i)
+    {
+        box const item = {i, packages[i].getFixedLength(), packages[i].getFixedWidth(), packages[i].getFixedHeight(),
+                          packages[i].getFixedWeight()};
+        boxes.insert(boxes.end(), packages[i].getQuantity(), item);
+    }
+    vector<future<PackingResult> > strategies;
+    for (int key = by_volume; key <= by_footprint; ++key)
+        for (int upright = 0; upright < 2; ++upright)
+            strategies.push_back(async(launch::async, &PackingEngine::run, this, boxes, static_cast<sort_key>(key),
+                                       upright == 1));
+    // The footprint is the same for every unit, so the loaded volume compares as the sum of the load heights
+    PackingResult best;
+    bool first = true;
+    for (size_t i = 0; i < strategies.size(); ++i)
+    {
+        PackingResult candidate = strategies[i].get();
+        int64_t candidate_height = 0, best_height = 0;
+        for (size_t u = 0; u < candidate.units.size(); ++u)
+            candidate_height += candidate.units[u].load_height.count();
+        for (size_t u = 0; u < best.units.size(); ++u)
+            best_height += best.units[u].load_height.count();
+        if (first || candidate.unpacked.size() < best.unpacked.size() ||
+            (candidate.unpacked.size() == best.unpacked.size() &&
+             (candidate.units.size() < best.units.size() ||
+              (candidate.units.size() == best.units.size() && candidate_height < best_height))))
+            best = std::move(candidate);
+        first = false;
+    }
+    return best;
+}
+
+/*!
+ * @brief   `mail::chargeable_grams` is a function that returns the weight consolidated units are charged for in a freight.
+ * @details Every unit is charged for the larger of its actual weight and the volumetric weight of its footprint times
+ *          its load height, instead of the sum of the volumes of the packages. Packages left out of the units would
+ *          not be charged at all, so a packing with any is refused.
+ * @param   freight The freight
+ * @param   packing The consolidated units
+ * @return  `mail::Gram` The chargeable weight
+ * @throws  `std::out_of_range` If some packages are too large or too heavy for the units, or the weight does not fit
+ *          in 64 bits
+ */
+Gram chargeable_grams(Freight const &freight, PackingResult const &packing)
+{
+    if (!packing.unpacked.empty())
+        throw out_of_range(to_string(packing.unpacked.size()) + " packages do not fit in the units");
+    Gram total;
+    for (size_t i = 0; i < packing.units.size(); ++i)
+    {
+        PackedUnit const &unit = packing.units[i];
+        Gram const volumetric = freight.volumetric_grams(unit.bin->length.millimeters(), unit.bin->width.millimeters(),
+                                                         unit.load_height, 1);
+        total += max(unit.weight, volumetric);
+    }
+    return total;
+}
+
+/*!
+ * @brief   `mail::chargeable_weight` is a function that returns the weight consolidated units are charged for in a freight.
+ * @param   freight The freight
+ * @param   packing The consolidated units
+ * @return  `long double` The chargeable weight in kilograms, see `mail::chargeable_grams`
+ * @throws  `std::out_of_range` If some packages are not in the units
+ */
+long double chargeable_weight(Freight const &freight, PackingResult const &packing)
+{
+    return chargeable_grams(freight, packing).value();
+}
+
+/*!
+ * @brief   `mail::quote_cost` is a function that calculates the price of shipping consolidated units in one freight.
+ * @param   freight The freight
+ * @param   packing The consolidated units
+ * @param   distance The distance in kilometers
+ * @return  `mail::Money` The exact price of the shipment
+ * @throws  `std::out_of_range` If some packages are not in the units, or the price does not fit in 64 bits
+ */
+Money quote_cost(Freight const &freight, PackingResult const &packing, RouteToDistance::DistanceType distance)
+{
+    return freight.cost(chargeable_grams(freight, packing), distance);
+}
+
+/*!
+ * @brief   `mail::freights` is the list of the freights an itinerary can use, indexed by mode.
+ */
+Freight const *const freights[] = {&ocean_freight, &air_freight, &rail_freight};
+/*!
+ * @brief   `mail::freight_count` is the number of entries in `mail::freights`.
+ */
+size_t const freight_count = sizeof freights / sizeof freights[0];
+
+/*!
+ * @brief   `mail::ItineraryLeg` is one leg of an itinerary, travelled in a single freight.
+ */
+struct ItineraryLeg
+{
+    CityIndex::IdType from;
+    CityIndex::IdType to;
+    Freight const *freight;
+    RouteToDistance::DistanceType distance;
+};
+
+/*!
+ * @brief   `mail::Itinerary` is a sequence of legs from an origin to a destination with its total price and duration.
+ */
+struct Itinerary
+{
+    vector<ItineraryLeg> legs;
+    long double cost;
+    long double hours;
+
+    Itinerary()
+        : legs()
+        , cost(0)
+        , hours(0)
+    {}
+};
+
+/*!
+ * @brief   `mail::ItineraryOptimizer` is a class that finds the Pareto-optimal multi-modal itineraries for a package.
+ * @details The search runs on a layered graph whose states are (city, freight of the last leg), built once from the
+ *          lanes of the distance map. Every lane is a leg and costs `Freight::cost` and `Freight::transit_hours` of its
+ *          freight, base fee and handling time included, so an itinerary costs the sum of its legs; switching
+ *          freight at a city adds the transfer penalty on top.
+ *
+ *          The search is a multi-criteria label-setting algorithm on (cost, hours): labels are settled in increasing
+ *          lexicographic order, a label is dropped as soon as one already kept at its state dominates it (cheaper,
+ *          faster and with no more legs) or an itinerary already found beats the lower bound of its cost and hours to
+ *          the destination, and itineraries are limited to `max_legs` lanes. The itineraries that are left at the
+ *          destination form the Pareto front, from the cheapest to the fastest.
+ */
+class ItineraryOptimizer
+{
+  public:
+    /*!
+     * @brief   `mail::ItineraryOptimizer::no_freight` is the freight index of the state before the first leg.
+     */
+    static size_t const no_freight = freight_count;
+
+  private:
+    struct label
+    {
+        long double cost;
+        long double hours;
+        CityIndex::IdType city;
+        unsigned char freight;
+        unsigned char legs;
+        size_t parent;
+        RouteToDistance::DistanceType distance;
+        bool dominated;
+    };
+    struct label_order
+    {
+        vector<label> const *labels;
+        bool operator()(size_t lhs, size_t rhs) const
+        {
+            label const &a = (*labels)[lhs], &b = (*labels)[rhs];
+            return a.cost != b.cost ? a.cost > b.cost : a.hours > b.hours;
+        }
+    };
+
+    CityIndex const &m_cities;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::m_first_lane` is, for every city, the index of its first outgoing lane.
+     */
+    vector<size_t> m_first_lane;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::m_lane_to` is the destination of every lane, grouped by origin.
+     */
+    vector<CityIndex::IdType> m_lane_to;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::m_lane_distance` is the distance of every lane, grouped by origin.
+     */
+    vector<RouteToDistance::DistanceType> m_lane_distance;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::m_first_inbound` is, for every city, the index of its first incoming lane.
+     */
+    vector<size_t> m_first_inbound;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::m_inbound_lane` is the index of every lane, grouped by destination.
+     */
+    vector<size_t> m_inbound_lane;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::m_lane_from` is the origin of every lane, grouped by origin.
+     */
+    vector<CityIndex::IdType> m_lane_from;
+    long double m_transfer_cost;
+    long double m_transfer_hours;
+    unsigned m_max_legs;
+
+    static bool dominates(label const &a, label const &b)
+    {
+        return a.cost <= b.cost && a.hours <= b.hours && a.legs <= b.legs;
+    }
+    /*!
+     * @brief   `mail::ItineraryOptimizer::distances_to` is a function that finds the shortest distance from every city
+     *          to a destination, following the lanes (Dijkstra's algorithm on the reversed lanes).
+     * @param   destination The ID of the destination city
+     * @return  `std::vector<unsigned long long>` The shortest distance of every city, `ULLONG_MAX` if unreachable
+     */
+    vector<unsigned long long> distances_to(CityIndex::IdType destination) const;
+    /*!
+     * @brief   `mail::ItineraryOptimizer::hops_to` is a function that finds the fewest lanes from every city to a
+     *          destination (breadth-first search on the reversed lanes).
+     * @param   destination The ID of the destination city
+     * @return  `std::vector<unsigned>` The fewest lanes of every city, `UINT_MAX` if unreachable
+     */
+    vector<unsigned> hops_to(CityIndex::IdType destination) const;
+
+  public:
+    /*!
+     * @brief   `mail::ItineraryOptimizer::ItineraryOptimizer` is a constructor that builds the lane graph.
+     * @param   router The distance map to take the lanes from
+     * @param   transfer_cost The price of switching freight at a city
+     * @param   transfer_hours The hours lost switching freight at a city
+     * @param   max_legs The maximum number of lanes in an itinerary
+     */
+    explicit ItineraryOptimizer(RouteToDistance const &router, long double transfer_cost = 25.0L,
+                                long double transfer_hours = 12.0L, unsigned max_legs = 4)
+        : m_cities(router.cities())
+        , m_first_lane(router.cities().size() + 1, 0)
+        , m_lane_to()
+        , m_lane_distance()
+        , m_first_inbound(router.cities().size() + 1, 0)
+        , m_inbound_lane()
+        , m_lane_from()
+        , m_transfer_cost(transfer_cost)
+        , m_transfer_hours(transfer_hours)
+        , m_max_legs(max_legs)
+    {
+        vector<LaneTable::Lane> const lanes = router.routes();
+        for (size_t i = 0; i < lanes.size(); ++i)
+            ++m_first_lane[lanes[i].from + 1];
+        for (size_t i = 1; i < m_first_lane.size(); ++i)
+            m_first_lane[i] += m_first_lane[i - 1];
+        m_lane_to.resize(lanes.size());
+        m_lane_distance.resize(lanes.size());
+        vector<size_t> next(m_first_lane.begin(), m_first_lane.end() - 1);
+        for (size_t i = 0; i < lanes.size(); ++i)
+        {
+            size_t const slot = next[lanes[i].from]++;
+            m_lane_to[slot] = lanes[i].to;
+            m_lane_distance[slot] = lanes[i].distance;
+        }
+        m_lane_from.resize(lanes.size());
+        for (CityIndex::IdType city = 0; city < m_cities.size(); ++city)
+            for (size_t lane = m_first_lane[city]; lane != m_first_lane[city + 1]; ++lane)
+            {
+                m_lane_from[lane] = city;
+                ++m_first_inbound[m_lane_to[lane] + 1];
+            }
+        for (size_t i = 1; i < m_first_inbound.size(); ++i)
+            m_first_inbound[i] += m_first_inbound[i - 1];
+        m_inbound_lane.resize(lanes.size());
+        vector<size_t> inbound_next(m_first_inbound.begin(), m_first_inbound.end() - 1);
+        for (size_t lane = 0; lane < m_lane_to.size(); ++lane)
+            m_inbound_lane[inbound_next[m_lane_to[lane]]++] = lane;
+    }
+    /*!
+     * @brief   `mail::ItineraryOptimizer::optimize` is a function that finds the Pareto-optimal itineraries.
+     * @param   origin The ID of the origin city
+     * @param   destination The ID of the destination city
+     * @param   package The package to ship
+     * @return  `std::vector<mail::Itinerary>` The itineraries that no other is both cheaper and faster than, sorted
+     *          from the cheapest to the fastest; empty if the destination cannot be reached
+     * @throws  `std::out_of_range` If a city ID is unknown
+     */
+    vector<Itinerary> optimize(CityIndex::IdType origin, CityIndex::IdType destination, PackageInfo const &package) const;
+};
+
+vector<unsigned long long> ItineraryOptimizer::distances_to(CityIndex::IdType destination) const
+{
+    typedef pair<unsigned long long, CityIndex::IdType> Entry;
+    vector<unsigned long long> distance(m_cities.size(), ULLONG_MAX);
+    priority_queue<Entry, vector<Entry>, greater<Entry> > queue;
+    distance[destination] = 0;
+    queue.push(Entry(0, destination));
+    while (!queue.empty())
+    {
+        Entry const top = queue.top();
+        queue.pop();
+        if (top.first != distance[top.second])
+            continue;
+        for (size_t i = m_first_inbound[top.second]; i != m_first_inbound[top.second + 1]; ++i)
+        {
+            size_t const lane = m_inbound_lane[i];
+            unsigned long long const candidate = top.first + m_lane_distance[lane];
+            if (candidate < distance[m_lane_from[lane]])
+            {
+                distance[m_lane_from[lane]] = candidate;
+                queue.push(Entry(candidate, m_lane_from[lane]));
+            }
+        }
+    }
+    return distance;
+}
+
+vector<unsigned> ItineraryOptimizer::hops_to(CityIndex::IdType destination) const
+{
+    vector<unsigned> hops(m_cities.size(), UINT_MAX);
+    vector<CityIndex::IdType> frontier(1, destination);
+    hops[destination] = 0;
+    for (size_t i = 0; i < frontier.size(); ++i)
+    {
+        CityIndex::IdType const city = frontier[i];
+        for (size_t j = m_first_inbound[city]; j != m_first_inbound[city + 1]; ++j)
+        {
+            CityIndex::IdType const from = m_lane_from[m_inbound_lane[j]];
+            if (hops[from] != UINT_MAX)
+                continue;
+            hops[from] = hops[city] + 1;
+            frontier.push_back(from);
+        }
+    }
+    return hops;
+}
+
+vector<Itinerary> ItineraryOptimizer::optimize(CityIndex::IdType origin, CityIndex::IdType destination,
+                                               PackageInfo const &package) const
+{
+    if (origin >= m_cities.size() || destination >= m_cities.size())
+        throw out_of_range("City not found");
+    long double weight[freight_count];
+    long double min_rate = numeric_limits<long double>::max(), max_speed = 0;
+    long double min_fee = numeric_limits<long double>::max(), min_handling = numeric_limits<long double>::max();
+    for (size_t f = 0; f < freight_count; ++f)
+    {
+        weight[f] = chargeable_weight(*freights[f], package);
+        min_rate = min(min_rate, freights[f]->rate().value() / 1000 * weight[f]);
+        max_speed = max(max_speed, freights[f]->speed());
+        min_fee = min(min_fee, freights[f]->base_fee().value());
+        min_handling = min(min_handling, freights[f]->handling_hours());
+    }
+    // Lower bounds of the cost and the hours left from every city, to prune against the itineraries found so far:
+    // every lane left costs at least the cheapest fee and handling, and the distance left at least the cheapest rate
+    // and the fastest speed
+    vector<unsigned long long> const remaining = distances_to(destination);
+    if (remaining[origin] == ULLONG_MAX)
+        return vector<Itinerary>();
+    vector<unsigned> const hops = hops_to(destination);
+    if (hops[origin] > m_max_legs)
+        return vector<Itinerary>();
+
+    vector<label> labels;
+    vector<vector<size_t> > bags(m_cities.size() * (freight_count + 1));
+    vector<size_t> arrived, targets;
+    if (origin == destination)
+        return vector<Itinerary>();
+    label const start = {0, 0, origin, static_cast<unsigned char>(no_freight), 0, ~size_t(0), 0, false};
+    labels.push_back(start);
+    label_order const order = {&labels};
+    priority_queue<size_t, vector<size_t>, label_order> queue(order);
+    queue.push(0);
+    while (!queue.empty())
+    {
+        size_t const current = queue.top();
+        queue.pop();
+        label const here = labels[current];
+        if (here.dominated)
+            continue;
+        // An itinerary found since this label was queued may have made it useless
+        long double const least_cost = here.cost + min_rate * remaining[here.city] + min_fee * hops[here.city];
+        long double const least_hours = here.hours + remaining[here.city] / max_speed + min_handling * hops[here.city];
+        bool hopeless = false;
+        for (size_t i = 0; i < targets.size() && !hopeless; ++i)
+            hopeless = labels[targets[i]].cost <= least_cost && labels[targets[i]].hours <= least_hours &&
+                       targets[i] != current;
+        if (hopeless)
+            continue;
+        if (here.city == destination && current != 0)
+        {
+            arrived.push_back(current);
+            continue;
+        }
+        if (here.legs >= m_max_legs)
+            continue;
+        for (size_t lane = m_first_lane[here.city]; lane != m_first_lane[here.city + 1]; ++lane)
+        {
+            RouteToDistance::DistanceType const distance = m_lane_distance[lane];
+            for (size_t f = 0; f < freight_count; ++f)
+            {
+                Freight const &freight = *freights[f];
+                label next = {here.cost + freight.cost(weight[f], distance),
+                              here.hours + freight.transit_hours(distance),
+                              m_lane_to[lane],
+                              static_cast<unsigned char>(f),
+                              static_cast<unsigned char>(here.legs + 1),
+                              current,
+                              distance,
+                              false};
+                if (here.freight != f && here.freight != no_freight)
+                {
+                    next.cost += m_transfer_cost;
+                    next.hours += m_transfer_hours;
+                }
+                // Target pruning: useless if the destination is too many lanes away or if an itinerary already found
+                // is at least as good as the best case
+                unsigned long long const left = remaining[next.city];
+                if (left == ULLONG_MAX || next.legs + hops[next.city] > m_max_legs)
+                    continue;
+                label best_case = next;
+                best_case.cost += min_rate * left + min_fee * hops[next.city];
+                best_case.hours += left / max_speed + min_handling * hops[next.city];
+                bool pruned = false;
+                for (size_t i = 0; i < targets.size() && !pruned; ++i)
+                    pruned = labels[targets[i]].cost <= best_case.cost && labels[targets[i]].hours <= best_case.hours;
+                vector<size_t> &bag = bags[next.city * (freight_count + 1) + f];
+                for (size_t i = 0; i < bag.size() && !pruned; ++i)
+                    pruned = dominates(labels[bag[i]], next);
+                if (pruned)
+                    continue;
+                // Dominated labels leave the bag but stay in `labels`, where they may still be a parent
+                for (size_t i = 0; i < bag.size();)
+                    if (dominates(next, labels[bag[i]]))
+                    {
+                        labels[bag[i]].dominated = true;
+                        bag[i] = bag.back();
+                        bag.pop_back();
+                    }
+                    else
+                        ++i;
+                bag.push_back(labels.size());
+                if (next.city == destination)
+                    targets.push_back(labels.size());
+                labels.push_back(next);
+                queue.push(labels.size() - 1);
+            }
+        }
+    }
+
+    vector<Itinerary> front;
+    for (size_t i = 0; i < arrived.size(); ++i)
+    {
+        label const &last = labels[arrived[i]];
+        bool dominated = false;
+        for (size_t j = 0; j < front.size() && !dominated; ++j)
+            dominated = front[j].cost <= last.cost && front[j].hours <= last.hours;
+        if (dominated)
+            continue;
+        Itinerary itinerary;
+        itinerary.cost = last.cost;
+        itinerary.hours = last.hours;
+        for (size_t at = arrived[i]; labels[at].parent != ~size_t(0); at = labels[at].parent)
+        {
+            ItineraryLeg const leg = {labels[labels[at].parent].city, labels[at].city, freights[labels[at].freight],
+                                      labels[at].distance};
+            itinerary.legs.push_back(leg);
+        }
+        reverse(itinerary.legs.begin(), itinerary.legs.end());
+        front.push_back(itinerary);
+    }
+    return front;
+}
+
+/*!
+ * @brief   `mail::append_uint` is a function that appends the decimal digits of an unsigned integer to a buffer.
+ * @param   out The buffer
+ * @param   value The value
+ */
+void append_uint(string &out, unsigned long long value)
+{
+    char digits[20];
+    char *cursor = digits + sizeof digits;
+    do
+    {
+        *--cursor = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    out.append(cursor, digits + sizeof digits);
+}
+
+/*!
+ * @brief   `mail::append_fixed` is a function that appends a number with a fixed number of decimals to a buffer.
+ * @details The value is rounded to an integer count of the last decimal and printed with integer arithmetic, which is
+ *          much cheaper than `operator<<` on `long double`. Values too large for that fall back to `snprintf`.
+ * @param   out The buffer
+ * @param   value The value
+ * @param   decimals The number of decimals, at most 9
+ */
+void append_fixed(string &out, long double value, unsigned decimals)
+{
+    static unsigned long long const scales[] = {1ULL,      10ULL,      100ULL,      1000ULL,      10000ULL,
+                                                100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+    decimals = min(decimals, 9U);
+    long double const magnitude = fabsl(value) * scales[decimals];
+    if (!(magnitude < 9e18L))
+    {
+        char text[64];
+        int const length = snprintf(text, sizeof text, "%.*Lf", static_cast<int>(decimals), value);
+        out.append(text, static_cast<size_t>(max(length, 0)));
+        return;
+    }
+    unsigned long long const scaled = static_cast<unsigned long long>(llroundl(magnitude));
+    if (value < 0 && scaled != 0)
+        out.push_back('-');
+    append_uint(out, scaled / scales[decimals]);
+    if (decimals == 0)
+        return;
+    out.push_back('.');
+    string::size_type const position = out.size();
+    append_uint(out, scaled % scales[decimals]);
+    out.insert(position, decimals - (out.size() - position), '0');
+}
+
+/*!
+ * @brief   `mail::append_fixed` is a function that appends an exact quantity in major units to a buffer.
+ * @details The digits come straight from the count of minor units, so nothing is rounded.
+ * @param   out The buffer
+ * @param   quantity The quantity
+ * @param   decimals The number of decimals, padded with zeros; the quantity is never cut to fewer than its minor
+ *                   unit needs
+ */
+template <typename Unit>
+void append_fixed(string &out, Fixed<Unit> quantity, unsigned decimals)
+{
+    int64_t const count = quantity.count();
+    unsigned long long const magnitude =
+        count < 0 ? 0ULL - static_cast<unsigned long long>(count) : static_cast<unsigned long long>(count);
+    if (count < 0)
+        out.push_back('-');
+    append_uint(out, magnitude / Unit::per_major);
+    unsigned digits = 0;
+    for (int64_t scale = Unit::per_major; scale > 1; scale /= 10)
+        ++digits;
+    if (digits == 0 && decimals == 0)
+        return;
+    out.push_back('.');
+    string::size_type const position = out.size();
+    if (digits != 0)
+    {
+        append_uint(out, magnitude % Unit::per_major);
+        out.insert(position, digits - (out.size() - position), '0');
+    }
+    if (decimals > digits)
+        out.append(decimals - digits, '0');
+}
+
+/*!
+ * @brief   `mail::AsyncWriter` is a class that writes buffers to a file descriptor on a dedicated thread.
+ * @details Producers hand over whole buffers, the writer thread issues one large `write()` per buffer and gives the
+ *          emptied buffer back for reuse, so the producers never wait for a system call. If the writer falls behind
+ *          by more than `max_pending` buffers, producers wait. Once a write fails, the buffers are discarded and the
+ *          error is kept for the next `drain`, or printed to `std::cerr` by the destructor if no `drain` reports it.
+ */
+class AsyncWriter
+{
+  private:
+    int m_fd;
+    size_t m_max_pending;
+    mutex m_mutex;
+    condition_variable m_changed;
+    deque<string> m_pending;
+    vector<string> m_free;
+    bool m_writing;
+    bool m_stop;
+    /*!
+     * @brief   `mail::AsyncWriter::m_error` is the `errno` of the first failed write not yet reported, 0 if none.
+     */
+    int m_error;
+    thread m_thread;
+
+    void run()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        while (true)
+        {
+            m_changed.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+            if (m_pending.empty())
+                return;
+            string buffer;
+            buffer.swap(m_pending.front());
+            m_pending.pop_front();
+            m_writing = true;
+            bool const failed = m_error != 0;
+            lock.unlock();
+            int const error = failed ? 0 : write_all(buffer);
+            buffer.clear();
+            lock.lock();
+            if (error != 0)
+                m_error = error;
+            m_writing = false;
+            m_free.push_back(string());
+            m_free.back().swap(buffer);
+            m_changed.notify_all();
+        }
+    }
+    int write_all(string const &buffer) const
+    {
+        char const *cursor = buffer.data();
+        size_t remaining = buffer.size();
+        while (remaining != 0)
+        {
+            ssize_t const written = ::write(m_fd, cursor, remaining);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return written < 0 ? errno : EIO;
+            cursor += written;
+            remaining -= static_cast<size_t>(written);
+        }
+        return 0;
+    }
+
+  public:
+    /*!
+     * @brief   `mail::AsyncWriter::AsyncWriter` is a constructor that starts the writer thread.
+     * @param   fd The file descriptor to write to
+     * @param   max_pending The number of buffers that may wait to be written
+     */
+    explicit AsyncWriter(int fd = STDOUT_FILENO, size_t max_pending = 64)
+        : m_fd(fd)
+        , m_max_pending(max(max_pending, size_t(1)))
+        , m_mutex()
+        , m_changed()
+        , m_pending()
+        , m_free()
+        , m_writing(false)
+        , m_stop(false)
+        , m_error(0)
+        , m_thread()
+    {
+        m_thread = thread(&AsyncWriter::run, this);
+    }
+    AsyncWriter(AsyncWriter const &) = delete;
+    AsyncWriter &operator=(AsyncWriter const &) = delete;
+    /*!
+     * @brief   `mail::AsyncWriter::~AsyncWriter` is a destructor that writes what is pending and stops the thread.
+     */
+    ~AsyncWriter()
+    {
+        {
+            lock_guard<mutex> const lock(m_mutex);
+            m_stop = true;
+        }
+        m_changed.notify_all();
+        m_thread.join();
+        if (m_error != 0)
+            cerr << "Failed to write output: " << strerror(m_error) << endl;
+    }
+    /*!
+     * @brief   `mail::AsyncWriter::submit` is a function that queues the content of a buffer for writing.
+     * @details `buffer` is swapped with an empty buffer that keeps the capacity of a previously written one.
+     * @param   buffer The buffer to write, empty on return
+     */
+    void submit(string &buffer)
+    {
+        if (buffer.empty())
+            return;
+        unique_lock<mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return m_pending.size() < m_max_pending; });
+        m_pending.push_back(string());
+        m_pending.back().swap(buffer);
+        if (!m_free.empty())
+        {
+            buffer.swap(m_free.back());
+            m_free.pop_back();
+        }
+        m_changed.notify_all();
+    }
+    /*!
+     * @brief   `mail::AsyncWriter::drain` is a function that waits until every submitted buffer has been written.
+     * @throws  `std::runtime_error` If a write failed since the previous call, losing output
+     */
+    void drain()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return m_pending.empty() && !m_writing; });
+        if (m_error != 0)
+        {
+            int const error = m_error;
+            m_error = 0;
+            throw runtime_error("Failed to write output: " + string(strerror(error)));
+        }
+    }
+};
+
+/*!
+ * @brief   `mail::OutputBuffer` is a class that accumulates rendered output of one thread for an `mail::AsyncWriter`.
+ * @details Every producing thread owns one. The text is handed to the writer once it exceeds `flush_size`, so the
+ *          writer only sees large buffers, and the buffer storage is recycled.
+ */
+class OutputBuffer
+{
+  private:
+    AsyncWriter &m_writer;
+    string m_text;
+    size_t m_flush_size;
+
+  public:
+    /*!
+     * @brief   `mail::OutputBuffer::OutputBuffer` is a constructor that initializes the `mail::OutputBuffer` object.
+     * @param   writer The writer that receives the full buffers
+     * @param   flush_size The size from which the buffer is handed to the writer
+     */
+    explicit OutputBuffer(AsyncWriter &writer, size_t flush_size = 1 << 16)
+        : m_writer(writer)
+        , m_text()
+        , m_flush_size(flush_size)
+    {
+        m_text.reserve(flush_size + flush_size / 4);
+    }
+    OutputBuffer(OutputBuffer const &) = delete;
+    OutputBuffer &operator=(OutputBuffer const &) = delete;
+    ~OutputBuffer()
+    {
+        flush();
+    }
+    /*!
+     * @brief   `mail::OutputBuffer::text` is a function that returns the buffer to render into.
+     * @return  `std::string &` The buffer
+     */
+    string &text()
+    {
+        return m_text;
+    }
+    /*!
+     * @brief   `mail::OutputBuffer::commit` is a function that hands the buffer to the writer if it is full enough.
+     */
+    void commit()
+    {
+        if (m_text.size() >= m_flush_size)
+            flush();
+    }
+    /*!
+     * @brief   `mail::OutputBuffer::flush` is a function that hands the buffer to the writer.
+     */
+    void flush()
+    {
+        m_writer.submit(m_text);
+    }
+};
+
+/*!
+ * @brief   `mail::QuoteFormatter` is a class that renders quote results into a buffer.
+ * @details Three formats are available: `csv` (RFC 4180, one line per quote, see `header()`), `jsonl` (one JSON
+ *          object per line) and `binary`, a fixed-width record of `binary_record_size` bytes in host byte order:
+ *
+ *          | Offset | Size | Field                                   |
+ *          |--------|------|-----------------------------------------|
+ *          | 0      | 32   | Origin city, NUL padded                 |
+ *          | 32     | 32   | Destination city, NUL padded            |
+ *          | 64     | 8    | Length in 1/1000 cm (`int64_t`)         |
+ *          | 72     | 8    | Width in 1/1000 cm (`int64_t`)          |
+ *          | 80     | 8    | Height in 1/1000 cm (`int64_t`)         |
+ *          | 88     | 8    | Weight in grams (`int64_t`)             |
+ *          | 96     | 8    | Freight weight in grams (`int64_t`)     |
+ *          | 104    | 8    | Cost in cents (`int64_t`)               |
+ *          | 112    | 4    | Quantity (`uint32_t`)                   |
+ *          | 116    | 1    | Mode: 1 ocean, 2 air, 3 rail            |
+ *          | 117    | 11   | Reserved, zero                          |
+ */
+class QuoteFormatter
+{
+  public:
+    enum format_type
+    {
+        csv,
+        jsonl,
+        binary
+    };
+    static size_t const binary_record_size = 128;
+
+  private:
+    format_type m_format;
+
+    static void append_csv_string(string &out, string const &value)
+    {
+        out.push_back('"');
+        for (size_t i = 0; i < value.size(); ++i)
+        {
+            if (value[i] == '"')
+                out.push_back('"');
+            out.push_back(value[i]);
+        }
+        out.push_back('"');
+    }
+    static void append_json_string(string &out, string const &value)
+    {
+        static char const hex[] = "0123456789abcdef";
+        out.push_back('"');
+        for (size_t i = 0; i < value.size(); ++i)
+        {
+            unsigned char const c = static_cast<unsigned char>(value[i]);
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+                out.push_back(static_cast<char>(c));
+            }
+            else if (c < 0x20)
+            {
+                out.append("\\u00");
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 0xF]);
+            }
+            else
+                out.push_back(static_cast<char>(c));
+        }
+        out.push_back('"');
+    }
+    static void put_fixed_string(char *field, size_t size, string const &value)
+    {
+        memcpy(field, value.data(), min(size, value.size()));
+    }
+    static void put_count(char *field, int64_t count)
+    {
+        memcpy(field, &count, sizeof count);
+    }
+    static unsigned char mode_code(string const &service_type)
+    {
+        if (service_type == "Ocean transport")
+            return 1;
+        if (service_type == "Air transport")
+            return 2;
+        if (service_type == "Rail transport")
+            return 3;
+        return 0;
+    }
+
+  public:
+    /*!
+     * @brief   `mail::QuoteFormatter::QuoteFormatter` is a constructor that initializes the `mail::QuoteFormatter` object.
+     * @param   format The output format
+     */
+    explicit QuoteFormatter(format_type format = csv)
+        : m_format(format)
+    {}
+    /*!
+     * @brief   `mail::QuoteFormatter::format_of` is a function that returns the format of a name.
+     * @param   name `csv`, `jsonl` or `binary`
+     * @return  `mail::QuoteFormatter::format_type` The format
+     * @throws  `std::runtime_error` If the name is none of them
+     */
+    static format_type format_of(string const &name)
+    {
+        if (name == "csv")
+            return csv;
+        if (name == "jsonl")
+            return jsonl;
+        if (name == "binary")
+            return binary;
+        throw runtime_error("Invalid output format: " + name);
+    }
+    /*!
+     * @brief   `mail::QuoteFormatter::header` is a function that returns the title line of the CSV format.
+     * @return  `std::string` The title line, empty for the other formats
+     */
+    string header() const
+    {
+        if (m_format != csv)
+            return string();
+        return "\"Origin\",\"Destination\",\"Mode\",\"Length\",\"Width\",\"Height\",\"Weight\",\"Quantity\","
+               "\"Freight Weight\",\"Cost\"\n";
+    }
+    /*!
+     * @brief   `mail::QuoteFormatter::render` is a function that appends one quote result to a buffer.
+     * @param   out The buffer
+     * @param   info The quote result
+     */
+    void render(string &out, ShipmentInfo const &info) const
+    {
+        PackageInfo const package = info.getPackage();
+        string const origin = info.getOrigin().getLocation(), destination = info.getDestination().getLocation();
+        string const mode = info.getServiceType();
+        switch (m_format)
+        {
+        case csv:
+            append_csv_string(out, origin);
+            out.push_back(',');
+            append_csv_string(out, destination);
+            out.push_back(',');
+            append_csv_string(out, mode);
+            out.push_back(',');
+            append_fixed(out, package.getFixedLength(), 2);
+            out.push_back(',');
+            append_fixed(out, package.getFixedWidth(), 2);
+            out.push_back(',');
+            append_fixed(out, package.getFixedHeight(), 2);
+            out.push_back(',');
+            append_fixed(out, package.getFixedWeight(), 3);
+            out.push_back(',');
+            append_uint(out, package.getQuantity());
+            out.push_back(',');
+            append_fixed(out, info.getFixedFreightWeight(), 3);
+            out.push_back(',');
+            append_fixed(out, info.getFixedCost(), 2);
+            out.push_back('\n');
+            break;
+        case jsonl:
+            out.append("{\"origin\":");
+            append_json_string(out, origin);
+            out.append(",\"destination\":");
+            append_json_string(out, destination);
+            out.append(",\"mode\":");
+            append_json_string(out, mode);
+            out.append(",\"length\":");
+            append_fixed(out, package.getFixedLength(), 2);
+            out.append(",\"width\":");
+            append_fixed(out, package.getFixedWidth(), 2);
+            out.append(",\"height\":");
+            append_fixed(out, package.getFixedHeight(), 2);
+            out.append(",\"weight\":");
+            append_fixed(out, package.getFixedWeight(), 3);
+            out.append(",\"quantity\":");
+            append_uint(out, package.getQuantity());
+            out.append(",\"freight_weight\":");
+            append_fixed(out, info.getFixedFreightWeight(), 3);
+            out.append(",\"cost\":");
+            append_fixed(out, info.getFixedCost(), 2);
+            out.append("}\n");
+            break;
+        case binary:
+        {
+            char record[binary_record_size] = {};
+            uint32_t const quantity = package.getQuantity();
+            put_fixed_string(record, 32, origin);
+            put_fixed_string(record + 32, 32, destination);
+            put_count(record + 64, (package.getFixedLength() * 100).count());
+            put_count(record + 72, (package.getFixedWidth() * 100).count());
+            put_count(record + 80, (package.getFixedHeight() * 100).count());
+            put_count(record + 88, package.getFixedWeight().count());
+            put_count(record + 96, info.getFixedFreightWeight().count());
+            put_count(record + 104, info.getFixedCost().count());
+            memcpy(record + 112, &quantity, sizeof quantity);
+            record[116] = static_cast<char>(mode_code(mode));
+            out.append(record, sizeof record);
+            break;
+        }
+        }
+    }
+};
+
+/*!
+ * @brief   `mail::quote_file` is a function that quotes every shipment of a request file and writes the results.
+ * @details The request file is a CSV file whose fields are the origin and destination cities, the freight name as
+ *          `mail::Freight::operator string` gives it, the length, width and height of a package in centimeters, its
+ *          weight in kilograms and the number of packages, after a title line. Every origin and destination is
+ *          checked with `mail::validate_routes` before anything is quoted, so records with an unknown city or no lane
+ *          are rejected early, with suggestions for misspelled cities; a missing lane whose distance can be estimated
+ *          is quoted, and reported on `std::cerr`. Each quote is then rendered with
+ *          `mail::QuoteFormatter` into an `mail::OutputBuffer`, and an `mail::AsyncWriter` writes the full buffers
+ *          while the next quotes are computed. A record that cannot be quoted is reported on `std::cerr` and skipped.
+ * @param   filename The name of the request file
+ * @param   format The output format
+ * @param   threads The number of threads to validate the routes with, 0 for the number of hardware threads
+ * @param   fd The file descriptor to write the results to
+ * @return  `std::size_t` The number of shipments quoted
+ * @throws  `std::runtime_error` If the file cannot be read or parsed, or the results cannot be written
+ */
+size_t quote_file(string const &filename, QuoteFormatter::format_type format, unsigned threads = 0,
+                  int fd = STDOUT_FILENO)
+{
+    ifstream stream(filename);
+    if (!stream)
+        throw runtime_error("Failed to open request file " + filename);
+    string title_line;
+    getline(stream, title_line);
+    stream.seekg(0);
+    string const data((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    csv::Parser parser(title_line);
+    parser.add_records(data);
+    if (parser.field_count() != 8)
+        throw runtime_error("Invalid request file " + filename + ": expected 8 fields");
+
+    vector<pair<string, string> > routes;
+    routes.reserve(parser.record_count());
+    for (size_t i = 0; i < parser.record_count(); ++i)
+        routes.push_back(make_pair(parser.field_at(i, 0), parser.field_at(i, 1)));
+    vector<RouteCheck> const checks = validate_routes(routes, threads);
+
+    QuoteFormatter const formatter(format);
+    AsyncWriter writer(fd);
+    size_t quoted = 0;
+    {
+        OutputBuffer buffer(writer);
+        buffer.text() += formatter.header();
+        for (size_t i = 0; i < parser.record_count(); ++i)
+            try
+            {
+                string const &origin = routes[i].first, &destination = routes[i].second;
+                if (!checks[i].valid() && checks[i].origin.id == CityIndex::npos)
+                    throw out_of_range(describe_city_check(origin, checks[i].origin));
+                if (!checks[i].valid() && checks[i].destination.id == CityIndex::npos)
+                    throw out_of_range(describe_city_check(destination, checks[i].destination));
+                if (!checks[i].valid())
+                    throw out_of_range("No route from " + origin + " to " + destination);
+                long double const length = parser.field_as<long double>(i, 3);
+                long double const width = parser.field_as<long double>(i, 4);
+                long double const height = parser.field_as<long double>(i, 5);
+                long double const weight = parser.field_as<long double>(i, 6);
+                unsigned int const quantity = parser.field_as<unsigned int>(i, 7);
+                if (!(length > 0 && length <= max_package_side && width > 0 && width <= max_package_side &&
+                      height > 0 && height <= max_package_side && weight > 0 && weight <= max_package_weight) ||
+                    quantity == 0 || quantity > max_package_quantity)
+                    throw runtime_error("Invalid package");
+                RouteToDistance::LookupResult const lane = route_to_distance.lookup(make_route(origin, destination));
+                if (!lane)
+                    throw out_of_range("No route from " + origin + " to " + destination);
+                PackageInfo const package(length, width, height, weight, quantity);
+                ShipmentInfo info(PostalAddress("", "", "", origin), PostalAddress("", "", "", destination), package,
+                                  UserInfo(), UserInfo(), parser.field_at(i, 2), 0);
+                info.setCost(quote_cost(info.getFreight(), package, lane.distance));
+                if (lane.estimated)
+                    cerr << filename << ", record " << i + 1 << ": distance from " << origin << " to " << destination
+                         << " estimated\n";
+                formatter.render(buffer.text(), info);
+                buffer.commit();
+                ++quoted;
+            }
+            catch (exception const &error)
+            {
+                cerr << filename << ", record " << i + 1 << ": " << error.what() << '\n';
+            }
+        buffer.flush();
+    }
+    writer.drain();
+    return quoted;
+}
+
+/*!
+ * @brief   `mail::crc32` is a function that computes the CRC-32 (IEEE 802.3) of a byte range.
+ * @param   data The beginning of the bytes
+ * @param   size The number of bytes
+ * @param   crc The CRC of the preceding bytes, to checksum a message in several parts
+ * @return  `uint32_t` The CRC of all the bytes so far
+ */
+uint32_t crc32(void const *data, size_t size, uint32_t crc = 0)
+{
+    struct table_type
+    {
+        uint32_t entries[256];
+
+        table_type()
+            : entries()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    value = (value >> 1) ^ (0xEDB88320U & (0U - (value & 1U)));
+                entries[i] = value;
+            }
+        }
+    };
+    static table_type const table;
+    unsigned char const *bytes = static_cast<unsigned char const *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table.entries[(crc ^ bytes[i]) & 0xFFU] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*!
+ * @brief   `mail::ByteWriter` is a class that appends fixed-size values and strings to a byte buffer in host byte order.
+ */
+class ByteWriter
+{
+  private:
+    string &m_out;
+
+  public:
+    explicit ByteWriter(string &out)
+        : m_out(out)
+    {}
+    template <typename T>
+    void put(T value)
+    {
+        m_out.append(reinterpret_cast<char const *>(&value), sizeof value);
+    }
+    /*!
+     * @brief   `mail::ByteWriter::put_string` is a function that appends a string preceded by its 32-bit length.
+     * @param   value The string
+     */
+    void put_string(string const &value)
+    {
+        put(static_cast<uint32_t>(value.size()));
+        m_out.append(value);
+    }
+};
+
+/*!
+ * @brief   `mail::ByteReader` is a class that reads what a `mail::ByteWriter` wrote.
+ */
+class ByteReader
+{
+  private:
+    char const *m_cursor;
+    char const *m_end;
+
+    void require(size_t size) const
+    {
+        if (static_cast<size_t>(m_end - m_cursor) < size)
+            throw runtime_error("Truncated binary data");
+    }
+
+  public:
+    ByteReader(char const *begin, char const *end)
+        : m_cursor(begin)
+        , m_end(end)
+    {}
+    /*!
+     * @brief   `mail::ByteReader::get` is a function that reads a fixed-size value.
+     * @return  `T` The value
+     * @throws  `std::runtime_error` If the data ends first
+     */
+    template <typename T>
+    T get()
+    {
+        require(sizeof(T));
+        T value;
+        memcpy(&value, m_cursor, sizeof value);
+        m_cursor += sizeof value;
+        return value;
+    }
+    /*!
+     * @brief   `mail::ByteReader::get_string` is a function that reads a string preceded by its 32-bit length.
+     * @return  `std::string` The string
+     * @throws  `std::runtime_error` If the data ends first
+     */
+    string get_string()
+    {
+        uint32_t const size = get<uint32_t>();
+        require(size);
+        string const value(m_cursor, size);
+        m_cursor += size;
+        return value;
+    }
+    /*!
+     * @brief   `mail::ByteReader::at_end` is a function that checks if everything has been read.
+     * @return  `bool` `true` if there is nothing left, `false` otherwise
+     */
+    bool at_end() const
+    {
+        return m_cursor == m_end;
+    }
+};
+
+/*!
+ * @brief   `mail::freight_mode` is the persistent code of a freight, the same as in the `binary` quote format.
+ */
+enum freight_mode
+{
+    ocean_mode = 1,
+    air_mode = 2,
+    rail_mode = 3
+};
+
+/*!
+ * @brief   `mail::mode_of` is a function that returns the code of a freight.
+ * @param   freight The freight, one of `ocean_freight`, `air_freight` and `rail_freight`
+ * @return  `mail::freight_mode` The code of the freight
+ * @throws  `std::invalid_argument` If the freight is not one of the three
+ */
+freight_mode mode_of(Freight const &freight)
+{
+    if (&freight == &ocean_freight)
+        return ocean_mode;
+    if (&freight == &air_freight)
+        return air_mode;
+    if (&freight == &rail_freight)
+        return rail_mode;
+    throw invalid_argument("Unknown freight");
+}
+
+/*!
+ * @brief   `mail::freight_of` is a function that returns the freight of a code.
+ * @param   mode The code of the freight
+ * @return  `mail::Freight const &` The freight
+ * @throws  `std::out_of_range` If the code is unknown
+ */
+Freight const &freight_of(freight_mode mode)
+{
+    switch (mode)
+    {
+    case ocean_mode:
+        return ocean_freight;
+    case air_mode:
+        return air_freight;
+    case rail_mode:
+        return rail_freight;
+    }
+    throw out_of_range("Unknown freight mode");
+}
+
+/*!
+ * @brief   `mail::ShipmentRecordView` is a class that reads a compact binary shipment record in place.
+ * @details A record is written by `mail::encode_shipment`, in host byte order and without alignment requirement:
+ *
+ *          | Offset | Size | Field                                                  |
+ *          |--------|------|--------------------------------------------------------|
+ *          | 0      | 4    | Record size, string table included                     |
+ *          | 4      | 1    | Format version, `1`                                    |
+ *          | 5      | 1    | Freight, see `mail::freight_mode`                      |
+ *          | 6      | 2    | Reserved, zero                                         |
+ *          | 8      | 4    | Origin city ID, `CityIndex::npos` if not interned      |
+ *          | 12     | 4    | Destination city ID, `CityIndex::npos` if not interned |
+ *          | 16     | 4    | Length in 1/1000 cm                                    |
+ *          | 20     | 4    | Width in 1/1000 cm                                     |
+ *          | 24     | 4    | Height in 1/1000 cm                                    |
+ *          | 28     | 4    | Weight in grams                                        |
+ *          | 32     | 4    | Quantity                                               |
+ *          | 36     | 4    | Freight weight in grams                                |
+ *          | 40     | 8    | Cost in cents (`int64_t`)                              |
+ *          | 48     | 28   | End offsets of the 14 strings, `uint16_t` each         |
+ *          | 76     | -    | The strings, back to back, see `string_slot`           |
+ *
+ *          City IDs refer to the `mail::CityIndex` the record was written with; the city string of an interned city
+ *          is empty. Accessors read straight from the buffer, which must outlive the view.
+ */
+class ShipmentRecordView
+{
+  public:
+    enum string_slot
+    {
+        user_name,
+        user_email,
+        user_phone_number,
+        consignee_name,
+        consignee_email,
+        consignee_phone_number,
+        origin_user_type,
+        origin_country,
+        origin_postal_code,
+        origin_city,
+        destination_user_type,
+        destination_country,
+        destination_postal_code,
+        destination_city,
+        string_slot_count
+    };
+    static size_t const fixed_size = 48;
+    static size_t const strings_offset = fixed_size + 2 * string_slot_count;
+    static unsigned char const version = 1;
+
+  private:
+    char const *m_data;
+
+    template <typename T>
+    T get(size_t offset) const
+    {
+        T value;
+        memcpy(&value, m_data + offset, sizeof value);
+        return value;
+    }
+    size_t string_end_offset(string_slot slot) const
+    {
+        return strings_offset + get<uint16_t>(fixed_size + 2 * slot);
+    }
+
+  public:
+    /*!
+     * @brief   `mail::ShipmentRecordView::ShipmentRecordView` is a constructor that checks a record and wraps it.
+     * @param   data The beginning of the record
+     * @param   size The number of bytes available, at least the size of the record
+     * @throws  `std::runtime_error` If the bytes are not a valid record
+     */
+    ShipmentRecordView(char const *data, size_t size)
+        : m_data(data)
+    {
+        if (size < strings_offset || get<uint32_t>(0) > size || get<uint32_t>(0) < strings_offset ||
+            get<unsigned char>(4) != version)
+            throw runtime_error("Invalid shipment record");
+        size_t previous = strings_offset;
+        for (int slot = 0; slot < string_slot_count; ++slot)
+        {
+            size_t const end = string_end_offset(static_cast<string_slot>(slot));
+            if (end < previous || end > get<uint32_t>(0))
+                throw runtime_error("Invalid shipment record");
+            previous = end;
+        }
+        freight_of(mode());
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::size` is a function that returns the size of the record.
+     * @return  `std::size_t` The number of bytes of the record
+     */
+    size_t size() const
+    {
+        return get<uint32_t>(0);
+    }
+    freight_mode mode() const
+    {
+        return static_cast<freight_mode>(get<unsigned char>(5));
+    }
+    Freight const &freight() const
+    {
+        return freight_of(mode());
+    }
+    CityIndex::IdType origin_city_id() const
+    {
+        return get<uint32_t>(8);
+    }
+    CityIndex::IdType destination_city_id() const
+    {
+        return get<uint32_t>(12);
+    }
+    uint32_t length() const
+    {
+        return get<uint32_t>(16);
+    }
+    uint32_t width() const
+    {
+        return get<uint32_t>(20);
+    }
+    uint32_t height() const
+    {
+        return get<uint32_t>(24);
+    }
+    uint32_t weight() const
+    {
+        return get<uint32_t>(28);
+    }
+    uint32_t quantity() const
+    {
+        return get<uint32_t>(32);
+    }
+    uint32_t freight_weight() const
+    {
+        return get<uint32_t>(36);
+    }
+    int64_t cost() const
+    {
+        return get<int64_t>(40);
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::string_begin` is a function that returns the beginning of a string.
+     * @param   slot The string
+     * @return  `char const *` The first character of the string, in the record
+     */
+    char const *string_begin(string_slot slot) const
+    {
+        return m_data + (slot == 0 ? strings_offset : string_end_offset(static_cast<string_slot>(slot - 1)));
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::string_end` is a function that returns the end of a string.
+     * @param   slot The string
+     * @return  `char const *` The position after the last character of the string, in the record
+     */
+    char const *string_end(string_slot slot) const
+    {
+        return m_data + string_end_offset(slot);
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::string_at` is a function that copies a string out of the record.
+     * @param   slot The string
+     * @return  `std::string` The string
+     */
+    string string_at(string_slot slot) const
+    {
+        return string(string_begin(slot), string_end(slot));
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::equals` is a function that compares a string of the record without copying it.
+     * @param   slot The string
+     * @param   value The string to compare with
+     * @return  `bool` `true` if they are equal, `false` otherwise
+     */
+    bool equals(string_slot slot, string const &value) const
+    {
+        size_t const size = static_cast<size_t>(string_end(slot) - string_begin(slot));
+        return size == value.size() && memcmp(string_begin(slot), value.data(), size) == 0;
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::origin_city_name` is a function that returns the origin city.
+     * @param   cities The index the record was written with
+     * @return  `std::string` The name of the origin city
+     * @throws  `std::out_of_range` If the city ID is not in the index
+     */
+    string origin_city_name(CityIndex const &cities) const
+    {
+        return origin_city_id() == CityIndex::npos ? string_at(origin_city) : cities.name_of(origin_city_id());
+    }
+    /*!
+     * @brief   `mail::ShipmentRecordView::destination_city_name` is a function that returns the destination city.
+     * @param   cities The index the record was written with
+     * @return  `std::string` The name of the destination city
+     * @throws  `std::out_of_range` If the city ID is not in the index
+     */
+    string destination_city_name(CityIndex const &cities) const
+    {
+        return destination_city_id() == CityIndex::npos ? string_at(destination_city)
+                                                        : cities.name_of(destination_city_id());
+    }
+};
+
+/*!
+ * @brief   `mail::encode_shipment` is a function that appends the compact binary record of a shipment to a buffer.
+ * @details Lengths are stored in 1/1000 cm, weights in grams and the cost in cents, all exact. Known cities are stored as
+ *          their ID in `cities`. See `mail::ShipmentRecordView` for the layout.
+ * @param   out The buffer
+ * @param   info The shipment
+ * @param   cities The index to intern the cities with
+ * @throws  `std::out_of_range` If a number does not fit its field or the strings exceed 64 KiB
+ */
+void encode_shipment(string &out, ShipmentInfo const &info, CityIndex const &cities)
+{
+    struct fixed
+    {
+        static uint32_t scale(int64_t value, int64_t factor)
+        {
+            if (value < 0 || value > 0xFFFFFFFFLL / factor)
+                throw out_of_range("Shipment value out of range for the record format");
+            return static_cast<uint32_t>(value * factor);
+        }
+    };
+    UserInfo const user = info.getUser(), consignee = info.getconsignee();
+    PostalAddress const origin = info.getOrigin(), destination = info.getDestination();
+    PackageInfo const package = info.getPackage();
+    CityIndex::IdType const origin_id = cities.id_of(origin.getLocation());
+    CityIndex::IdType const destination_id = cities.id_of(destination.getLocation());
+    string const strings[ShipmentRecordView::string_slot_count] = {
+        user.getName(),
+        user.getEmail(),
+        user.getPhoneNumber(),
+        consignee.getName(),
+        consignee.getEmail(),
+        consignee.getPhoneNumber(),
+        origin.getUserType(),
+        origin.getCountry(),
+        origin.getPostalCode(),
+        origin_id == CityIndex::npos ? origin.getLocation() : string(),
+        destination.getUserType(),
+        destination.getCountry(),
+        destination.getPostalCode(),
+        destination_id == CityIndex::npos ? destination.getLocation() : string(),
+    };
+    size_t strings_size = 0;
+    for (size_t i = 0; i < ShipmentRecordView::string_slot_count; ++i)
+        strings_size += strings[i].size();
+    if (strings_size > 0xFFFF)
+        throw out_of_range("Shipment strings too long for the record format");
+
+    ByteWriter writer(out);
+    writer.put(static_cast<uint32_t>(ShipmentRecordView::strings_offset + strings_size));
+    writer.put(ShipmentRecordView::version);
+    writer.put(static_cast<unsigned char>(mode_of(info.getFreight())));
+    writer.put(uint16_t(0));
+    writer.put(static_cast<uint32_t>(origin_id));
+    writer.put(static_cast<uint32_t>(destination_id));
+    writer.put(fixed::scale(package.getFixedLength().count(), 100));
+    writer.put(fixed::scale(package.getFixedWidth().count(), 100));
+    writer.put(fixed::scale(package.getFixedHeight().count(), 100));
+    writer.put(fixed::scale(package.getFixedWeight().count(), 1));
+    writer.put(static_cast<uint32_t>(package.getQuantity()));
+    writer.put(fixed::scale(info.getFixedFreightWeight().count(), 1));
+    writer.put(static_cast<int64_t>(info.getFixedCost().count()));
+    uint16_t end = 0;
+    for (size_t i = 0; i < ShipmentRecordView::string_slot_count; ++i)
+        writer.put(end = static_cast<uint16_t>(end + strings[i].size()));
+    for (size_t i = 0; i < ShipmentRecordView::string_slot_count; ++i)
+        out += strings[i];
+}
+
+/*!
+ * @brief   `mail::decode_shipment` is a function that rebuilds a shipment from its compact binary record.
+ * @param   record The record
+ * @param   cities The index the record was written with
+ * @return  `mail::ShipmentInfo` The shipment
+ * @throws  `std::out_of_range` If a city ID is not in the index
+ */
+ShipmentInfo decode_shipment(ShipmentRecordView const &record, CityIndex const &cities)
+{
+    typedef ShipmentRecordView View;
+    UserInfo const user(record.string_at(View::user_name), record.string_at(View::user_email),
+                        record.string_at(View::user_phone_number));
+    UserInfo const consignee(record.string_at(View::consignee_name), record.string_at(View::consignee_email),
+                             record.string_at(View::consignee_phone_number));
+    PostalAddress const origin(record.string_at(View::origin_user_type), record.string_at(View::origin_country),
+                               record.string_at(View::origin_postal_code), record.origin_city_name(cities));
+    PostalAddress const destination(record.string_at(View::destination_user_type),
+                                    record.string_at(View::destination_country),
+                                    record.string_at(View::destination_postal_code),
+                                    record.destination_city_name(cities));
+    PackageInfo const package(Millimeter((record.length() + 50) / 100), Millimeter((record.width() + 50) / 100),
+                              Millimeter((record.height() + 50) / 100), Gram(record.weight()), record.quantity());
+    ShipmentInfo info(origin, destination, package, user, consignee, string(record.freight()), 0);
+    info.setCost(Money(record.cost()));
+    return info;
+}
+
+/*!
+ * @brief   `mail::decode_legacy_shipment` is a function that rebuilds a shipment from a `"MAILLOG1"` record.
+ * @details That format wrote every string with `mail::ByteWriter::put_string`, the dimensions, the weight and the
+ *          cost as `double`, and the service type as a string. It is only read to migrate old logs.
+ * @param   begin The beginning of the payload
+ * @param   end The end of the payload
+ * @return  `mail::ShipmentInfo` The shipment
+ * @throws  `std::runtime_error` If the data is truncated or malformed
+ */
+ShipmentInfo decode_legacy_shipment(char const *begin, char const *end)
+{
+    ByteReader reader(begin, end);
+    UserInfo users[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        string const name = reader.get_string(), email = reader.get_string(), phone = reader.get_string();
+        users[i] = UserInfo(name, email, phone);
+    }
+    PostalAddress addresses[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        string const user_type = reader.get_string(), country = reader.get_string(),
+                     postal_code = reader.get_string(), location = reader.get_string();
+        addresses[i] = PostalAddress(user_type, country, postal_code, location);
+    }
+    double const length = reader.get<double>(), width = reader.get<double>(), height = reader.get<double>(),
+                 weight = reader.get<double>();
+    uint32_t const quantity = reader.get<uint32_t>();
+    string const service_type = reader.get_string();
+    double const cost = reader.get<double>();
+    if (!reader.at_end())
+        throw runtime_error("Invalid shipment record");
+    try
+    {
+        ShipmentInfo info(addresses[0], addresses[1], PackageInfo(length, width, height, weight, quantity), users[0],
+                          users[1], service_type, 0);
+        info.setCost(cost);
+        return info;
+    }
+    catch (out_of_range const &)
+    {
+        throw runtime_error("Invalid shipment record");
+    }
+}
+
+/*!
+ * @brief   `mail::LedgerEntry` is a confirmed shipment read back from the `mail::ShipmentLedger`.
+ */
+struct LedgerEntry
+{
+    uint64_t sequence;
+    /*!
+     * @brief   `mail::LedgerEntry::timestamp` is the confirmation time in seconds since the Unix epoch.
+     */
+    int64_t timestamp;
+    ShipmentInfo info;
+};
+
+/*!
+ * @brief   `mail::ShipmentLedger` is a class that stores confirmed shipments durably in an append-only log.
+ * @details The log starts with a header that holds the city table the record IDs refer to:
+ *
+ *          | Offset | Size | Field                                                  |
+ *          |--------|------|--------------------------------------------------------|
+ *          | 0      | 8    | Magic `"MAILLOG3"`                                     |
+ *          | 8      | 8    | Random generation number                               |
+ *          | 16     | 4    | Size of the city table                                 |
+ *          | 20     | 4    | CRC-32 of the city table                               |
+ *          | 24     | -    | City table: the count, then each name in ID order      |
+ *
+ *          The table is the `mail::CityIndex` given when the log was created, so the log stays readable whatever
+ *          later happens to the distance map; a city that is not in it is stored by name. The header is followed by
+ *          records:
+ *
+ *          | Offset | Size | Field                                                  |
+ *          |--------|------|--------------------------------------------------------|
+ *          | 0      | 4    | Magic `"SHIP"`                                         |
+ *          | 4      | 4    | Payload size                                           |
+ *          | 8      | 4    | CRC-32 of bytes 16 to the end of the payload           |
+ *          | 12     | 4    | Reserved, zero                                         |
+ *          | 16     | 8    | Sequence number                                        |
+ *          | 24     | 8    | Confirmation time, seconds since the Unix epoch        |
+ *          | 32     | -    | Payload, see `mail::ShipmentRecordView`                |
+ *
+ *          Appends from any number of threads are gathered by a committer thread, which writes each batch with one
+ *          `write()` and makes it durable with one `fdatasync()` (group commit). `append` returns once its record is
+ *          durable, or at once with a callback that the committer calls then, for a thread that must not wait.
+ *
+ *          Indexes by user email, by route and by day are kept in memory. At startup they are loaded from the
+ *          latest snapshot and completed by scanning, through `mmap`, only the part of the log written after it. A
+ *          torn record at the end of the log, left by a crash, is cut off; a damaged record followed by more data is
+ *          not, the log is refused instead so that no valid record is lost. A snapshot is written every `snapshot_interval` records, and
+ *          `compact` rewrites the log without the records older than a given time.
+ */
+class ShipmentLedger
+{
+  public:
+    typedef pair<string, string> RouteKey;
+    /*!
+     * @brief   `mail::ShipmentLedger::Callback` is called with an empty string once a record is durable, or with the
+     *          error that kept it from being written.
+     */
+    typedef function<void(string const &)> Callback;
+
+  private:
+    static size_t const fixed_header_size = 24;
+    static size_t const record_header_size = 32;
+    static uint32_t const record_magic = 0x50494853U; // "SHIP" in little-endian byte order
+
+    struct pending_entry
+    {
+        uint64_t offset;
+        string email;
+        RouteKey route;
+        int64_t day;
+    };
+
+    string m_path;
+    /*!
+     * @brief   `mail::ShipmentLedger::m_cities` is the city table of the log.
+     */
+    CityIndex m_cities;
+    int m_fd;
+    uint64_t m_generation;
+    size_t m_snapshot_interval;
+    mutable mutex m_mutex;
+    condition_variable m_wake;
+    condition_variable m_durable;
+    /*!
+     * @brief   `mail::ShipmentLedger::m_batch` is the records appended but not written yet.
+     */
+    string m_batch;
+    vector<pending_entry> m_batch_entries;
+    /*!
+     * @brief   `mail::ShipmentLedger::m_batch_callbacks` is the callbacks of the records of `m_batch`.
+     */
+    vector<Callback> m_batch_callbacks;
+    /*!
+     * @brief   `mail::ShipmentLedger::m_end_offset` is the offset in the log of the first byte of `m_batch`.
+     */
+    uint64_t m_end_offset;
+    uint64_t m_next_sequence;
+    uint64_t m_durable_sequence;
+    size_t m_since_snapshot;
+    bool m_committing;
+    bool m_stop;
+    string m_error;
+    multimap<string, uint64_t> m_by_user;
+    multimap<RouteKey, uint64_t> m_by_route;
+    multimap<int64_t, uint64_t> m_by_day;
+    thread m_committer;
+
+    static void write_all(int fd, char const *data, size_t size);
+    static int64_t day_of(int64_t timestamp)
+    {
+        return timestamp >= 0 ? timestamp / 86400 : (timestamp - 86399) / 86400;
+    }
+    string file_header(uint64_t generation) const;
+    pending_entry entry_of(uint64_t offset, ShipmentRecordView const &record, int64_t timestamp) const;
+    void open_log();
+    void migrate_log(string const &magic);
+    void scan_log(uint64_t from);
+    static bool is_record(char const *record, uint64_t available);
+    bool load_snapshot();
+    void write_snapshot() const;
+    void index(pending_entry const &entry);
+    /*!
+     * @brief   `mail::ShipmentLedger::enqueue` is a function that adds a record to the next batch and wakes the
+     *          committer.
+     * @param   info The confirmed shipment
+     * @param   lock The lock of `m_mutex`, not held; it is held on return
+     * @return  `uint64_t` The sequence number of the record
+     * @throws  `std::runtime_error` If the log has already failed
+     */
+    uint64_t enqueue(ShipmentInfo const &info, unique_lock<mutex> &lock);
+    void commit_loop();
+    LedgerEntry read_at(uint64_t offset) const;
+    vector<LedgerEntry> read_all(vector<uint64_t> const &offsets) const;
+
+  public:
+    /*!
+     * @brief   `mail::ShipmentLedger::ShipmentLedger` is a constructor that opens or creates the log and rebuilds the indexes.
+     * @param   path The path of the log; the snapshot is kept next to it with the `.snapshot` suffix
+     * @details A log in an older format is rewritten in the current one first, the old file being kept with the
+     *          `.bak` suffix.
+     * @param   snapshot_interval The number of records after which a new snapshot is written
+     * @param   cities The city table of a new log, and the cities a `"MAILLOG2"` log must have been written with
+     * @throws  `std::runtime_error` If the log cannot be opened or migrated, or is not a shipment log
+     */
+    explicit ShipmentLedger(string const &path, size_t snapshot_interval = 10000,
+                            CityIndex const &cities = route_to_distance.cities());
+    ShipmentLedger(ShipmentLedger const &) = delete;
+    ShipmentLedger &operator=(ShipmentLedger const &) = delete;
+    /*!
+     * @brief   `mail::ShipmentLedger::~ShipmentLedger` is a destructor that commits what is pending and closes the log.
+     */
+    ~ShipmentLedger();
+    /*!
+     * @brief   `mail::ShipmentLedger::append` is a function that records a confirmed shipment.
+     * @details It blocks until the record, and every record appended before it, is on disk.
+     * @param   info The confirmed shipment
+     * @return  `uint64_t` The sequence number of the record
+     * @throws  `std::runtime_error` If the log cannot be written
+     */
+    uint64_t append(ShipmentInfo const &info);
+    /*!
+     * @brief   `mail::ShipmentLedger::append` is a function that records a confirmed shipment without waiting.
+     * @details It returns as soon as the record is queued. `done` is called from the committer thread, without the
+     *          lock held, once the record and every record appended before it is on disk or has failed to be written.
+     *          It must not block and must not append.
+     * @param   info The confirmed shipment
+     * @param   done The function told the outcome
+     * @return  `uint64_t` The sequence number of the record
+     * @throws  `std::runtime_error` If the log has already failed; `done` is not called then
+     */
+    uint64_t append(ShipmentInfo const &info, Callback const &done);
+    /*!
+     * @brief   `mail::ShipmentLedger::size` is a function that returns the number of durable records.
+     * @return  `std::size_t` The number of records in the indexes
+     */
+    size_t size() const
+    {
+        lock_guard<mutex> const lock(m_mutex);
+        return m_by_day.size();
+    }
+    /*!
+     * @brief   `mail::ShipmentLedger::find_by_user` is a function that returns the shipments of a user.
+     * @param   email The email of the user
+     * @return  `std::vector<mail::LedgerEntry>` The shipments in log order
+     */
+    vector<LedgerEntry> find_by_user(string const &email) const;
+    /*!
+     * @brief   `mail::ShipmentLedger::find_by_route` is a function that returns the shipments on a route.
+     * @param   origin The origin city
+     * @param   destination The destination city
+     * @return  `std::vector<mail::LedgerEntry>` The shipments in log order
+     */
+    vector<LedgerEntry> find_by_route(string const &origin, string const &destination) const;
+    /*!
+     * @brief   `mail::ShipmentLedger::find_by_time` is a function that returns the shipments confirmed on some days.
+     * @param   from The first second of the range, since the Unix epoch
+     * @param   to The second after the range
+     * @return  `std::vector<mail::LedgerEntry>` The shipments confirmed on the days that overlap `[from, to)`, in log order
+     */
+    vector<LedgerEntry> find_by_time(int64_t from, int64_t to) const;
+    /*!
+     * @brief   `mail::ShipmentLedger::snapshot` is a function that writes a snapshot of the indexes now.
+     */
+    void snapshot();
+    /*!
+     * @brief   `mail::ShipmentLedger::compact` is a function that drops the records confirmed before a given time.
+     * @details The kept records are copied to a new log, which replaces the old one atomically, and a snapshot of
+     *          the new indexes is written. Appends wait while it runs.
+     * @param   keep_since The oldest confirmation time to keep, in seconds since the Unix epoch
+     * @return  `std::size_t` The number of records dropped
+     * @throws  `std::runtime_error` If the new log cannot be written
+     */
+    size_t compact(int64_t keep_since);
+};
+
+void ShipmentLedger::write_all(int fd, char const *data, size_t size)
+{
+    while (size != 0)
+    {
+        ssize_t const written = ::write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw runtime_error("Failed to write shipment ledger: " + string(strerror(errno)));
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+/*!
+ * @brief   `mail::sync_directory_of` is a function that makes a rename in the directory of a file durable.
+ * @param   path The path of the file
+ * @throws  `std::runtime_error` If the directory cannot be opened or synchronized
+ */
+void sync_directory_of(string const &path)
+{
+    string::size_type const slash = path.rfind('/');
+    string const directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int const fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw runtime_error("Failed to open directory " + directory + ": " + strerror(errno));
+    int const result = ::fsync(fd);
+    int const error = errno;
+    ::close(fd);
+    if (result != 0)
+        throw runtime_error("Failed to synchronize directory " + directory + ": " + strerror(error));
+}
+
+ShipmentLedger::ShipmentLedger(string const &path, size_t snapshot_interval, CityIndex const &cities)
+    : m_path(path)
+    , m_cities(cities)
+    , m_fd(-1)
+    , m_generation(0)
+    , m_snapshot_interval(max(snapshot_interval, size_t(1)))
+    , m_mutex()
+    , m_wake()
+    , m_durable()
+    , m_batch()
+    , m_batch_entries()
+    , m_batch_callbacks()
+    , m_end_offset(0)
+    , m_next_sequence(0)
+    , m_durable_sequence(0)
+    , m_since_snapshot(0)
+    , m_committing(false)
+    , m_stop(false)
+    , m_error()
+    , m_by_user()
+    , m_by_route()
+    , m_by_day()
+    , m_committer()
+{
+    open_log();
+    m_committer = thread(&ShipmentLedger::commit_loop, this);
+}
+
+ShipmentLedger::~ShipmentLedger()
+{
+    {
+        lock_guard<mutex> const lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    m_committer.join();
+    if (m_since_snapshot != 0)
+    {
+        try
+        {
+            write_snapshot();
+        }
+        catch (exception const &)
+        {
+            // The snapshot only speeds up the next start, the log is intact without it
+        }
+    }
+    ::close(m_fd);
+}
+
+string ShipmentLedger::file_header(uint64_t generation) const
+{
+    string table;
+    ByteWriter table_writer(table);
+    table_writer.put(static_cast<uint32_t>(m_cities.size()));
+    for (size_t i = 0; i < m_cities.size(); ++i)
+        table_writer.put_string(m_cities.names()[i]);
+    string header("MAILLOG3", 8);
+    ByteWriter writer(header);
+    writer.put(generation);
+    writer.put(static_cast<uint32_t>(table.size()));
+    writer.put(crc32(table.data(), table.size()));
+    return header + table;
+}
+
+ShipmentLedger::pending_entry ShipmentLedger::entry_of(uint64_t offset, ShipmentRecordView const &record,
+                                                       int64_t timestamp) const
+{
+    pending_entry const entry = {
+        offset, record.string_at(ShipmentRecordView::user_email),
+        RouteKey(record.origin_city_name(m_cities), record.destination_city_name(m_cities)), day_of(timestamp)};
+    return entry;
+}
+
+void ShipmentLedger::open_log()
+{
+    m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw runtime_error("Failed to open shipment ledger " + m_path + ": " + strerror(errno));
+    struct stat status;
+    if (::fstat(m_fd, &status) != 0)
+        throw runtime_error("Failed to open shipment ledger " + m_path + ": " + strerror(errno));
+    if (status.st_size == 0)
+    {
+        random_device random;
+        m_generation = (static_cast<uint64_t>(random()) << 32) | random();
+        string const header = file_header(m_generation);
+        write_all(m_fd, header.data(), header.size());
+        ::fdatasync(m_fd);
+        m_end_offset = header.size();
+        return;
+    }
+    char header[fixed_header_size];
+    if (::pread(m_fd, header, 8, 0) == 8 && (memcmp(header, "MAILLOG1", 8) == 0 || memcmp(header, "MAILLOG2", 8) == 0))
+    {
+        migrate_log(string(header, 8));
+        ::close(m_fd);
+        m_fd = -1;
+        open_log();
+        return;
+    }
+    if (::pread(m_fd, header, sizeof header, 0) != static_cast<ssize_t>(sizeof header) ||
+        memcmp(header, "MAILLOG3", 8) != 0)
+        throw runtime_error("Not a shipment ledger: " + m_path);
+    uint32_t table_size, checksum;
+    memcpy(&m_generation, header + 8, sizeof m_generation);
+    memcpy(&table_size, header + 16, 4);
+    memcpy(&checksum, header + 20, 4);
+    string table(table_size, '\0');
+    if (::pread(m_fd, &table[0], table_size, fixed_header_size) != static_cast<ssize_t>(table_size) ||
+        crc32(table.data(), table.size()) != checksum)
+        throw runtime_error("Shipment ledger " + m_path + " has a damaged city table");
+    ByteReader reader(table.data(), table.data() + table.size());
+    vector<string> names(reader.get<uint32_t>());
+    for (size_t i = 0; i < names.size(); ++i)
+        names[i] = reader.get_string();
+    m_cities = CityIndex(names);
+    if (m_cities.names() != names || !reader.at_end())
+        throw runtime_error("Shipment ledger " + m_path + " has a damaged city table");
+    m_end_offset = fixed_header_size + table_size;
+    uint64_t scan_from = m_end_offset;
+    if (load_snapshot())
+        scan_from = m_end_offset;
+    scan_log(scan_from);
+}
+
+void ShipmentLedger::migrate_log(string const &magic)
+{
+    bool const legacy = magic == "MAILLOG1";
+    size_t const header_size = legacy ? 16 : 24;
+    struct stat status;
+    if (::fstat(m_fd, &status) != 0)
+        throw runtime_error("Failed to migrate shipment ledger " + m_path + ": " + strerror(errno));
+    string old(static_cast<size_t>(status.st_size), '\0');
+    if (old.size() < header_size || ::pread(m_fd, &old[0], old.size(), 0) != static_cast<ssize_t>(old.size()))
+        throw runtime_error("Failed to migrate shipment ledger " + m_path);
+    uint64_t fingerprint = 0;
+    if (!legacy)
+        memcpy(&fingerprint, old.data() + 16, sizeof fingerprint);
+    // A MAILLOG2 log stores city IDs but not the table they index, only its fingerprint
+    if (!legacy && fingerprint != m_cities.fingerprint())
+        throw runtime_error("Shipment ledger " + m_path +
+                            " is in the MAILLOG2 format and was written with another city list; open it once with "
+                            "the distance map it was written with to migrate it");
+
+    random_device random;
+    uint64_t const generation = (static_cast<uint64_t>(random()) << 32) | random();
+    string content = file_header(generation);
+    size_t offset = header_size;
+    while (old.size() - offset >= record_header_size)
+    {
+        char const *const record = old.data() + offset;
+        uint32_t magic_word, payload_size, checksum;
+        memcpy(&magic_word, record, 4);
+        memcpy(&payload_size, record + 4, 4);
+        memcpy(&checksum, record + 8, 4);
+        if (magic_word != record_magic || old.size() - offset - record_header_size < payload_size ||
+            crc32(record + 16, 16 + payload_size) != checksum)
+            break;
+        char const *const payload = record + record_header_size;
+        string converted(record, record_header_size);
+        if (legacy)
+            encode_shipment(converted, decode_legacy_shipment(payload, payload + payload_size), m_cities);
+        else
+            converted.append(payload, payload_size);
+        uint32_t const size = static_cast<uint32_t>(converted.size() - record_header_size);
+        memcpy(&converted[4], &size, 4);
+        uint32_t const converted_checksum = crc32(converted.data() + 16, converted.size() - 16);
+        memcpy(&converted[8], &converted_checksum, 4);
+        content += converted;
+        offset += record_header_size + payload_size;
+    }
+
+    string const temporary = m_path + ".migrate";
+    int const fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw runtime_error("Failed to migrate shipment ledger " + m_path + ": " + strerror(errno));
+    try
+    {
+        write_all(fd, content.data(), content.size());
+        if (::fdatasync(fd) != 0)
+            throw runtime_error("Failed to migrate shipment ledger " + m_path + ": " + strerror(errno));
+    }
+    catch (...)
+    {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    ::close(fd);
+    string const backup = m_path + ".bak";
+    ::unlink(backup.c_str());
+    if (::link(m_path.c_str(), backup.c_str()) != 0 || ::rename(temporary.c_str(), m_path.c_str()) != 0)
+    {
+        string const error = strerror(errno);
+        ::unlink(temporary.c_str());
+        throw runtime_error("Failed to migrate shipment ledger " + m_path + ": " + error);
+    }
+    ::unlink((m_path + ".snapshot").c_str());
+    sync_directory_of(m_path);
+}
+
+void ShipmentLedger::scan_log(uint64_t from)
+{
+    struct stat status;
+    ::fstat(m_fd, &status);
+    uint64_t const file_size = static_cast<uint64_t>(status.st_size);
+    m_end_offset = from;
+    if (file_size > from)
+    {
+        void *const mapping = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (mapping == MAP_FAILED)
+            throw runtime_error("Failed to map shipment ledger " + m_path + ": " + strerror(errno));
+        ::madvise(mapping, file_size, MADV_SEQUENTIAL);
+        char const *const base = static_cast<char const *>(mapping);
+        uint64_t offset = from;
+        while (offset != file_size && is_record(base + offset, file_size - offset))
+        {
+            char const *const record = base + offset;
+            uint32_t payload_size;
+            uint64_t sequence;
+            int64_t timestamp;
+            memcpy(&payload_size, record + 4, 4);
+            memcpy(&sequence, record + 16, 8);
+            memcpy(&timestamp, record + 24, 8);
+            index(entry_of(offset, ShipmentRecordView(record + record_header_size, payload_size), timestamp));
+            m_next_sequence = max(m_next_sequence, sequence + 1);
+            offset += record_header_size + payload_size;
+            ++m_since_snapshot;
+        }
+        // A crash can only tear the last record: it is cut short, or its space was allocated but never written.
+        // Anything else is damage inside the log, which is left alone rather than cut away with what follows it.
+        bool torn = true;
+        if (offset != file_size)
+        {
+            uint32_t payload_size = 0;
+            if (file_size - offset >= 8)
+                memcpy(&payload_size, base + offset + 4, 4);
+            bool const cut_short = file_size - offset < record_header_size + static_cast<uint64_t>(payload_size);
+            torn = cut_short || all_of(base + offset, base + file_size, [](char c) { return c == '\0'; });
+            for (uint64_t next = offset + 1; torn && file_size - next >= record_header_size; ++next)
+                torn = !is_record(base + next, file_size - next);
+        }
+        ::munmap(mapping, file_size);
+        if (!torn)
+            throw runtime_error("Shipment ledger " + m_path + " is damaged at offset " + to_string(offset));
+        m_end_offset = offset;
+    }
+    m_durable_sequence = m_next_sequence;
+    if (m_end_offset != file_size && ::ftruncate(m_fd, static_cast<off_t>(m_end_offset)) != 0)
+        throw runtime_error("Failed to repair shipment ledger " + m_path + ": " + strerror(errno));
+    ::lseek(m_fd, static_cast<off_t>(m_end_offset), SEEK_SET);
+}
+
+bool ShipmentLedger::is_record(char const *record, uint64_t available)
+{
+    if (available < record_header_size)
+        return false;
+    uint32_t magic, payload_size, checksum;
+    memcpy(&magic, record, 4);
+    memcpy(&payload_size, record + 4, 4);
+    memcpy(&checksum, record + 8, 4);
+    return magic == record_magic && available - record_header_size >= payload_size &&
+           crc32(record + 16, 16 + payload_size) == checksum;
+}
+
+void ShipmentLedger::index(pending_entry const &entry)
+{
+    m_by_user.insert(make_pair(entry.email, entry.offset));
+    m_by_route.insert(make_pair(entry.route, entry.offset));
+    m_by_day.insert(make_pair(entry.day, entry.offset));
+}
+
+bool ShipmentLedger::load_snapshot()
+{
+    ifstream stream(m_path + ".snapshot", ios::binary);
+    if (!stream)
+        return false;
+    string const content((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    if (content.size() < 12 || content.compare(0, 8, "MAILSNP1") != 0)
+        return false;
+    uint32_t checksum;
+    memcpy(&checksum, content.data() + 8, 4);
+    if (crc32(content.data() + 12, content.size() - 12) != checksum)
+        return false;
+    try
+    {
+        ByteReader reader(content.data() + 12, content.data() + content.size());
+        if (reader.get<uint64_t>() != m_generation)
+            return false;
+        uint64_t const covered = reader.get<uint64_t>();
+        uint64_t const next_sequence = reader.get<uint64_t>();
+        struct stat status;
+        if (::fstat(m_fd, &status) != 0 || static_cast<uint64_t>(status.st_size) < covered)
+            return false;
+        multimap<string, uint64_t> by_user;
+        multimap<RouteKey, uint64_t> by_route;
+        multimap<int64_t, uint64_t> by_day;
+        for (uint64_t n = reader.get<uint64_t>(); n != 0; --n)
+        {
+            string const email = reader.get_string();
+            by_user.insert(by_user.end(), make_pair(email, reader.get<uint64_t>()));
+        }
+        for (uint64_t n = reader.get<uint64_t>(); n != 0; --n)
+        {
+            string const origin = reader.get_string(), destination = reader.get_string();
+            by_route.insert(by_route.end(), make_pair(RouteKey(origin, destination), reader.get<uint64_t>()));
+        }
+        for (uint64_t n = reader.get<uint64_t>(); n != 0; --n)
+        {
+            int64_t const day = reader.get<int64_t>();
+            by_day.insert(by_day.end(), make_pair(day, reader.get<uint64_t>()));
+        }
+        m_by_user.swap(by_user);
+        m_by_route.swap(by_route);
+        m_by_day.swap(by_day);
+        m_end_offset = covered;
+        m_next_sequence = next_sequence;
+        return true;
+    }
+    catch (runtime_error const &)
+    {
+        return false;
+    }
+}
+
+void ShipmentLedger::write_snapshot() const
+{
+    string body;
+    ByteWriter writer(body);
+    {
+        lock_guard<mutex> const lock(m_mutex);
+        writer.put(m_generation);
+        writer.put(m_end_offset);
+        writer.put(m_durable_sequence);
+        writer.put(static_cast<uint64_t>(m_by_user.size()));
+        for (multimap<string, uint64_t>::const_iterator it = m_by_user.begin(); it != m_by_user.end(); ++it)
+        {
+            writer.put_string(it->first);
+            writer.put(it->second);
+        }
+        writer.put(static_cast<uint64_t>(m_by_route.size()));
+        for (multimap<RouteKey, uint64_t>::const_iterator it = m_by_route.begin(); it != m_by_route.end(); ++it)
+        {
+            writer.put_string(it->first.first);
+            writer.put_string(it->first.second);
+            writer.put(it->second);
+        }
+        writer.put(static_cast<uint64_t>(m_by_day.size()));
+        for (multimap<int64_t, uint64_t>::const_iterator it = m_by_day.begin(); it != m_by_day.end(); ++it)
+        {
+            writer.put(it->first);
+            writer.put(it->second);
+        }
+    }
+    string content("MAILSNP1", 8);
+    ByteWriter(content).put(crc32(body.data(), body.size()));
+    content += body;
+    string const temporary = m_path + ".snapshot.tmp";
+    int const fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw runtime_error("Failed to write ledger snapshot: " + string(strerror(errno)));
+    try
+    {
+        write_all(fd, content.data(), content.size());
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+    ::fdatasync(fd);
+    ::close(fd);
+    if (::rename(temporary.c_str(), (m_path + ".snapshot").c_str()) != 0)
+        throw runtime_error("Failed to write ledger snapshot: " + string(strerror(errno)));
+    sync_directory_of(m_path);
+}
+
+void ShipmentLedger::commit_loop()
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (true)
+    {
+        m_wake.wait(lock, [this]() { return m_stop || !m_batch.empty(); });
+        if (m_batch.empty())
+            return;
+        string batch;
+        batch.swap(m_batch);
+        vector<pending_entry> entries;
+        entries.swap(m_batch_entries);
+        vector<Callback> callbacks;
+        callbacks.swap(m_batch_callbacks);
+        uint64_t const last_sequence = m_next_sequence;
+        m_committing = true;
+        lock.unlock();
+        string error;
+        try
+        {
+            write_all(m_fd, batch.data(), batch.size());
+            if (::fdatasync(m_fd) != 0)
+                throw runtime_error("Failed to sync shipment ledger: " + string(strerror(errno)));
+        }
+        catch (runtime_error const &e)
+        {
+            error = e.what();
+        }
+        lock.lock();
+        m_committing = false;
+        if (!error.empty())
+            m_error = error;
+        else
+        {
+            for (size_t i = 0; i < entries.size(); ++i)
+                index(entries[i]);
+            m_end_offset += batch.size();
+            m_durable_sequence = last_sequence;
+            m_since_snapshot += entries.size();
+        }
+        m_durable.notify_all();
+        if (!callbacks.empty())
+        {
+            lock.unlock();
+            for (size_t i = 0; i < callbacks.size(); ++i)
+                callbacks[i](error);
+            lock.lock();
+        }
+        if (error.empty() && m_since_snapshot >= m_snapshot_interval)
+        {
+            m_since_snapshot = 0;
+            lock.unlock();
+            try
+            {
+                write_snapshot();
+            }
+            catch (runtime_error const &)
+            {
+                // Retried at the next interval, the log itself is durable
+            }
+            lock.lock();
+        }
+    }
+}
+
+uint64_t ShipmentLedger::append(ShipmentInfo const &info)
+{
+    unique_lock<mutex> lock(m_mutex, defer_lock);
+    uint64_t const sequence = enqueue(info, lock);
+    m_durable.wait(lock, [this, sequence]() { return m_durable_sequence > sequence || !m_error.empty(); });
+    if (m_durable_sequence <= sequence)
+        throw runtime_error(m_error);
+    return sequence;
+}
+
+uint64_t ShipmentLedger::append(ShipmentInfo const &info, Callback const &done)
+{
+    unique_lock<mutex> lock(m_mutex, defer_lock);
+    uint64_t const sequence = enqueue(info, lock);
+    m_batch_callbacks.push_back(done);
+    return sequence;
+}
+
+uint64_t ShipmentLedger::enqueue(ShipmentInfo const &info, unique_lock<mutex> &lock)
+{
+    string payload;
+    encode_shipment(payload, info, m_cities);
+    int64_t const timestamp = static_cast<int64_t>(::time(nullptr));
+
+    lock.lock();
+    if (!m_error.empty())
+        throw runtime_error(m_error);
+    uint64_t const sequence = m_next_sequence++;
+    string record;
+    record.reserve(record_header_size + payload.size());
+    ByteWriter writer(record);
+    writer.put(record_magic);
+    writer.put(static_cast<uint32_t>(payload.size()));
+    writer.put(uint32_t(0));
+    writer.put(uint32_t(0));
+    writer.put(sequence);
+    writer.put(timestamp);
+    record += payload;
+    uint32_t const checksum = crc32(record.data() + 16, record.size() - 16);
+    memcpy(&record[8], &checksum, sizeof checksum);
+    m_batch_entries.push_back(
+        entry_of(m_end_offset + m_batch.size(), ShipmentRecordView(payload.data(), payload.size()), timestamp));
+    m_batch += record;
+    m_wake.notify_one();
+    return sequence;
+}
+
+LedgerEntry ShipmentLedger::read_at(uint64_t offset) const
+{
+    char header[record_header_size];
+    if (::pread(m_fd, header, sizeof header, static_cast<off_t>(offset)) != static_cast<ssize_t>(sizeof header))
+        throw runtime_error("Failed to read shipment ledger: " + string(strerror(errno)));
+    uint32_t payload_size;
+    memcpy(&payload_size, header + 4, 4);
+    string payload(payload_size, '\0');
+    if (::pread(m_fd, &payload[0], payload_size, static_cast<off_t>(offset + record_header_size)) !=
+        static_cast<ssize_t>(payload_size))
+        throw runtime_error("Failed to read shipment ledger: " + string(strerror(errno)));
+    uint64_t sequence;
+    int64_t timestamp;
+    memcpy(&sequence, header + 16, 8);
+    memcpy(&timestamp, header + 24, 8);
+    LedgerEntry const entry = {sequence, timestamp,
+                               decode_shipment(ShipmentRecordView(payload.data(), payload.size()), m_cities)};
+    return entry;
+}
+
+vector<LedgerEntry> ShipmentLedger::read_all(vector<uint64_t> const &offsets) const
+{
+    vector<LedgerEntry> entries;
+    entries.reserve(offsets.size());
+    for (size_t i = 0; i < offsets.size(); ++i)
+        entries.push_back(read_at(offsets[i]));
+    return entries;
+}
+
+vector<LedgerEntry> ShipmentLedger::find_by_user(string const &email) const
+{
+    vector<uint64_t> offsets;
+    lock_guard<mutex> const lock(m_mutex);
+    typedef multimap<string, uint64_t>::const_iterator Iterator;
+    pair<Iterator, Iterator> const range = m_by_user.equal_range(email);
+    for (Iterator it = range.first; it != range.second; ++it)
+        offsets.push_back(it->second);
+    sort(offsets.begin(), offsets.end());
+    return read_all(offsets);
+}
+
+vector<LedgerEntry> ShipmentLedger::find_by_route(string const &origin, string const &destination) const
+{
+    vector<uint64_t> offsets;
+    lock_guard<mutex> const lock(m_mutex);
+    typedef multimap<RouteKey, uint64_t>::const_iterator Iterator;
+    pair<Iterator, Iterator> const range = m_by_route.equal_range(RouteKey(origin, destination));
+    for (Iterator it = range.first; it != range.second; ++it)
+        offsets.push_back(it->second);
+    sort(offsets.begin(), offsets.end());
+    return read_all(offsets);
+}
+
+vector<LedgerEntry> ShipmentLedger::find_by_time(int64_t from, int64_t to) const
+{
+    vector<uint64_t> offsets;
+    lock_guard<mutex> const lock(m_mutex);
+    typedef multimap<int64_t, uint64_t>::const_iterator Iterator;
+    Iterator const last = m_by_day.upper_bound(day_of(to - 1));
+    for (Iterator it = m_by_day.lower_bound(day_of(from)); it != last; ++it)
+        offsets.push_back(it->second);
+    sort(offsets.begin(), offsets.end());
+    return read_all(offsets);
+}
+
+void ShipmentLedger::snapshot()
+{
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_durable.wait(lock, [this]() { return (m_batch.empty() && !m_committing) || !m_error.empty(); });
+        m_since_snapshot = 0;
+    }
+    write_snapshot();
+}
+
+size_t ShipmentLedger::compact(int64_t keep_since)
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_durable.wait(lock, [this]() { return (m_batch.empty() && !m_committing) || !m_error.empty(); });
+    if (!m_error.empty())
+        throw runtime_error(m_error);
+    // Holding the lock keeps the committer and the appenders out until the new log is in place
+    vector<uint64_t> kept;
+    typedef multimap<int64_t, uint64_t>::const_iterator Iterator;
+    for (Iterator it = m_by_day.lower_bound(day_of(keep_since)); it != m_by_day.end(); ++it)
+        kept.push_back(it->second);
+    sort(kept.begin(), kept.end());
+
+    string const temporary = m_path + ".compact";
+    int const fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw runtime_error("Failed to compact shipment ledger: " + string(strerror(errno)));
+    string content = file_header(m_generation + 1);
+    multimap<string, uint64_t> by_user;
+    multimap<RouteKey, uint64_t> by_route;
+    multimap<int64_t, uint64_t> by_day;
+    size_t dropped = m_by_day.size() - kept.size();
+    try
+    {
+        for (size_t i = 0; i < kept.size(); ++i)
+        {
+            char header[record_header_size];
+            if (::pread(m_fd, header, sizeof header, static_cast<off_t>(kept[i])) != static_cast<ssize_t>(sizeof header))
+                throw runtime_error("Failed to compact shipment ledger: " + string(strerror(errno)));
+            uint32_t payload_size;
+            int64_t timestamp;
+            memcpy(&payload_size, header + 4, 4);
+            memcpy(&timestamp, header + 24, 8);
+            string record(header, sizeof header);
+            record.resize(sizeof header + payload_size);
+            if (::pread(m_fd, &record[sizeof header], payload_size, static_cast<off_t>(kept[i] + sizeof header)) !=
+                static_cast<ssize_t>(payload_size))
+                throw runtime_error("Failed to compact shipment ledger: " + string(strerror(errno)));
+            pending_entry const entry =
+                entry_of(content.size(), ShipmentRecordView(record.data() + sizeof header, payload_size), timestamp);
+            by_user.insert(make_pair(entry.email, entry.offset));
+            by_route.insert(make_pair(entry.route, entry.offset));
+            by_day.insert(make_pair(entry.day, entry.offset));
+            content += record;
+        }
+        write_all(fd, content.data(), content.size());
+        if (::fdatasync(fd) != 0 || ::rename(temporary.c_str(), m_path.c_str()) != 0)
+            throw runtime_error("Failed to compact shipment ledger: " + string(strerror(errno)));
+    }
+    catch (...)
+    {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    ::close(m_fd);
+    m_fd = fd;
+    ::lseek(m_fd, 0, SEEK_END);
+    ++m_generation;
+    m_end_offset = content.size();
+    m_by_user.swap(by_user);
+    m_by_route.swap(by_route);
+    m_by_day.swap(by_day);
+    m_since_snapshot = 0;
+    lock.unlock();
+    sync_directory_of(m_path);
+    write_snapshot();
+    return dropped;
+}
+
+/*!
+ * @brief   `mail::ShipmentPreset` is a standard package size offered by `mail::ShipmentMode`.
+ */
+struct ShipmentPreset
+{
+    string name;
+    Centimeter length;
+    Centimeter width;
+    Centimeter height;
+};
+
+/*!
+ * @brief   `mail::shipment_presets` is the list of the presets the quote grid is computed for.
+ * @details The pallet is quoted at the full load height of the standard pallet, see `mail::standard_bins`.
+ */
+ShipmentPreset const shipment_presets[] = {
+    {"document", 32, 24, 1},
+    {"moving box", 75, 35, 35},
+    {"pallet", 110, 110, 160},
+};
+/*!
+ * @brief   `mail::shipment_preset_count` is the number of entries in `mail::shipment_presets`.
+ */
+size_t const shipment_preset_count = sizeof shipment_presets / sizeof shipment_presets[0];
+
+/*!
+ * @brief   `mail::QuoteGrid` is a class that holds the price of every preset on every lane in every freight.
+ * @details A preset package weighing no more than its volumetric weight is charged for its volumetric weight, so its
+ *          price only depends on the lane, the preset and the freight. All of them are computed once into a dense
+ *          table and a preset quote is a single array read. The grid carries a fingerprint of the distances, the
+ *          rates and the presets it was computed from; a saved grid whose fingerprint differs from the current data
+ *          is stale and `open` computes it again.
+ *
+ *          The file format is the 8-byte magic `"MAILGRD1"`, the fingerprint (`uint64_t`), the numbers of cities,
+ *          presets and freights and a reserved word (`uint32_t` each), then the prices in cents (`int64_t`, `-1`
+ *          where there is no lane) in the order of `find`'s arguments, all in host byte order.
+ */
+class QuoteGrid
+{
+  public:
+    typedef CityIndex::IdType IdType;
+    /*!
+     * @brief   `mail::QuoteGrid::npos` is the preset returned by `preset_of` for a package the grid does not cover.
+     */
+    static size_t const npos = ~size_t(0);
+
+  private:
+    uint64_t m_fingerprint;
+    size_t m_city_count;
+    /*!
+     * @brief   `mail::QuoteGrid::m_cells` is the price in cents of each origin, destination, preset and freight.
+     */
+    vector<int64_t> m_cells;
+
+    QuoteGrid(uint64_t fingerprint, size_t city_count, vector<int64_t> const &cells)
+        : m_fingerprint(fingerprint)
+        , m_city_count(city_count)
+        , m_cells(cells)
+    {}
+    size_t index_of(IdType origin, IdType destination, size_t preset, size_t freight) const
+    {
+        return ((static_cast<size_t>(origin) * m_city_count + destination) * shipment_preset_count + preset) *
+                   freight_count +
+               freight;
+    }
+
+  public:
+    /*!
+     * @brief   `mail::QuoteGrid::QuoteGrid` is a constructor that computes the grid.
+     * @param   router The distances and cities to compute the grid for
+     */
+    explicit QuoteGrid(RouteToDistance const &router = route_to_distance);
+    /*!
+     * @brief   `mail::QuoteGrid::data_fingerprint` is a function that returns the fingerprint of the current data.
+     * @param   router The distances and cities
+     * @return  `uint64_t` A hash of the distances, of what every freight charges and of the preset sizes
+     */
+    static uint64_t data_fingerprint(RouteToDistance const &router = route_to_distance);
+    /*!
+     * @brief   `mail::QuoteGrid::load` is a function that reads a grid saved by `save`.
+     * @param   path The path of the file
+     * @param   router The distances and cities the grid must have been computed for
+     * @return  `mail::QuoteGrid` The grid
+     * @throws  `std::runtime_error` If the file cannot be read, is not a quote grid or is stale
+     */
+    static QuoteGrid load(string const &path, RouteToDistance const &router = route_to_distance);
+    /*!
+     * @brief   `mail::QuoteGrid::open` is a function that loads a grid, or computes and saves it if it is missing or stale.
+     * @details Failing to save the grid is not an error; it is computed again the next time.
+     * @param   path The path of the file
+     * @param   router The distances and cities
+     * @return  `mail::QuoteGrid` The up-to-date grid
+     */
+    static QuoteGrid open(string const &path, RouteToDistance const &router = route_to_distance);
+    /*!
+     * @brief   `mail::QuoteGrid::save` is a function that writes the grid to a file.
+     * @param   path The path of the file, replaced atomically
+     * @throws  `std::runtime_error` If the file cannot be written
+     */
+    void save(string const &path) const;
+    /*!
+     * @brief   `mail::QuoteGrid::fingerprint` is a function that returns the fingerprint of the data of the grid.
+     * @return  `uint64_t` See `data_fingerprint`
+     */
+    uint64_t fingerprint() const
+    {
+        return m_fingerprint;
+    }
+    /*!
+     * @brief   `mail::QuoteGrid::preset_of` is a function that finds the preset a package is quoted as.
+     * @param   package The package
+     * @param   freight The index of the freight in `mail::freights`
+     * @return  `std::size_t` The index of the preset in `mail::shipment_presets`, or `npos` unless the package is a
+     *          single preset package no heavier than its volumetric weight
+     */
+    static size_t preset_of(PackageInfo const &package, size_t freight);
+    /*!
+     * @brief   `mail::QuoteGrid::find` is a function that looks a preset quote up.
+     * @param   origin The ID of the origin in the cities of the router
+     * @param   destination The ID of the destination in the cities of the router
+     * @param   preset The index of the preset in `mail::shipment_presets`
+     * @param   freight The index of the freight in `mail::freights`
+     * @param   cost Set to the price if there is one
+     * @return  `bool` `true` if the lane exists, `false` otherwise
+     * @throws  `std::out_of_range` If an index is out of range
+     */
+    bool find(IdType origin, IdType destination, size_t preset, size_t freight, Money &cost) const
+    {
+        if (origin >= m_city_count || destination >= m_city_count || preset >= shipment_preset_count ||
+            freight >= freight_count)
+            throw out_of_range("Quote grid index out of range");
+        int64_t const cents = m_cells[index_of(origin, destination, preset, freight)];
+        if (cents < 0)
+            return false;
+        cost = Money(cents);
+        return true;
+    }
+};
+
+size_t const QuoteGrid::npos;
+
+QuoteGrid::QuoteGrid(RouteToDistance const &router)
+    : m_fingerprint(data_fingerprint(router))
+    , m_city_count(router.cities().size())
+    , m_cells(m_city_count * m_city_count * shipment_preset_count * freight_count, -1)
+{
+    for (IdType origin = 0; origin < m_city_count; ++origin)
+        for (IdType destination = 0; destination < m_city_count; ++destination)
+        {
+            RouteToDistance::LookupResult const lane = router.lookup(origin, destination);
+            if (!lane)
+                continue;
+            for (size_t p = 0; p < shipment_preset_count; ++p)
+                for (size_t f = 0; f < freight_count; ++f)
+                {
+                    ShipmentPreset const &preset = shipment_presets[p];
+                    Gram const volumetric = freights[f]->volumetric_grams(
+                        preset.length.millimeters(), preset.width.millimeters(), preset.height.millimeters(), 1);
+                    m_cells[index_of(origin, destination, p, f)] = freights[f]->cost(volumetric, lane.distance).count();
+                }
+        }
+}
+
+uint64_t QuoteGrid::data_fingerprint(RouteToDistance const &router)
+{
+    vector<int64_t> data(1, router.fingerprint());
+    for (size_t f = 0; f < freight_count; ++f)
+    {
+        data.push_back(freights[f]->base_fee().count());
+        data.push_back(freights[f]->rate().count());
+        data.push_back(freights[f]->volumetric_divisor());
+    }
+    for (size_t p = 0; p < shipment_preset_count; ++p)
+    {
+        data.push_back(shipment_presets[p].length.millimeters().count());
+        data.push_back(shipment_presets[p].width.millimeters().count());
+        data.push_back(shipment_presets[p].height.millimeters().count());
+    }
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < data.size(); ++i)
+        for (int byte = 0; byte < 8; ++byte)
+            hash = (hash ^ ((static_cast<uint64_t>(data[i]) >> (8 * byte)) & 0xFFU)) * 0x100000001B3ULL;
+    return hash;
+}
+
+QuoteGrid QuoteGrid::load(string const &path, RouteToDistance const &router)
+{
+    ifstream stream(path, ios::binary);
+    if (!stream)
+        throw runtime_error("Failed to open quote grid " + path);
+    string const content((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    if (content.size() < 32 || content.compare(0, 8, "MAILGRD1") != 0)
+        throw runtime_error("Not a quote grid: " + path);
+    ByteReader reader(content.data() + 8, content.data() + content.size());
+    uint64_t const fingerprint = reader.get<uint64_t>();
+    size_t const city_count = reader.get<uint32_t>();
+    size_t const preset_count = reader.get<uint32_t>(), freights_count = reader.get<uint32_t>();
+    reader.get<uint32_t>();
+    if (fingerprint != data_fingerprint(router) || city_count != router.cities().size() ||
+        preset_count != shipment_preset_count || freights_count != freight_count)
+        throw runtime_error("Stale quote grid: " + path);
+    vector<int64_t> cells(city_count * city_count * preset_count * freights_count);
+    for (size_t i = 0; i < cells.size(); ++i)
+        cells[i] = reader.get<int64_t>();
+    if (!reader.at_end())
+        throw runtime_error("Not a quote grid: " + path);
+    return QuoteGrid(fingerprint, city_count, cells);
+}
+
+QuoteGrid QuoteGrid::open(string const &path, RouteToDistance const &router)
+{
+    try
+    {
+        return load(path, router);
+    }
+    catch (runtime_error const &)
+    {
+        QuoteGrid const grid(router);
+        try
+        {
+            grid.save(path);
+        }
+        catch (runtime_error const &)
+        {
+        }
+        return grid;
+    }
+}
+
+void QuoteGrid::save(string const &path) const
+{
+    string content("MAILGRD1", 8);
+    content.reserve(32 + m_cells.size() * sizeof(int64_t));
+    ByteWriter writer(content);
+    writer.put(m_fingerprint);
+    writer.put(static_cast<uint32_t>(m_city_count));
+    writer.put(static_cast<uint32_t>(shipment_preset_count));
+    writer.put(static_cast<uint32_t>(freight_count));
+    writer.put(uint32_t(0));
+    for (size_t i = 0; i < m_cells.size(); ++i)
+        writer.put(m_cells[i]);
+    string const temporary = path + ".tmp";
+    {
+        ofstream stream(temporary, ios::binary | ios::trunc);
+        if (!stream.write(content.data(), static_cast<streamsize>(content.size())) || !stream.flush())
+            throw runtime_error("Failed to write quote grid " + temporary);
+    }
+    if (::rename(temporary.c_str(), path.c_str()) != 0)
+        throw runtime_error("Failed to write quote grid " + path + ": " + strerror(errno));
+}
+
+size_t QuoteGrid::preset_of(PackageInfo const &package, size_t freight)
+{
+    if (package.getQuantity() != 1 || freight >= freight_count)
+        return npos;
+    for (size_t p = 0; p < shipment_preset_count; ++p)
+    {
+        ShipmentPreset const &preset = shipment_presets[p];
+        if (package.getFixedLength() == preset.length.millimeters() &&
+            package.getFixedWidth() == preset.width.millimeters() &&
+            package.getFixedHeight() == preset.height.millimeters())
+        {
+            Gram const volumetric = freights[freight]->volumetric_grams(
+                package.getFixedLength(), package.getFixedWidth(), package.getFixedHeight(), 1);
+            return package.getFixedWeight() <= volumetric ? p : npos;
+        }
+    }
+    return npos;
+}
+
+/*!
+ * @brief   `mail::FreightRates` is what a freight charges, in the integer units of `mail::Freight::cost`.
+ */
+struct FreightRates
+{
+    /*!
+     * @brief   `mail::FreightRates::fee` is the fee per leg in cents.
+     */
+    int64_t fee;
+    /*!
+     * @brief   `mail::FreightRates::rate` is the price in cents per tonne of chargeable weight and per kilometer.
+     */
+    int64_t rate;
+    /*!
+     * @brief   `mail::FreightRates::divisor` is the volumetric divisor, in cubic centimeters per kilogram.
+     */
+    int64_t divisor;
+};
+
+/*!
+ * @brief   `mail::PricingSnapshot` is an immutable version of the distances and of the freight rates.
+ * @details The distance table is split into one row per origin city, held by `std::shared_ptr`. A version derived
+ *          with `with_lane` copies only the row it changes and shares the others, and one derived with `with_rates`
+ *          shares every row, so many versions of a table cost little more than one. Snapshots are values: copying
+ *          one copies pointers, and no snapshot ever changes after it is made, so any number of threads may read
+ *          them. The cities are those of the router the first version was made from.
+ */
+class PricingSnapshot
+{
+  public:
+    typedef RouteToDistance::DistanceType DistanceType;
+    typedef array<FreightRates, freight_count> RateTable;
+    /*!
+     * @brief   `mail::PricingSnapshot::LaneChange` is a new distance for a lane, `no_lane` to remove it.
+     */
+    struct LaneChange
+    {
+        CityIndex::IdType from;
+        CityIndex::IdType to;
+        DistanceType distance;
+    };
+
+  private:
+    typedef vector<DistanceType> Row;
+
+    uint64_t m_version;
+    uint64_t m_parent;
+    string m_label;
+    vector<shared_ptr<Row const> > m_rows;
+    shared_ptr<RateTable const> m_rates;
+
+    static uint64_t next_version()
+    {
+        static atomic<uint64_t> version(0);
+        return ++version;
+    }
+    PricingSnapshot(PricingSnapshot const &parent, string const &label)
+        : m_version(next_version())
+        , m_parent(parent.m_version)
+        , m_label(label)
+        , m_rows(parent.m_rows)
+        , m_rates(parent.m_rates)
+    {}
+
+  public:
+    /*!
+     * @brief   `mail::PricingSnapshot::PricingSnapshot` is a constructor that takes the first version from the
+     *          current data.
+     * @param   router The distances
+     * @param   label The name of the version
+     */
+    explicit PricingSnapshot(RouteToDistance const &router = route_to_distance, string const &label = "current");
+    PricingSnapshot(PricingSnapshot const &) = default;
+    PricingSnapshot &operator=(PricingSnapshot const &) = default;
+    /*!
+     * @brief   `mail::PricingSnapshot::version` is a function that returns the number of the version.
+     * @return  `uint64_t` A number unique to this version in the process
+     */
+    uint64_t version() const
+    {
+        return m_version;
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::parent` is a function that returns the version this one was derived from.
+     * @return  `uint64_t` The number of the parent version, 0 for a first version
+     */
+    uint64_t parent() const
+    {
+        return m_parent;
+    }
+    string const &label() const
+    {
+        return m_label;
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::city_count` is a function that returns the number of cities.
+     * @return  `std::size_t` The number of cities, whose IDs index the distances
+     */
+    size_t city_count() const
+    {
+        return m_rows.size();
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::distance` is a function that returns the distance of a lane.
+     * @param   from The ID of the origin
+     * @param   to The ID of the destination
+     * @return  `mail::PricingSnapshot::DistanceType` The distance, `RouteToDistance::no_lane` if there is no lane
+     */
+    DistanceType distance(CityIndex::IdType from, CityIndex::IdType to) const
+    {
+        return from < m_rows.size() && to < m_rows.size() ? (*m_rows[from])[to] : RouteToDistance::no_lane;
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::rates` is a function that returns what a freight charges.
+     * @param   freight The index of the freight in `mail::freights`
+     * @return  `mail::FreightRates const &` The rates
+     */
+    FreightRates const &rates(size_t freight) const
+    {
+        return (*m_rates)[freight];
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::cost` is a function that prices a direct shipment in this version.
+     * @details It is `mail::quote_cost` with the rates and the distances of the version.
+     * @param   freight The index of the freight in `mail::freights`
+     * @param   from The ID of the origin
+     * @param   to The ID of the destination
+     * @param   weight The actual weight of the whole shipment
+     * @param   volume The volume of the whole shipment in cubic millimeters
+     * @param   cost The price of the shipment, set only if there is a lane
+     * @return  `bool` `true` if there is a lane, `false` otherwise
+     * @throws  `std::out_of_range` If the price does not fit in 64 bits
+     */
+    bool cost(size_t freight, CityIndex::IdType from, CityIndex::IdType to, Gram weight, int64_t volume,
+              Money &cost) const
+    {
+        DistanceType const lane = distance(from, to);
+        if (lane == RouteToDistance::no_lane)
+            return false;
+        FreightRates const &r = (*m_rates)[freight];
+        int64_t const chargeable = max(weight.count(), checked_add(volume, r.divisor / 2) / r.divisor);
+        int64_t const product = checked_multiply(checked_multiply(chargeable, lane), r.rate);
+        cost = Money(checked_add(r.fee, checked_add(product, 500000) / 1000000));
+        return true;
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::with_lanes` is a function that derives a version with other distances.
+     * @param   changes The lanes to set or remove
+     * @param   label The name of the new version
+     * @return  `mail::PricingSnapshot` The new version, sharing every row without a change with this one
+     * @throws  `std::out_of_range` If a change names an unknown city
+     */
+    PricingSnapshot with_lanes(vector<LaneChange> const &changes, string const &label) const;
+    /*!
+     * @brief   `mail::PricingSnapshot::with_lane` is a function that derives a version with another distance for one lane.
+     * @param   from The ID of the origin
+     * @param   to The ID of the destination
+     * @param   distance The new distance, `RouteToDistance::no_lane` to remove the lane
+     * @param   label The name of the new version
+     * @return  `mail::PricingSnapshot` See `with_lanes`
+     */
+    PricingSnapshot with_lane(CityIndex::IdType from, CityIndex::IdType to, DistanceType distance,
+                              string const &label) const
+    {
+        LaneChange const change = {from, to, distance};
+        return with_lanes(vector<LaneChange>(1, change), label);
+    }
+    /*!
+     * @brief   `mail::PricingSnapshot::with_rates` is a function that derives a version with other rates for a freight.
+     * @param   freight The index of the freight in `mail::freights`
+     * @param   rates The new rates
+     * @param   label The name of the new version
+     * @return  `mail::PricingSnapshot` The new version, sharing every distance with this one
+     * @throws  `std::out_of_range` If there is no such freight or the divisor is not positive
+     */
+    PricingSnapshot with_rates(size_t freight, FreightRates const &rates, string const &label) const;
+    /*!
+     * @brief   `mail::PricingSnapshot::memory_usage` is a function that returns the memory taken by versions together.
+     * @param   snapshots The versions
+     * @return  `std::size_t` The bytes of the distinct rows and rate tables of the versions
+     */
+    static size_t memory_usage(vector<PricingSnapshot> const &snapshots);
+};
+
+PricingSnapshot::PricingSnapshot(RouteToDistance const &router, string const &label)
+    : m_version(next_version())
+    , m_parent(0)
+    , m_label(label)
+    , m_rows(router.cities().size())
+    , m_rates()
+{
+    size_t const n = router.cities().size();
+    LaneTable const &lanes = router.lanes();
+    for (size_t from = 0; from < n; ++from)
+    {
+        shared_ptr<Row> const row = make_shared<Row>(n);
+        for (size_t to = 0; to < n; ++to)
+            (*row)[to] = lanes.distance(static_cast<CityIndex::IdType>(from), static_cast<CityIndex::IdType>(to));
+        m_rows[from] = row;
+    }
+    shared_ptr<RateTable> const rates = make_shared<RateTable>();
+    for (size_t f = 0; f < freight_count; ++f)
+    {
+        FreightRates const r = {freights[f]->base_fee().count(), freights[f]->rate().count(),
+                                freights[f]->volumetric_divisor()};
+        (*rates)[f] = r;
+    }
+    m_rates = rates;
+}
+
+PricingSnapshot PricingSnapshot::with_lanes(vector<LaneChange> const &changes, string const &label) const
+{
+    PricingSnapshot snapshot(*this, label);
+    map<CityIndex::IdType, shared_ptr<Row> > copies;
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+        if (changes[i].from >= m_rows.size() || changes[i].to >= m_rows.size())
+            throw out_of_range("City not found");
+        shared_ptr<Row> &copy = copies[changes[i].from];
+        if (!copy)
+            copy = make_shared<Row>(*m_rows[changes[i].from]);
+        (*copy)[changes[i].to] = changes[i].distance;
+    }
+    for (map<CityIndex::IdType, shared_ptr<Row> >::const_iterator it = copies.begin(); it != copies.end(); ++it)
+        snapshot.m_rows[it->first] = it->second;
+    return snapshot;
+}
+
+PricingSnapshot PricingSnapshot::with_rates(size_t freight, FreightRates const &rates, string const &label) const
+{
+    if (freight >= freight_count || rates.divisor <= 0)
+        throw out_of_range("Freight not found");
+    PricingSnapshot snapshot(*this, label);
+    shared_ptr<RateTable> const table = make_shared<RateTable>(*m_rates);
+    (*table)[freight] = rates;
+    snapshot.m_rates = table;
+    return snapshot;
+}
+
+size_t PricingSnapshot::memory_usage(vector<PricingSnapshot> const &snapshots)
+{
+    set<void const *> seen;
+    size_t bytes = 0;
+    for (size_t s = 0; s < snapshots.size(); ++s)
+    {
+        bytes += snapshots[s].m_rows.size() * sizeof(shared_ptr<Row const>);
+        for (size_t i = 0; i < snapshots[s].m_rows.size(); ++i)
+            if (seen.insert(snapshots[s].m_rows[i].get()).second)
+                bytes += sizeof(Row) + snapshots[s].m_rows[i]->size() * sizeof(DistanceType);
+        if (seen.insert(snapshots[s].m_rates.get()).second)
+            bytes += sizeof(RateTable);
+    }
+    return bytes;
+}
+
+/*!
+ * @brief   `mail::RepricingItem` is a shipment reduced to what pricing needs.
+ */
+struct RepricingItem
+{
+    CityIndex::IdType origin;
+    CityIndex::IdType destination;
+    /*!
+     * @brief   `mail::RepricingItem::freight` is the index of the freight in `mail::freights`.
+     */
+    size_t freight;
+    /*!
+     * @brief   `mail::RepricingItem::weight` is the actual weight of all the packages.
+     */
+    Gram weight;
+    /*!
+     * @brief   `mail::RepricingItem::volume` is the volume of all the packages in cubic millimeters.
+     */
+    int64_t volume;
+};
+
+/*!
+ * @brief   `mail::repricing_item` is a function that reduces a quote to what pricing needs.
+ * @param   origin The ID of the origin
+ * @param   destination The ID of the destination
+ * @param   freight The index of the freight in `mail::freights`
+ * @param   package The package
+ * @return  `mail::RepricingItem` The quote
+ * @throws  `std::out_of_range` If the weight or the volume does not fit in 64 bits
+ */
+RepricingItem repricing_item(CityIndex::IdType origin, CityIndex::IdType destination, size_t freight,
+                             PackageInfo const &package)
+{
+    int64_t const area = checked_multiply(package.getFixedLength().count(), package.getFixedWidth().count());
+    RepricingItem const item = {
+        origin, destination, freight, package.getFixedWeight() * package.getQuantity(),
+        checked_multiply(checked_multiply(area, package.getFixedHeight().count()), package.getQuantity())};
+    return item;
+}
+
+/*!
+ * @brief   `mail::repricing_item` is a function that reduces a shipment to what pricing needs.
+ * @param   info The shipment
+ * @param   cities The cities the IDs refer to
+ * @return  `mail::RepricingItem` The shipment, with `CityIndex::npos` for a city that is not known
+ */
+RepricingItem repricing_item(ShipmentInfo const &info, CityIndex const &cities = route_to_distance.cities())
+{
+    return repricing_item(cities.id_of(info.getOrigin().getLocation()), cities.id_of(info.getDestination().getLocation()),
+                          static_cast<size_t>(mode_of(info.getFreight())) - 1, info.getPackage());
+}
+
+/*!
+ * @brief   `mail::RepricingTotals` is the result of repricing a set of shipments in one version.
+ * @details The differences are against the first version of the comparison, over the shipments priced in both.
+ */
+struct RepricingTotals
+{
+    /*!
+     * @brief   `mail::RepricingTotals::total` is the sum of the prices of the shipments with a lane.
+     */
+    Money total;
+    size_t priced;
+    /*!
+     * @brief   `mail::RepricingTotals::unpriced` is the number of shipments without a lane in this version.
+     */
+    size_t unpriced;
+    /*!
+     * @brief   `mail::RepricingTotals::changed` is the number of shipments whose price differs.
+     */
+    size_t changed;
+    Money increase;
+    Money decrease;
+};
+
+/*!
+ * @brief   `mail::reprice` is a function that prices shipments in several versions at once.
+ * @details The shipments are read once: each is priced in every version before the next one is looked at, and the
+ *          prices are handed to `sink` as they are computed, so a large set never has to be held twice.
+ * @param   items The shipments
+ * @param   snapshots The versions, the first one being the baseline of the differences
+ * @param   sink Called for each shipment with its index and one price in cents per version, -1 without a lane;
+ *               none if empty
+ * @return  `std::vector<mail::RepricingTotals>` The totals of each version
+ */
+vector<RepricingTotals> reprice(vector<RepricingItem> const &items, vector<PricingSnapshot> const &snapshots,
+                                function<void(size_t, int64_t const *)> const &sink = nullptr)
+{
+    RepricingTotals const zero = {Money(), 0, 0, 0, Money(), Money()};
+    vector<RepricingTotals> totals(snapshots.size(), zero);
+    vector<int64_t> prices(snapshots.size());
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        RepricingItem const &item = items[i];
+        for (size_t s = 0; s < snapshots.size(); ++s)
+        {
+            Money cost;
+            if (!snapshots[s].cost(item.freight, item.origin, item.destination, item.weight, item.volume, cost))
+            {
+                prices[s] = -1;
+                ++totals[s].unpriced;
+                continue;
+            }
+            prices[s] = cost.count();
+            totals[s].total += cost;
+            ++totals[s].priced;
+            if (prices[0] < 0 || prices[s] == prices[0])
+                continue;
+            ++totals[s].changed;
+            if (prices[s] > prices[0])
+                totals[s].increase += Money(prices[s] - prices[0]);
+            else
+                totals[s].decrease += Money(prices[0] - prices[s]);
+        }
+        if (sink)
+            sink(i, prices.data());
+    }
+    return totals;
+}
+
+/*!
+ * @brief   `mail::derive_snapshot` is a function that derives a version from a change written as text.
+ * @details A change is one of:
+ *          | Change                  | Meaning                                                         |
+ *          | ----------------------- | --------------------------------------------------------------- |
+ *          | `air.fee=12.5`          | The fee per leg in currency units                               |
+ *          | `ocean.rate=0.0002`     | The rate in currency units per kilogram and kilometer           |
+ *          | `rail.divisor=4000`     | The volumetric divisor, in cubic centimeters per kilogram       |
+ *          | `lane:Paris:Tokyo=9700` | The distance of a lane in whole kilometers, `none` to remove it |
+ *          The change is also the label of the new version.
+ * @param   base The version to change
+ * @param   change The change
+ * @return  `mail::PricingSnapshot` The new version
+ * @throws  `std::runtime_error` If the change cannot be parsed
+ * @throws  `std::out_of_range` If it names an unknown city
+ */
+PricingSnapshot derive_snapshot(PricingSnapshot const &base, string const &change,
+                                CityIndex const &cities = route_to_distance.cities())
+{
+    size_t const equals = change.rfind('=');
+    if (equals == string::npos)
+        throw runtime_error("Invalid change: " + change);
+    string const target = change.substr(0, equals), value = change.substr(equals + 1);
+    char *end = nullptr;
+    long double const number = strtold(value.c_str(), &end);
+    if (value.empty() || (*end && value != "none") || (!*end && (!isfinite(number) || number < 0)))
+        throw runtime_error("Invalid change: " + change);
+    if (target.compare(0, 5, "lane:") == 0)
+    {
+        size_t const colon = target.find(':', 5);
+        if (colon == string::npos || (!*end && (number > RouteToDistance::no_lane - 1 || number != floorl(number))))
+            throw runtime_error("Invalid change: " + change);
+        CityIndex::IdType const from = cities.id_of(target.substr(5, colon - 5));
+        CityIndex::IdType const to = cities.id_of(target.substr(colon + 1));
+        if (from == CityIndex::npos || to == CityIndex::npos)
+            throw out_of_range("City not found in " + change);
+        return base.with_lane(from, to, *end ? RouteToDistance::no_lane : static_cast<PricingSnapshot::DistanceType>(number),
+                              change);
+    }
+    size_t const dot = target.find('.');
+    string const name = target.substr(0, dot), field = dot == string::npos ? "" : target.substr(dot + 1);
+    char const *const names[] = {"ocean", "air", "rail"};
+    size_t const freight = find(names, names + freight_count, name) - names;
+    if (freight == freight_count || *end)
+        throw runtime_error("Invalid change: " + change);
+    long double const scale = field == "fee" ? 100 : field == "rate" ? 100000 : 1;
+    if (number * scale >= static_cast<long double>(INT64_MAX))
+        throw runtime_error("Invalid change: " + change);
+    FreightRates rates = base.rates(freight);
+    if (field == "fee")
+        rates.fee = llroundl(number * 100);
+    else if (field == "rate")
+        rates.rate = llroundl(number * 100000);
+    else if (field == "divisor" && number >= 1)
+        rates.divisor = llroundl(number);
+    else
+        throw runtime_error("Invalid change: " + change);
+    return base.with_rates(freight, rates, change);
+}
+
+/*!
+ * @brief   `mail::PostalCodeEntry` is a record of the postal code file: the city and service zone of a code prefix.
+ */
+struct PostalCodeEntry
+{
+    string country;
+    /*!
+     * @brief   `mail::PostalCodeEntry::code` is the postal code, or the prefix shared by every code of the city; empty
+     *          for a country without postal codes.
+     */
+    string code;
+    string city;
+    string zone;
+};
+
+/*!
+ * @brief   `mail::PostalIndex` is a class that resolves postal codes to cities and service zones.
+ * @details The codes are keys of a compressed radix trie, looked up by longest prefix, so a record for `CN 200`
+ *          answers every code from `200000` to `200999`. The trie is one flat image of 32-bit arrays that is used
+ *          in place, whether it was just built or mapped from a file:
+ *
+ *          | Part         | Content                                                                      |
+ *          |--------------|------------------------------------------------------------------------------|
+ *          | header       | `MAILPST1`, the five counts below, the CRC-32 of the rest, two zeros          |
+ *          | nodes        | 16 bytes per node, the root first: first child, number of children and label  |
+ *          |              | length << 16, entry or `~0`, label if at most 4 bytes or its offset otherwise |
+ *          | entries      | city name, zone name per distinct pair                                       |
+ *          | name offsets | start of each name in the names, then their total length                    |
+ *          | first bytes  | the first byte of the label of each node, padded to 4 bytes                 |
+ *          | labels       | the labels longer than 4 bytes, padded to 4 bytes                            |
+ *          | names        | the city and zone names                                                      |
+ *
+ *          The children of a node are adjacent, so the next node is picked with `memchr` over their first bytes,
+ *          and a node holds its entry and short label itself: a step down the trie touches two cache lines. Copies
+ *          share the image.
+ */
+class PostalIndex
+{
+  public:
+    /*!
+     * @brief   `mail::PostalIndex::Match` is the result of a lookup.
+     */
+    struct Match
+    {
+        bool found;
+        /*!
+         * @brief   `mail::PostalIndex::Match::city` is the index of the city in `name`.
+         */
+        uint32_t city;
+        /*!
+         * @brief   `mail::PostalIndex::Match::zone` is the index of the service zone in `name`.
+         */
+        uint32_t zone;
+        /*!
+         * @brief   `mail::PostalIndex::Match::length` is the number of characters of the key that matched.
+         */
+        size_t length;
+
+        explicit operator bool() const
+        {
+            return found;
+        }
+    };
+
+  private:
+    static size_t const header_size = 40;
+    static uint32_t const no_entry = ~0U;
+
+    shared_ptr<void const> m_owner;
+    char const *m_data;
+    size_t m_size;
+    uint32_t const *m_nodes;
+    uint32_t const *m_entries;
+    uint32_t const *m_name_offsets;
+    char const *m_first_bytes;
+    char const *m_labels;
+    char const *m_names;
+    uint32_t m_name_count;
+    /*!
+     * @brief   `mail::PostalIndex::m_city_ids` is the ID in the cities of the router of each name, `npos` if it is
+     *          not one of them.
+     */
+    vector<CityIndex::IdType> m_city_ids;
+
+    PostalIndex(shared_ptr<void const> const &owner, char const *data, size_t size, CityIndex const &cities);
+    PostalIndex(shared_ptr<string const> const &image, CityIndex const &cities);
+    struct Builder;
+
+  public:
+    /*!
+     * @brief   `mail::PostalIndex::PostalIndex` is a constructor that uses a trie image made by `build`.
+     * @param   image The image
+     * @param   cities The cities that `city_id` reports IDs in
+     * @throws  `std::runtime_error` If the image is not valid
+     */
+    explicit PostalIndex(string const &image, CityIndex const &cities = route_to_distance.cities());
+    PostalIndex(PostalIndex const &) = default;
+    PostalIndex &operator=(PostalIndex const &) = default;
+    /*!
+     * @brief   `mail::PostalIndex::key_of` is a function that returns the key of a postal code in the trie.
+     * @details Country codes are case-insensitive and postal codes may contain spaces or dashes, so `jp 100-0001`
+     *          and `JP 1000001` are the same code.
+     * @param   country The country code
+     * @param   code The postal code
+     * @return  `std::string` The upper-case country, a colon and the upper-case letters and digits of the code
+     */
+    static string key_of(string const &country, string const &code);
+    /*!
+     * @brief   `mail::PostalIndex::read_csv` is a function that reads postal code records.
+     * @param   filename The postal code file in CSV format, with the country, postal code, city and zone per record
+     * @return  `std::vector<mail::PostalCodeEntry>` The records
+     * @throws  `std::runtime_error` If the file cannot be read or is not valid
+     */
+    static vector<PostalCodeEntry> read_csv(string const &filename);
+    /*!
+     * @brief   `mail::PostalIndex::build` is a function that builds the trie image of postal code records.
+     * @param   entries The records, in any order
+     * @return  `std::string` The image
+     * @throws  `std::runtime_error` If a postal code appears twice
+     */
+    static string build(vector<PostalCodeEntry> const &entries);
+    /*!
+     * @brief   `mail::PostalIndex::load` is a function that maps a trie image saved by `save`.
+     * @param   path The path of the file
+     * @param   cities The cities that `city_id` reports IDs in
+     * @return  `mail::PostalIndex` The index, reading the file in place
+     * @throws  `std::runtime_error` If the file cannot be mapped or is not a valid image
+     */
+    static PostalIndex load(string const &path, CityIndex const &cities = route_to_distance.cities());
+    /*!
+     * @brief   `mail::PostalIndex::open` is a function that loads an image, or builds and saves it if it is missing
+     *          or older than its source.
+     * @details Failing to save the image is not an error; it is built again the next time.
+     * @param   path The path of the image
+     * @param   source The postal code file in CSV format
+     * @param   cities The cities that `city_id` reports IDs in
+     * @return  `mail::PostalIndex` The up-to-date index
+     * @throws  `std::runtime_error` If the image has to be built and the source cannot be read
+     */
+    static PostalIndex open(string const &path, string const &source,
+                            CityIndex const &cities = route_to_distance.cities());
+    /*!
+     * @brief   `mail::PostalIndex::save` is a function that writes the image to a file.
+     * @param   path The path of the file, replaced atomically
+     * @throws  `std::runtime_error` If the file cannot be written
+     */
+    void save(string const &path) const;
+    /*!
+     * @brief   `mail::PostalIndex::size` is a function that returns the size of the image.
+     * @return  `std::size_t` The size in bytes
+     */
+    size_t size() const
+    {
+        return m_size;
+    }
+    /*!
+     * @brief   `mail::PostalIndex::find` is a function that finds the longest prefix of a key with a record.
+     * @param   key A key made by `key_of`
+     * @return  `mail::PostalIndex::Match` The city and zone of the longest matching prefix, with `found` set to
+     *          `false` if no prefix has a record
+     */
+    Match find(string const &key) const
+    {
+        Match match = {false, 0, 0, 0};
+        uint32_t const *node = m_nodes;
+        size_t position = 0;
+        for (;;)
+        {
+            if (node[2] != no_entry)
+            {
+                match.found = true;
+                match.city = m_entries[2 * node[2]];
+                match.zone = m_entries[2 * node[2] + 1];
+                match.length = position;
+            }
+            if (position == key.size())
+                break;
+            void const *const hit = memchr(m_first_bytes + node[0], key[position], node[1] & 0xFFFFU);
+            if (!hit)
+                break;
+            node = m_nodes + 4 * (static_cast<char const *>(hit) - m_first_bytes);
+            size_t const length = node[1] >> 16;
+            char const *const label = length <= 4 ? reinterpret_cast<char const *>(node + 3) : m_labels + node[3];
+            if (length > key.size() - position || memcmp(label, key.data() + position, length) != 0)
+                break;
+            position += length;
+        }
+        return match;
+    }
+    /*!
+     * @brief   `mail::PostalIndex::find` is a function that resolves a postal code.
+     * @param   country The country code
+     * @param   code The postal code
+     * @return  `mail::PostalIndex::Match` See `find(key_of(country, code))`
+     */
+    Match find(string const &country, string const &code) const
+    {
+        return find(key_of(country, code));
+    }
+    /*!
+     * @brief   `mail::PostalIndex::name` is a function that returns a city or zone name.
+     * @param   index The index of the name, from a `mail::PostalIndex::Match`
+     * @return  `std::string` The name
+     * @throws  `std::out_of_range` If there is no such name
+     */
+    string name(uint32_t index) const
+    {
+        if (index >= m_name_count)
+            throw out_of_range("Postal index name out of range");
+        return string(m_names + m_name_offsets[index], m_names + m_name_offsets[index + 1]);
+    }
+    /*!
+     * @brief   `mail::PostalIndex::city_id` is a function that returns the ID of a matched city among the cities of
+     *          the router.
+     * @param   match A successful match
+     * @return  `mail::CityIndex::IdType` The ID, or `npos` if the city is not in the distance map
+     */
+    CityIndex::IdType city_id(Match const &match) const
+    {
+        return match.city < m_city_ids.size() ? m_city_ids[match.city] : CityIndex::npos;
+    }
+};
+
+size_t const PostalIndex::header_size;
+uint32_t const PostalIndex::no_entry;
+
+PostalIndex::PostalIndex(shared_ptr<void const> const &owner, char const *data, size_t size,
+                         CityIndex const &cities)
+    : m_owner(owner)
+    , m_data(data)
+    , m_size(size)
+    , m_nodes(nullptr)
+    , m_entries(nullptr)
+    , m_name_offsets(nullptr)
+    , m_first_bytes(nullptr)
+    , m_labels(nullptr)
+    , m_names(nullptr)
+    , m_name_count(0)
+    , m_city_ids()
+{
+    if (size < header_size || memcmp(data, "MAILPST1", 8) != 0)
+        throw runtime_error("Not a postal index");
+    ByteReader header(data + 8, data + header_size);
+    uint64_t const node_count = header.get<uint32_t>(), entry_count = header.get<uint32_t>();
+    uint64_t const name_count = header.get<uint32_t>(), label_bytes = header.get<uint32_t>();
+    uint64_t const name_bytes = header.get<uint32_t>();
+    uint32_t const checksum = header.get<uint32_t>();
+    uint64_t const expected = header_size + 4 * (4 * node_count + 2 * entry_count + name_count + 1) +
+                              (node_count + 3) / 4 * 4 + (label_bytes + 3) / 4 * 4 + name_bytes;
+    if (node_count == 0 || expected != size)
+        throw runtime_error("Not a postal index");
+    if (crc32(data + header_size, size - header_size) != checksum)
+        throw runtime_error("Corrupt postal index");
+
+    m_nodes = reinterpret_cast<uint32_t const *>(data + header_size);
+    m_entries = m_nodes + 4 * node_count;
+    m_name_offsets = m_entries + 2 * entry_count;
+    m_first_bytes = reinterpret_cast<char const *>(m_name_offsets + name_count + 1);
+    m_labels = m_first_bytes + (node_count + 3) / 4 * 4;
+    m_names = m_labels + (label_bytes + 3) / 4 * 4;
+    m_name_count = static_cast<uint32_t>(name_count);
+
+    for (uint64_t i = 0; i < node_count; ++i)
+    {
+        uint32_t const *const node = m_nodes + 4 * i;
+        uint64_t const children = node[1] & 0xFFFFU, length = node[1] >> 16;
+        if ((children > 0 && (node[0] == 0 || node[0] + children > node_count)) || (i > 0) != (length > 0) ||
+            (length > 4 && node[3] + length > label_bytes) || (node[2] != no_entry && node[2] >= entry_count))
+            throw runtime_error("Corrupt postal index");
+    }
+    for (uint64_t i = 0; i < 2 * entry_count; ++i)
+        if (m_entries[i] >= name_count)
+            throw runtime_error("Corrupt postal index");
+    for (uint64_t i = 0; i < name_count; ++i)
+        if (m_name_offsets[i] > m_name_offsets[i + 1] || m_name_offsets[i + 1] > name_bytes)
+            throw runtime_error("Corrupt postal index");
+
+    m_city_ids.resize(name_count);
+    for (uint32_t i = 0; i < name_count; ++i)
+        m_city_ids[i] = cities.id_of(name(i));
+}
+
+PostalIndex::PostalIndex(shared_ptr<string const> const &image, CityIndex const &cities)
+    : PostalIndex(image, image->data(), image->size(), cities)
+{}
+
+PostalIndex::PostalIndex(string const &image, CityIndex const &cities)
+    : PostalIndex(make_shared<string const>(image), cities)
+{}
+
+string PostalIndex::key_of(string const &country, string const &code)
+{
+    string key;
+    key.reserve(country.size() + 1 + code.size());
+    for (size_t i = 0; i < country.size(); ++i)
+        key.push_back(static_cast<char>(toupper(static_cast<unsigned char>(country[i]))));
+    key.push_back(':');
+    for (size_t i = 0; i < code.size(); ++i)
+        if (isalnum(static_cast<unsigned char>(code[i])))
+            key.push_back(static_cast<char>(toupper(static_cast<unsigned char>(code[i]))));
+    return key;
+}
+
+vector<PostalCodeEntry> PostalIndex::read_csv(string const &filename)
+{
+    ifstream stream(filename);
+    if (!stream)
+        throw runtime_error("Failed to open postal code file " + filename);
+    string title_line;
+    getline(stream, title_line);
+    stream.seekg(0);
+    string const file_buffer((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+
+    csv::Parser parser(title_line, csv::Dialect(), csv::Parser::column_storage);
+    parser.add_records(file_buffer);
+    if (parser.field_count() < 4)
+        throw runtime_error("Postal code file " + filename + " needs a country, code, city and zone per record");
+    csv::Column const &countries = parser.column(0), &codes = parser.column(1);
+    csv::Column const &cities = parser.column(2), &zones = parser.column(3);
+    vector<PostalCodeEntry> entries;
+    entries.reserve(parser.record_count());
+    for (size_t i = 0; i < parser.record_count(); ++i)
+    {
+        PostalCodeEntry const entry = {string(countries.field_begin(i), countries.field_end(i)),
+                                       string(codes.field_begin(i), codes.field_end(i)),
+                                       string(cities.field_begin(i), cities.field_end(i)),
+                                       string(zones.field_begin(i), zones.field_end(i))};
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+/*!
+ * @brief   `mail::PostalIndex::Builder` is the state of `mail::PostalIndex::build` while it lays the trie out.
+ */
+struct PostalIndex::Builder
+{
+    vector<string> const &keys;
+    vector<uint32_t> const &values;
+    vector<uint32_t> nodes;
+    string first_bytes;
+    string labels;
+
+    /*!
+     * @brief   `mail::PostalIndex::Builder::add` is a function that adds nodes without filling them in.
+     * @param   count The number of nodes
+     * @return  `std::size_t` The index of the first one
+     */
+    size_t add(size_t count)
+    {
+        size_t const first = nodes.size() / 4;
+        nodes.resize(nodes.size() + 4 * count);
+        first_bytes.resize(first_bytes.size() + count);
+        return first;
+    }
+    /*!
+     * @brief   `mail::PostalIndex::Builder::fill` is a function that fills a node in with the keys `[begin, end)`,
+     *          which share their first `depth` characters, and adds the nodes below it.
+     */
+    void fill(size_t node, size_t begin, size_t end, size_t depth)
+    {
+        nodes[4 * node + 2] = no_entry;
+        if (begin < end && keys[begin].size() == depth)
+            nodes[4 * node + 2] = values[begin++];
+        vector<pair<size_t, size_t> > groups;
+        for (size_t i = begin; i < end;)
+        {
+            size_t j = i + 1;
+            while (j < end && keys[j][depth] == keys[i][depth])
+                ++j;
+            groups.push_back(make_pair(i, j));
+            i = j;
+        }
+        size_t const first_child = add(groups.size());
+        nodes[4 * node] = static_cast<uint32_t>(first_child);
+        nodes[4 * node + 1] |= static_cast<uint32_t>(groups.size());
+        for (size_t g = 0; g < groups.size(); ++g)
+        {
+            string const &low = keys[groups[g].first], &high = keys[groups[g].second - 1];
+            size_t common = depth + 1;
+            while (common < low.size() && common < high.size() && low[common] == high[common])
+                ++common;
+            size_t const child = first_child + g, length = common - depth;
+            first_bytes[child] = low[depth];
+            nodes[4 * child + 1] = static_cast<uint32_t>(length << 16);
+            if (length <= 4)
+                memcpy(&nodes[4 * child + 3], low.data() + depth, length);
+            else
+            {
+                nodes[4 * child + 3] = static_cast<uint32_t>(labels.size());
+                labels.append(low, depth, length);
+            }
+            fill(child, groups[g].first, groups[g].second, common);
+        }
+    }
+};
+
+string PostalIndex::build(vector<PostalCodeEntry> const &entries)
+{
+    vector<pair<string, size_t> > order;
+    order.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+        order.push_back(make_pair(key_of(entries[i].country, entries[i].code), i));
+    sort(order.begin(), order.end());
+
+    map<string, uint32_t> name_ids;
+    vector<string> names;
+    map<pair<uint32_t, uint32_t>, uint32_t> entry_ids;
+    vector<uint32_t> entry_table;
+    vector<string> keys;
+    vector<uint32_t> values;
+    keys.reserve(order.size());
+    values.reserve(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        PostalCodeEntry const &entry = entries[order[i].second];
+        if (i > 0 && order[i].first == order[i - 1].first)
+            throw runtime_error("Duplicate postal code " + entry.country + " " + entry.code);
+        uint32_t ids[2];
+        string const *const fields[2] = {&entry.city, &entry.zone};
+        for (int f = 0; f < 2; ++f)
+        {
+            map<string, uint32_t>::const_iterator const it =
+                name_ids.insert(make_pair(*fields[f], static_cast<uint32_t>(names.size()))).first;
+            if (it->second == names.size())
+                names.push_back(*fields[f]);
+            ids[f] = it->second;
+        }
+        map<pair<uint32_t, uint32_t>, uint32_t>::const_iterator const it =
+            entry_ids.insert(make_pair(make_pair(ids[0], ids[1]), static_cast<uint32_t>(entry_table.size() / 2)))
+                .first;
+        if (it->second == entry_table.size() / 2)
+        {
+            entry_table.push_back(ids[0]);
+            entry_table.push_back(ids[1]);
+        }
+        keys.push_back(order[i].first);
+        values.push_back(it->second);
+    }
+
+    Builder builder = {keys, values, vector<uint32_t>(), string(), string()};
+    builder.fill(builder.add(1), 0, keys.size(), 0);
+
+    string body;
+    ByteWriter writer(body);
+    vector<uint32_t> const *const tables[] = {&builder.nodes, &entry_table};
+    for (size_t t = 0; t < 2; ++t)
+        for (size_t i = 0; i < tables[t]->size(); ++i)
+            writer.put((*tables[t])[i]);
+    uint32_t offset = 0;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        writer.put(offset);
+        offset += static_cast<uint32_t>(names[i].size());
+    }
+    writer.put(offset);
+    body += builder.first_bytes;
+    body.append((4 - builder.first_bytes.size() % 4) % 4, '\0');
+    body += builder.labels;
+    body.append((4 - builder.labels.size() % 4) % 4, '\0');
+    for (size_t i = 0; i < names.size(); ++i)
+        body += names[i];
+
+    string image("MAILPST1", 8);
+    ByteWriter header(image);
+    header.put(static_cast<uint32_t>(builder.nodes.size() / 4));
+    header.put(static_cast<uint32_t>(entry_table.size() / 2));
+    header.put(static_cast<uint32_t>(names.size()));
+    header.put(static_cast<uint32_t>(builder.labels.size()));
+    header.put(offset);
+    header.put(crc32(body.data(), body.size()));
+    header.put(uint32_t(0));
+    header.put(uint32_t(0));
+    return image + body;
+}
+
+PostalIndex PostalIndex::load(string const &path, CityIndex const &cities)
+{
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw runtime_error("Failed to open postal index " + path + ": " + strerror(errno));
+    struct stat status;
+    if (::fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(header_size))
+    {
+        ::close(fd);
+        throw runtime_error("Not a postal index: " + path);
+    }
+    size_t const size = static_cast<size_t>(status.st_size);
+    void *const mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+        throw runtime_error("Failed to map postal index " + path + ": " + strerror(errno));
+    shared_ptr<void const> const owner(mapping, [size](void const *data) { ::munmap(const_cast<void *>(data), size); });
+    try
+    {
+        return PostalIndex(owner, static_cast<char const *>(mapping), size, cities);
+    }
+    catch (runtime_error const &e)
+    {
+        throw runtime_error(string(e.what()) + ": " + path);
+    }
+}
+
+PostalIndex PostalIndex::open(string const &path, string const &source, CityIndex const &cities)
+{
+    struct stat image_status, source_status;
+    bool const source_exists = ::stat(source.c_str(), &source_status) == 0;
+    if (::stat(path.c_str(), &image_status) == 0 &&
+        (!source_exists || image_status.st_mtim.tv_sec > source_status.st_mtim.tv_sec ||
+         (image_status.st_mtim.tv_sec == source_status.st_mtim.tv_sec &&
+          image_status.st_mtim.tv_nsec >= source_status.st_mtim.tv_nsec)))
+    {
+        try
+        {
+            return load(path, cities);
+        }
+        catch (runtime_error const &)
+        {
+        }
+    }
+    PostalIndex const index(build(read_csv(source)), cities);
+    try
+    {
+        index.save(path);
+    }
+    catch (runtime_error const &)
+    {
+    }
+    return index;
+}
+
+void PostalIndex::save(string const &path) const
+{
+    string const temporary = path + ".tmp";
+    {
+        ofstream stream(temporary, ios::binary | ios::trunc);
+        if (!stream.write(m_data, static_cast<streamsize>(m_size)) || !stream.flush())
+            throw runtime_error("Failed to write postal index " + temporary);
+    }
+    if (::rename(temporary.c_str(), path.c_str()) != 0)
+        throw runtime_error("Failed to write postal index " + path + ": " + strerror(errno));
+}
+
+/*!
+ * @brief   `mail::QuoteAuditRecord` is the fixed-size record of one computed quote in the audit log.
+ * @details Lengths are in millimeters, weights in grams and the cost in cents, as in `mail::Fixed`.
+ */
+struct QuoteAuditRecord
+{
+    /*!
+     * @brief   `mail::QuoteAuditRecord::timestamp` is the time of the quote in nanoseconds since the Unix epoch.
+     */
+    int64_t timestamp;
+    /*!
+     * @brief   `mail::QuoteAuditRecord::origin` is the ID of the origin in the cities of the router.
+     */
+    uint32_t origin;
+    uint32_t destination;
+    uint32_t distance;
+    uint16_t quantity;
+    /*!
+     * @brief   `mail::QuoteAuditRecord::freight` is the `mail::freight_mode` of the freight.
+     */
+    uint8_t freight;
+    /*!
+     * @brief   `mail::QuoteAuditRecord::flags` is a combination of `mail::audit_flag` values.
+     */
+    uint8_t flags;
+    int32_t length;
+    int32_t width;
+    int32_t height;
+    /*!
+     * @brief   `mail::QuoteAuditRecord::thread` is the number of the buffer, and so of the thread, that logged it.
+     */
+    uint32_t thread;
+    int64_t weight;
+    /*!
+     * @brief   `mail::QuoteAuditRecord::chargeable_weight` is the weight the cost was computed with.
+     */
+    int64_t chargeable_weight;
+    int64_t cost;
+};
+
+static_assert(sizeof(QuoteAuditRecord) == 64, "an audit record must fill one cache line");
+
+/*!
+ * @brief   `mail::audit_flag` is a property of a quote recorded in `mail::QuoteAuditRecord::flags`.
+ */
+enum audit_flag
+{
+    audit_estimated = 1,
+    audit_from_grid = 2
+};
+
+/*!
+ * @brief   `mail::audit_record` is a function that makes the audit record of a quote, stamped with the current time.
+ * @param   origin The ID of the origin
+ * @param   destination The ID of the destination
+ * @param   distance The distance the cost was computed for
+ * @param   freight The freight
+ * @param   package The package
+ * @param   cost The cost
+ * @param   flags A combination of `mail::audit_flag` values
+ * @return  `mail::QuoteAuditRecord` The record
+ */
+QuoteAuditRecord audit_record(CityIndex::IdType origin, CityIndex::IdType destination, unsigned distance,
+                              Freight const &freight, PackageInfo const &package, Money cost, unsigned flags = 0)
+{
+    QuoteAuditRecord const record = {
+        chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count(),
+        origin,
+        destination,
+        distance,
+        static_cast<uint16_t>(min(package.getQuantity(), 0xFFFFU)),
+        static_cast<uint8_t>(mode_of(freight)),
+        static_cast<uint8_t>(flags),
+        static_cast<int32_t>(package.getFixedLength().count()),
+        static_cast<int32_t>(package.getFixedWidth().count()),
+        static_cast<int32_t>(package.getFixedHeight().count()),
+        0,
+        package.getFixedWeight().count(),
+        chargeable_grams(freight, package).count(),
+        cost.count()};
+    return record;
+}
+
+/*!
+ * @brief   `mail::QuoteAuditFile` is the content of one file of the audit log.
+ */
+struct QuoteAuditFile
+{
+    /*!
+     * @brief   `mail::QuoteAuditFile::city_fingerprint` is the fingerprint of the cities the IDs refer to.
+     */
+    uint64_t city_fingerprint;
+    /*!
+     * @brief   `mail::QuoteAuditFile::dropped` is the number of records lost to full buffers or failed writes while
+     *          the file was written.
+     */
+    uint64_t dropped;
+    vector<QuoteAuditRecord> records;
+};
+
+/*!
+ * @brief   `mail::QuoteAuditLog` is a class that records every computed quote in rotating binary files.
+ * @details Each logging thread gets its own single-producer single-consumer ring of records, so `log` takes no lock
+ *          and shares no cache line with other producers: it copies the record into the next free slot and
+ *          publishes it with one release store. When the ring is full the record is counted as dropped instead of
+ *          waiting. A drain thread empties the rings every `interval` into blocks of the current file:
+ *
+ *          | Offset | Size | Field                                                            |
+ *          |--------|------|------------------------------------------------------------------|
+ *          | 0      | 4    | Magic `"QBLK"`                                                   |
+ *          | 4      | 4    | Number of records                                                |
+ *          | 8      | 4    | Size of the encoded records                                      |
+ *          | 12     | 4    | CRC-32 of the encoded records                                    |
+ *          | 16     | 8    | Records dropped since the previous block                         |
+ *          | 24     | -    | Records, each XORed with the one before and run-length encoded  |
+ *
+ *          Consecutive quotes share most of their bytes, so after the XOR most bytes are zero: a control byte below
+ *          128 is followed by that many plus one literal bytes, and a control byte `c` from 128 stands for `c - 127`
+ *          zero bytes. Files are named `path.000001`, `path.000002` and so on, each starts with `"MAILAUD1"` and the
+ *          fingerprint of the cities. A new log carries on with the last file while it is below `max_file_bytes` and
+ *          has the same cities, dropping a block torn by a crash; when a new file is started, the oldest files are
+ *          removed until all of them take at most `max_total_bytes`. Records lost to a failed write are reported as
+ *          dropped in the next block, which goes to a new file. A ring stays with the log after its thread ends, so
+ *          the log suits a fixed pool of threads.
+ */
+class QuoteAuditLog
+{
+  private:
+    struct Ring;
+    static size_t const file_header_size = 16;
+    static size_t const block_header_size = 24;
+    static uint32_t const block_magic = 0x4B4C4251U; // "QBLK" in little-endian byte order
+
+    uint64_t m_id;
+    string m_path;
+    uint64_t m_city_fingerprint;
+    size_t m_capacity;
+    uint64_t m_max_file_bytes;
+    uint64_t m_max_total_bytes;
+    chrono::milliseconds m_interval;
+    mutable mutex m_mutex;
+    condition_variable m_wake;
+    condition_variable m_drained;
+    vector<unique_ptr<Ring> > m_rings;
+    uint64_t m_flush_requested;
+    uint64_t m_flush_done;
+    bool m_stop;
+    string m_error;
+    uint64_t m_written;
+    uint64_t m_reported_drops;
+    uint64_t m_lost;
+    ofstream m_file;
+    uint64_t m_file_index;
+    uint64_t m_file_size;
+    thread m_drainer;
+
+    Ring &local_ring();
+    void drain_loop();
+    void write_block(string const &raw, size_t count, uint64_t dropped);
+    void reopen_last(string const &file);
+    void remove_old_files() const;
+    static string file_name(string const &path, uint64_t index);
+
+  public:
+    /*!
+     * @brief   `mail::QuoteAuditLog::QuoteAuditLog` is a constructor that opens the last file of the log, or starts a
+     *          new one, and its drain thread.
+     * @param   path The path the files are named after
+     * @param   capacity The number of records of the ring of each thread, rounded up to a power of two
+     * @param   max_file_bytes The size after which the next file is started
+     * @param   max_total_bytes The size of all the files after which the oldest are removed
+     * @param   interval The time between two drains
+     * @param   cities The cities the IDs of the records refer to
+     * @throws  `std::runtime_error` If the file cannot be opened or created
+     */
+    explicit QuoteAuditLog(string const &path, size_t capacity = 4096, uint64_t max_file_bytes = uint64_t(64) << 20,
+                           uint64_t max_total_bytes = uint64_t(512) << 20,
+                           chrono::milliseconds interval = chrono::milliseconds(20),
+                           CityIndex const &cities = route_to_distance.cities());
+    QuoteAuditLog(QuoteAuditLog const &) = delete;
+    QuoteAuditLog &operator=(QuoteAuditLog const &) = delete;
+    /*!
+     * @brief   `mail::QuoteAuditLog::~QuoteAuditLog` is a destructor that writes what is buffered and closes the file.
+     */
+    ~QuoteAuditLog();
+    /*!
+     * @brief   `mail::QuoteAuditLog::log` is a function that records a quote without blocking.
+     * @param   record The record; its `thread` field is filled in
+     * @return  `bool` `true` if the record was buffered, `false` if the ring of the thread was full and it was dropped
+     */
+    bool log(QuoteAuditRecord const &record);
+    /*!
+     * @brief   `mail::QuoteAuditLog::flush` is a function that waits until every record logged before the call is
+     *          written to the file.
+     * @throws  `std::runtime_error` If a write failed since the previous call, losing records
+     */
+    void flush();
+    /*!
+     * @brief   `mail::QuoteAuditLog::written` is a function that returns the number of records written to the files.
+     * @return  `uint64_t` The number of records
+     */
+    uint64_t written() const
+    {
+        lock_guard<mutex> const lock(m_mutex);
+        return m_written;
+    }
+    /*!
+     * @brief   `mail::QuoteAuditLog::dropped` is a function that returns the number of records lost to full rings or
+     *          failed writes.
+     * @return  `uint64_t` The number of records
+     */
+    uint64_t dropped() const;
+    /*!
+     * @brief   `mail::QuoteAuditLog::files` is a function that lists the files of a log.
+     * @param   path The path the files are named after
+     * @return  `std::vector<std::string>` The files, oldest first
+     */
+    static vector<string> files(string const &path);
+    /*!
+     * @brief   `mail::QuoteAuditLog::read` is a function that reads one file of a log.
+     * @details A block cut short at the end of the file, as left by a crash, is ignored.
+     * @param   file The path of the file
+     * @return  `mail::QuoteAuditFile` The records in the order they were written
+     * @throws  `std::runtime_error` If the file cannot be read, is not an audit file or is corrupt
+     */
+    static QuoteAuditFile read(string const &file);
+};
+
+/*!
+ * @brief   `mail::QuoteAuditLog::Ring` is the ring of records of one thread.
+ * @details The producer owns `head` and its copy of `tail`, the drain thread owns `tail`; each sits on its own cache
+ *          line.
+ */
+struct QuoteAuditLog::Ring
+{
+    atomic<uint64_t> head;
+    char head_padding[64 - sizeof(atomic<uint64_t>)];
+    atomic<uint64_t> tail;
+    char tail_padding[64 - sizeof(atomic<uint64_t>)];
+    uint64_t cached_tail;
+    atomic<uint64_t> dropped;
+    uint32_t id;
+    vector<QuoteAuditRecord> slots;
+
+    Ring(size_t capacity, uint32_t ring_id)
+        : head(0)
+        , head_padding()
+        , tail(0)
+        , tail_padding()
+        , cached_tail(0)
+        , dropped(0)
+        , id(ring_id)
+        , slots(capacity)
+    {}
+};
+
+size_t const QuoteAuditLog::file_header_size;
+size_t const QuoteAuditLog::block_header_size;
+uint32_t const QuoteAuditLog::block_magic;
+
+QuoteAuditLog::QuoteAuditLog(string const &path, size_t capacity, uint64_t max_file_bytes,
+                             uint64_t max_total_bytes, chrono::milliseconds interval, CityIndex const &cities)
+    : m_id(0)
+    , m_path(path)
+    , m_city_fingerprint(cities.fingerprint())
+    , m_capacity(1)
+    , m_max_file_bytes(max_file_bytes)
+    , m_max_total_bytes(max_total_bytes)
+    , m_interval(interval)
+    , m_mutex()
+    , m_wake()
+    , m_drained()
+    , m_rings()
+    , m_flush_requested(0)
+    , m_flush_done(0)
+    , m_stop(false)
+    , m_error()
+    , m_written(0)
+    , m_reported_drops(0)
+    , m_lost(0)
+    , m_file()
+    , m_file_index(0)
+    , m_file_size(0)
+    , m_drainer()
+{
+    static atomic<uint64_t> next_id(1);
+    m_id = next_id++;
+    while (m_capacity < capacity)
+        m_capacity *= 2;
+    vector<string> const existing = files(path);
+    if (!existing.empty())
+    {
+        m_file_index = stoull(existing.back().substr(path.size() + 1));
+        reopen_last(existing.back());
+    }
+    write_block(string(), 0, 0);
+    m_drainer = thread(&QuoteAuditLog::drain_loop, this);
+}
+
+QuoteAuditLog::~QuoteAuditLog()
+{
+    {
+        lock_guard<mutex> const lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    m_drainer.join();
+}
+
+void QuoteAuditLog::reopen_last(string const &file)
+{
+    ifstream stream(file, ios::binary);
+    string const content((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    if (content.size() < file_header_size || content.size() >= m_max_file_bytes ||
+        content.compare(0, 8, "MAILAUD1") != 0 ||
+        ByteReader(content.data() + 8, content.data() + file_header_size).get<uint64_t>() != m_city_fingerprint)
+        return;
+    size_t offset = file_header_size;
+    while (content.size() - offset >= block_header_size)
+    {
+        ByteReader header(content.data() + offset, content.data() + offset + block_header_size);
+        uint32_t const magic = header.get<uint32_t>();
+        header.get<uint32_t>();
+        size_t const size = header.get<uint32_t>();
+        uint32_t const checksum = header.get<uint32_t>();
+        if (magic != block_magic || content.size() - offset - block_header_size < size ||
+            crc32(content.data() + offset + block_header_size, size) != checksum)
+            break;
+        offset += block_header_size + size;
+    }
+    if (offset != content.size())
+    {
+        // Only a block cut short by a crash is dropped; appending after damage elsewhere would hide it
+        uint32_t size = 0;
+        if (content.size() - offset >= 12)
+            memcpy(&size, content.data() + offset + 8, 4);
+        if (content.size() - offset >= block_header_size && content.size() - offset - block_header_size >= size)
+            return;
+        if (::truncate(file.c_str(), static_cast<off_t>(offset)) != 0)
+            return;
+    }
+    m_file.open(file, ios::binary | ios::app);
+    if (!m_file)
+    {
+        m_file.close();
+        m_file.clear();
+        return;
+    }
+    m_file_size = offset;
+}
+
+void QuoteAuditLog::remove_old_files() const
+{
+    vector<string> const existing = files(m_path);
+    vector<uint64_t> sizes(existing.size(), 0);
+    uint64_t total = 0;
+    for (size_t i = 0; i < existing.size(); ++i)
+    {
+        struct stat status;
+        if (::stat(existing[i].c_str(), &status) == 0)
+            sizes[i] = static_cast<uint64_t>(status.st_size);
+        total += sizes[i];
+    }
+    // The current file is the last one and is always kept
+    for (size_t i = 0; i + 1 < existing.size() && total > m_max_total_bytes; ++i)
+        if (::unlink(existing[i].c_str()) == 0)
+            total -= sizes[i];
+}
+
+string QuoteAuditLog::file_name(string const &path, uint64_t index)
+{
+    string number = to_string(index);
+    number.insert(0, number.size() < 6 ? 6 - number.size() : 0, '0');
+    return path + "." + number;
+}
+
+vector<string> QuoteAuditLog::files(string const &path)
+{
+    size_t const slash = path.rfind('/');
+    string const directory = slash == string::npos ? "." : path.substr(0, slash + 1);
+    string const prefix = (slash == string::npos ? path : path.substr(slash + 1)) + ".";
+    vector<pair<uint64_t, string> > found;
+    if (DIR *const dir = ::opendir(directory.c_str()))
+    {
+        while (dirent const *const entry = ::readdir(dir))
+        {
+            string const name = entry->d_name;
+            if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+                name.find_first_not_of("0123456789", prefix.size()) != string::npos)
+                continue;
+            uint64_t const index = stoull(name.substr(prefix.size()));
+            found.push_back(make_pair(index, file_name(path, index)));
+        }
+        ::closedir(dir);
+    }
+    sort(found.begin(), found.end());
+    vector<string> names;
+    for (size_t i = 0; i < found.size(); ++i)
+        names.push_back(found[i].second);
+    return names;
+}
+
+QuoteAuditLog::Ring &QuoteAuditLog::local_ring()
+{
+    static thread_local uint64_t cached_log = 0;
+    static thread_local Ring *cached_ring = nullptr;
+    static thread_local vector<pair<uint64_t, Ring *> > rings;
+    if (cached_log == m_id)
+        return *cached_ring;
+    Ring *ring = nullptr;
+    for (size_t i = 0; i < rings.size() && !ring; ++i)
+        if (rings[i].first == m_id)
+            ring = rings[i].second;
+    if (!ring)
+    {
+        lock_guard<mutex> const lock(m_mutex);
+        m_rings.push_back(unique_ptr<Ring>(new Ring(m_capacity, static_cast<uint32_t>(m_rings.size()))));
+        ring = m_rings.back().get();
+        rings.push_back(make_pair(m_id, ring));
+    }
+    cached_log = m_id;
+    cached_ring = ring;
+    return *ring;
+}
+
+bool QuoteAuditLog::log(QuoteAuditRecord const &record)
+{
+    Ring &ring = local_ring();
+    uint64_t const head = ring.head.load(memory_order_relaxed);
+    if (head - ring.cached_tail >= m_capacity)
+    {
+        ring.cached_tail = ring.tail.load(memory_order_acquire);
+        if (head - ring.cached_tail >= m_capacity)
+        {
+            ring.dropped.store(ring.dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    QuoteAuditRecord &slot = ring.slots[head & (m_capacity - 1)];
+    memcpy(&slot, &record, sizeof slot);
+    slot.thread = ring.id;
+    ring.head.store(head + 1, memory_order_release);
+    return true;
+}
+
+void QuoteAuditLog::flush()
+{
+    unique_lock<mutex> lock(m_mutex);
+    uint64_t const request = ++m_flush_requested;
+    m_wake.notify_all();
+    m_drained.wait(lock, [this, request]() { return m_flush_done >= request; });
+    if (!m_error.empty())
+    {
+        string const error = m_error;
+        m_error.clear();
+        throw runtime_error(error);
+    }
+}
+
+uint64_t QuoteAuditLog::dropped() const
+{
+    lock_guard<mutex> const lock(m_mutex);
+    uint64_t total = m_lost;
+    for (size_t i = 0; i < m_rings.size(); ++i)
+        total += m_rings[i]->dropped.load(memory_order_relaxed);
+    return total;
+}
+
+void QuoteAuditLog::drain_loop()
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (true)
+    {
+        m_wake.wait_for(lock, m_interval, [this]() { return m_stop || m_flush_requested != m_flush_done; });
+        bool const stopping = m_stop;
+        uint64_t const request = m_flush_requested;
+        vector<Ring *> rings;
+        for (size_t i = 0; i < m_rings.size(); ++i)
+            rings.push_back(m_rings[i].get());
+        lock.unlock();
+
+        string raw;
+        size_t count = 0;
+        uint64_t drops = 0;
+        for (size_t r = 0; r < rings.size(); ++r)
+        {
+            Ring &ring = *rings[r];
+            uint64_t const tail = ring.tail.load(memory_order_relaxed);
+            uint64_t const head = ring.head.load(memory_order_acquire);
+            for (uint64_t i = tail; i < head; ++i)
+                raw.append(reinterpret_cast<char const *>(&ring.slots[i & (m_capacity - 1)]), sizeof(QuoteAuditRecord));
+            ring.tail.store(head, memory_order_release);
+            count += head - tail;
+            drops += ring.dropped.load(memory_order_relaxed);
+        }
+        // Only the drain thread changes m_lost, it reads it without the lock
+        uint64_t const lost = m_lost;
+        string error;
+        if (count > 0 || drops + lost != m_reported_drops)
+        {
+            try
+            {
+                write_block(raw, count, drops + lost - m_reported_drops);
+            }
+            catch (runtime_error const &e)
+            {
+                error = e.what();
+                // Part of the block may be in the file, the next one starts a new file after it
+                m_file.close();
+                m_file.clear();
+            }
+        }
+
+        lock.lock();
+        if (!error.empty())
+        {
+            m_error = error;
+            m_lost += count;
+        }
+        else
+        {
+            m_written += count;
+            m_reported_drops = drops + lost;
+        }
+        m_flush_done = request;
+        m_drained.notify_all();
+        if (stopping)
+            return;
+    }
+}
+
+void QuoteAuditLog::write_block(string const &raw, size_t count, uint64_t dropped)
+{
+    string encoded;
+    char previous[sizeof(QuoteAuditRecord)] = {};
+    for (size_t offset = 0; offset < raw.size(); offset += sizeof(QuoteAuditRecord))
+    {
+        char delta[sizeof(QuoteAuditRecord)];
+        for (size_t i = 0; i < sizeof delta; ++i)
+        {
+            delta[i] = static_cast<char>(raw[offset + i] ^ previous[i]);
+            previous[i] = raw[offset + i];
+        }
+        for (size_t i = 0; i < sizeof delta;)
+        {
+            size_t run = i;
+            while (run < sizeof delta && run - i < 128 && delta[run] == 0)
+                ++run;
+            if (run > i)
+            {
+                encoded.push_back(static_cast<char>(127 + (run - i)));
+                i = run;
+                continue;
+            }
+            size_t end = i;
+            while (end < sizeof delta && end - i < 128 && delta[end] != 0)
+                ++end;
+            encoded.push_back(static_cast<char>(end - i - 1));
+            encoded.append(delta + i, end - i);
+            i = end;
+        }
+    }
+
+    string block;
+    if (count > 0 || dropped > 0)
+    {
+        ByteWriter writer(block);
+        writer.put(block_magic);
+        writer.put(static_cast<uint32_t>(count));
+        writer.put(static_cast<uint32_t>(encoded.size()));
+        writer.put(crc32(encoded.data(), encoded.size()));
+        writer.put(dropped);
+        block += encoded;
+    }
+    if (!m_file.is_open() || (m_file_size > file_header_size && m_file_size + block.size() > m_max_file_bytes))
+    {
+        m_file.close();
+        m_file.clear();
+        string const name = file_name(m_path, ++m_file_index);
+        m_file.open(name, ios::binary | ios::trunc);
+        string header("MAILAUD1", 8);
+        ByteWriter(header).put(m_city_fingerprint);
+        if (!m_file.write(header.data(), static_cast<streamsize>(header.size())))
+            throw runtime_error("Failed to write quote audit log " + name);
+        m_file_size = header.size();
+        remove_old_files();
+    }
+    if (!m_file.write(block.data(), static_cast<streamsize>(block.size())) || !m_file.flush())
+        throw runtime_error("Failed to write quote audit log " + file_name(m_path, m_file_index));
+    m_file_size += block.size();
+}
+
+QuoteAuditFile QuoteAuditLog::read(string const &file)
+{
+    ifstream stream(file, ios::binary);
+    if (!stream)
+        throw runtime_error("Failed to open quote audit log " + file);
+    string const content((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    if (content.size() < file_header_size || content.compare(0, 8, "MAILAUD1") != 0)
+        throw runtime_error("Not a quote audit log: " + file);
+    QuoteAuditFile result = {0, 0, vector<QuoteAuditRecord>()};
+    result.city_fingerprint = ByteReader(content.data() + 8, content.data() + file_header_size).get<uint64_t>();
+    size_t offset = file_header_size;
+    while (content.size() - offset >= block_header_size)
+    {
+        ByteReader header(content.data() + offset, content.data() + offset + block_header_size);
+        uint32_t const magic = header.get<uint32_t>();
+        size_t const count = header.get<uint32_t>(), size = header.get<uint32_t>();
+        uint32_t const checksum = header.get<uint32_t>();
+        uint64_t const dropped = header.get<uint64_t>();
+        if (magic != block_magic)
+            throw runtime_error("Corrupt quote audit log: " + file);
+        if (content.size() - offset - block_header_size < size)
+            break;
+        char const *cursor = content.data() + offset + block_header_size;
+        char const *const end = cursor + size;
+        if (crc32(cursor, size) != checksum)
+            throw runtime_error("Corrupt quote audit log: " + file);
+
+        char previous[sizeof(QuoteAuditRecord)] = {};
+        for (size_t r = 0; r < count; ++r)
+        {
+            for (size_t i = 0; i < sizeof previous;)
+            {
+                if (cursor == end)
+                    throw runtime_error("Corrupt quote audit log: " + file);
+                unsigned char const control = static_cast<unsigned char>(*cursor++);
+                size_t const length = control < 128 ? control + 1U : control - 127U;
+                if (i + length > sizeof previous || (control < 128 && static_cast<size_t>(end - cursor) < length))
+                    throw runtime_error("Corrupt quote audit log: " + file);
+                if (control < 128)
+                {
+                    for (size_t k = 0; k < length; ++k)
+                        previous[i + k] ^= cursor[k];
+                    cursor += length;
+                }
+                i += length;
+            }
+            QuoteAuditRecord record;
+            memcpy(&record, previous, sizeof record);
+            result.records.push_back(record);
+        }
+        if (cursor != end)
+            throw runtime_error("Corrupt quote audit log: " + file);
+        result.dropped += dropped;
+        offset += block_header_size + size;
+    }
+    return result;
+}
+
+/*!
+ * @brief   `mail::Session` is a class that runs the shipping dialogue of `mail::interface` as a resumable state machine.
+ * @details Input is pushed in with `feed` in chunks of any size and the replies are collected with `take_output`, so
+ *          a session never blocks on I/O and any number of them can share a thread. The prompts and the order of
+ *          the questions are the ones of the console, which itself runs on a `mail::Session`. Like `std::cin >>`,
+ *          answers are separated by whitespace and the yes/no answers are a single character; a number that does
+ *          not parse, or that is not positive and within the bounds of `max_package_quantity`, `max_package_weight`
+ *          and `max_package_side`, is asked again. With a postal index, `-` as a city stands for the city of the postal code just
+ *          given. A route without a lane whose distance can be estimated from the coordinates of its cities is
+ *          quoted on the estimate, which the reply says and the audit record flags with `audit_estimated`. A session
+ *          that defers its records does not append a confirmed shipment itself: it waits in `record_shipment` with
+ *          the shipment in `pending_record` until `recorded` tells it the outcome, so that its thread never waits
+ *          for the ledger.
+ */
+class Session
+{
+  public:
+    enum state_type
+    {
+        user_type,
+        user_name,
+        user_email,
+        user_phone_number,
+        origin_country,
+        origin_postal_code,
+        origin_city,
+        destination_country,
+        destination_postal_code,
+        destination_city,
+        consignee_name,
+        consignee_email,
+        consignee_phone_number,
+        shipment_mode,
+        package_quantity,
+        package_weight,
+        package_length,
+        package_width,
+        package_height,
+        freight_type,
+        confirm_shipment,
+        record_shipment,
+        confirm_quit,
+        done
+    };
+
+  private:
+    state_type m_state;
+    ShipmentLedger *m_ledger;
+    QuoteGrid const *m_grid;
+    PostalIndex const *m_postal;
+    QuoteAuditLog *m_audit;
+    DistanceReplica const *m_distances;
+    bool m_defer_records;
+    string m_input;
+    size_t m_cursor;
+    bool m_input_closed;
+    ostringstream m_output;
+    string m_user_type, m_user_name, m_user_email, m_user_phone_number;
+    string m_origin_country, m_origin_postal_code, m_origin_city;
+    string m_destination_country, m_destination_postal_code, m_destination_city;
+    string m_consignee_name, m_consignee_email, m_consignee_phone_number;
+    unsigned int m_quantity;
+    long double m_weight, m_length, m_width, m_height;
+    unique_ptr<ShipmentInfo> m_info;
+
+    static bool is_space(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+    bool next_token(string &token);
+    bool next_char(char &c);
+    void prompt_account();
+    bool resolve_city(string const &country, string const &postal_code, string &city);
+    void quote(size_t freight);
+    void answer(string const &token);
+    void answer(char c);
+    void prompt_quit(string const &error);
+    void process();
+
+  public:
+    /*!
+     * @brief   `mail::Session::Session` is a constructor that starts a dialogue with the welcome banner.
+     * @param   ledger The ledger confirmed shipments are recorded in, none if `nullptr`
+     * @param   grid The precomputed preset quotes, none if `nullptr`
+     * @param   postal The postal codes that a city can be resolved from, none if `nullptr`
+     * @param   audit The log every quote is recorded in, none if `nullptr`
+     * @param   distances The replica of `mail::route_to_distance` to look lanes up in, the router itself if `nullptr`
+     * @param   defer_records `true` to leave the confirmed shipments to the caller, see `pending_record`
+     */
+    explicit Session(ShipmentLedger *ledger = nullptr, QuoteGrid const *grid = nullptr,
+                     PostalIndex const *postal = nullptr, QuoteAuditLog *audit = nullptr,
+                     DistanceReplica const *distances = nullptr, bool defer_records = false);
+    Session(Session const &) = delete;
+    Session &operator=(Session const &) = delete;
+    /*!
+     * @brief   `mail::Session::feed` is a function that hands input to the session and runs it as far as it goes.
+     * @param   data The beginning of the input
+     * @param   size The number of bytes
+     */
+    void feed(char const *data, size_t size);
+    /*!
+     * @brief   `mail::Session::close_input` is a function that tells the session no more input will come.
+     * @details An answer at the very end of the input without a trailing newline is taken as complete.
+     */
+    void close_input();
+    /*!
+     * @brief   `mail::Session::take_output` is a function that returns and clears the replies produced so far.
+     * @return  `std::string` The replies
+     */
+    string take_output();
+    /*!
+     * @brief   `mail::Session::buffered` is a function that returns the input fed but not consumed yet.
+     * @return  `std::size_t` The bytes of an answer still incomplete, or of the answers waiting for `recorded`
+     */
+    size_t buffered() const
+    {
+        return m_input.size() - m_cursor;
+    }
+    /*!
+     * @brief   `mail::Session::pending_record` is a function that returns the shipment waiting to be recorded.
+     * @return  `mail::ShipmentInfo const *` The confirmed shipment in `record_shipment`, `nullptr` otherwise
+     */
+    ShipmentInfo const *pending_record() const
+    {
+        return m_state == record_shipment ? m_info.get() : nullptr;
+    }
+    /*!
+     * @brief   `mail::Session::recorded` is a function that tells the session the outcome of `pending_record` and
+     *          runs it on with the input it holds.
+     * @param   error The reason the shipment was not recorded, empty if it was
+     * @throws  `std::logic_error` If no shipment is waiting to be recorded
+     */
+    void recorded(string const &error);
+    /*!
+     * @brief   `mail::Session::state` is a function that returns the question the session waits an answer for.
+     * @return  `mail::Session::state_type` The current state
+     */
+    state_type state() const
+    {
+        return m_state;
+    }
+    /*!
+     * @brief   `mail::Session::finished` is a function that checks if the user has quit.
+     * @return  `bool` `true` once the user has answered yes to quitting, `false` otherwise
+     */
+    bool finished() const
+    {
+        return m_state == done;
+    }
+};
+
+Session::Session(ShipmentLedger *ledger, QuoteGrid const *grid, PostalIndex const *postal, QuoteAuditLog *audit,
+                 DistanceReplica const *distances, bool defer_records)
+    : m_state(user_type)
+    , m_ledger(ledger)
+    , m_grid(grid)
+    , m_postal(postal)
+    , m_audit(audit)
+    , m_distances(distances)
+    , m_defer_records(defer_records)
+    , m_input()
+    , m_cursor(0)
+    , m_input_closed(false)
+    , m_output()
+    , m_user_type()
+    , m_user_name()
+    , m_user_email()
+    , m_user_phone_number()
+    , m_origin_country()
+    , m_origin_postal_code()
+    , m_origin_city()
+    , m_destination_country()
+    , m_destination_postal_code()
+    , m_destination_city()
+    , m_consignee_name()
+    , m_consignee_email()
+    , m_consignee_phone_number()
+    , m_quantity(0)
+    , m_weight(0)
+    , m_length(0)
+    , m_width(0)
+    , m_height(0)
+    , m_info()
+{
+    m_output << "********************* Ship now *********************" << '\n';
+    m_output << "*******1.Please enter your account******************" << '\n';
+    m_output << "****** 2.Enter your departure and destination ******" << '\n';
+    m_output << "****** 3.Enter your service type *******************" << '\n';
+    m_output << "****** 4.Describe your shipment ********************" << '\n';
+    m_output << "****** 5.Get shipping prices ***********************" << '\n';
+    prompt_account();
+}
+
+void Session::feed(char const *data, size_t size)
+{
+    if (m_cursor == m_input.size())
+    {
+        m_input.clear();
+        m_cursor = 0;
+    }
+    m_input.append(data, size);
+    process();
+}
+
+void Session::close_input()
+{
+    m_input_closed = true;
+    process();
+}
+
+string Session::take_output()
+{
+    string const output = m_output.str();
+    m_output.str(string());
+    return output;
+}
+
+void Session::recorded(string const &error)
+{
+    if (m_state != record_shipment)
+        throw logic_error("No shipment is waiting to be recorded");
+    prompt_quit(error);
+    process();
+}
+
+bool Session::next_token(string &token)
+{
+    while (m_cursor < m_input.size() && is_space(m_input[m_cursor]))
+        ++m_cursor;
+    size_t end = m_cursor;
+    while (end < m_input.size() && !is_space(m_input[end]))
+        ++end;
+    // A token touching the end of the input may still be growing
+    if (end == m_cursor || (end == m_input.size() && !m_input_closed))
+        return false;
+    token.assign(m_input, m_cursor, end - m_cursor);
+    m_cursor = end;
+    return true;
+}
+
+bool Session::next_char(char &c)
+{
+    while (m_cursor < m_input.size() && is_space(m_input[m_cursor]))
+        ++m_cursor;
+    if (m_cursor == m_input.size())
+        return false;
+    c = m_input[m_cursor++];
+    return true;
+}
+
+void Session::process()
+{
+    while (m_state != done && m_state != record_shipment)
+    {
+        if (m_state == confirm_shipment || m_state == confirm_quit)
+        {
+            char c;
+            if (!next_char(c))
+                return;
+            answer(c);
+        }
+        else
+        {
+            string token;
+            if (!next_token(token))
+                return;
+            answer(token);
+        }
+    }
+}
+
+void Session::prompt_account()
+{
+    m_output << "Account" << '\n';
+    m_output << "I am shipping as a.... ( business | private  )" << '\n';
+    m_state = user_type;
+}
+
+bool Session::resolve_city(string const &country, string const &postal_code, string &city)
+{
+    PostalIndex::Match const match = m_postal ? m_postal->find(country, postal_code) : PostalIndex::Match();
+    if (!match)
+    {
+        m_output << "Postal code " << country << ' ' << postal_code << " is not known." << '\n';
+        return false;
+    }
+    city = m_postal->name(match.city);
+    m_output << "Postal code " << country << ' ' << postal_code << " is in " << city << " ("
+             << m_postal->name(match.zone) << " zone)." << '\n';
+    return true;
+}
+
+void Session::quote(size_t freight)
+{
+    PostalAddress const origin(m_user_type, m_origin_country, m_origin_postal_code, m_origin_city);
+    PostalAddress const destination(m_user_type, m_destination_country, m_destination_postal_code, m_destination_city);
+    PackageInfo const package(m_length, m_width, m_height, m_weight, m_quantity);
+    m_info.reset(new ShipmentInfo(origin, destination, package, UserInfo(m_user_name, m_user_email, m_user_phone_number),
+                                  UserInfo(m_consignee_name, m_consignee_email, m_consignee_phone_number),
+                                  string(*freights[freight]), 0));
+    m_output << '\n';
+
+    CityIndex const &cities = route_to_distance.cities();
+    CityIndex::IdType const origin_id = cities.id_of(m_origin_city), destination_id = cities.id_of(m_destination_city);
+    size_t const preset = QuoteGrid::preset_of(package, freight);
+    RouteToDistance::LookupResult lane = {false, 0, false};
+    if (origin_id != CityIndex::npos && destination_id != CityIndex::npos)
+        lane = m_distances ? m_distances->lookup(origin_id, destination_id)
+                           : route_to_distance.lookup(origin_id, destination_id);
+    if (!lane)
+        lane = route_to_distance.estimate(m_origin_city, m_destination_city);
+    unsigned const distance = lane.distance;
+    Money cost;
+    bool const from_grid =
+        m_grid && preset != QuoteGrid::npos && m_grid->find(origin_id, destination_id, preset, freight, cost);
+    try
+    {
+        if (!from_grid)
+            cost = quote_cost(*freights[freight], package, distance);
+    }
+    catch (out_of_range const &)
+    {
+        m_info.reset();
+        m_output << "The shipment is too large to be quoted." << '\n';
+        m_output << "Please enter the quantity of the package" << '\n';
+        m_state = package_quantity;
+        return;
+    }
+    m_info->setCost(cost);
+    if (m_audit)
+        m_audit->log(audit_record(origin_id, destination_id, distance, *freights[freight], package, cost,
+                                  (from_grid ? audit_from_grid : 0) | (lane.estimated ? audit_estimated : 0)));
+
+    if (lane.estimated)
+        m_output << "The distance from " << m_origin_city << " to " << m_destination_city << " is estimated: "
+                 << distance << " km." << '\n';
+    m_output << "The shipping fee is: " << m_info->getCost() << '\n';
+    m_output << '\n';
+    m_output << "Details are as follows" << '\n';
+    m_info->display(m_output);
+    m_output << "Do you want to confirm the shipment? (y/n): ";
+    m_state = confirm_shipment;
+}
+
+void Session::answer(string const &token)
+{
+    char *end = nullptr;
+    switch (m_state)
+    {
+    case user_type:
+        m_user_type = token;
+        m_output << "please enter your account:( name | email | phone number ) " << '\n';
+        m_state = user_name;
+        break;
+    case user_name:
+        m_user_name = token;
+        m_state = user_email;
+        break;
+    case user_email:
+        m_user_email = token;
+        m_state = user_phone_number;
+        break;
+    case user_phone_number:
+        m_user_phone_number = token;
+        m_output << "Login successful!" << '\n';
+        m_output << '\n';
+        m_output << "Origin and Destination" << '\n';
+        m_output << "Please enter your origin: ( country | postal code | city ) ";
+        m_state = origin_country;
+        break;
+    case origin_country:
+        m_origin_country = token;
+        m_state = origin_postal_code;
+        break;
+    case origin_postal_code:
+        m_origin_postal_code = token;
+        m_state = origin_city;
+        break;
+    case origin_city:
+    {
+        if (token != "-")
+            m_origin_city = token;
+        else if (!resolve_city(m_origin_country, m_origin_postal_code, m_origin_city))
+        {
+            m_output << "Please re-enter your origin city: ";
+            break;
+        }
+        CityCheck const check = check_city(route_to_distance.cities(), m_origin_city);
+        if (check.id == CityIndex::npos &&
+            route_to_distance.geo_index().cities().id_of(m_origin_city) == CityIndex::npos)
+        {
+            m_output << describe_city_check(m_origin_city, check) << '\n';
+            m_output << "Please re-enter your origin city: ";
+            break;
+        }
+        m_output << "Please enter your destination: ( country | postal code | city ) ";
+        m_state = destination_country;
+        break;
+    }
+    case destination_country:
+        m_destination_country = token;
+        m_state = destination_postal_code;
+        break;
+    case destination_postal_code:
+        m_destination_postal_code = token;
+        m_state = destination_city;
+        break;
+    case destination_city:
+    {
+        if (token != "-")
+            m_destination_city = token;
+        else if (!resolve_city(m_destination_country, m_destination_postal_code, m_destination_city))
+        {
+            m_output << "Please re-enter your destination city: ";
+            break;
+        }
+        RouteCheck const check =
+            validate_routes(vector<pair<string, string> >(1, make_pair(m_origin_city, m_destination_city)), 1).front();
+        if (!check.valid())
+        {
+            if (check.destination.id == CityIndex::npos &&
+                route_to_distance.geo_index().cities().id_of(m_destination_city) == CityIndex::npos)
+                m_output << describe_city_check(m_destination_city, check.destination) << '\n';
+            else
+                m_output << "No route from " << m_origin_city << " to " << m_destination_city << "." << '\n';
+            m_output << "Please re-enter your destination city: ";
+            break;
+        }
+        m_output << "Please enter the consignee information: ( name | email | phone number )" << '\n';
+        m_state = consignee_name;
+        break;
+    }
+    case consignee_name:
+        m_consignee_name = token;
+        m_state = consignee_email;
+        break;
+    case consignee_email:
+        m_consignee_email = token;
+        m_state = consignee_phone_number;
+        break;
+    case consignee_phone_number:
+        m_consignee_phone_number = token;
+        m_output << '\n';
+        ShipmentMode().selectShipmentMode(m_output);
+        m_output << "Enter your choice (1, 2, or 3): ";
+        m_state = shipment_mode;
+        break;
+    case shipment_mode:
+    {
+        long const choice = strtol(token.c_str(), &end, 10);
+        if (*end != '\0')
+        {
+            m_output << "Invalid input, please re-enter: ";
+            break;
+        }
+        ShipmentMode shipment(static_cast<int>(choice), m_user_type, m_output);
+        shipment.setshipmentMode(static_cast<int>(choice), m_output);
+        m_output << "Package Description" << '\n';
+        m_output << "Please enter the quantity of the package" << '\n';
+        m_state = package_quantity;
+        break;
+    }
+    case package_quantity:
+    {
+        unsigned long const quantity = strtoul(token.c_str(), &end, 10);
+        if (*end != '\0' || token[0] == '-' || quantity == 0 || quantity > max_package_quantity)
+        {
+            m_output << "Invalid input, please re-enter: ";
+            break;
+        }
+        m_quantity = static_cast<unsigned int>(quantity);
+        m_output << "Please enter your weight(kg): " << '\n';
+        m_state = package_weight;
+        break;
+    }
+    case package_weight:
+    case package_length:
+    case package_width:
+    case package_height:
+    {
+        long double const value = strtold(token.c_str(), &end);
+        long double const bound = m_state == package_weight ? max_package_weight : max_package_side;
+        if (*end != '\0' || !isfinite(value) || !(value > 0) || value > bound)
+        {
+            m_output << "Invalid input, please re-enter: ";
+            break;
+        }
+        if (m_state == package_weight)
+        {
+            m_weight = value;
+            m_output << "Please enter your length(cm): " << '\n';
+            m_state = package_length;
+        }
+        else if (m_state == package_length)
+        {
+            m_length = value;
+            m_output << "Please enter your width(cm): " << '\n';
+            m_state = package_width;
+        }
+        else if (m_state == package_width)
+        {
+            m_width = value;
+            m_output << "Please enter your height(cm): " << '\n';
+            m_state = package_height;
+        }
+        else
+        {
+            m_height = value;
+            m_output << '\n';
+            m_output << "Mode of transport" << '\n';
+            m_output << "Please enter a number to select your shipping type: ( Ocean transport(1) | Air transport(2) | "
+                        "Rail Freight(3)) ";
+            m_state = freight_type;
+        }
+        break;
+    }
+    case freight_type:
+    {
+        long const type = strtol(token.c_str(), &end, 10);
+        if (*end != '\0' || type < 1 || type > 3)
+        {
+            m_output << "Invalid input, please re-enter: ";
+            break;
+        }
+        quote(static_cast<size_t>(type - 1)); // The menu follows the order of `mail::freights`
+        break;
+    }
+    default:
+        throw logic_error("Session: unexpected answer");
+    }
+}
+
+void Session::answer(char c)
+{
+    bool const yes = c == 'y' || c == 'Y';
+    if (m_state == confirm_shipment)
+    {
+        if (yes)
+        {
+            m_output << "Shipment confirmed. Please proceed to payment." << '\n';
+            m_output << "Payment successful. Thank you!" << '\n';
+            if (m_ledger && m_defer_records)
+            {
+                m_state = record_shipment;
+                return;
+            }
+            string error;
+            if (m_ledger)
+            {
+                try
+                {
+                    m_ledger->append(*m_info);
+                }
+                catch (exception const &e)
+                {
+                    error = e.what();
+                }
+            }
+            prompt_quit(error);
+            return;
+        }
+        m_output << "Shipment not confirmed." << '\n';
+        prompt_quit(string());
+        return;
+    }
+    if (yes)
+    {
+        m_output << "Thank you for your use !" << '\n';
+        m_state = done;
+        return;
+    }
+    prompt_account();
+}
+
+void Session::prompt_quit(string const &error)
+{
+    if (!error.empty())
+        m_output << "The shipment could not be recorded: " << error << '\n';
+    m_output << "Do you want to quit? (Y/N): " << '\n';
+    m_state = confirm_quit;
+}
+
+/*!
+ * @brief   `mail::SessionServer` is a class that serves `mail::Session`s to TCP clients over non-blocking sockets.
+ * @details Every connection gets its own session. Each worker thread runs a `poll()` loop over its connections and
+ *          the shared listening socket, so a few threads carry thousands of concurrent dialogues. A connection is
+ *          closed once its session has finished and its replies are sent, or once the client has hung up.
+ *          Confirmed shipments are handed to the ledger's committer without waiting: the session pauses, the
+ *          worker serves its other connections, and the committer wakes it through a pipe once the group commit
+ *          is durable to resume the session. A connection is read from only while less than `max_buffered` bytes
+ *          of its input and of its replies wait, so a client that sends without reading cannot grow either
+ *          without bound; one whose single answer is longer than that is dropped. A session that throws is closed
+ *          on its own and the worker carries on. With replicas, every worker is
+ *          pinned to a memory node and its sessions look lanes up in the replica of that node.
+ */
+class SessionServer
+{
+  private:
+    int m_listener;
+    /*!
+     * @brief   `mail::SessionServer::m_stop_pipe` is written to by `stop` to wake up every worker.
+     */
+    int m_stop_pipe[2];
+    uint16_t m_port;
+    ShipmentLedger *m_ledger;
+    QuoteGrid const *m_grid;
+    PostalIndex const *m_postal;
+    QuoteAuditLog *m_audit;
+    ReplicatedRouteIndex const *m_replicas;
+
+    /*!
+     * @brief   `mail::SessionServer::max_buffered` is the bytes of input or of replies above which a connection is
+     *          not read from.
+     */
+    static size_t const max_buffered = 65536;
+
+    struct connection
+    {
+        /*!
+         * @brief   `mail::SessionServer::connection::id` tells the connection apart from an earlier one that had the
+         *          same descriptor.
+         */
+        uint64_t id;
+        unique_ptr<Session> session;
+        string pending;
+        bool input_closed;
+        /*!
+         * @brief   `mail::SessionServer::connection::recording` is `true` while the ledger commits the shipment of
+         *          the session.
+         */
+        bool recording;
+
+        connection()
+            : id(0)
+            , session()
+            , pending()
+            , input_closed(false)
+            , recording(false)
+        {}
+    };
+    /*!
+     * @brief   `mail::SessionServer::outcome` is the outcome of the record of a connection.
+     */
+    struct outcome
+    {
+        int fd;
+        uint64_t id;
+        string error;
+    };
+    /*!
+     * @brief   `mail::SessionServer::outcomes` is where the committer of the ledger leaves the outcomes of the records
+     *          of a worker, which it wakes up through a pipe. The callbacks share it, so it outlives a worker that
+     *          stops before its records are durable.
+     */
+    struct outcomes
+    {
+        mutex lock;
+        vector<outcome> done;
+        int pipe[2];
+
+        outcomes()
+            : lock()
+            , done()
+            , pipe()
+        {
+            if (::pipe2(pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+                throw runtime_error("Failed to create pipe: " + string(strerror(errno)));
+        }
+        outcomes(outcomes const &) = delete;
+        outcomes &operator=(outcomes const &) = delete;
+        ~outcomes()
+        {
+            ::close(pipe[0]);
+            ::close(pipe[1]);
+        }
+    };
+
+    static void set_non_blocking(int fd)
+    {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    /*!
+     * @brief   `mail::SessionServer::record` is a function that hands the shipment a session waits on to the ledger.
+     * @details If the ledger refuses it at once, the session is told so and runs on, until it waits on another
+     *          shipment or on input.
+     * @param   fd The descriptor of the connection
+     * @param   client The connection
+     * @param   recorded Where the outcome is to be left
+     */
+    void record(int fd, connection &client, shared_ptr<outcomes> const &recorded) const;
+    void serve(unsigned worker) const;
+
+  public:
+    /*!
+     * @brief   `mail::SessionServer::SessionServer` is a constructor that listens on the loopback interface.
+     * @param   port The TCP port, 0 for any free port
+     * @param   ledger The ledger confirmed shipments are recorded in, none if `nullptr`
+     * @param   grid The precomputed preset quotes, none if `nullptr`
+     * @param   postal The postal codes that cities can be resolved from, none if `nullptr`
+     * @param   audit The log every quote is recorded in, none if `nullptr`
+     * @param   replicas The per-node replicas of `mail::route_to_distance` workers are pinned to, none if `nullptr`
+     * @throws  `std::runtime_error` If the socket cannot be set up
+     */
+    SessionServer(uint16_t port, ShipmentLedger *ledger, QuoteGrid const *grid = nullptr,
+                  PostalIndex const *postal = nullptr, QuoteAuditLog *audit = nullptr,
+                  ReplicatedRouteIndex const *replicas = nullptr);
+    SessionServer(SessionServer const &) = delete;
+    SessionServer &operator=(SessionServer const &) = delete;
+    ~SessionServer();
+    /*!
+     * @brief   `mail::SessionServer::port` is a function that returns the port the server listens on.
+     * @return  `uint16_t` The port
+     */
+    uint16_t port() const
+    {
+        return m_port;
+    }
+    /*!
+     * @brief   `mail::SessionServer::run` is a function that serves clients until `stop` is called.
+     * @param   threads The number of worker threads, the calling thread being the first
+     */
+    void run(unsigned threads) const;
+    /*!
+     * @brief   `mail::SessionServer::stop` is a function that makes `run` return; open connections are dropped.
+     */
+    void stop() const;
+};
+
+SessionServer::SessionServer(uint16_t port, ShipmentLedger *ledger, QuoteGrid const *grid,
+                             PostalIndex const *postal, QuoteAuditLog *audit, ReplicatedRouteIndex const *replicas)
+    : m_listener(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))
+    , m_stop_pipe()
+    , m_port(port)
+    , m_ledger(ledger)
+    , m_grid(grid)
+    , m_postal(postal)
+    , m_audit(audit)
+    , m_replicas(replicas)
+{
+    if (m_listener < 0)
+        throw runtime_error("Failed to create socket: " + string(strerror(errno)));
+    int const reuse = 1;
+    ::setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t length = sizeof address;
+    if (::bind(m_listener, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0 ||
+        ::listen(m_listener, SOMAXCONN) != 0 ||
+        ::getsockname(m_listener, reinterpret_cast<sockaddr *>(&address), &length) != 0 ||
+        ::pipe2(m_stop_pipe, O_CLOEXEC) != 0)
+    {
+        string const error = strerror(errno);
+        ::close(m_listener);
+        throw runtime_error("Failed to listen on port " + to_string(port) + ": " + error);
+    }
+    set_non_blocking(m_listener);
+    m_port = ntohs(address.sin_port);
+}
+
+size_t const SessionServer::max_buffered;
+
+SessionServer::~SessionServer()
+{
+    ::close(m_listener);
+    ::close(m_stop_pipe[0]);
+    ::close(m_stop_pipe[1]);
+}
+
+void SessionServer::stop() const
+{
+    char const byte = 0;
+    while (::write(m_stop_pipe[1], &byte, 1) < 0 && errno == EINTR)
+        continue;
+}
+
+void SessionServer::run(unsigned threads) const
+{
+    vector<thread> workers;
+    for (unsigned i = 1; i < max(threads, 1U); ++i)
+        workers.push_back(thread(&SessionServer::serve, this, i));
+    serve(0);
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+void SessionServer::record(int fd, connection &client, shared_ptr<outcomes> const &recorded) const
+{
+    ShipmentInfo const *info;
+    while (!client.recording && (info = client.session->pending_record()) != nullptr)
+    {
+        uint64_t const id = client.id;
+        try
+        {
+            m_ledger->append(*info, [recorded, fd, id](string const &error) {
+                outcome const result = {fd, id, error};
+                {
+                    lock_guard<mutex> const lock(recorded->lock);
+                    recorded->done.push_back(result);
+                }
+                char const byte = 0;
+                while (::write(recorded->pipe[1], &byte, 1) < 0 && errno == EINTR)
+                    continue;
+            });
+            client.recording = true;
+        }
+        catch (exception const &e)
+        {
+            client.session->recorded(e.what());
+        }
     }
-} const rail_freight;
+    client.pending += client.session->take_output();
+}
 
-// Corresponding to the CSV file format
-class PostalAddress
+void SessionServer::serve(unsigned worker) const
 {
-  protected:
-    string m_user_type;
-    string m_country;
-    string m_postal_code;
-    string m_location;
-
-  public:
-    PostalAddress() = default;
-    PostalAddress(string ut, string c, string pc, string l)
+    DistanceReplica const *distances = nullptr;
+    try
     {
-        m_user_type = ut;
-        m_country = c;
-        m_postal_code = pc;
-        m_location = l;
+        if (m_replicas)
+            distances = &m_replicas->pin_worker(worker);
     }
-
-    string getUserType() const
+    catch (runtime_error const &e)
     {
-        return m_user_type;
+        cerr << "Worker " << worker << " uses the shared distances: " << e.what() << endl;
     }
-
-    void setUserType(string ut)
+    shared_ptr<outcomes> const recorded(new outcomes());
+    map<int, connection> connections;
+    uint64_t next_id = 0;
+    vector<pollfd> fds;
+    char buffer[4096];
+    while (true)
     {
-        if (ut == "business" || ut == "private")
+        fds.clear();
+        pollfd const stop = {m_stop_pipe[0], POLLIN, 0}, listener = {m_listener, POLLIN, 0},
+                     committed = {recorded->pipe[0], POLLIN, 0};
+        fds.push_back(stop);
+        fds.push_back(listener);
+        fds.push_back(committed);
+        for (map<int, connection>::const_iterator it = connections.begin(); it != connections.end(); ++it)
         {
-            m_user_type = ut;
+            connection const &client = it->second;
+            bool const reading = !client.input_closed && client.pending.size() < max_buffered &&
+                                 client.session->buffered() < max_buffered;
+            pollfd const fd = {it->first,
+                               static_cast<short>((reading ? POLLIN : 0) | (client.pending.empty() ? 0 : POLLOUT)), 0};
+            fds.push_back(fd);
         }
-        else
+        if (::poll(fds.data(), fds.size(), -1) < 0)
         {
-            cout << "Invalid user type! Choose business or private." << endl;
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("poll failed: " + string(strerror(errno)));
+        }
+        if (fds[0].revents != 0)
+            break;
+        if (fds[1].revents & POLLIN)
+        {
+            int fd;
+            // Other workers may win the race for the same connection, then accept fails with EAGAIN
+            while ((fd = ::accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            {
+                connection &client = connections[fd];
+                client.id = next_id++;
+                client.session.reset(new Session(m_ledger, m_grid, m_postal, m_audit, distances, true));
+                client.pending = client.session->take_output();
+            }
+        }
+        if (fds[2].revents & POLLIN)
+        {
+            char drain[64];
+            while (::read(recorded->pipe[0], drain, sizeof drain) > 0)
+                continue;
+            vector<outcome> results;
+            {
+                lock_guard<mutex> const lock(recorded->lock);
+                results.swap(recorded->done);
+            }
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                map<int, connection>::iterator const it = connections.find(results[i].fd);
+                // The client may have hung up and its descriptor gone to another connection meanwhile
+                if (it == connections.end() || it->second.id != results[i].id)
+                    continue;
+                try
+                {
+                    it->second.recording = false;
+                    it->second.session->recorded(results[i].error);
+                    record(it->first, it->second, recorded);
+                }
+                catch (exception const &e)
+                {
+                    cerr << "Session on connection " << it->first << " failed: " << e.what() << '\n';
+                    ::close(it->first);
+                    connections.erase(it);
+                }
+            }
+        }
+        for (size_t i = 3; i < fds.size(); ++i)
+        {
+            if (fds[i].revents == 0)
+                continue;
+            map<int, connection>::iterator const it = connections.find(fds[i].fd);
+            if (it == connections.end())
+                continue;
+            connection &client = it->second;
+            bool drop = (fds[i].revents & (POLLERR | POLLNVAL)) != 0;
+            if (!drop && (fds[i].events & POLLIN) && (fds[i].revents & (POLLIN | POLLHUP)))
+            {
+                ssize_t const received = ::recv(fds[i].fd, buffer, sizeof buffer, 0);
+                // A session that fails takes only its own connection down, never the worker
+                try
+                {
+                    if (received > 0)
+                        client.session->feed(buffer, static_cast<size_t>(received));
+                    else if (received == 0)
+                    {
+                        client.input_closed = true;
+                        client.session->close_input();
+                    }
+                    else if (errno != EAGAIN && errno != EINTR)
+                        drop = true;
+                    record(fds[i].fd, client, recorded);
+                    // An answer this long is not going to end
+                    drop |= client.session->buffered() >= max_buffered && !client.recording &&
+                            !client.session->finished();
+                }
+                catch (exception const &e)
+                {
+                    cerr << "Session on connection " << fds[i].fd << " failed: " << e.what() << '\n';
+                    drop = true;
+                }
+            }
+            if (!drop && !client.pending.empty())
+            {
+                ssize_t const sent = ::send(fds[i].fd, client.pending.data(), client.pending.size(), MSG_NOSIGNAL);
+                if (sent > 0)
+                    client.pending.erase(0, static_cast<size_t>(sent));
+                else if (sent < 0 && errno != EAGAIN && errno != EINTR)
+                    drop = true;
+            }
+            if (drop ||
+                (client.pending.empty() && !client.recording && (client.session->finished() || client.input_closed)))
+            {
+                ::close(fds[i].fd);
+                connections.erase(it);
+            }
         }
     }
+    for (map<int, connection>::const_iterator it = connections.begin(); it != connections.end(); ++it)
+        ::close(it->first);
+}
 
-    string getCountry() const
+void interface()
+{
+    unique_ptr<ShipmentLedger> ledger;
+    try
     {
-        return m_country;
+        ledger.reset(new ShipmentLedger("shipments.log"));
     }
-
-    void setCountry(string c)
+    catch (runtime_error const &e)
     {
-        m_country = c;
+        std::cout << "Shipment history is unavailable: " << e.what() << std::endl;
     }
-
-    string getPostalCode() const
+    QuoteGrid const grid = QuoteGrid::open("quote_grid.bin");
+    unique_ptr<PostalIndex> postal;
+    try
     {
-        return m_postal_code;
+        postal.reset(new PostalIndex(PostalIndex::open("postal_codes.idx", "postal_codes.csv")));
     }
-
-    void setPostalCode(string pc)
+    catch (runtime_error const &e)
     {
-        m_postal_code = pc;
+        std::cout << "Postal codes are unavailable: " << e.what() << std::endl;
     }
-
-    std::string getLocation() const
+    unique_ptr<QuoteAuditLog> audit;
+    try
     {
-        return m_location;
+        audit.reset(new QuoteAuditLog("quotes.audit"));
+    }
+    catch (runtime_error const &e)
+    {
+        std::cout << "Quote auditing is unavailable: " << e.what() << std::endl;
+    }
+    Session session(ledger.get(), &grid, postal.get(), audit.get());
+    std::cout << session.take_output() << std::flush;
+    std::string line;
+    while (!session.finished() && std::getline(std::cin, line))
+    {
+        line.push_back('\n');
+        session.feed(line.data(), line.size());
+        std::cout << session.take_output() << std::flush;
     }
+    session.close_input();
+    std::cout << session.take_output() << std::flush;
+}
 
-    void setLocation(string l)
+} // namespace mail
+
+namespace bench
+{
+
+/*!
+ * @brief   `bench::seconds_since` is a function that returns the seconds elapsed since `start`.
+ * @param   start The start time
+ * @return  `double` The elapsed seconds
+ */
+double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/*!
+ * @brief   `bench::find_based_parse` is the `std::find` based parser that `csv::Parser` used before dialects.
+ * @details It only understands quoted fields and is kept as the reference point for `bench::csv_throughput`.
+ * @param   data The CSV data
+ * @return  `std::size_t` The number of fields found
+ */
+size_t find_based_parse(string const &data)
+{
+    typedef string::const_iterator Iterator;
+    vector<vector<string> > records;
+    size_t fields = 0;
+    Iterator record_begin = data.begin();
+    while (record_begin != data.end())
     {
-        m_location = l;
+        Iterator const record_end = find(record_begin, data.end(), '\n');
+        vector<string> record;
+        Iterator field_begin = record_begin;
+        while (true)
+        {
+            field_begin = find(field_begin, record_end, '\"');
+            if (field_begin == record_end)
+                break;
+            Iterator const field_end = find(field_begin + 1, record_end, '\"');
+            if (field_end == record_end)
+                throw runtime_error("Invalid CSV format: missing quote");
+            record.push_back(string(field_begin + 1, field_end));
+            field_begin = field_end + 1;
+        }
+        fields += record.size();
+        records.push_back(record);
+        record_begin = record_end == data.end() ? record_end : record_end + 1;
     }
+    return fields;
+}
 
-    void display()
+/*!
+ * @brief   `bench::csv_throughput` is a function that measures how fast CSV data is split into records.
+ * @details It builds `rows` lines shaped like `distance.csv`, both quoted and unquoted, and prints the throughput of
+ *          the old `std::find` splitter and of `csv::Parser` in MB/s.
+ * @param   rows The number of data lines to generate
+ */
+void csv_throughput(size_t rows)
+{
+    string const title = "\"From City\", \"To City\", \"Distance\"";
+    string quoted = title + "\n", unquoted = "From City,To City,Distance\n";
+    for (size_t i = 0; i < rows; ++i)
     {
-        std::cout << "Country: " << m_country << std::endl;
-        std::cout << "Postal code: " << m_postal_code << std::endl;
-        std::cout << "location: " << m_location << std::endl;
+        string const from = "City" + std::to_string(i % 997), to = "Town" + std::to_string(i % 991);
+        string const distance = std::to_string(100 + i % 9000);
+        quoted += "\"" + from + "\", \"" + to + "\", \"" + distance + "\"\n";
+        unquoted += from + "," + to + "," + distance + "\n";
     }
-};
+    double const megabytes = static_cast<double>(quoted.size()) / 1e6;
 
-// Other information
-class UserInfo
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t const fields = find_based_parse(quoted);
+    double const find_seconds = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    csv::Parser quoted_parser(title);
+    quoted_parser.add_records(quoted);
+    double const quoted_seconds = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    csv::Parser unquoted_parser("From City,To City,Distance");
+    unquoted_parser.add_records(unquoted);
+    double const unquoted_seconds = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    csv::Parser column_parser(title, csv::Dialect(), csv::Parser::column_storage);
+    column_parser.add_records(quoted);
+    double const column_seconds = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    vector<unsigned> const row_distances = quoted_parser.column_as<unsigned>(2);
+    double const row_decode_seconds = seconds_since(start);
+    start = chrono::steady_clock::now();
+    vector<unsigned> const column_distances = column_parser.column_as<unsigned>(2);
+    double const column_decode_seconds = seconds_since(start);
+
+    cout << "rows: " << rows << ", fields: " << fields << '\n';
+    cout << "std::find, quoted:   " << megabytes / find_seconds << " MB/s\n";
+    cout << "csv::Parser, quoted: " << megabytes / quoted_seconds << " MB/s\n";
+    cout << "csv::Parser, plain:  " << static_cast<double>(unquoted.size()) / 1e6 / unquoted_seconds << " MB/s\n";
+    cout << "csv::Parser, quoted, column storage: " << megabytes / column_seconds << " MB/s\n";
+    cout << "column_as<unsigned>, row storage:    " << static_cast<double>(row_distances.size()) / row_decode_seconds / 1e6
+         << " M fields/s\n";
+    cout << "column_as<unsigned>, column storage: "
+         << static_cast<double>(column_distances.size()) / column_decode_seconds / 1e6 << " M fields/s\n";
+}
+
+/*!
+ * @brief   `bench::output_throughput` is a function that measures how fast quote results are written to `stdout`.
+ * @details It renders `count` copies of a quote with `mail::QuoteFormatter` through `mail::AsyncWriter`, then the same
+ *          number through `mail::ShipmentInfo::display`, and reports both times on `stderr`.
+ * @param   format The output format: `csv`, `jsonl` or `binary`
+ * @param   count The number of quotes to write
+ */
+void output_throughput(string const &format, size_t count)
 {
-  protected:
-    std::string m_name;
-    std::string m_email;
-    std::string m_phone_number;
+    mail::QuoteFormatter::format_type const type = mail::QuoteFormatter::format_of(format);
+    mail::ShipmentInfo info(mail::PostalAddress("private", "CN", "200000", "Shanghai"),
+                            mail::PostalAddress("private", "CN", "100000", "Beijing"),
+                            mail::PackageInfo(32, 24, 1, 0.5L, 2), mail::UserInfo(), mail::UserInfo(), "Air transport", 0);
+    info.setCost(123.45L);
+    mail::QuoteFormatter const formatter(type);
 
-  public:
-    UserInfo() = default;
-    UserInfo(std::string name, std::string email, std::string phone_number)
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     {
-        std::string m_name = name;
-        std::string m_email = email;
-        std::string m_phone_number = phone_number;
+        mail::AsyncWriter writer;
+        mail::OutputBuffer buffer(writer);
+        buffer.text() += formatter.header();
+        for (size_t i = 0; i < count; ++i)
+        {
+            formatter.render(buffer.text(), info);
+            buffer.commit();
+        }
+        buffer.flush();
+        writer.drain();
     }
-    std::string getName() const
+    double const formatter_seconds = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i)
+        info.display();
+    cout.flush();
+    double const display_seconds = seconds_since(start);
+
+    cerr << "quotes: " << count << '\n';
+    cerr << "QuoteFormatter (" << format << "): " << static_cast<double>(count) / formatter_seconds << " quotes/s\n";
+    cerr << "ShipmentInfo::display: " << static_cast<double>(count) / display_seconds << " quotes/s\n";
+}
+
+/*!
+ * @brief   `bench::validation_throughput` is a function that measures how fast a batch of routes is validated.
+ * @details It draws `count` routes between the cities of the distance map, misspells one city in ten, validates the
+ *          batch with `mail::validate_routes` on one thread and then on `threads` threads, and checks that both give
+ *          the same results.
+ * @param   count The number of routes
+ * @param   threads The number of threads, 0 for the number of hardware threads
+ */
+void validation_throughput(size_t count, unsigned threads)
+{
+    mail::CityIndex const &cities = mail::route_to_distance.cities();
+    mt19937_64 random(42);
+    uniform_int_distribution<mail::CityIndex::IdType> city(0, static_cast<mail::CityIndex::IdType>(cities.size() - 1));
+    vector<pair<string, string> > routes;
+    routes.reserve(count);
+    for (size_t i = 0; i < count; ++i)
     {
-        return m_name;
+        routes.push_back(make_pair(string(cities.name_of(city(random))), string(cities.name_of(city(random)))));
+        if (i % 10 == 0)
+            routes.back().first[random() % routes.back().first.size()] = 'x';
     }
 
-    void setName(const std::string &name)
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<mail::RouteCheck> const single = mail::validate_routes(routes, 1);
+    double const single_seconds = seconds_since(start);
+    start = chrono::steady_clock::now();
+    vector<mail::RouteCheck> const parallel = mail::validate_routes(routes, threads);
+    double const parallel_seconds = seconds_since(start);
+
+    size_t valid = 0, unknown = 0, mismatches = 0;
+    for (size_t i = 0; i < count; ++i)
     {
-        m_name = name;
+        valid += single[i].valid();
+        unknown += single[i].origin.id == mail::CityIndex::npos || single[i].destination.id == mail::CityIndex::npos;
+        mismatches += single[i].origin.id != parallel[i].origin.id ||
+                      single[i].origin.suggestions != parallel[i].origin.suggestions ||
+                      single[i].destination.id != parallel[i].destination.id ||
+                      single[i].lane_exists != parallel[i].lane_exists;
     }
+    cout << "routes: " << count << ", valid: " << valid << ", with an unknown city: " << unknown
+         << ", threads agree: " << (mismatches ? "MISMATCH" : "OK") << '\n';
+    cout << "validate_routes, 1 thread: " << static_cast<double>(count) / single_seconds << " routes/s\n";
+    cout << "validate_routes, " << (threads ? threads : max(1U, thread::hardware_concurrency()))
+         << " threads: " << static_cast<double>(count) / parallel_seconds << " routes/s\n";
+}
 
-    std::string getEmail() const
+/*!
+ * @brief   `bench::itinerary_throughput` is a function that measures how many multi-modal itineraries are found per second.
+ * @details It optimizes a 100 kg package between every ordered pair of cities and prints the rate and one example.
+ * @param   rounds The number of passes over all the pairs
+ */
+void itinerary_throughput(size_t rounds)
+{
+    mail::ItineraryOptimizer const optimizer(mail::route_to_distance);
+    mail::CityIndex const &cities = mail::route_to_distance.cities();
+    mail::PackageInfo const package(60, 40, 40, 25, 4);
+    size_t queries = 0, itineraries = 0;
+    chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round)
+        for (mail::CityIndex::IdType from = 0; from < cities.size(); ++from)
+            for (mail::CityIndex::IdType to = 0; to < cities.size(); ++to)
+            {
+                itineraries += optimizer.optimize(from, to, package).size();
+                ++queries;
+            }
+    double const seconds = seconds_since(start);
+    cout << "queries: " << queries << ", Pareto-optimal itineraries: " << itineraries << '\n';
+    cout << "ItineraryOptimizer: " << static_cast<double>(queries) / seconds << " quotes/s\n";
+
+    vector<mail::Itinerary> const front =
+        optimizer.optimize(cities.id_of("Shanghai"), cities.id_of("Karachi"), package);
+    for (size_t i = 0; i < front.size(); ++i)
     {
-        return m_email;
+        cout << "Shanghai -> Karachi, cost " << front[i].cost << ", hours " << front[i].hours << ':';
+        for (size_t j = 0; j < front[i].legs.size(); ++j)
+            cout << ' ' << cities.name_of(front[i].legs[j].to) << " (" << (string)(*front[i].legs[j].freight) << ')';
+        cout << '\n';
     }
+}
 
-    void setEmail(const std::string &email)
+/*!
+ * @brief   `bench::packing_throughput` is a function that measures how long consolidating a business batch takes.
+ * @details It packs `count` boxes of a few mixed sizes onto pallets and into a 20ft container and compares the
+ *          chargeable air weight of the packed units with the naive per-package volumetric weight.
+ * @param   count The number of boxes
+ */
+void packing_throughput(size_t count)
+{
+    vector<mail::PackageInfo> packages;
+    packages.push_back(mail::PackageInfo(60, 40, 40, 12, static_cast<unsigned>(count / 2)));
+    packages.push_back(mail::PackageInfo(40, 30, 20, 5, static_cast<unsigned>(count / 4)));
+    packages.push_back(mail::PackageInfo(75, 35, 35, 18, static_cast<unsigned>(count - count / 2 - count / 4)));
+    long double naive = 0;
+    for (size_t i = 0; i < packages.size(); ++i)
+        naive += mail::chargeable_weight(mail::air_freight, packages[i]);
+    for (size_t b = 0; b < 2; ++b)
     {
-        m_email = email;
+        mail::PackingEngine const engine(mail::standard_bins[b]);
+        chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+        mail::PackingResult const packing = engine.pack(packages);
+        double const seconds = seconds_since(start);
+        cout << mail::standard_bins[b].name << ": " << count << " boxes into " << packing.units.size() << " units ("
+             << packing.strategy << ", " << packing.unpacked.size() << " left over) in " << seconds * 1000 << " ms\n";
+        if (packing.unpacked.empty())
+            cout << "  chargeable air weight: " << mail::chargeable_weight(mail::air_freight, packing)
+                 << " kg, per package: " << naive << " kg\n";
+        else
+            cout << "  not quoted, some boxes do not fit\n";
     }
+}
 
-    std::string getPhoneNumber() const
+/*!
+ * @brief   `bench::ledger_throughput` is a function that measures how fast shipments are recorded and found again.
+ * @details Several threads append `count` shipments to a ledger in the temporary directory, so that group commit can
+ *          share each `fdatasync`. The ledger is then reopened, with and without its snapshot, queried and compacted.
+ * @param   count The number of shipments
+ * @param   threads The number of appending threads
+ */
+void ledger_throughput(size_t count, size_t threads)
+{
+    string const path = "/tmp/bench-ledger-" + to_string(::getpid()) + ".log";
+    mail::PostalAddress const origin("business", "CN", "200000", "Shanghai");
+    mail::PostalAddress const destination("business", "SG", "018989", "Singapore");
+    mail::PackageInfo const package(60, 40, 40, 12, 3);
+    threads = max(threads, size_t(1));
     {
-        return m_phone_number;
+        mail::ShipmentLedger ledger(path);
+        chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (size_t t = 0; t < threads; ++t)
+            workers.push_back(thread([&, t]() {
+                for (size_t i = t; i < count; i += threads)
+                {
+                    mail::UserInfo const user("user" + to_string(i % 100), "user" + to_string(i % 100) + "@example.com",
+                                              "555" + to_string(i));
+                    mail::ShipmentInfo const info(origin, destination, package, user, user, "Ocean transport", 0);
+                    ledger.append(info);
+                }
+            }));
+        for (size_t t = 0; t < threads; ++t)
+            workers[t].join();
+        double const seconds = seconds_since(start);
+        cout << "append (" << threads << " threads): " << static_cast<double>(count) / seconds << " shipments/s\n";
     }
-
-    void setPhoneNumber(const std::string &phone_number)
     {
-        m_phone_number = phone_number;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        mail::ShipmentLedger ledger(path);
+        cout << "reopen with snapshot: " << seconds_since(start) * 1000 << " ms, " << ledger.size() << " shipments\n";
+        ::unlink((path + ".snapshot").c_str());
     }
-    void display()
     {
-        std::cout << "Name: " << m_name << std::endl;
-        std::cout << "Email: " << m_email << std::endl;
-        std::cout << "Phone number: " << m_phone_number << std::endl;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        mail::ShipmentLedger ledger(path);
+        cout << "reopen by scan: " << seconds_since(start) * 1000 << " ms\n";
+        start = chrono::steady_clock::now();
+        size_t const by_user = ledger.find_by_user("user7@example.com").size();
+        cout << "find_by_user: " << by_user << " shipments in " << seconds_since(start) * 1000 << " ms\n";
+        start = chrono::steady_clock::now();
+        size_t const dropped = ledger.compact(static_cast<int64_t>(::time(nullptr)) + 86400);
+        cout << "compact: " << dropped << " dropped in " << seconds_since(start) * 1000 << " ms\n";
     }
-};
+    ::unlink(path.c_str());
+    ::unlink((path + ".snapshot").c_str());
+}
 
-// Pure storage struct, no need for any method
-struct Dimension
+/*!
+ * @brief   `bench::lookup_throughput` is a function that compares the throwing and the batch route lookups.
+ * @details Every ordered pair of cities is looked up, most of which are not lanes, so the throwing lookup unwinds
+ *          for most of them.
+ * @param   rounds The number of passes over all the pairs
+ */
+void lookup_throughput(size_t rounds)
 {
-    Centimeter length;
-    Centimeter width;
-    Centimeter height;
-};
+    mail::CityIndex const &cities = mail::route_to_distance.cities();
+    vector<mail::Route> routes;
+    for (size_t from = 0; from < cities.size(); ++from)
+        for (size_t to = 0; to < cities.size(); ++to)
+            routes.push_back(mail::make_route(mail::FromLocation(cities.name_of(static_cast<mail::CityIndex::IdType>(from))),
+                                              mail::ToLocation(cities.name_of(static_cast<mail::CityIndex::IdType>(to)))));
+    size_t const count = routes.size() * rounds;
 
-class ShipmentMode
-{
-  private:
-    int choice;
-    string userType;
-    Dimension m_dimension;
-    string ModeOfShipment;
+    uint64_t total = 0;
+    size_t missed = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round)
+        for (size_t i = 0; i < routes.size(); ++i)
+        {
+            try
+            {
+                total += mail::route_to_distance(routes[i]);
+            }
+            catch (out_of_range const &)
+            {
+                ++missed;
+            }
+        }
+    double const throwing_seconds = seconds_since(start);
 
-  public:
-    ShipmentMode() = default;
-    ShipmentMode(int c, string ut)
+    vector<mail::RouteToDistance::DistanceType> distances(routes.size());
+    vector<uint64_t> misses((routes.size() + 63) / 64);
+    uint64_t batch_total = 0;
+    size_t batch_missed = 0;
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round)
     {
-        choice = c;
-        userType = ut;
-        setshipmentMode(c);
+        batch_missed += mail::route_to_distance.lookup_many(routes.data(), routes.size(), distances.data(), misses.data());
+        batch_total += accumulate(distances.begin(), distances.end(), uint64_t(0));
     }
-    void selectShipmentMode()
+    double const batch_seconds = seconds_since(start);
+
+    cout << "lookups: " << count << ", misses: " << missed << " / " << batch_missed << ", checksum "
+         << (total == batch_total ? "equal" : "DIFFERENT") << '\n';
+    cout << "operator() with catch: " << static_cast<double>(count) / throwing_seconds << " lookups/s\n";
+    cout << "lookup_many: " << static_cast<double>(count) / batch_seconds << " lookups/s\n";
+}
+
+/*!
+ * @brief   `bench::lane_table_throughput` is a function that compares the lane table with a dense matrix.
+ * @details It prints the memory of the lanes of `distance.csv` in both forms, then builds a random network of
+ *          `cities` cities in which `symmetric` of the lanes have the same distance both ways, checks every pair of
+ *          the table against the matrix and times random lookups in both. The table is packed only above
+ *          `mail::LaneTable::dense_cities` cities.
+ * @param   cities The number of cities of the random network
+ * @param   symmetric The share of the lanes of the random network that are symmetric
+ * @param   lookups The number of random lookups
+ */
+void lane_table_throughput(size_t cities, double symmetric, size_t lookups)
+{
+    mail::LaneTable const &network = mail::route_to_distance.lanes();
+    size_t const lanes = network.lanes().size();
+    cout << "distance.csv: " << network.cities() << " cities, " << lanes << " lanes, " << network.override_count()
+         << " ways back apart, " << network.memory_usage() << " bytes in the lane table, "
+         << network.cities() * network.cities() * sizeof(mail::LaneTable::DistanceType) << " bytes as a matrix, about "
+         << lanes * (sizeof(pair<mail::Route const, mail::LaneTable::DistanceType>) + 32) << " bytes as a map\n";
+
+    mt19937_64 random(42);
+    uniform_real_distribution<double> coordinate(0, 20000), detour(1.05, 1.35), chance(0, 1);
+    vector<double> x(cities), y(cities);
+    for (size_t i = 0; i < cities; ++i)
     {
-        if (userType == "private")
-        {
-            std::cout << "Select Mode of Shipment: " << std::endl;
-            std::cout << "1. Document (32 x 24 x 1 cm)" << std::endl;
-            std::cout << "2. Moving Box (75 x 35 x 35 cm)" << std::endl;
-            std::cout << "3. Packages" << std::endl;
-            std::cout << "Enter choice: " << std::endl;
-        }
-        else if (userType == "business")
+        x[i] = coordinate(random);
+        y[i] = coordinate(random);
+    }
+    vector<mail::LaneTable::DistanceType> matrix(cities * cities, mail::LaneTable::no_lane);
+    vector<mail::LaneTable::Lane> generated;
+    for (mail::CityIndex::IdType from = 0; from < cities; ++from)
+        for (mail::CityIndex::IdType to = from + 1; to < cities; ++to)
         {
-            std::cout << "Select Mode of Shipment: " << std::endl;
-            std::cout << "1. Pallet (110 x 110 cm)" << std::endl;
-            std::cout << "2. Container" << std::endl;
-            std::cout << "3. Cargo" << std::endl;
-            std::cout << "Enter choice: " << std::endl;
+            if (chance(random) >= 0.1)
+                continue;
+            double const great_circle = hypot(x[from] - x[to], y[from] - y[to]);
+            mail::LaneTable::DistanceType const out =
+                max(1U, static_cast<mail::LaneTable::DistanceType>(great_circle * detour(random)));
+            mail::LaneTable::DistanceType const back =
+                chance(random) < symmetric ? out
+                                           : max(1U, static_cast<mail::LaneTable::DistanceType>(great_circle * detour(random)));
+            mail::LaneTable::Lane const there = {from, to, out}, home = {to, from, back};
+            generated.push_back(there);
+            generated.push_back(home);
+            matrix[from * cities + to] = out;
+            matrix[to * cities + from] = back;
         }
+    mail::LaneTable const packed(cities, generated);
+    size_t wrong = 0;
+    for (mail::CityIndex::IdType from = 0; from < cities; ++from)
+        for (mail::CityIndex::IdType to = 0; to < cities; ++to)
+            wrong += packed.distance(from, to) != matrix[from * cities + to];
+
+    vector<pair<mail::CityIndex::IdType, mail::CityIndex::IdType> > pairs(size_t(1) << 16);
+    for (size_t i = 0; i < pairs.size(); ++i)
+        pairs[i] = make_pair(static_cast<mail::CityIndex::IdType>(random() % cities),
+                             static_cast<mail::CityIndex::IdType>(random() % cities));
+    uint64_t matrix_total = 0, packed_total = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i)
+    {
+        pair<mail::CityIndex::IdType, mail::CityIndex::IdType> const &p = pairs[i % pairs.size()];
+        matrix_total += matrix[p.first * cities + p.second];
     }
-    void setshipmentMode(int choice)
+    double const matrix_seconds = seconds_since(start);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i)
     {
-        if (userType == "private")
-        {
-            switch (choice)
-            {
-            case 1:
-                m_dimension.length = 32;
-                m_dimension.width = 24;
-                m_dimension.height = 1;
-                ModeOfShipment = "document";
-                break;
-            case 2:
-                m_dimension.length = 75;
-                m_dimension.width = 35;
-                m_dimension.height = 35;
-                ModeOfShipment = "moving box";
-            case 3:
-                ModeOfShipment = "packages";
-                break;
-            default:
-                std::cout << "Invalid choice!" << std::endl;
-                break;
-            }
-        }
-        else if (userType == "business")
-        {
-            switch (choice)
-            {
-            case 1:
-                m_dimension.length = 110;
-                m_dimension.width = 110;
-                ModeOfShipment = "pallet";
-                break;
-            case 2:
-                ModeOfShipment = "container";
-                break;
-            case 3:
-                ModeOfShipment = "cargo";
-                break;
-            default:
-                std::cout << "Invalid choice \n" << std::endl;
-                break;
-            }
-            if (m_dimension.length)
-                std::cout << "Suggested length: " << m_dimension.length;
-            if (m_dimension.width)
-                std::cout << "Suggested width: " << m_dimension.width;
-            if (m_dimension.height)
-                std::cout << "Suggested height: " << m_dimension.height;
-        }
+        pair<mail::CityIndex::IdType, mail::CityIndex::IdType> const &p = pairs[i % pairs.size()];
+        packed_total += packed.distance(p.first, p.second);
+    }
+    double const packed_seconds = seconds_since(start);
+
+    char const *const form = cities > mail::LaneTable::dense_cities ? "packed" : "plain";
+    cout << "random network: " << cities << " cities, " << generated.size() << " lanes, " << packed.override_count()
+         << " ways back apart, " << packed.memory_usage() << " bytes " << form << ", "
+         << matrix.size() * sizeof(mail::LaneTable::DistanceType) << " bytes as a matrix, every pair "
+         << (wrong ? "MISMATCH" : "OK") << '\n';
+    cout << "matrix: " << matrix_seconds / lookups * 1e9 << " ns per lookup, " << form << ": " << packed_seconds / lookups * 1e9
+         << " ns per lookup, checksum " << (matrix_total == packed_total ? "equal" : "DIFFERENT") << '\n';
+}
+
+/*!
+ * @brief   `bench::geo_throughput` is a function that measures the coordinate index and the accuracy of estimates.
+ * @details Every lane with coordinates at both ends is estimated as if it were missing and compared with its listed
+ *          distance. The k-d tree is then checked against a brute-force scan on random cities spread over the globe,
+ *          and the haversine kernel is timed on its own.
+ * @param   cities The number of random cities
+ * @param   queries The number of nearest-neighbour queries
+ */
+void geo_throughput(size_t cities, size_t queries)
+{
+    mail::RouteToDistance const &router = mail::route_to_distance;
+    double error = 0;
+    size_t estimated = 0;
+    vector<mail::LaneTable::Lane> const lanes = router.routes();
+    for (size_t i = 0; i < lanes.size(); ++i)
+    {
+        mail::RouteToDistance::LookupResult const estimate =
+            router.estimate(router.cities().name_of(lanes[i].from), router.cities().name_of(lanes[i].to));
+        if (!estimate)
+            continue;
+        error += fabs(static_cast<double>(estimate.distance) - lanes[i].distance) / lanes[i].distance;
+        ++estimated;
+    }
+    cout << "lanes estimated: " << estimated << " of " << lanes.size()
+         << ", mean absolute error: " << (estimated ? 100 * error / estimated : 0) << " %\n";
+
+    mt19937 random(42);
+    uniform_real_distribution<double> uniform(-1, 1), longitude(-180, 180);
+    vector<string> names(cities);
+    vector<double> latitudes(cities), longitudes(cities);
+    for (size_t i = 0; i < cities; ++i)
+    {
+        names[i] = "City" + to_string(i);
+        latitudes[i] = asin(uniform(random)) * 180 / acos(-1.0);
+        longitudes[i] = longitude(random);
     }
-};
+    mail::GeoIndex const index(names, latitudes, longitudes);
+    size_t const count = 8;
+    vector<mail::CityIndex::IdType> targets(cities);
+    for (size_t i = 0; i < cities; ++i)
+        targets[i] = static_cast<mail::CityIndex::IdType>(i);
+    vector<mail::CityIndex::IdType> sources(queries);
+    for (size_t i = 0; i < queries; ++i)
+        sources[i] = static_cast<mail::CityIndex::IdType>(random() % cities);
 
-class PackageInfo
-{
-  protected:
-    Dimension m_dimension;
-    long double m_weight;
-    unsigned int m_quantity;
+    size_t found = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < queries; ++i)
+        found += index.nearest(sources[i], count, [](mail::CityIndex::IdType) { return true; }).size();
+    double const tree_seconds = seconds_since(start);
 
-  public:
-    PackageInfo() = default;
-    PackageInfo(long double length, long double width, long double height, long double weight, unsigned int quantity)
+    size_t const checked = min(queries, size_t(1000));
+    size_t mismatches = 0;
+    vector<double> distances(cities);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < checked; ++i)
     {
-            m_dimension.length = length;
-            m_dimension.width = width;
-            m_dimension.height = height;
-            m_weight = weight;
-            m_quantity = quantity;
+        index.distances_from(sources[i], targets.data(), cities, distances.data());
+        distances[sources[i]] = numeric_limits<double>::infinity();
+        vector<double> best(distances);
+        partial_sort(best.begin(), best.begin() + count, best.end());
+        vector<mail::GeoIndex::Neighbour> const tree =
+            index.nearest(sources[i], count, [](mail::CityIndex::IdType) { return true; });
+        for (size_t k = 0; k < count; ++k)
+            mismatches += fabs(tree[k].distance - best[k]) > 1e-6;
     }
+    double const scan_seconds = seconds_since(start);
 
-    long double getLength() const
+    cout << "k-d tree, " << cities << " cities: " << tree_seconds / queries * 1e6 << " us per " << count
+         << "-nearest query (" << found << " found), brute-force check: " << scan_seconds / checked * 1e6
+         << " us per query, " << mismatches << " mismatches\n";
+    cout << "haversine kernel: " << static_cast<double>(cities) * checked / scan_seconds << " distances/s\n";
+
+    char const *const examples[][2] = {{"Singapore", "Tokyo"}, {"Bangkok", "Hong Kong"}, {"Hanoi", "Shanghai"}};
+    for (size_t i = 0; i < sizeof examples / sizeof examples[0]; ++i)
     {
-        return m_dimension.length;
+        mail::RouteToDistance::LookupResult const result = router.lookup(
+            mail::make_route(mail::FromLocation(examples[i][0]), mail::ToLocation(examples[i][1])));
+        vector<mail::GeoIndex::Neighbour> const hubs = router.nearest_hubs(examples[i][0], 3);
+        cout << examples[i][0] << " -> " << examples[i][1] << ": " << result.distance
+             << (result.estimated ? " km (estimated)" : " km") << ", nearest hubs:";
+        for (size_t k = 0; k < hubs.size(); ++k)
+            cout << ' ' << router.cities().name_of(hubs[k].id) << " (" << lround(hubs[k].distance) << " km)";
+        cout << '\n';
     }
+}
 
-    void setLength(long double length)
+/*!
+ * @brief   `bench::postal_throughput` is a function that builds, maps and queries a postal index of synthetic codes.
+ * @details The codes are distinct 8-digit numbers spread over four countries. Each is looked up as given and with
+ *          two more digits, which must resolve to the same record by longest prefix.
+ * @param   codes The number of postal codes
+ * @param   lookups The number of lookups of each kind
+ */
+void postal_throughput(size_t codes, size_t lookups)
+{
+    mail::CityIndex const &cities = mail::route_to_distance.cities();
+    char const *const zones[] = {"metro", "urban", "regional", "remote"};
+    mt19937 random(42);
+    vector<mail::PostalCodeEntry> entries;
+    entries.reserve(codes);
+    for (size_t i = 0; i < codes; ++i)
     {
-        m_dimension.length = length;
+        string code = to_string(i * 2654435761ULL % 100000000ULL);
+        code.insert(0, 8 - code.size(), '0');
+        mail::PostalCodeEntry const entry = {string("Z") + static_cast<char>('A' + i % 4), code,
+                                             cities.name_of(static_cast<mail::CityIndex::IdType>(random() % cities.size())),
+                                             zones[random() % 4]};
+        entries.push_back(entry);
     }
 
-    long double getWidth() const
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    string const image = mail::PostalIndex::build(entries);
+    double const build_seconds = seconds_since(start);
+    string const path = "postal_bench.idx";
+    mail::PostalIndex(image).save(path);
+    start = chrono::steady_clock::now();
+    mail::PostalIndex const index = mail::PostalIndex::load(path);
+    double const load_seconds = seconds_since(start);
+    ::unlink(path.c_str());
+
+    vector<size_t> picks(lookups);
+    vector<string> exact(lookups), longer(lookups);
+    for (size_t i = 0; i < lookups; ++i)
+    {
+        picks[i] = random() % codes;
+        exact[i] = mail::PostalIndex::key_of(entries[picks[i]].country, entries[picks[i]].code);
+        longer[i] = exact[i] + "42";
+    }
+    size_t mismatches = 0;
+    double seconds[2];
+    vector<string> const *const keys[2] = {&exact, &longer};
+    for (int kind = 0; kind < 2; ++kind)
     {
-        return m_dimension.width;
+        vector<mail::PostalIndex::Match> matches(lookups);
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i)
+            matches[i] = index.find((*keys[kind])[i]);
+        seconds[kind] = seconds_since(start);
+        for (size_t i = 0; i < lookups; ++i)
+            mismatches += !matches[i] || index.name(matches[i].city) != entries[picks[i]].city ||
+                          index.name(matches[i].zone) != entries[picks[i]].zone ||
+                          matches[i].length != exact[i].size();
     }
 
-    void setWidth(long double width)
+    cout << "codes: " << codes << ", image: " << index.size() << " bytes ("
+         << static_cast<double>(index.size()) / codes << " per code), build: " << build_seconds * 1000
+         << " ms, map: " << load_seconds * 1000 << " ms\n";
+    cout << "exact lookups: " << seconds[0] / lookups * 1e9 << " ns, longest-prefix lookups: "
+         << seconds[1] / lookups * 1e9 << " ns, mismatches: " << mismatches << '\n';
+}
+
+/*!
+ * @brief   `bench::session_throughput` is a function that drives a `mail::SessionServer` with scripted local clients.
+ * @details Every client thread opens `sessions` connections at once, sends a complete dialogue on each and reads the
+ *          replies back, so `clients * sessions` dialogues are in flight together. Each transcript is checked against
+ *          the one a `mail::Session` produces in-process for the same script. With a ledger, every dialogue
+ *          confirms a shipment, which the server records in a scratch log while it serves the other connections.
+ * @param   clients The number of client threads
+ * @param   sessions The number of connections per client thread
+ * @param   threads The number of server threads
+ * @param   recorded `true` to record the shipments in a ledger
+ */
+void session_throughput(size_t clients, size_t sessions, unsigned threads, bool recorded)
+{
+    string const script = "private\nbob b@x 123\nCN 200000 Shanghai\nCN 100000 Beijing\nal a@x 9\n1\n1\n1\n32\n24\n"
+                          "1\n2\ny\ny\n";
+    string expected;
     {
-        m_dimension.width = width;
+        mail::Session session;
+        session.feed(script.data(), script.size());
+        expected = session.take_output();
     }
 
-    long double getHeight() const
+    string const path = "/tmp/bench-sessions-" + to_string(::getpid()) + ".log";
+    unique_ptr<mail::ShipmentLedger> ledger(recorded ? new mail::ShipmentLedger(path) : nullptr);
+    mail::SessionServer const server(0, ledger.get());
+    thread serving(&mail::SessionServer::run, &server, threads);
+    atomic<size_t> matching(0);
+    chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (size_t c = 0; c < clients; ++c)
+        workers.push_back(thread([&]() {
+            vector<int> sockets;
+            for (size_t i = 0; i < sessions; ++i)
+            {
+                int const fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                sockaddr_in address = sockaddr_in();
+                address.sin_family = AF_INET;
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                address.sin_port = htons(server.port());
+                if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0 ||
+                    ::send(fd, script.data(), script.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(script.size()))
+                {
+                    cerr << "client: " << strerror(errno) << '\n';
+                    if (fd >= 0)
+                        ::close(fd);
+                    continue;
+                }
+                sockets.push_back(fd);
+            }
+            char buffer[4096];
+            for (size_t i = 0; i < sockets.size(); ++i)
+            {
+                string transcript;
+                ssize_t received;
+                while ((received = ::recv(sockets[i], buffer, sizeof buffer, 0)) > 0)
+                    transcript.append(buffer, static_cast<size_t>(received));
+                ::close(sockets[i]);
+                matching += transcript == expected;
+            }
+        }));
+    for (size_t c = 0; c < workers.size(); ++c)
+        workers[c].join();
+    double const seconds = seconds_since(start);
+    server.stop();
+    serving.join();
+
+    size_t const total = clients * sessions;
+    cout << "sessions: " << total << " (" << clients << " clients x " << sessions << " concurrent), server threads: "
+         << threads << ", matching transcripts: " << matching;
+    if (ledger)
     {
-        return m_dimension.height;
+        cout << ", shipments recorded: " << ledger->size();
+        ledger.reset();
+        ::unlink(path.c_str());
+        ::unlink((path + ".snapshot").c_str());
     }
+    cout << '\n';
+    cout << "SessionServer: " << static_cast<double>(total) / seconds << " sessions/s\n";
+}
 
-    void setHeight(long double height)
+/*!
+ * @brief   `bench::quote_grid_throughput` is a function that compares preset quotes from the grid with computed ones.
+ * @details It builds the grid, checks every cell against `mail::quote_cost` and times both ways over all the cells.
+ * @param   rounds The number of passes over the grid
+ */
+void quote_grid_throughput(size_t rounds)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    mail::QuoteGrid const grid;
+    double const build_seconds = seconds_since(start);
+    mail::CityIndex const &cities = mail::route_to_distance.cities();
+    typedef mail::CityIndex::IdType IdType;
+
+    size_t cells = 0, mismatches = 0;
+    int64_t grid_total = 0, computed_total = 0;
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round)
+        for (IdType from = 0; from < cities.size(); ++from)
+            for (IdType to = 0; to < cities.size(); ++to)
+                for (size_t p = 0; p < mail::shipment_preset_count; ++p)
+                    for (size_t f = 0; f < mail::freight_count; ++f)
+                    {
+                        mail::Money cost;
+                        if (grid.find(from, to, p, f, cost))
+                            grid_total += cost.count();
+                    }
+    double const grid_seconds = seconds_since(start);
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round)
+        for (IdType from = 0; from < cities.size(); ++from)
+            for (IdType to = 0; to < cities.size(); ++to)
+            {
+                mail::RouteToDistance::LookupResult const lane = mail::route_to_distance.lookup(from, to);
+                for (size_t p = 0; p < mail::shipment_preset_count; ++p)
+                    for (size_t f = 0; f < mail::freight_count; ++f)
+                    {
+                        ++cells;
+                        mail::ShipmentPreset const &preset = mail::shipment_presets[p];
+                        mail::PackageInfo const package(preset.length, preset.width, preset.height, 0, 1);
+                        mail::Money grid_cost;
+                        bool const found = grid.find(from, to, p, f, grid_cost);
+                        if (!lane)
+                        {
+                            mismatches += found;
+                            continue;
+                        }
+                        mail::Money const cost = mail::quote_cost(*mail::freights[f], package, lane.distance);
+                        computed_total += cost.count();
+                        mismatches += !found || cost != grid_cost;
+                    }
+            }
+    double const computed_seconds = seconds_since(start);
+
+    cout << "grid: " << hex << grid.fingerprint() << dec << " built in " << build_seconds * 1000 << " ms, cells: " << cells / rounds
+         << ", mismatches: " << mismatches << ", totals " << (grid_total == computed_total ? "equal" : "DIFFERENT")
+         << '\n';
+    cout << "QuoteGrid::find: " << static_cast<double>(cells) / grid_seconds << " quotes/s\n";
+    cout << "quote_cost: " << static_cast<double>(cells) / computed_seconds << " quotes/s\n";
+}
+
+/*!
+ * @brief   `bench::numa_throughput` is a function that compares a shared distance table with per-node replicas.
+ * @details Workers are pinned round-robin over the memory nodes and look up random city pairs, first all in the
+ *          lane table of `mail::route_to_distance`, which lives on whichever node loaded it, then each in the replica
+ *          of its own node, a copy of the same table. On a single-node machine both runs read local memory and
+ *          should match.
+ * @param   rounds The number of lookups per worker
+ * @param   threads The number of workers, 0 for one per CPU
+ */
+void numa_throughput(size_t rounds, unsigned threads)
+{
+    mail::ReplicatedRouteIndex const index(mail::route_to_distance);
+    if (threads == 0)
+    {
+        for (size_t node = 0; node < index.nodes().size(); ++node)
+            threads += static_cast<unsigned>(index.nodes()[node].cpus.size());
+    }
+    size_t const cities = mail::route_to_distance.cities().size();
+    vector<vector<mail::CityIndex::IdType> > pairs(threads);
+    for (unsigned t = 0; t < threads; ++t)
     {
-        m_dimension.height = height;
+        mt19937 random(t);
+        uniform_int_distribution<unsigned> city(0, static_cast<unsigned>(cities - 1));
+        for (size_t i = 0; i < 2 * 4096; ++i)
+            pairs[t].push_back(static_cast<mail::CityIndex::IdType>(city(random)));
     }
 
-    long double getWeight() const
+    for (int replicated = 0; replicated < 2; ++replicated)
     {
-        return m_weight;
+        vector<uint64_t> totals(threads);
+        vector<thread> workers;
+        chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+        for (unsigned t = 0; t < threads; ++t)
+            workers.push_back(thread([&, t]() {
+                mail::DistanceReplica const &local = index.pin_worker(t);
+                vector<mail::CityIndex::IdType> const &ids = pairs[t];
+                uint64_t total = 0;
+                for (size_t i = 0; i < rounds; ++i)
+                {
+                    size_t const k = 2 * (i % 4096);
+                    total += replicated ? local.lookup(ids[k], ids[k + 1]).distance
+                                        : mail::route_to_distance.lookup(ids[k], ids[k + 1]).distance;
+                }
+                totals[t] = total;
+            }));
+        for (unsigned t = 0; t < threads; ++t)
+            workers[t].join();
+        double const seconds = seconds_since(start);
+        cout << (replicated ? "per-node replicas: " : "shared table: ")
+             << static_cast<double>(rounds) * threads / seconds << " lookups/s, checksum "
+             << accumulate(totals.begin(), totals.end(), uint64_t(0)) << '\n';
     }
+    cout << "nodes: " << index.nodes().size() << ", workers: " << threads << '\n';
+}
 
-    void setWeight(long double weight)
+/*!
+ * @brief   `bench::generate_network` is a function that writes a synthetic distance map in the format of `distance.csv`.
+ * @details Cities are scattered over a 20000 km square and every city is linked to the next one, so the network is
+ *          connected; each other ordered pair is a lane with probability `density`. Distances are the straight line
+ *          plus a random 5 to 35 % detour. The same seed gives the same file.
+ * @param   path The file to write
+ * @param   cities The number of cities
+ * @param   density The share of the ordered city pairs that are lanes, from 0 to 1
+ * @param   seed The seed of the random generator
+ * @return  `std::size_t` The number of lanes written
+ * @throws  `std::runtime_error` If the file cannot be written
+ */
+size_t generate_network(string const &path, size_t cities, double density, uint64_t seed)
+{
+    mt19937_64 random(seed);
+    uniform_real_distribution<double> coordinate(0, 20000), detour(1.05, 1.35), chance(0, 1);
+    vector<double> x(cities), y(cities);
+    vector<string> names(cities);
+    for (size_t i = 0; i < cities; ++i)
     {
-        m_weight = weight;
+        x[i] = coordinate(random);
+        y[i] = coordinate(random);
+        names[i] = "City" + to_string(i);
     }
+    ofstream stream(path, ios::trunc);
+    if (!stream)
+        throw runtime_error("Failed to write network " + path);
+    stream << "\"From City\", \"To City\", \"Distance\"\n";
+    size_t lanes = 0;
+    for (size_t from = 0; from < cities; ++from)
+        for (size_t to = 0; to < cities; ++to)
+        {
+            if (from == to || (to != (from + 1) % cities && chance(random) >= density))
+                continue;
+            double const distance = hypot(x[from] - x[to], y[from] - y[to]) * detour(random);
+            stream << '"' << names[from] << "\", \"" << names[to] << "\", \""
+                   << max(1UL, static_cast<unsigned long>(distance)) << "\"\n";
+            ++lanes;
+        }
+    if (!stream.flush())
+        throw runtime_error("Failed to write network " + path);
+    return lanes;
+}
 
-    unsigned int getQuantity() const
+/*!
+ * @brief   `bench::QuoteRequest` is one synthetic request to quote a shipment.
+ */
+struct QuoteRequest
+{
+    mail::CityIndex::IdType origin;
+    mail::CityIndex::IdType destination;
+    mail::PackageInfo package;
+    /*!
+     * @brief   `bench::QuoteRequest::freight` is the index of the freight in `mail::freights`.
+     */
+    size_t freight;
+};
+
+/*!
+ * @brief   `bench::WorkloadGenerator` is a class that draws a reproducible stream of quote requests.
+ * @details City popularity follows a Zipf law over a shuffled ranking, so a few cities take most of the traffic.
+ *          Packages mix documents, parcels, moving boxes and pallets in proportions typical of a parcel network,
+ *          and the freight is air for half of the requests, ocean for 30 % and rail for the rest.
+ */
+class WorkloadGenerator
+{
+  private:
+    mt19937_64 m_random;
+    vector<mail::CityIndex::IdType> m_ranking;
+    vector<double> m_popularity;
+
+    mail::CityIndex::IdType draw_city()
     {
-        return m_quantity;
+        double const u = uniform_real_distribution<double>(0, m_popularity.back())(m_random);
+        size_t const rank = upper_bound(m_popularity.begin(), m_popularity.end(), u) - m_popularity.begin();
+        return m_ranking[min(rank, m_ranking.size() - 1)];
+    }
+    long double uniform(long double low, long double high)
+    {
+        return uniform_real_distribution<long double>(low, high)(m_random);
     }
 
-    void setQuantity(unsigned int quantity)
+  public:
+    /*!
+     * @brief   `bench::WorkloadGenerator::WorkloadGenerator` is a constructor that seeds the generator.
+     * @param   cities The number of cities, at least 2
+     * @param   seed The seed of the random generator
+     * @param   skew The exponent of the Zipf law, 0 for uniform popularity
+     */
+    WorkloadGenerator(size_t cities, uint64_t seed, double skew = 1.1)
+        : m_random(seed)
+        , m_ranking(cities)
+        , m_popularity(cities)
     {
-        m_quantity = quantity;
+        for (size_t i = 0; i < cities; ++i)
+            m_ranking[i] = static_cast<mail::CityIndex::IdType>(i);
+        shuffle(m_ranking.begin(), m_ranking.end(), m_random);
+        double total = 0;
+        for (size_t rank = 0; rank < cities; ++rank)
+            m_popularity[rank] = total += pow(static_cast<double>(rank + 1), -skew);
     }
-    void display() const
+    /*!
+     * @brief   `bench::WorkloadGenerator::next` is a function that draws the next request.
+     * @return  `bench::QuoteRequest` The request
+     */
+    QuoteRequest next()
     {
-        std::cout << "Weight:" << m_weight << std::endl;
-        std::cout << "length: " << m_dimension.length << std::endl;
-        std::cout << "Width: " << m_dimension.width << std::endl;
-        std::cout << "Height " << m_dimension.height << std::endl;
-        std::cout << "Quantity " << m_quantity << std::endl;
+        QuoteRequest request = {draw_city(), 0, mail::PackageInfo(), 0};
+        do
+            request.destination = draw_city();
+        while (request.destination == request.origin);
+
+        double const kind = uniform_real_distribution<double>(0, 1)(m_random);
+        unsigned const quantity = kind < 0.8 ? 1 : uniform_int_distribution<unsigned>(2, 10)(m_random);
+        if (kind < 0.4)
+            request.package = mail::PackageInfo(32, 24, 1, uniform(0.05L, 1), 1);
+        else if (kind < 0.75)
+            request.package = mail::PackageInfo(uniform(10, 60), uniform(10, 50), uniform(5, 40), uniform(0.5L, 30),
+                                                quantity);
+        else if (kind < 0.95)
+            request.package = mail::PackageInfo(75, 35, 35, uniform(5, 40), quantity);
+        else
+            request.package = mail::PackageInfo(110, 110, uniform(50, 160), uniform(100, 800), quantity);
+
+        double const mode = uniform_real_distribution<double>(0, 1)(m_random);
+        request.freight = mode < 0.5 ? 1 : mode < 0.8 ? 0 : 2;
+        return request;
     }
 };
 
-class ShipmentInfo
+/*!
+ * @brief   `bench::audit_throughput` is a function that measures the cost of logging quotes and checks the files.
+ * @details Every thread logs its share of synthetic quotes as fast as it can, so records are dropped once the drain
+ *          thread falls behind. The files are then read back: every record logged and not dropped must be there.
+ * @param   records The number of records in total
+ * @param   threads The number of logging threads
+ * @param   capacity The number of records of each ring
+ */
+void audit_throughput(size_t records, unsigned threads, size_t capacity)
 {
-  protected:
-    UserInfo m_user;
-    PostalAddress m_origin;
-    PostalAddress m_destination;
-    PackageInfo m_package;
-    UserInfo m_consignee;
-    Freight const *m_service_type;
-    long double m_freight_weight;
-    long double m_cost;
-
-    static Freight const *service_type_to_freight(string const &service_type)
+    string const path = "audit_bench.audit";
+    vector<string> const stale = mail::QuoteAuditLog::files(path);
+    for (size_t i = 0; i < stale.size(); ++i)
+        ::unlink(stale[i].c_str());
+    threads = max(threads, 1U);
+    size_t const per_thread = records / threads;
+    uint64_t logged = 0, dropped = 0, written = 0;
+    double seconds = 0;
     {
-        if (service_type == "Air transport")
-        {
-            return &air_freight;
-        }
-        if (service_type == "Ocean transport")
-        {
-            return &ocean_freight;
-        }
-        if (service_type == "Rail transport")
+        mail::QuoteAuditLog audit(path, capacity, uint64_t(16) << 20, ~uint64_t(0));
+        WorkloadGenerator generator(mail::route_to_distance.cities().size(), 42);
+        vector<mail::QuoteAuditRecord> samples;
+        for (size_t i = 0; i < 1024; ++i)
         {
-            return &rail_freight;
+            QuoteRequest const request = generator.next();
+            mail::Freight const &freight = *mail::freights[request.freight];
+            unsigned const distance = mail::route_to_distance.lookup(request.origin, request.destination).distance;
+            samples.push_back(mail::audit_record(request.origin, request.destination, distance, freight, request.package,
+                                                 mail::quote_cost(freight, request.package, distance)));
         }
-        throw runtime_error("Invalid service type");
+        vector<uint64_t> accepted(threads);
+        vector<thread> workers;
+        chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+        for (unsigned t = 0; t < threads; ++t)
+            workers.push_back(thread([&, t]() {
+                uint64_t count = 0;
+                for (size_t i = 0; i < per_thread; ++i)
+                    count += audit.log(samples[(i + t) % samples.size()]);
+                accepted[t] = count;
+            }));
+        for (unsigned t = 0; t < threads; ++t)
+            workers[t].join();
+        seconds = seconds_since(start);
+        audit.flush();
+        logged = accumulate(accepted.begin(), accepted.end(), uint64_t(0));
+        dropped = audit.dropped();
+        written = audit.written();
     }
 
-  public:
-    ShipmentInfo() = default;
-    ShipmentInfo(
-        const PostalAddress& origin, 
-        const PostalAddress& destination, 
-        const PackageInfo& package,
-        const UserInfo& user, 
-        const UserInfo& consignee, 
-        const std::string& service_type,
-        long double /* For ABI compatibility */
-    )
+    vector<string> const files = mail::QuoteAuditLog::files(path);
+    uint64_t read = 0, read_dropped = 0, bytes = 0;
+    for (size_t i = 0; i < files.size(); ++i)
     {
-        m_origin = origin;
-        m_destination = destination;
-        m_package = package;
-        m_user = user;
-        m_consignee = consignee;
-        m_service_type = service_type_to_freight(service_type);
-        m_freight_weight = m_service_type->volumetric_weight(
-            m_package.getLength(), 
-            m_package.getWidth(), 
-            m_package.getHeight(), 
-            m_package.getQuantity()
-        );
+        mail::QuoteAuditFile const file = mail::QuoteAuditLog::read(files[i]);
+        read += file.records.size();
+        read_dropped += file.dropped;
+        struct stat status;
+        if (::stat(files[i].c_str(), &status) == 0)
+            bytes += static_cast<uint64_t>(status.st_size);
+        ::unlink(files[i].c_str());
     }
+    cout << "records: " << per_thread * threads << " from " << threads << " threads, "
+         << seconds / per_thread * 1e9 << " ns per call per thread, " << per_thread * threads / seconds
+         << " records/s\n";
+    cout << "buffered: " << logged << ", dropped: " << dropped << ", written: " << written << ", read back: " << read
+         << " (" << read_dropped << " drops recorded) " << (read == logged && read_dropped == dropped ? "OK" : "MISMATCH")
+         << '\n';
+    cout << "files: " << files.size() << ", " << bytes << " bytes, "
+         << (bytes ? static_cast<double>(read * sizeof(mail::QuoteAuditRecord)) / bytes : 0) << "x compression\n";
+}
 
-    // Getters
-    PostalAddress getOrigin() const
+/*!
+ * @brief   `bench::reprice_throughput` is a function that measures repricing a shipment set in several versions.
+ * @details Each version derives from the previous one by a change of rates or of a few lanes. It prints the memory
+ *          of the versions against full copies, checks the first version against `mail::quote_cost` and times one
+ *          pass over all the versions against one pass per version.
+ * @param   shipments The number of shipments
+ * @param   versions The number of versions, including the current one
+ */
+void reprice_throughput(size_t shipments, size_t versions)
+{
+    mail::RouteToDistance const &router = mail::route_to_distance;
+    size_t const cities = router.cities().size();
+    WorkloadGenerator generator(cities, 42);
+    vector<QuoteRequest> requests;
+    vector<mail::RepricingItem> items;
+    requests.reserve(shipments);
+    items.reserve(shipments);
+    for (size_t i = 0; i < shipments; ++i)
     {
-        return m_origin;
+        requests.push_back(generator.next());
+        items.push_back(mail::repricing_item(requests.back().origin, requests.back().destination,
+                                             requests.back().freight, requests.back().package));
     }
-    PostalAddress getDestination() const
+
+    vector<mail::PricingSnapshot> snapshots(1, mail::PricingSnapshot(router));
+    mt19937_64 random(7);
+    while (snapshots.size() < max<size_t>(versions, 1))
     {
-        return m_destination;
+        mail::PricingSnapshot const &last = snapshots.back();
+        if (snapshots.size() % 2)
+        {
+            size_t const freight = snapshots.size() / 2 % mail::freight_count;
+            mail::FreightRates rates = last.rates(freight);
+            rates.rate += rates.rate / 20;
+            snapshots.push_back(last.with_rates(freight, rates, "rate +5%"));
+            continue;
+        }
+        vector<mail::PricingSnapshot::LaneChange> changes;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            mail::CityIndex::IdType const from = static_cast<mail::CityIndex::IdType>(random() % cities);
+            mail::CityIndex::IdType const to = static_cast<mail::CityIndex::IdType>(random() % cities);
+            mail::PricingSnapshot::DistanceType const distance = last.distance(from, to);
+            mail::PricingSnapshot::LaneChange const change = {
+                from, to, distance == mail::RouteToDistance::no_lane ? 1000 : distance + distance / 10};
+            changes.push_back(change);
+        }
+        snapshots.push_back(last.with_lanes(changes, "4 lanes"));
     }
-    PackageInfo getPackage() const
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < shipments; ++i)
     {
-        return m_package;
+        mail::Money cost;
+        if (snapshots[0].cost(items[i].freight, items[i].origin, items[i].destination, items[i].weight, items[i].volume,
+                              cost) &&
+            cost != mail::quote_cost(*mail::freights[requests[i].freight], requests[i].package,
+                                     snapshots[0].distance(items[i].origin, items[i].destination)))
+            ++mismatches;
     }
-    UserInfo getUser() const
+
+    int64_t net = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<mail::RepricingTotals> const totals =
+        mail::reprice(items, snapshots, [&](size_t, int64_t const *prices) {
+            for (size_t s = 1; s < snapshots.size(); ++s)
+                if (prices[0] >= 0 && prices[s] >= 0)
+                    net += prices[s] - prices[0];
+        });
+    double const fused = seconds_since(start);
+    start = chrono::steady_clock::now();
+    bool same = true;
+    for (size_t s = 0; s < snapshots.size(); ++s)
+        same &= mail::reprice(items, vector<mail::PricingSnapshot>(1, snapshots[s]))[0].total == totals[s].total;
+    double const separate = seconds_since(start);
+    int64_t net_totals = 0;
+    for (size_t s = 1; s < snapshots.size(); ++s)
+        net_totals += totals[s].increase.count() - totals[s].decrease.count();
+
+    size_t const one = mail::PricingSnapshot::memory_usage(vector<mail::PricingSnapshot>(1, snapshots[0]));
+    size_t const shared = mail::PricingSnapshot::memory_usage(snapshots);
+    cout << "versions: " << snapshots.size() << " over " << cities << " cities, " << shared << " bytes shared, "
+         << one * snapshots.size() << " bytes as full copies\n";
+    cout << "shipments: " << shipments << ", priced: " << totals[0].priced << ", checked against quote_cost: "
+         << (mismatches ? "MISMATCH" : "OK") << '\n';
+    cout << "one pass: " << static_cast<double>(shipments * snapshots.size()) / fused << " prices/s, one pass per version: "
+         << static_cast<double>(shipments * snapshots.size()) / separate << " prices/s, totals "
+         << (same && net == net_totals ? "OK" : "MISMATCH") << '\n';
+    cout << fixed << setprecision(2);
+    for (size_t s = 0; s < snapshots.size(); ++s)
+        cout << "v" << snapshots[s].version() << " (" << snapshots[s].label() << "): total " << totals[s].total.value()
+             << ", changed " << totals[s].changed << ", +" << totals[s].increase.value() << " -"
+             << totals[s].decrease.value() << '\n';
+    cout.unsetf(ios::floatfield);
+}
+
+/*!
+ * @brief   `bench::print_latencies` is a function that prints the throughput and the latency distribution of a run.
+ * @param   label The kind of requests measured
+ * @param   latencies The latency of every request in nanoseconds, sorted in place
+ * @param   seconds The duration of the run
+ */
+void print_latencies(string const &label, vector<double> &latencies, double seconds)
+{
+    sort(latencies.begin(), latencies.end());
+    cout << label << " requests: " << latencies.size() << ", throughput: " << static_cast<double>(latencies.size()) / seconds
+         << " quotes/s\n";
+    if (latencies.empty())
+        return;
+    double const percentiles[] = {50, 90, 99, 99.9, 99.99};
+    cout << "  latency (us):";
+    for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; ++i)
     {
-        return m_user;
+        size_t const rank = min(latencies.size() - 1, static_cast<size_t>(percentiles[i] / 100 * latencies.size()));
+        cout << " p" << percentiles[i] << '=' << latencies[rank] / 1000;
     }
-    UserInfo getconsignee() const
+    cout << " max=" << latencies.back() / 1000 << '\n';
+}
+
+/*!
+ * @brief   `bench::load_test` is a function that replays a synthetic request stream against the quoting engine.
+ * @details A request on a lane is quoted directly; one without a lane goes through the multi-modal itinerary
+ *          optimizer. In the closed loop, `threads` workers send requests back to back. In the open loop, requests
+ *          arrive as a Poisson process at `rate` per second whatever the workers do, and latency is measured from
+ *          the arrival time, so a saturated engine shows up as queueing delay instead of a lower request rate.
+ *          Direct and multi-leg requests are timed apart as well as together, since their costs differ by orders of
+ *          magnitude and a mix hides either. With replicas, worker `i` is pinned like `mail::ReplicatedRouteIndex::pin_worker` and looks lanes up in
+ *          the replica of its node.
+ * @param   network The distance map file to quote on
+ * @param   open_loop `true` for the open loop, `false` for the closed loop
+ * @param   requests The number of requests
+ * @param   threads The number of worker threads
+ * @param   rate The arrival rate of the open loop, in requests per second
+ * @param   seed The seed of the request stream and of the arrivals
+ * @param   replicated `true` to pin the workers and give each node its own replica of the lanes
+ */
+void load_test(string const &network, bool open_loop, size_t requests, unsigned threads, double rate, uint64_t seed,
+               bool replicated)
+{
+    mail::RouteToDistance const router(network);
+    unique_ptr<mail::ReplicatedRouteIndex const> replicas(replicated ? new mail::ReplicatedRouteIndex(router) : nullptr);
+    mail::ItineraryOptimizer const optimizer(router);
+    WorkloadGenerator generator(router.cities().size(), seed);
+    vector<QuoteRequest> stream;
+    stream.reserve(requests);
+    for (size_t i = 0; i < requests; ++i)
+        stream.push_back(generator.next());
+    vector<double> arrivals(requests);
+    mt19937_64 random(seed ^ 0x9E3779B97F4A7C15ULL);
+    exponential_distribution<double> gap(rate);
+    for (size_t i = 1; i < requests; ++i)
+        arrivals[i] = arrivals[i - 1] + gap(random);
+
+    threads = max(threads, 1U);
+    vector<vector<double> > direct(threads), routed(threads);
+    atomic<size_t> next(0), multi_leg(0), unquoted(0);
+    chrono::steady_clock::time_point const start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.push_back(thread([&, t]() {
+            mail::DistanceReplica const *local = nullptr;
+            try
+            {
+                if (replicas)
+                    local = &replicas->pin_worker(t);
+            }
+            catch (runtime_error const &e)
+            {
+                cerr << "Worker " << t << " uses the shared distances: " << e.what() << '\n';
+            }
+            for (size_t i; (i = next++) < requests;)
+            {
+                chrono::steady_clock::time_point issued = chrono::steady_clock::now();
+                if (open_loop)
+                {
+                    issued = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                         chrono::duration<double>(arrivals[i]));
+                    this_thread::sleep_until(issued);
+                }
+                QuoteRequest const &request = stream[i];
+                mail::RouteToDistance::LookupResult const lane = local ? local->lookup(request.origin, request.destination)
+                                                                       : router.lookup(request.origin, request.destination);
+                if (lane)
+                    mail::quote_cost(*mail::freights[request.freight], request.package, lane.distance);
+                else if (!optimizer.optimize(request.origin, request.destination, request.package).empty())
+                    ++multi_leg;
+                else
+                    ++unquoted;
+                (lane ? direct : routed)[t].push_back(
+                    chrono::duration<double, nano>(chrono::steady_clock::now() - issued).count());
+            }
+        }));
+    for (unsigned t = 0; t < threads; ++t)
+        workers[t].join();
+    double const seconds = seconds_since(start);
+
+    vector<double> all, all_direct, all_routed;
+    for (unsigned t = 0; t < threads; ++t)
     {
-        return m_consignee;
+        all_direct.insert(all_direct.end(), direct[t].begin(), direct[t].end());
+        all_routed.insert(all_routed.end(), routed[t].begin(), routed[t].end());
     }
-    string getServiceType() const
+    all.insert(all.end(), all_direct.begin(), all_direct.end());
+    all.insert(all.end(), all_routed.begin(), all_routed.end());
+    cout << "network: " << network << " (" << router.cities().size() << " cities, " << router.routes().size()
+         << " lanes), " << (open_loop ? "open" : "closed") << " loop, " << threads << " threads";
+    if (replicas)
+        cout << " pinned to " << replicas->nodes().size() << " nodes";
+    if (open_loop)
+        cout << ", offered " << rate << " requests/s";
+    cout << ", seed " << seed << '\n';
+    cout << "multi-leg itineraries: " << multi_leg << ", unquoted: " << unquoted << '\n';
+    print_latencies("all", all, seconds);
+    print_latencies("direct", all_direct, seconds);
+    print_latencies("multi-leg", all_routed, seconds);
+}
+
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    vector<string> const args(argv + 1, argv + argc);
+    if (!args.empty() && args[0] == "--bench-csv")
     {
-        return (string)(*m_service_type);
+        bench::csv_throughput(args.size() > 1 ? stoul(args[1]) : 1000000);
+        return 0;
     }
-    long double getCost() const
+    if (!args.empty() && args[0] == "--bench-output")
     {
-        return m_cost;
+        bench::output_throughput(args.size() > 1 ? args[1] : "csv", args.size() > 2 ? stoul(args[2]) : 1000000);
+        return 0;
     }
-    long double getFreightWeight() const
+    if (!args.empty() && args[0] == "--quote-file" && args.size() > 1)
     {
-        return m_freight_weight;
+        size_t const quoted =
+            mail::quote_file(args[1], mail::QuoteFormatter::format_of(args.size() > 2 ? args[2] : "csv"),
+                             args.size() > 3 ? static_cast<unsigned>(stoul(args[3])) : 0);
+        cerr << quoted << " shipments quoted\n";
+        return 0;
     }
-
-    // Setters
-    void setOrigin(const PostalAddress &o)
+    if (!args.empty() && args[0] == "--bench-validation")
     {
-        m_origin = o;
+        bench::validation_throughput(args.size() > 1 ? stoul(args[1]) : 1000000,
+                                     args.size() > 2 ? static_cast<unsigned>(stoul(args[2])) : 0);
+        return 0;
     }
-    void setDestination(const PostalAddress &d)
+    if (!args.empty() && args[0] == "--bench-itinerary")
     {
-        m_destination = d;
+        bench::itinerary_throughput(args.size() > 1 ? stoul(args[1]) : 10);
+        return 0;
     }
-    void setPackage(const PackageInfo &p)
+    if (!args.empty() && args[0] == "--bench-packing")
     {
-        m_package = p;
+        bench::packing_throughput(args.size() > 1 ? stoul(args[1]) : 200);
+        return 0;
     }
-    void setconsignee(const UserInfo &s)
+    if (!args.empty() && args[0] == "--bench-lookup")
     {
-        m_consignee = s;
+        bench::lookup_throughput(args.size() > 1 ? stoul(args[1]) : 100);
+        return 0;
     }
-    void setServiceType(const string &st)
+    if (!args.empty() && args[0] == "--bench-numa")
     {
-        m_service_type = service_type_to_freight(st);
+        bench::numa_throughput(args.size() > 1 ? stoul(args[1]) : 50000000,
+                               args.size() > 2 ? static_cast<unsigned>(stoul(args[2])) : 0);
+        return 0;
     }
-    void setFreightWeight(long double /* For ABI compatibility */)
+    if (!args.empty() && args[0] == "--bench-lanes")
     {
-        m_freight_weight = m_service_type->volumetric_weight(
-            m_package.getLength(), 
-            m_package.getWidth(), 
-            m_package.getHeight(), 
-            m_package.getQuantity()
-        );
+        bench::lane_table_throughput(args.size() > 1 ? stoul(args[1]) : 2000, args.size() > 2 ? stod(args[2]) : 0.8,
+                                     args.size() > 3 ? stoul(args[3]) : 50000000);
+        return 0;
     }
-    void setCost(long double c)
+    if (!args.empty() && args[0] == "--bench-geo")
     {
-        m_cost = c;
+        bench::geo_throughput(args.size() > 1 ? stoul(args[1]) : 100000, args.size() > 2 ? stoul(args[2]) : 100000);
+        return 0;
     }
-    void display()
-    {
-        std::cout << "Account" << std::endl;
-        m_user.display();
-        std::cout << std::endl;
-        std::cout << "Origin" << std::endl;
-        m_origin.display();
-        std::cout << std::endl;
-        std::cout << "Destination" << std::endl;
-        m_destination.display();
-        std::cout << std::endl;
-        std::cout << "consignee information" << std::endl;
-        m_consignee.display();
-        std::cout << std::endl;
-        std::cout << "Shipment information" << std::endl;
-        m_package.display();
-        std::cout << std::endl;
-        std::cout << " Mode of transport: " << (string)(*m_service_type) << std::endl;
-        std::cout << std::endl;
-        std::cout << " Freight weight: " << m_freight_weight << std::endl;
-        std::cout << std::endl;
-        std::cout << "Cost: " << m_cost << std::endl;
+    if (!args.empty() && args[0] == "--bench-postal")
+    {
+        bench::postal_throughput(args.size() > 1 ? stoul(args[1]) : 2000000, args.size() > 2 ? stoul(args[2]) : 1000000);
+        return 0;
     }
-};
-
-void interface()
-{
-    std::cout << "********************* Ship now *********************" << std::endl;
-    std::cout << "*******1.Please enter your account******************" << std::endl;
-    std::cout << "****** 2.Enter your departure and destination ******" << std::endl;
-    std::cout << "****** 3.Enter your service type *******************" << std::endl;
-    std::cout << "****** 4.Describe your shipment ********************" << std::endl;
-    std::cout << "****** 5.Get shipping prices ***********************" << std::endl;
-
-    std::string usertype, username, useremail, usernumber, ocountry, opostalcode, ocity, consigneename,
-        consigneeemail, consigneenumber, dcountry, dpostalcode, dcity, shipmentid, shipmentdate, servicetype;
-
-    char confirm;
-    int userChoice, type;
-    unsigned int packages;
-    while (true)
+    if (!args.empty() && args[0] == "--resolve-postal" && (args.size() == 3 || args.size() == 5))
     {
-        std::cout << "Account" << std::endl;
-        std::cout << "I am shipping as a.... ( business | private  )" << std::endl;
-        std::cin >> usertype;
-        std::cout << "please enter your account:( name | email | phone number ) " << std::endl;
-        std::cin >> username;
-        std::cin >> useremail;
-        std::cin >> usernumber;
-        UserInfo user(username, useremail, usernumber);
-        std::cout << "Login successful!" << std::endl;
-        std::cout << std::endl;
-
-        std::cout << "Origin and Destination" << std::endl;
-        std::cout << "Please enter your origin: ( country | postal code | city ) ";
-        std::cin >> ocountry;
-        std::cin >> opostalcode;
-        std::cin >> ocity;
-
-        PostalAddress origin(usertype,ocountry, opostalcode, ocity);
-        std::cout << "Please enter your destination: ( country | postal code | city ) ";
-        std::cin >> dcountry;
-        std::cin >> dpostalcode;
-        std::cin >> dcity;
-        std::cout << "Please enter the consignee information: ( name | email | phone number )" << std::endl;
-        std::cin >> consigneename;
-        std::cin >> consigneeemail;
-        std::cin >> consigneenumber;
-        UserInfo consignee(consigneename, consigneeemail, consigneenumber);
-        PostalAddress destination(usertype,dcountry, dpostalcode, dcity);
-        std::cout << std::endl;
-
-
-        //Determine and recommend the type of transport service
-        ShipmentMode shipment;
-        shipment.selectShipmentMode();
-        std::cout << "Enter your choice (1, 2, or 3): ";
-        std::cin >> userChoice;
-        shipment = ShipmentMode(userChoice, usertype);
-        shipment.setshipmentMode(userChoice);
-
-        //Package details
-        long double length, width, height, weight, cost;
-        unsigned int quantity;
-        std::cout << "Package Description" << std::endl;
-        std::cout << "Please enter the quantity of the package" << std::endl;
-        std::cin >> quantity;
-        std::cout << "Please enter your weight(kg): " << std::endl;
-        std::cin >> weight;
-        std::cout << "Please enter your length(cm): " << std::endl;
-        std::cin >> length;
-        std::cout << "Please enter your width(cm): " << std::endl;
-        std::cin >> width;
-        std::cout << "Please enter your height(cm): " << std::endl;
-        std::cin >> height;
-        PackageInfo package(length, width, height, weight, quantity);
-        std::cout << endl;
-
-        //Enter and determine the mode of transport and calculate the volume of transport
-        double FreightWeight = 0;
-        std::cout << "Mode of transport" << std::endl;
-        std::cout << "Please enter a number to select your shipping type: ( Ocean transport(1) | Air transport(2) | "
-            "Rail Freight(3)) ";
-
-        while (true)
+        mail::PostalIndex const postal = mail::PostalIndex::open("postal_codes.idx", "postal_codes.csv");
+        vector<string> resolved;
+        for (size_t i = 1; i + 1 < args.size(); i += 2)
         {
-            cin >> type;
-            switch (type)
+            mail::PostalIndex::Match const match = postal.find(args[i], args[i + 1]);
+            if (!match)
             {
-            case 1:
-                servicetype = "Ocean transport";
-                FreightWeight = ocean_freight.volumetric_weight(length, width, height, quantity);
-                break;
-            case 2:
-                servicetype = "Air transport";
-                FreightWeight = air_freight.volumetric_weight(length, width, height, quantity);
-                break;
-            case 3:
-                servicetype = "Rail transport";
-                FreightWeight = rail_freight.volumetric_weight(length, width, height, quantity);
-                break;
-            default:
-                cout << "Invalid input, please re-enter: ";
-                continue;
+                cout << args[i] << ' ' << args[i + 1] << ": not known\n";
+                return 1;
             }
-            break;
-        }
-
-        ShipmentInfo info(origin, destination, package, user, consignee, servicetype, FreightWeight);
-        std::cout << std::endl;
-
-        //Distance calculation
-        typedef mail::FromLocation From;
-        typedef mail::ToLocation To;
-        typedef mail::Route Route;
-        typedef mail::RouteToDistance::DistanceType Distance;
-        Route const route = mail::make_route(From(ocity), To(dcity));
-        Distance const distance = mail::route_to_distance(route);
-
-        // need calculate Fees
-
-        cost = 0;
-        
-        std::cout << "The shipping fee is: " << info.getCost() << std::endl;
-        std::cout << std::endl;
-
-        std::cout << "Details are as follows" << std::endl;
-        info.display();
-
-        // Confirm whether to pay
-        std::cout << "Do you want to confirm the shipment? (y/n): ";
-        std::cin >> confirm;
-        if (confirm == 'y' || confirm == 'Y')
-        {
-            std::cout << "Shipment confirmed. Please proceed to payment." << std::endl;
-            std::cout << "Payment successful. Thank you!" << std::endl;
+            resolved.push_back(postal.name(match.city));
+            cout << args[i] << ' ' << args[i + 1] << ": " << resolved.back() << " (" << postal.name(match.zone)
+                 << " zone)\n";
         }
-        else
+        if (resolved.size() == 2)
         {
-            std::cout << "Shipment not confirmed." << std::endl;
+            mail::RouteToDistance::LookupResult const lane = mail::route_to_distance.lookup(
+                mail::make_route(mail::FromLocation(resolved[0]), mail::ToLocation(resolved[1])));
+            if (lane)
+                cout << "Distance: " << lane.distance << (lane.estimated ? " km (estimated)\n" : " km\n");
+            else
+                cout << "No route from " << resolved[0] << " to " << resolved[1] << ".\n";
         }
-
-        // Use again or exit
-        std::cout << "Do you want to quit? (Y/N): " << std::endl;
-        std::cin >> confirm;
-        if (confirm == 'Y' || confirm == 'y')
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-audit")
+    {
+        bench::audit_throughput(args.size() > 1 ? stoul(args[1]) : 4000000,
+                                args.size() > 2 ? static_cast<unsigned>(stoul(args[2])) : 4,
+                                args.size() > 3 ? stoul(args[3]) : 65536);
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--dump-audit")
+    {
+        mail::CityIndex const &cities = mail::route_to_distance.cities();
+        vector<string> const files = mail::QuoteAuditLog::files(args.size() > 1 ? args[1] : "quotes.audit");
+        cout << "time_ns,origin,destination,distance,freight,quantity,length_mm,width_mm,height_mm,weight_g,"
+                "chargeable_g,cost_cents,flags,thread\n";
+        for (size_t f = 0; f < files.size(); ++f)
         {
-            std::cout << "Thank you for your use !" << std::endl;
-            break;
+            mail::QuoteAuditFile const file = mail::QuoteAuditLog::read(files[f]);
+            bool const same_cities = file.city_fingerprint == cities.fingerprint();
+            for (size_t i = 0; i < file.records.size(); ++i)
+            {
+                mail::QuoteAuditRecord const &r = file.records[i];
+                cout << r.timestamp << ','
+                     << (same_cities && r.origin < cities.size() ? cities.name_of(r.origin) : to_string(r.origin)) << ','
+                     << (same_cities && r.destination < cities.size() ? cities.name_of(r.destination)
+                                                                       : to_string(r.destination))
+                     << ',' << r.distance << ',' << unsigned(r.freight) << ',' << r.quantity << ',' << r.length << ','
+                     << r.width << ',' << r.height << ',' << r.weight << ',' << r.chargeable_weight << ',' << r.cost
+                     << ',' << unsigned(r.flags) << ',' << r.thread << '\n';
+            }
+            if (file.dropped)
+                cerr << files[f] << ": " << file.dropped << " records dropped\n";
         }
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-reprice")
+    {
+        bench::reprice_throughput(args.size() > 1 ? stoul(args[1]) : 1000000, args.size() > 2 ? stoul(args[2]) : 8);
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--reprice")
+    {
+        mail::ShipmentLedger const ledger(args.size() > 1 ? args[1] : "shipments.log");
+        int64_t const now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+        vector<mail::LedgerEntry> const entries =
+            ledger.find_by_time(now - 86400 * (args.size() > 2 ? stoll(args[2]) : 30), now + 1);
+        vector<mail::PricingSnapshot> snapshots(1, mail::PricingSnapshot());
+        for (size_t i = 3; i < args.size(); ++i)
+            snapshots.push_back(mail::derive_snapshot(snapshots.back(), args[i]));
+        vector<mail::RepricingItem> items;
+        items.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+            items.push_back(mail::repricing_item(entries[i].info));
+        cout << "sequence,v" << snapshots[0].version() << "_cents";
+        for (size_t s = 1; s < snapshots.size(); ++s)
+            cout << ",v" << snapshots[s].version() << "_delta";
+        cout << '\n';
+        vector<mail::RepricingTotals> const totals =
+            mail::reprice(items, snapshots, [&](size_t i, int64_t const *prices) {
+                cout << entries[i].sequence << ',' << (prices[0] < 0 ? string() : to_string(prices[0]));
+                for (size_t s = 1; s < snapshots.size(); ++s)
+                    cout << ',' << (prices[0] < 0 || prices[s] < 0 ? string() : to_string(prices[s] - prices[0]));
+                cout << '\n';
+            });
+        cerr << fixed << setprecision(2);
+        for (size_t s = 0; s < snapshots.size(); ++s)
+            cerr << 'v' << snapshots[s].version() << " (" << snapshots[s].label() << "): " << totals[s].priced
+                 << " priced, " << totals[s].unpriced << " without a lane, total " << totals[s].total.value() << ", "
+                 << totals[s].changed << " changed, +" << totals[s].increase.value() << " -"
+                 << totals[s].decrease.value() << '\n';
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-sessions")
+    {
+        bench::session_throughput(args.size() > 1 ? stoul(args[1]) : 4, args.size() > 2 ? stoul(args[2]) : 100,
+                                  args.size() > 3 ? static_cast<unsigned>(stoul(args[3])) : 2,
+                                  args.size() > 4 && args[4] == "ledger");
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--serve")
+    {
+        mail::ShipmentLedger ledger("shipments.log");
+        mail::QuoteGrid const grid = mail::QuoteGrid::open("quote_grid.bin");
+        mail::PostalIndex const postal = mail::PostalIndex::open("postal_codes.idx", "postal_codes.csv");
+        mail::QuoteAuditLog audit("quotes.audit");
+        unique_ptr<mail::ReplicatedRouteIndex const> replicas(
+            args.size() > 3 && args[3] == "replicas" ? new mail::ReplicatedRouteIndex(mail::route_to_distance) : nullptr);
+        mail::SessionServer const server(static_cast<uint16_t>(args.size() > 1 ? stoul(args[1]) : 7209), &ledger,
+                                         &grid, &postal, &audit, replicas.get());
+        cerr << "Serving on 127.0.0.1:" << server.port() << '\n';
+        server.run(args.size() > 2 ? static_cast<unsigned>(stoul(args[2])) : 2);
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-quote-grid")
+    {
+        bench::quote_grid_throughput(args.size() > 1 ? stoul(args[1]) : 100);
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--build-quote-grid")
+    {
+        string const path = args.size() > 1 ? args[1] : "quote_grid.bin";
+        mail::QuoteGrid const grid;
+        grid.save(path);
+        cout << "Wrote " << path << " (fingerprint " << hex << grid.fingerprint() << dec << ")\n";
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--generate-network")
+    {
+        string const path = args.size() > 1 ? args[1] : "synthetic_distance.csv";
+        size_t const cities = args.size() > 2 ? stoul(args[2]) : 200;
+        double const density = args.size() > 3 ? stod(args[3]) : 0.1;
+        uint64_t const seed = args.size() > 4 ? stoull(args[4]) : random_device()();
+        size_t const lanes = bench::generate_network(path, cities, density, seed);
+        cout << "Wrote " << path << ": " << cities << " cities, " << lanes << " lanes\n";
+        cout << "Reproduce with: --generate-network " << path << ' ' << cities << ' ' << density << ' ' << seed << '\n';
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--load-test")
+    {
+        bool const open_loop = args.size() > 1 && args[1] == "open";
+        size_t const requests = args.size() > 2 ? stoul(args[2]) : 100000;
+        unsigned const threads = args.size() > 3 ? static_cast<unsigned>(stoul(args[3])) : 4;
+        double const rate = args.size() > 4 ? stod(args[4]) : 50000;
+        uint64_t const seed = args.size() > 5 ? stoull(args[5]) : random_device()();
+        string const network = args.size() > 6 ? args[6] : "distance.csv";
+        bool const replicated = args.size() > 7 && args[7] == "replicas";
+        bench::load_test(network, open_loop, requests, threads, rate, seed, replicated);
+        cout << "Reproduce with: --load-test " << (open_loop ? "open" : "closed") << ' ' << requests << ' ' << threads
+             << ' ' << rate << ' ' << seed << ' ' << network << (replicated ? " replicas" : "") << '\n';
+        return 0;
+    }
+    if (!args.empty() && args[0] == "--bench-ledger")
+    {
+        bench::ledger_throughput(args.size() > 1 ? stoul(args[1]) : 20000, args.size() > 2 ? stoul(args[2]) : 8);
+        return 0;
     }
-}
-
-} // namespace mail
-
-int main()
-{
     mail::interface();
     return 0;
 }